@@ -40,6 +40,7 @@ typedef struct redisAeEvents {
     aeEventLoop *loop;
     int fd;
     int reading, writing;
+    long long timer_id;
 } redisAeEvents;
 
 static void redisAeReadEvent(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -56,6 +57,16 @@ static void redisAeWriteEvent(aeEventLoop *el, int fd, void *privdata, int mask)
     redisAsyncHandleWrite(e->context);
 }
 
+static int redisAeTimeout(aeEventLoop *el, long long id, void *privdata) {
+    ((void)el); ((void)id);
+
+    redisAeEvents *e = (redisAeEvents*)privdata;
+    /* The event loop deletes the timer when AE_NOMORE is returned. */
+    e->timer_id = -1;
+    redisAsyncHandleTimeout(e->context);
+    return AE_NOMORE;
+}
+
 static void redisAeAddRead(void *privdata) {
     redisAeEvents *e = (redisAeEvents*)privdata;
     aeEventLoop *loop = e->loop;
@@ -92,10 +103,29 @@ static void redisAeDelWrite(void *privdata) {
     }
 }
 
+static void redisAeScheduleTimer(void *privdata, struct timeval tv) {
+    redisAeEvents *e = (redisAeEvents*)privdata;
+    aeEventLoop *loop = e->loop;
+    long long ms = tv.tv_sec*1000LL + (tv.tv_usec+999)/1000;
+    if (e->timer_id != -1)
+        aeDeleteTimeEvent(loop,e->timer_id);
+    e->timer_id = aeCreateTimeEvent(loop,ms,redisAeTimeout,e,NULL);
+}
+
+static void redisAeCancelTimer(void *privdata) {
+    redisAeEvents *e = (redisAeEvents*)privdata;
+    if (e->timer_id != -1) {
+        aeDeleteTimeEvent(e->loop,e->timer_id);
+        e->timer_id = -1;
+    }
+}
+
 static void redisAeCleanup(void *privdata) {
     redisAeEvents *e = (redisAeEvents*)privdata;
     redisAeDelRead(privdata);
     redisAeDelWrite(privdata);
+    if (e->timer_id != -1)
+        aeDeleteTimeEvent(e->loop,e->timer_id);
     free(e);
 }
 
@@ -113,6 +143,7 @@ static int redisAeAttach(aeEventLoop *loop, redisAsyncContext *ac) {
     e->loop = loop;
     e->fd = c->fd;
     e->reading = e->writing = 0;
+    e->timer_id = -1;
 
     /* Register functions to start/stop listening for events */
     ac->ev.addRead = redisAeAddRead;
@@ -120,6 +151,8 @@ static int redisAeAttach(aeEventLoop *loop, redisAsyncContext *ac) {
     ac->ev.addWrite = redisAeAddWrite;
     ac->ev.delWrite = redisAeDelWrite;
     ac->ev.cleanup = redisAeCleanup;
+    ac->ev.scheduleTimer = redisAeScheduleTimer;
+    ac->ev.cancelTimer = redisAeCancelTimer;
     ac->ev.data = e;
 
     return REDIS_OK;
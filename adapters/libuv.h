@@ -8,7 +8,9 @@
 typedef struct redisLibuvEvents {
   redisAsyncContext* context;
   uv_poll_t          handle;
+  uv_timer_t         timer;
   int                events;
+  int                refcount;
 } redisLibuvEvents;
 
 int redisLibuvAttach(redisAsyncContext*, uv_loop_t*);
@@ -73,10 +75,36 @@ static void redisLibuvDelWrite(void *privdata) {
 }
 
 
+static void redisLibuvTimeout(uv_timer_t* timer) {
+  redisLibuvEvents* p = (redisLibuvEvents*)timer->data;
+
+  redisAsyncHandleTimeout(p->context);
+}
+
+
+static void redisLibuvScheduleTimer(void *privdata, struct timeval tv) {
+  redisLibuvEvents* p = (redisLibuvEvents*)privdata;
+  uint64_t ms = (uint64_t)tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+
+  uv_timer_start(&p->timer, redisLibuvTimeout, ms, 0);
+}
+
+
+static void redisLibuvCancelTimer(void *privdata) {
+  redisLibuvEvents* p = (redisLibuvEvents*)privdata;
+
+  uv_timer_stop(&p->timer);
+}
+
+
 static void on_close(uv_handle_t* handle) {
   redisLibuvEvents* p = (redisLibuvEvents*)handle->data;
 
-  free(p);
+  /* Both the poll and the timer handle need to be closed before the
+   * container can be free'd. */
+  if (--p->refcount == 0) {
+    free(p);
+  }
 }
 
 
@@ -84,6 +112,7 @@ static void redisLibuvCleanup(void *privdata) {
   redisLibuvEvents* p = (redisLibuvEvents*)privdata;
 
   uv_close((uv_handle_t*)&p->handle, on_close);
+  uv_close((uv_handle_t*)&p->timer, on_close);
 }
 
 
@@ -99,6 +128,8 @@ static int redisLibuvAttach(redisAsyncContext* ac, uv_loop_t* loop) {
   ac->ev.addWrite = redisLibuvAddWrite;
   ac->ev.delWrite = redisLibuvDelWrite;
   ac->ev.cleanup  = redisLibuvCleanup;
+  ac->ev.scheduleTimer = redisLibuvScheduleTimer;
+  ac->ev.cancelTimer   = redisLibuvCancelTimer;
 
   redisLibuvEvents* p = (redisLibuvEvents*)malloc(sizeof(*p));
 
@@ -112,9 +143,15 @@ static int redisLibuvAttach(redisAsyncContext* ac, uv_loop_t* loop) {
     return REDIS_ERR;
   }
 
+  if (uv_timer_init(loop, &p->timer) != 0) {
+    return REDIS_ERR;
+  }
+
   ac->ev.data    = p;
   p->handle.data = p;
+  p->timer.data  = p;
   p->context     = ac;
+  p->refcount    = 2;
 
   return REDIS_OK;
 }
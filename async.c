@@ -36,9 +36,20 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include "async.h"
 #include "net.h"
-#include "dict.c"
+#include "subdict.c"
 #include "sds.h"
 
 #define _EL_ADD_READ(ctx) do { \
@@ -56,58 +67,31 @@
 #define _EL_CLEANUP(ctx) do { \
         if ((ctx)->ev.cleanup) (ctx)->ev.cleanup((ctx)->ev.data); \
     } while(0);
+#define _EL_SCHEDULE_TIMER(ctx,tv) do { \
+        if ((ctx)->ev.scheduleTimer) (ctx)->ev.scheduleTimer((ctx)->ev.data,(tv)); \
+    } while(0)
+#define _EL_CANCEL_TIMER(ctx) do { \
+        if ((ctx)->ev.cancelTimer) (ctx)->ev.cancelTimer((ctx)->ev.data); \
+    } while(0)
 
 /* Forward declaration of function in hiredis.c */
-void __redisAppendCommand(redisContext *c, char *cmd, size_t len);
-
-/* Functions managing dictionary of callbacks for pub/sub. */
-static unsigned int callbackHash(const void *key) {
-    return dictGenHashFunction((const unsigned char *)key,
-                               sdslen((const sds)key));
-}
-
-static void *callbackValDup(void *privdata, const void *src) {
-    ((void) privdata);
-    redisCallback *dup = malloc(sizeof(*dup));
-    memcpy(dup,src,sizeof(*dup));
-    return dup;
-}
-
-static int callbackKeyCompare(void *privdata, const void *key1, const void *key2) {
-    int l1, l2;
-    ((void) privdata);
-
-    l1 = sdslen((const sds)key1);
-    l2 = sdslen((const sds)key2);
-    if (l1 != l2) return 0;
-    return memcmp(key1,key2,l1) == 0;
-}
-
-static void callbackKeyDestructor(void *privdata, void *key) {
-    ((void) privdata);
-    sdsfree((sds)key);
-}
-
-static void callbackValDestructor(void *privdata, void *val) {
-    ((void) privdata);
-    free(val);
-}
-
-static dictType callbackDict = {
-    callbackHash,
-    NULL,
-    callbackValDup,
-    callbackKeyCompare,
-    callbackKeyDestructor,
-    callbackValDestructor
-};
+int __redisAppendCommand(redisContext *c, const char *cmd, size_t len);
+void __redisSetError(redisContext *c, int type, const char *str);
+void __redisCopyError(int *err, char *errstr, int type, const char *str);
+redisContext *redisContextInit(void);
 
 static redisAsyncContext *redisAsyncInitialize(redisContext *c) {
     redisAsyncContext *ac;
+    subdict *channels, *patterns;
+
+    channels = subdictCreate();
+    patterns = subdictCreate();
+    if (channels == NULL || patterns == NULL)
+        goto oom;
 
     ac = realloc(c,sizeof(redisAsyncContext));
     if (ac == NULL)
-        return NULL;
+        goto oom;
 
     c = &(ac->c);
 
@@ -126,17 +110,54 @@ static redisAsyncContext *redisAsyncInitialize(redisContext *c) {
     ac->ev.addWrite = NULL;
     ac->ev.delWrite = NULL;
     ac->ev.cleanup = NULL;
+    ac->ev.scheduleTimer = NULL;
+    ac->ev.cancelTimer = NULL;
 
     ac->onConnect = NULL;
     ac->onDisconnect = NULL;
-
-    ac->replies.head = NULL;
-    ac->replies.tail = NULL;
-    ac->sub.invalid.head = NULL;
-    ac->sub.invalid.tail = NULL;
-    ac->sub.channels = dictCreate(&callbackDict,NULL);
-    ac->sub.patterns = dictCreate(&callbackDict,NULL);
+    ac->connectTimeout.tv_sec = 0;
+    ac->connectTimeout.tv_usec = 0;
+    ac->resolver = NULL;
+
+    memset(&ac->replies,0,sizeof(ac->replies));
+    memset(&ac->sub.invalid,0,sizeof(ac->sub.invalid));
+    ac->sub.channels = channels;
+    ac->sub.patterns = patterns;
+    ac->queue = NULL;
+    ac->pipelineWindow.tv_sec = 0;
+    ac->pipelineWindow.tv_usec = 0;
+    memset(&ac->pipeline,0,sizeof(ac->pipeline));
+    ac->merge = NULL;
+    memset(&ac->watermarks,0,sizeof(ac->watermarks));
+    ac->onWatermark = NULL;
+    memset(&ac->reconnect,0,sizeof(ac->reconnect));
+    memset(&ac->timers,0,sizeof(ac->timers));
     return ac;
+
+oom:
+    if (channels != NULL) subdictRelease(channels);
+    if (patterns != NULL) subdictRelease(patterns);
+    return NULL;
+}
+
+/* Remember where the context connects to, so it can reconnect. */
+static int __redisAsyncSaveAddress(redisAsyncContext *ac, const char *host, int port,
+                                   const char *source_addr, const char *path,
+                                   const struct sockaddr *addr, size_t addrlen) {
+    if (host != NULL && (ac->reconnect.host = strdup(host)) == NULL)
+        return REDIS_ERR;
+    if (source_addr != NULL && (ac->reconnect.source_addr = strdup(source_addr)) == NULL)
+        return REDIS_ERR;
+    if (path != NULL && (ac->reconnect.path = strdup(path)) == NULL)
+        return REDIS_ERR;
+    if (addr != NULL) {
+        if ((ac->reconnect.addr = malloc(addrlen)) == NULL)
+            return REDIS_ERR;
+        memcpy(ac->reconnect.addr,addr,addrlen);
+        ac->reconnect.addrlen = addrlen;
+    }
+    ac->reconnect.port = port;
+    return REDIS_OK;
 }
 
 /* We want the error field to be accessible directly instead of requiring
@@ -147,29 +168,104 @@ static void __redisAsyncCopyError(redisAsyncContext *ac) {
     ac->errstr = c->errstr;
 }
 
-redisAsyncContext *redisAsyncConnect(const char *ip, int port) {
+/* Connect to a TCP address without blocking on name resolution. Host names
+ * are resolved on a separate thread and the connect callback is called with
+ * REDIS_ERR when the lookup fails. */
+static redisAsyncContext *__redisAsyncConnectTcp(const char *ip, int port,
+                                                 const char *source_addr,
+                                                 const redisSocketOptions *opts) {
     redisContext *c;
     redisAsyncContext *ac;
+    struct redisResolveJob *job;
 
-    c = redisConnectNonBlock(ip,port);
+    c = redisContextInit();
     if (c == NULL)
         return NULL;
 
+    c->flags &= ~REDIS_BLOCK;
+    if (opts != NULL)
+        c->sockopts = *opts;
+    job = redisContextResolveTcp(c,ip,port,source_addr);
+
     ac = redisAsyncInitialize(c);
     if (ac == NULL) {
+        if (job != NULL)
+            redisResolveJobRelease(job);
         redisFree(c);
         return NULL;
     }
 
+    ac->resolver = job;
     __redisAsyncCopyError(ac);
+    if (__redisAsyncSaveAddress(ac,ip,port,source_addr,NULL,NULL,0) != REDIS_OK) {
+        redisAsyncFree(ac);
+        return NULL;
+    }
+    return ac;
+}
+
+redisAsyncContext *redisAsyncConnect(const char *ip, int port) {
+    return __redisAsyncConnectTcp(ip,port,NULL,NULL);
+}
+
+/* Connect to a server for one of the modules that own their connections, and
+ * attach the context to the event library with the attach function of the
+ * module. The connect timeout is only set when timeout is not NULL. On error
+ * NULL is returned and the error is stored in err and errstr. */
+redisAsyncContext *__redisAsyncOpen(const char *ip, int port, const struct timeval *timeout,
+                                    int (*attach)(redisAsyncContext *, void *), void *data,
+                                    int *err, char *errstr) {
+    redisAsyncContext *ac;
+
+    ac = redisAsyncConnect(ip,port);
+    if (ac == NULL) {
+        __redisCopyError(err,errstr,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    if (ac->err) {
+        __redisCopyError(err,errstr,ac->err,ac->errstr);
+        redisAsyncFree(ac);
+        return NULL;
+    }
+    if (attach(ac,data) != REDIS_OK) {
+        __redisCopyError(err,errstr,REDIS_ERR_OTHER,"Cannot attach to the event library");
+        redisAsyncFree(ac);
+        return NULL;
+    }
+    if (timeout != NULL)
+        redisAsyncSetConnectTimeout(ac,*timeout);
     return ac;
 }
 
 redisAsyncContext *redisAsyncConnectBind(const char *ip, int port,
                                          const char *source_addr) {
-    redisContext *c = redisConnectBindNonBlock(ip,port,source_addr);
-    redisAsyncContext *ac = redisAsyncInitialize(c);
+    return __redisAsyncConnectTcp(ip,port,source_addr,NULL);
+}
+
+redisAsyncContext *redisAsyncConnectWithOptions(const char *ip, int port,
+                                                const redisSocketOptions *opts) {
+    return __redisAsyncConnectTcp(ip,port,NULL,opts);
+}
+
+redisAsyncContext *redisAsyncConnectAddr(const struct sockaddr *addr, size_t addrlen) {
+    redisContext *c;
+    redisAsyncContext *ac;
+
+    c = redisConnectAddrNonBlock(addr,addrlen);
+    if (c == NULL)
+        return NULL;
+
+    ac = redisAsyncInitialize(c);
+    if (ac == NULL) {
+        redisFree(c);
+        return NULL;
+    }
+
     __redisAsyncCopyError(ac);
+    if (__redisAsyncSaveAddress(ac,NULL,0,NULL,NULL,addr,addrlen) != REDIS_OK) {
+        redisAsyncFree(ac);
+        return NULL;
+    }
     return ac;
 }
 
@@ -188,9 +284,120 @@ redisAsyncContext *redisAsyncConnectUnix(const char *path) {
     }
 
     __redisAsyncCopyError(ac);
+    if (__redisAsyncSaveAddress(ac,NULL,0,NULL,path,NULL,0) != REDIS_OK) {
+        redisAsyncFree(ac);
+        return NULL;
+    }
     return ac;
 }
 
+/* Timers use the monotonic clock, so they are not moved by changes of the
+ * wall clock. */
+static long long __redisAsyncUsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ((long long)ts.tv_sec*1000000)+ts.tv_nsec/1000;
+}
+
+/* Set the timer of the event library to the earliest timer, or cancel it
+ * when there is none. */
+static void __redisAsyncArmTimer(redisAsyncContext *ac, long long now) {
+    long long when = ac->timers.internal;
+    struct timeval tv;
+
+    if (ac->timers.head != NULL && (when == 0 || ac->timers.head->when < when))
+        when = ac->timers.head->when;
+    if (when == 0) {
+        _EL_CANCEL_TIMER(ac);
+        return;
+    }
+    when = when > now ? when-now : 0;
+    tv.tv_sec = when/1000000;
+    tv.tv_usec = when%1000000;
+    _EL_SCHEDULE_TIMER(ac,tv);
+}
+
+/* Schedule the timer of the library itself, replacing the previous one. */
+static void __redisAsyncScheduleTimer(redisAsyncContext *ac, struct timeval tv) {
+    long long now = __redisAsyncUsec();
+    ac->timers.internal = now+(long long)tv.tv_sec*1000000+tv.tv_usec;
+    __redisAsyncArmTimer(ac,now);
+}
+
+/* Call a function after the given interval. Returns NULL when the event
+ * library does not provide scheduleTimer. The timer can be cancelled until
+ * it fires, and is dropped without calling the function when the context is
+ * free'd. */
+redisAsyncTimer *redisAsyncAddTimer(redisAsyncContext *ac, struct timeval tv, redisTimerCallback *fn, void *privdata) {
+    redisAsyncTimer *t, *prev;
+    long long now;
+
+    if (ac->ev.scheduleTimer == NULL || (ac->c.flags & REDIS_FREEING))
+        return NULL;
+    if ((t = malloc(sizeof(*t))) == NULL)
+        return NULL;
+    now = __redisAsyncUsec();
+    t->when = now+(long long)tv.tv_sec*1000000+tv.tv_usec;
+    t->fn = fn;
+    t->privdata = privdata;
+
+    /* Timers mostly use the same interval, so search from the end. */
+    for (prev = ac->timers.tail; prev != NULL && prev->when > t->when; prev = prev->prev);
+    t->prev = prev;
+    t->next = prev ? prev->next : ac->timers.head;
+    if (t->next != NULL)
+        t->next->prev = t;
+    else
+        ac->timers.tail = t;
+    if (prev != NULL)
+        prev->next = t;
+    else
+        ac->timers.head = t;
+
+    if (ac->timers.head == t)
+        __redisAsyncArmTimer(ac,now);
+    return t;
+}
+
+static void __redisAsyncUnlinkTimer(redisAsyncContext *ac, redisAsyncTimer *t) {
+    if (t->prev != NULL)
+        t->prev->next = t->next;
+    else
+        ac->timers.head = t->next;
+    if (t->next != NULL)
+        t->next->prev = t->prev;
+    else
+        ac->timers.tail = t->prev;
+}
+
+/* Cancel a timer that did not fire yet. The timer of the event library is
+ * left alone, and fires for nothing at worst. */
+void redisAsyncCancelTimer(redisAsyncContext *ac, redisAsyncTimer *t) {
+    __redisAsyncUnlinkTimer(ac,t);
+    free(t);
+}
+
+/* Called when the event library is asked to watch a connecting context. A
+ * pending name lookup signals completion through a read event. The connect
+ * timeout is scheduled only once. */
+static void __redisAsyncWatchConnect(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+
+    if (c->flags & (REDIS_CONNECTED | REDIS_RECONNECT_TIMER))
+        return;
+    if (ac->resolver != NULL)
+        _EL_ADD_READ(ac);
+    if (c->flags & REDIS_CONNECT_TIMER)
+        return;
+    if (ac->ev.scheduleTimer == NULL)
+        return;
+    if (ac->connectTimeout.tv_sec == 0 && ac->connectTimeout.tv_usec == 0)
+        return;
+
+    c->flags |= REDIS_CONNECT_TIMER;
+    __redisAsyncScheduleTimer(ac,ac->connectTimeout);
+}
+
 int redisAsyncSetConnectCallback(redisAsyncContext *ac, redisConnectCallback *fn) {
     if (ac->onConnect == NULL) {
         ac->onConnect = fn;
@@ -199,6 +406,7 @@ int redisAsyncSetConnectCallback(redisAsyncContext *ac, redisConnectCallback *fn
          * the first write event to be fired. This assumes the related event
          * library functions are already set. */
         _EL_ADD_WRITE(ac);
+        __redisAsyncWatchConnect(ac);
         return REDIS_OK;
     }
     return REDIS_ERR;
@@ -212,60 +420,343 @@ int redisAsyncSetDisconnectCallback(redisAsyncContext *ac, redisDisconnectCallba
     return REDIS_ERR;
 }
 
+/* Bound the time spent waiting for connect(2) to complete. When the timeout
+ * expires, the connect callback is called with REDIS_ERR and the context is
+ * free'd. The timer is scheduled once the event library is attached, so this
+ * should be called before or right after attaching the context. */
+int redisAsyncSetConnectTimeout(redisAsyncContext *ac, const struct timeval tv) {
+    redisContext *c = &(ac->c);
+
+    if (tv.tv_sec < 0 || tv.tv_usec < 0 || tv.tv_usec >= 1000000)
+        return REDIS_ERR;
+    if (c->flags & (REDIS_CONNECTED | REDIS_CONNECT_TIMER))
+        return REDIS_ERR;
+
+    ac->connectTimeout = tv;
+    if (ac->resolver != NULL)
+        redisResolveJobSetTimeout(ac->resolver,&tv);
+    __redisAsyncWatchConnect(ac);
+    return REDIS_OK;
+}
+
+/* Delay writing commands by the given interval, so that commands issued by
+ * independent callers within that window are written together. */
+int redisAsyncSetPipelineWindow(redisAsyncContext *ac, const struct timeval tv) {
+    if (tv.tv_sec < 0 || tv.tv_usec < 0 || tv.tv_usec >= 1000000)
+        return REDIS_ERR;
+
+    ac->pipelineWindow = tv;
+    return REDIS_OK;
+}
+
+/* Set the watermarks of the context. The callback is optional. */
+int redisAsyncSetWatermarks(redisAsyncContext *ac, const redisWatermarks *wm, redisWatermarkCallback *fn) {
+    if ((wm->highbytes && wm->lowbytes > wm->highbytes) ||
+        (wm->highcallbacks && wm->lowcallbacks > wm->highcallbacks))
+        return REDIS_ERR;
+
+    ac->watermarks = *wm;
+    ac->onWatermark = fn;
+    return REDIS_OK;
+}
+
+/* Initial number of entries in a callback list. */
+#define REDIS_CALLBACK_LIST_SIZE 16
+
+/* Reconnect when the connection is lost. Passing NULL options disables it.
+ * This can only be enabled while the output buffer is empty, since the
+ * commands in it were not tracked. */
+int redisAsyncSetReconnect(redisAsyncContext *ac, const redisReconnectOptions *opts, redisReconnectCallback *fn) {
+    if (opts == NULL) {
+        ac->reconnect.enabled = 0;
+        return REDIS_OK;
+    }
+
+    if (opts->delay.tv_sec < 0 || opts->delay.tv_usec < 0 ||
+        opts->delay.tv_usec >= 1000000 || opts->maxdelay.tv_sec < 0 ||
+        opts->maxdelay.tv_usec < 0 || opts->maxdelay.tv_usec >= 1000000 ||
+        opts->maxattempts < 0 ||
+        (opts->replay != REDIS_REPLAY_NONE && opts->replay != REDIS_REPLAY_UNSENT))
+        return REDIS_ERR;
+    if (!ac->reconnect.enabled && sdslen(ac->c.obuf) > 0)
+        return REDIS_ERR;
+
+    ac->reconnect.enabled = 1;
+    ac->reconnect.opts = *opts;
+    ac->reconnect.fn = fn;
+    return REDIS_OK;
+}
+
+/* Append a command to the output buffer, remembering where it ends. */
+static void __redisAsyncAppend(redisAsyncContext *ac, char *cmd, size_t len) {
+    redisContext *c = &(ac->c);
+    size_t size, i;
+    unsigned long long *ends;
+
+    if (__redisAppendCommand(c,cmd,len) != REDIS_OK)
+        return;
+    ac->reconnect.appended += len;
+    if (!ac->reconnect.enabled)
+        return;
+
+    /* Grow the ring buffer when it is full, unwrapping it. When this fails,
+     * the commands can no longer be told apart, and none will be replayed. */
+    if (ac->reconnect.len == ac->reconnect.size) {
+        size = ac->reconnect.size ? ac->reconnect.size*2 : REDIS_CALLBACK_LIST_SIZE;
+        ends = malloc(size*sizeof(*ends));
+        if (ends == NULL) {
+            ac->reconnect.opts.replay = REDIS_REPLAY_NONE;
+            return;
+        }
+        for (i = 0; i < ac->reconnect.len; i++)
+            ends[i] = ac->reconnect.ends[(ac->reconnect.head+i) & (ac->reconnect.size-1)];
+        free(ac->reconnect.ends);
+        ac->reconnect.ends = ends;
+        ac->reconnect.size = size;
+        ac->reconnect.head = 0;
+    }
+
+    i = (ac->reconnect.head+ac->reconnect.len) & (ac->reconnect.size-1);
+    ac->reconnect.ends[i] = ac->reconnect.appended;
+    ac->reconnect.len++;
+}
+
+/* Drop the commands that were written completely from the ring buffer. */
+static void __redisAsyncWritten(redisAsyncContext *ac, size_t len) {
+    ac->reconnect.written += len;
+    while (ac->reconnect.len > 0 &&
+           ac->reconnect.ends[ac->reconnect.head] <= ac->reconnect.written)
+    {
+        ac->reconnect.flushed = ac->reconnect.ends[ac->reconnect.head];
+        ac->reconnect.head = (ac->reconnect.head+1) & (ac->reconnect.size-1);
+        ac->reconnect.len--;
+    }
+    if (ac->reconnect.len == 0)
+        ac->reconnect.flushed = ac->reconnect.written;
+}
+
+static size_t __redisAsyncPendingCallbacks(redisAsyncContext *ac);
+
+/* Called whenever the output buffer or the number of pending callbacks may
+ * have changed. The context moves above its watermarks when one of the high
+ * limits is reached, and back when all amounts are at or below the low
+ * limits. */
+static void __redisAsyncCheckWatermarks(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+    redisWatermarks *wm = &ac->watermarks;
+    size_t bytes, callbacks;
+
+    if (wm->highbytes == 0 && wm->highcallbacks == 0)
+        return;
+
+    bytes = sdslen(c->obuf);
+    callbacks = __redisAsyncPendingCallbacks(ac);
+    if (!(c->flags & REDIS_ABOVE_WATERMARK)) {
+        if ((wm->highbytes && bytes >= wm->highbytes) ||
+            (wm->highcallbacks && callbacks >= wm->highcallbacks))
+        {
+            c->flags |= REDIS_ABOVE_WATERMARK;
+            if (ac->onWatermark) ac->onWatermark(ac,1);
+        }
+    } else {
+        if ((wm->highbytes == 0 || bytes <= wm->lowbytes) &&
+            (wm->highcallbacks == 0 || callbacks <= wm->lowcallbacks))
+        {
+            c->flags &= ~REDIS_ABOVE_WATERMARK;
+            if (ac->onWatermark) ac->onWatermark(ac,0);
+        }
+    }
+}
+
+/* Returns 1 when a new command should be rejected. Replies may have been
+ * processed since the last check, for instance when this is called from a
+ * callback, so check again. */
+static int __redisAsyncFailFast(redisAsyncContext *ac) {
+    if (!ac->watermarks.failfast || !(ac->c.flags & REDIS_ABOVE_WATERMARK))
+        return 0;
+    __redisAsyncCheckWatermarks(ac);
+    return (ac->c.flags & REDIS_ABOVE_WATERMARK) != 0;
+}
+
+/* Write the output buffer without waiting for the pipeline window once it
+ * holds this many bytes. */
+#define REDIS_PIPELINE_FLUSH_SIZE (1024*64)
+
+/* Schedule a write of the output buffer. Until the context is connected,
+ * the write event also signals that the connection is established, so it
+ * is never delayed. */
+static void __redisAsyncScheduleWrite(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+
+    /* Nothing can be written before reconnecting. */
+    if (c->flags & REDIS_RECONNECT_TIMER)
+        return;
+
+    if (!(c->flags & REDIS_CONNECTED) || ac->ev.scheduleTimer == NULL ||
+        (ac->pipelineWindow.tv_sec == 0 && ac->pipelineWindow.tv_usec == 0) ||
+        sdslen(c->obuf) >= REDIS_PIPELINE_FLUSH_SIZE)
+    {
+        _EL_ADD_WRITE(ac);
+        return;
+    }
+
+    if (c->flags & REDIS_PIPELINE_TIMER)
+        return;
+    c->flags |= REDIS_PIPELINE_TIMER;
+    __redisAsyncScheduleTimer(ac,ac->pipelineWindow);
+}
+
 /* Helper functions to push/shift callbacks */
 static int __redisPushCallback(redisCallbackList *list, redisCallback *source) {
     redisCallback *cb;
 
-    /* Copy callback from stack to heap */
-    cb = malloc(sizeof(*cb));
-    if (cb == NULL)
-        return REDIS_ERR_OOM;
-
-    if (source != NULL) {
-        memcpy(cb,source,sizeof(*cb));
-        cb->next = NULL;
+    /* Grow the ring buffer when it is full, unwrapping it so that the
+     * oldest callback is at the start of the new buffer. */
+    if (list->len == list->size) {
+        size_t size = list->size ? list->size*2 : REDIS_CALLBACK_LIST_SIZE;
+        size_t first = list->size-list->head;
+        redisCallback *buf;
+
+        buf = malloc(size*sizeof(*buf));
+        if (buf == NULL)
+            return REDIS_ERR_OOM;
+        if (list->len > 0) {
+            memcpy(buf,list->buf+list->head,first*sizeof(*buf));
+            memcpy(buf+first,list->buf,list->head*sizeof(*buf));
+        }
+        free(list->buf);
+        list->buf = buf;
+        list->size = size;
+        list->head = 0;
     }
 
     /* Store callback in list */
-    if (list->head == NULL)
-        list->head = cb;
-    if (list->tail != NULL)
-        list->tail->next = cb;
-    list->tail = cb;
+    cb = &list->buf[(list->head+list->len) & (list->size-1)];
+    if (source != NULL)
+        memcpy(cb,source,sizeof(*cb));
+    else
+        memset(cb,0,sizeof(*cb));
+    list->len++;
     return REDIS_OK;
 }
 
 static int __redisShiftCallback(redisCallbackList *list, redisCallback *target) {
-    redisCallback *cb = list->head;
-    if (cb != NULL) {
-        list->head = cb->next;
-        if (cb == list->tail)
-            list->tail = NULL;
-
-        /* Copy callback from heap to stack */
+    if (list->len > 0) {
+        /* Copy callback from the list to the stack */
         if (target != NULL)
-            memcpy(target,cb,sizeof(*cb));
-        free(cb);
+            memcpy(target,&list->buf[list->head],sizeof(*target));
+        list->head = (list->head+1) & (list->size-1);
+        list->len--;
         return REDIS_OK;
     }
     return REDIS_ERR;
 }
 
+static void __redisFreeCallbackList(redisCallbackList *list) {
+    free(list->buf);
+    memset(list,0,sizeof(*list));
+}
+
+/* The channels and patterns of one subscribe call share their privdata. The
+ * privdata of their message callbacks points to this. */
+typedef struct redisSubscription {
+    void *privdata;
+    unsigned long refcount; /* Channels and patterns still subscribed */
+} redisSubscription;
+
+/* Drop a reference to the subscription of a message callback. When it was
+ * the last one, the callback is called with a NULL message so that it can
+ * release its privdata. This can run from a command function that is itself
+ * called from a callback, so the callback flag is restored afterwards. */
+static void __redisReleaseSubscription(redisAsyncContext *ac, redisCallback *cb) {
+    redisContext *c = &(ac->c);
+    redisSubscription *sub = cb->privdata;
+    int incallback = c->flags & REDIS_IN_CALLBACK;
+
+    if (--sub->refcount > 0)
+        return;
+    c->flags |= REDIS_IN_CALLBACK;
+    cb->msgfn(ac,NULL,sub->privdata);
+    if (!incallback)
+        c->flags &= ~REDIS_IN_CALLBACK;
+    free(sub);
+}
+
+/* Run a message callback for a pub/sub reply. Messages are passed as a view
+ * of the reply, the end of the subscription releases it and other replies
+ * (such as the subscribe confirmation) are not passed at all. */
+static void __redisRunMessageCallback(redisAsyncContext *ac, redisCallback *cb, redisReply *reply) {
+    redisContext *c = &(ac->c);
+    redisSubscription *sub = cb->privdata;
+    redisMessage m;
+
+    if (reply != NULL) {
+        redisReply **e = reply->element;
+
+        if (reply->type != REDIS_REPLY_ARRAY || reply->elements < 3)
+            return;
+        if (reply->elements == 3 && e[0]->len == 7 &&
+            strncasecmp(e[0]->str,"message",7) == 0) {
+            m.pattern = NULL;
+            m.patternlen = 0;
+        } else if (reply->elements == 4 && e[0]->len == 8 &&
+                   strncasecmp(e[0]->str,"pmessage",8) == 0) {
+            m.pattern = e[1]->str;
+            m.patternlen = e[1]->len;
+            e++;
+        } else if (e[0]->len >= 11 && strncasecmp(e[0]->str+e[0]->len-11,"unsubscribe",11) == 0) {
+            __redisReleaseSubscription(ac,cb);
+            return;
+        } else {
+            return;
+        }
+
+        m.channel = e[1]->str;
+        m.channellen = e[1]->len;
+        m.payload = e[2]->str;
+        m.payloadlen = e[2]->len;
+        c->flags |= REDIS_IN_CALLBACK;
+        cb->msgfn(ac,&m,sub->privdata);
+        c->flags &= ~REDIS_IN_CALLBACK;
+    } else {
+        __redisReleaseSubscription(ac,cb);
+    }
+}
+
 static void __redisRunCallback(redisAsyncContext *ac, redisCallback *cb, redisReply *reply) {
     redisContext *c = &(ac->c);
     if (cb->fn != NULL) {
         c->flags |= REDIS_IN_CALLBACK;
         cb->fn(ac,reply,cb->privdata);
         c->flags &= ~REDIS_IN_CALLBACK;
+    } else if (cb->msgfn != NULL) {
+        __redisRunMessageCallback(ac,cb,reply);
     }
 }
 
+static void __redisAsyncQueueDetach(redisAsyncQueue *q);
+static char *nextArgument(char *start, char **str, size_t *len);
+static int __redisAsyncReconnect(redisAsyncContext *ac);
+static void __redisAsyncDisconnect(redisAsyncContext *ac);
+static void __redisMergeFlush(redisAsyncContext *ac);
+static void __redisMergeFree(redisAsyncContext *ac);
+
 /* Helper function to free the context. */
 static void __redisAsyncFree(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
     redisCallback cb;
-    dictIterator *it;
-    dictEntry *de;
+    subdictEntry *de;
+    unsigned long cursor;
+
+    /* The resolver thread may outlive the context. */
+    if (ac->resolver != NULL) {
+        redisResolveJobRelease(ac->resolver);
+        ac->resolver = NULL;
+    }
+
+    /* Commands queued by other threads can no longer be sent. */
+    if (ac->queue != NULL)
+        __redisAsyncQueueDetach(ac->queue);
 
     /* Execute pending callbacks with NULL reply. */
     while (__redisShiftCallback(&ac->replies,&cb) == REDIS_OK)
@@ -275,18 +766,33 @@ static void __redisAsyncFree(redisAsyncContext *ac) {
     while (__redisShiftCallback(&ac->sub.invalid,&cb) == REDIS_OK)
         __redisRunCallback(ac,&cb,NULL);
 
+    /* Commands waiting to be merged were issued after those. */
+    if (ac->merge != NULL)
+        __redisMergeFree(ac);
+
+    __redisFreeCallbackList(&ac->replies);
+    __redisFreeCallbackList(&ac->sub.invalid);
+
     /* Run subscription callbacks callbacks with NULL reply */
-    it = dictGetIterator(ac->sub.channels);
-    while ((de = dictNext(it)) != NULL)
-        __redisRunCallback(ac,dictGetEntryVal(de),NULL);
-    dictReleaseIterator(it);
-    dictRelease(ac->sub.channels);
-
-    it = dictGetIterator(ac->sub.patterns);
-    while ((de = dictNext(it)) != NULL)
-        __redisRunCallback(ac,dictGetEntryVal(de),NULL);
-    dictReleaseIterator(it);
-    dictRelease(ac->sub.patterns);
+    cursor = 0;
+    while ((de = subdictNext(ac->sub.channels,&cursor)) != NULL)
+        __redisRunCallback(ac,&de->cb,NULL);
+    subdictRelease(ac->sub.channels);
+
+    cursor = 0;
+    while ((de = subdictNext(ac->sub.patterns,&cursor)) != NULL)
+        __redisRunCallback(ac,&de->cb,NULL);
+    subdictRelease(ac->sub.patterns);
+
+    /* Timers that did not fire are dropped. */
+    while (ac->timers.head != NULL)
+        redisAsyncCancelTimer(ac,ac->timers.head);
+
+    free(ac->reconnect.host);
+    free(ac->reconnect.source_addr);
+    free(ac->reconnect.path);
+    free(ac->reconnect.addr);
+    free(ac->reconnect.ends);
 
     /* Signal event lib to clean up */
     _EL_CLEANUP(ac);
@@ -316,6 +822,230 @@ void redisAsyncFree(redisAsyncContext *ac) {
         __redisAsyncFree(ac);
 }
 
+/* Write a command that subscribes to every channel or pattern in the dict
+ * again. */
+static sds __redisResubscribeCommand(sds cmd, subdict *d, const char *command) {
+    subdictEntry *de;
+    unsigned long cursor = 0;
+
+    if (cmd == NULL || subdictSize(d) == 0)
+        return cmd;
+    cmd = sdscatprintf(cmd,"*%lu\r\n$%zu\r\n%s\r\n",
+        subdictSize(d)+1,strlen(command),command);
+    while (cmd != NULL && (de = subdictNext(d,&cursor)) != NULL) {
+        cmd = sdscatprintf(cmd,"$%zu\r\n",sdslen(de->name));
+        if (cmd != NULL) cmd = sdscatlen(cmd,de->name,sdslen(de->name));
+        if (cmd != NULL) cmd = sdscatlen(cmd,"\r\n",2);
+    }
+    return cmd;
+}
+
+/* Remove the (P)SUBSCRIBE commands that were not written from the output
+ * buffer. Their channels and patterns are already in the subscription
+ * dicts, so they are subscribed to again with all others, and writing them
+ * as well would give duplicate confirmations. */
+static void __redisAsyncDropSubscribes(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+    unsigned long long start = ac->reconnect.written, end, len;
+    size_t mask = ac->reconnect.size-1, i, j, k, n, clen;
+    redisCallbackList *list;
+    char *cmd, *cstr;
+
+    for (i = n = 0; i < ac->reconnect.len; i++) {
+        end = ac->reconnect.ends[(ac->reconnect.head+i) & mask];
+        cmd = c->obuf+(start-ac->reconnect.written);
+        if (nextArgument(cmd,&cstr,&clen) == NULL ||
+            ((clen != 9 || strncasecmp(cstr,"subscribe",9) != 0) &&
+             (clen != 10 || strncasecmp(cstr,"psubscribe",10) != 0)))
+        {
+            ac->reconnect.ends[(ac->reconnect.head+n++) & mask] = end;
+            start = end;
+            continue;
+        }
+
+        /* Everything after the command moves. */
+        len = end-start;
+        memmove(cmd,cmd+len,sdslen(c->obuf)-(end-ac->reconnect.written));
+        sdsIncrLen(c->obuf,-(int)len);
+        ac->reconnect.appended -= len;
+        if (ac->pipeline.pending > 0)
+            ac->pipeline.pending--;
+        for (k = i+1; k < ac->reconnect.len; k++)
+            ac->reconnect.ends[(ac->reconnect.head+k) & mask] -= len;
+        for (j = 0; j < 2; j++) {
+            list = j ? &ac->sub.invalid : &ac->replies;
+            for (k = 0; k < list->len; k++) {
+                redisCallback *cb = &list->buf[(list->head+k) & (list->size-1)];
+                if (cb->end > start)
+                    cb->end -= len;
+            }
+        }
+    }
+    ac->reconnect.len = n;
+}
+
+/* Subscribe again before the commands that were issued while subscribed.
+ * The commands for the pending regular callbacks go first, since their
+ * replies are expected before any pub/sub reply. */
+static int __redisAsyncResubscribe(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+    unsigned long long pos = ac->reconnect.written;
+    sds cmd, obuf;
+    size_t off, len, i;
+
+    cmd = __redisResubscribeCommand(sdsempty(),ac->sub.channels,"SUBSCRIBE");
+    cmd = __redisResubscribeCommand(cmd,ac->sub.patterns,"PSUBSCRIBE");
+    if (cmd == NULL)
+        return REDIS_ERR;
+    if ((len = sdslen(cmd)) == 0) {
+        sdsfree(cmd);
+        return REDIS_OK;
+    }
+
+    if (ac->replies.len > 0)
+        pos = ac->replies.buf[(ac->replies.head+ac->replies.len-1) & (ac->replies.size-1)].end;
+    off = pos-ac->reconnect.written;
+    obuf = sdsnewlen(c->obuf,off);
+    if (obuf != NULL) obuf = sdscatlen(obuf,cmd,len);
+    if (obuf != NULL) obuf = sdscatlen(obuf,c->obuf+off,sdslen(c->obuf)-off);
+    sdsfree(cmd);
+    if (obuf == NULL)
+        return REDIS_ERR;
+    sdsfree(c->obuf);
+    c->obuf = obuf;
+
+    /* Everything after the insertion moves. */
+    for (i = 0; i < ac->reconnect.len; i++) {
+        unsigned long long *end = &ac->reconnect.ends[(ac->reconnect.head+i) & (ac->reconnect.size-1)];
+        if (*end > pos) *end += len;
+    }
+    for (i = 0; i < ac->sub.invalid.len; i++) {
+        redisCallback *cb = &ac->sub.invalid.buf[(ac->sub.invalid.head+i) & (ac->sub.invalid.size-1)];
+        if (cb->end > pos) cb->end += len;
+    }
+    ac->reconnect.appended += len;
+    return REDIS_OK;
+}
+
+/* Fail the callbacks of the commands that end at or before the given
+ * position in the output stream. Returns REDIS_ERR when a callback asked for
+ * the context to be disconnected or free'd. */
+static int __redisAsyncDropCallbacks(redisAsyncContext *ac, redisCallbackList *list,
+                                     unsigned long long dropto) {
+    redisContext *c = &(ac->c);
+    redisCallback cb;
+
+    while (list->len > 0 && list->buf[list->head].end <= dropto) {
+        __redisShiftCallback(list,&cb);
+        __redisRunCallback(ac,&cb,NULL);
+        if (c->flags & (REDIS_DISCONNECTING | REDIS_FREEING))
+            return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Called when the connection is lost. The context stays around and tries to
+ * connect again after the reconnect delay. Commands that were written fail,
+ * the others are kept in the output buffer, and the subscriptions are
+ * restored. Returns REDIS_ERR when the context should be free'd instead. */
+static int __redisAsyncReconnect(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+    redisReader *r;
+    unsigned long long dropto;
+    struct timeval tv;
+    int i;
+
+    /* Only connections that were established once are re-established. */
+    if (!ac->reconnect.enabled || ac->ev.scheduleTimer == NULL)
+        return REDIS_ERR;
+    if (c->flags & (REDIS_DISCONNECTING | REDIS_FREEING))
+        return REDIS_ERR;
+    if (ac->reconnect.attempts == 0 && !(c->flags & REDIS_CONNECTED))
+        return REDIS_ERR;
+    if (ac->reconnect.opts.maxattempts > 0 &&
+        ac->reconnect.attempts >= ac->reconnect.opts.maxattempts)
+        return REDIS_ERR;
+
+    /* Partial replies are of no use on the next connection. */
+    if ((r = redisReaderCreate()) == NULL)
+        return REDIS_ERR;
+    r->fn = c->reader->fn;
+    r->privdata = c->reader->privdata;
+    r->maxbuf = c->reader->maxbuf;
+    redisReaderFree(c->reader);
+    c->reader = r;
+
+    /* The fd number is kept, since the event library watches it. */
+    _EL_DEL_READ(ac);
+    _EL_DEL_WRITE(ac);
+    if (ac->resolver != NULL) {
+        redisResolveJobRelease(ac->resolver);
+        ac->resolver = NULL;
+    }
+    shutdown(c->fd,SHUT_RDWR);
+    c->flags |= REDIS_RECONNECT_TIMER;
+    c->flags &= ~(REDIS_CONNECT_TIMER | REDIS_PIPELINE_TIMER);
+
+    /* Drop the commands that were written. A command that was only written
+     * in part is dropped as well. */
+    if (ac->reconnect.opts.replay == REDIS_REPLAY_NONE)
+        dropto = ac->reconnect.appended;
+    else if (ac->reconnect.flushed < ac->reconnect.written)
+        dropto = ac->reconnect.ends[ac->reconnect.head];
+    else
+        dropto = ac->reconnect.written;
+    if (dropto-ac->reconnect.written < sdslen(c->obuf))
+        sdsrange(c->obuf,dropto-ac->reconnect.written,-1);
+    else
+        sdsclear(c->obuf);
+    __redisAsyncWritten(ac,dropto-ac->reconnect.written);
+
+    if (ac->reconnect.fn) {
+        c->flags |= REDIS_IN_CALLBACK;
+        ac->reconnect.fn(ac,REDIS_ERR);
+        c->flags &= ~REDIS_IN_CALLBACK;
+        if (c->flags & (REDIS_DISCONNECTING | REDIS_FREEING))
+            return REDIS_ERR;
+    }
+    if (__redisAsyncDropCallbacks(ac,&ac->replies,dropto) != REDIS_OK ||
+        __redisAsyncDropCallbacks(ac,&ac->sub.invalid,dropto) != REDIS_OK)
+        return REDIS_ERR;
+
+    /* The monitor callback is dropped once MONITOR was written. */
+    if (ac->replies.len == 0)
+        c->flags &= ~REDIS_MONITORING;
+    __redisAsyncDropSubscribes(ac);
+    if (__redisAsyncResubscribe(ac) != REDIS_OK)
+        return REDIS_ERR;
+
+    c->err = 0;
+    c->errstr[0] = '\0';
+    __redisAsyncCopyError(ac);
+    c->flags &= ~REDIS_CONNECTED;
+
+    /* Back off exponentially. */
+    tv = ac->reconnect.opts.delay;
+    for (i = 0; i < ac->reconnect.attempts; i++) {
+        tv.tv_sec *= 2;
+        tv.tv_usec *= 2;
+        if (tv.tv_usec >= 1000000) {
+            tv.tv_sec++;
+            tv.tv_usec -= 1000000;
+        }
+        if (tv.tv_sec > ac->reconnect.opts.maxdelay.tv_sec ||
+            (tv.tv_sec == ac->reconnect.opts.maxdelay.tv_sec &&
+             tv.tv_usec > ac->reconnect.opts.maxdelay.tv_usec))
+        {
+            tv = ac->reconnect.opts.maxdelay;
+            break;
+        }
+    }
+    ac->reconnect.attempts++;
+    __redisAsyncScheduleTimer(ac,tv);
+    __redisAsyncCheckWatermarks(ac);
+    return REDIS_OK;
+}
+
 /* Helper function to make the disconnect happen and clean up. */
 static void __redisAsyncDisconnect(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
@@ -323,6 +1053,16 @@ static void __redisAsyncDisconnect(redisAsyncContext *ac) {
     /* Make sure error is accessible if there is any */
     __redisAsyncCopyError(ac);
 
+    /* Keep the context when the connection can be re-established. */
+    if (ac->err != 0 && ac->reconnect.enabled) {
+        if (__redisAsyncReconnect(ac) == REDIS_OK)
+            return;
+        /* When giving up, the disconnect callback reports the error of the
+         * connection that was lost. */
+        if (ac->reconnect.attempts > 0)
+            c->flags |= REDIS_CONNECTED;
+    }
+
     if (ac->err == 0) {
         /* For clean disconnects, there should be no pending callbacks. */
         assert(__redisShiftCallback(&ac->replies,NULL) == REDIS_ERR);
@@ -345,18 +1085,19 @@ static void __redisAsyncDisconnect(redisAsyncContext *ac) {
  * when there are no pending callbacks. */
 void redisAsyncDisconnect(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
+    if (ac->merge != NULL)
+        __redisMergeFlush(ac);
     c->flags |= REDIS_DISCONNECTING;
-    if (!(c->flags & REDIS_IN_CALLBACK) && ac->replies.head == NULL)
+    if (!(c->flags & REDIS_IN_CALLBACK) && ac->replies.len == 0)
         __redisAsyncDisconnect(ac);
 }
 
 static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply, redisCallback *dstcb) {
     redisContext *c = &(ac->c);
-    dict *callbacks;
-    dictEntry *de;
+    subdictEntry *de;
+    subdict *callbacks;
     int pvariant;
     char *stype;
-    sds sname;
 
     /* Custom reply functions are not supported for pub/sub. This will fail
      * very hard when they are used... */
@@ -373,14 +1114,14 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
 
         /* Locate the right callback */
         assert(reply->element[1]->type == REDIS_REPLY_STRING);
-        sname = sdsnewlen(reply->element[1]->str,reply->element[1]->len);
-        de = dictFind(callbacks,sname);
+        de = subdictFind(callbacks,reply->element[1]->str,reply->element[1]->len);
         if (de != NULL) {
-            memcpy(dstcb,dictGetEntryVal(de),sizeof(*dstcb));
+            memcpy(dstcb,&de->cb,sizeof(*dstcb));
 
-            /* If this is an unsubscribe message, remove it. */
-            if (strcasecmp(stype+pvariant,"unsubscribe") == 0) {
-                dictDelete(callbacks,sname);
+            /* If this is an unsubscribe message, remove it. Of the message
+             * types, only (p)unsubscribe has this length. */
+            if (reply->element[0]->len == 11+pvariant) {
+                subdictDelete(callbacks,de);
 
                 /* If this was the last unsubscribe message, revert to
                  * non-subscribe mode. */
@@ -389,7 +1130,6 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
                     c->flags &= ~REDIS_SUBSCRIBED;
             }
         }
-        sdsfree(sname);
     } else {
         /* Shift callback for invalid commands. */
         __redisShiftCallback(&ac->sub.invalid,dstcb);
@@ -397,25 +1137,126 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
     return REDIS_OK;
 }
 
-void redisProcessCallbacks(redisAsyncContext *ac) {
+/* Parse the bulk string at *p. Returns 0 when it is incomplete or is not a
+ * bulk string, otherwise *p is moved past it. */
+static int __redisParseBulk(const char **p, const char *end, const char **str, size_t *len) {
+    const char *s = *p;
+    size_t n = 0;
+
+    if (s == end || *s++ != '$' || s == end || !isdigit((unsigned char)*s))
+        return 0;
+    while (s != end && isdigit((unsigned char)*s)) {
+        n = n*10+(*s++ - '0');
+        if (n > (size_t)(end-s))
+            return 0;
+    }
+    if ((size_t)(end-s) < n+4 || s[0] != '\r' || s[1] != '\n')
+        return 0;
+    s += 2;
+    if (s[n] != '\r' || s[n+1] != '\n')
+        return 0;
+    *str = s;
+    *len = n;
+    *p = s+n+2;
+    return 1;
+}
+
+/* Fast path for subscriptions with a message callback. When the read buffer
+ * starts with a complete (p)message for such a subscription, it is passed to
+ * the callback as a view into the buffer and skipped, without building a
+ * reply. Returns REDIS_ERR when this is not the case and the message should
+ * go through the reader. */
+static int __redisDispatchMessage(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
-    redisCallback cb = {NULL, NULL, NULL};
-    void *reply = NULL;
-    int status;
+    redisReader *r = c->reader;
+    const char *p, *end, *type;
+    size_t typelen;
+    redisMessage m;
+    redisCallback *cb;
+    subdictEntry *de;
+    int pattern;
 
-    while((status = redisGetReply(c,&reply)) == REDIS_OK) {
-        if (reply == NULL) {
-            /* When the connection is being disconnected and there are
-             * no more replies, this is the cue to really disconnect. */
-            if (c->flags & REDIS_DISCONNECTING && sdslen(c->obuf) == 0) {
-                __redisAsyncDisconnect(ac);
-                return;
-            }
+    /* The reader must not be halfway through a reply. Once it ran out of
+     * input, it keeps a root task that did not read its type yet. */
+    if (r->err || r->len-r->pos < 4)
+        return REDIS_ERR;
+    if (r->ridx != -1 && (r->ridx != 0 || r->rstack[0].type != -1))
+        return REDIS_ERR;
 
-            /* If monitor mode, repush callback */
-            if(c->flags & REDIS_MONITORING) {
-                __redisPushCallback(&ac->replies,&cb);
-            }
+    p = r->buf+r->pos;
+    end = r->buf+r->len;
+    if (p[0] != '*' || (p[1] != '3' && p[1] != '4') || p[2] != '\r' || p[3] != '\n')
+        return REDIS_ERR;
+    pattern = (p[1] == '4');
+    p += 4;
+
+    if (!__redisParseBulk(&p,end,&type,&typelen))
+        return REDIS_ERR;
+    if (pattern) {
+        if (typelen != 8 || memcmp(type,"pmessage",8) != 0 ||
+            !__redisParseBulk(&p,end,&m.pattern,&m.patternlen))
+            return REDIS_ERR;
+    } else {
+        if (typelen != 7 || memcmp(type,"message",7) != 0)
+            return REDIS_ERR;
+        m.pattern = NULL;
+        m.patternlen = 0;
+    }
+    if (!__redisParseBulk(&p,end,&m.channel,&m.channellen) ||
+        !__redisParseBulk(&p,end,&m.payload,&m.payloadlen))
+        return REDIS_ERR;
+
+    if (pattern)
+        de = subdictFind(ac->sub.patterns,m.pattern,m.patternlen);
+    else
+        de = subdictFind(ac->sub.channels,m.channel,m.channellen);
+    if (de == NULL)
+        return REDIS_ERR;
+    cb = &de->cb;
+    if (cb->msgfn == NULL)
+        return REDIS_ERR;
+
+    /* The buffer is left alone until the next read, so the view stays valid
+     * for the duration of the callback. */
+    r->pos = p-r->buf;
+    c->flags |= REDIS_IN_CALLBACK;
+    cb->msgfn(ac,&m,((redisSubscription*)cb->privdata)->privdata);
+    c->flags &= ~REDIS_IN_CALLBACK;
+    return REDIS_OK;
+}
+
+void redisProcessCallbacks(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+    redisCallback cb = {NULL, NULL, NULL, 0};
+    void *reply = NULL;
+    int status;
+
+    for (;;) {
+        /* Messages can only be next when no regular replies are pending. */
+        if ((c->flags & REDIS_SUBSCRIBED) && ac->replies.len == 0 &&
+            __redisDispatchMessage(ac) == REDIS_OK) {
+            /* Proceed with free'ing when redisAsyncFree() was called. */
+            if (c->flags & REDIS_FREEING) {
+                __redisAsyncFree(ac);
+                return;
+            }
+            continue;
+        }
+
+        if ((status = redisGetReply(c,&reply)) != REDIS_OK)
+            break;
+        if (reply == NULL) {
+            /* When the connection is being disconnected and there are
+             * no more replies, this is the cue to really disconnect. */
+            if (c->flags & REDIS_DISCONNECTING && sdslen(c->obuf) == 0) {
+                __redisAsyncDisconnect(ac);
+                return;
+            }
+
+            /* If monitor mode, repush callback */
+            if(c->flags & REDIS_MONITORING) {
+                __redisPushCallback(&ac->replies,&cb);
+            }
 
             /* When the connection is not being disconnected, simply stop
              * trying to get replies and wait for the next loop tick. */
@@ -452,7 +1293,7 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
                 __redisGetSubscribeCallback(ac,reply,&cb);
         }
 
-        if (cb.fn != NULL) {
+        if (cb.fn != NULL || cb.msgfn != NULL) {
             __redisRunCallback(ac,&cb,reply);
             c->reader->fn->freeObject(reply);
 
@@ -473,6 +1314,8 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
     /* Disconnect when there was an error reading the reply */
     if (status != REDIS_OK)
         __redisAsyncDisconnect(ac);
+    else
+        __redisAsyncCheckWatermarks(ac);
 }
 
 /* Internal helper function to detect socket status the first time a read or
@@ -486,23 +1329,76 @@ static int __redisAsyncHandleConnect(redisAsyncContext *ac) {
         if (errno == EINPROGRESS)
             return REDIS_OK;
 
-        if (ac->onConnect) ac->onConnect(ac,REDIS_ERR);
+        if (ac->onConnect && ac->reconnect.attempts == 0)
+            ac->onConnect(ac,REDIS_ERR);
         __redisAsyncDisconnect(ac);
         return REDIS_ERR;
     }
 
-    /* Mark context as connected. */
+    /* Mark context as connected, and disarm the connect timeout. */
     c->flags |= REDIS_CONNECTED;
-    if (ac->onConnect) ac->onConnect(ac,REDIS_OK);
+    if (c->flags & REDIS_CONNECT_TIMER) {
+        c->flags &= ~REDIS_CONNECT_TIMER;
+        ac->timers.internal = 0;
+        __redisAsyncArmTimer(ac,__redisAsyncUsec());
+    }
+    if (ac->reconnect.attempts > 0) {
+        ac->reconnect.attempts = 0;
+        if (ac->reconnect.fn) ac->reconnect.fn(ac,REDIS_OK);
+    } else {
+        if (ac->onConnect) ac->onConnect(ac,REDIS_OK);
+    }
     return REDIS_OK;
 }
 
+/* Called when the fd of a context that is resolving a host name becomes
+ * readable. When the lookup is done, the connected socket takes over the fd
+ * and the context waits for the first write event as usual. */
+static void __redisAsyncHandleResolve(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+    struct redisResolveJob *job = ac->resolver;
+    int status;
+
+    if (!redisResolveJobDone(job))
+        return;
+
+    /* Stop watching the pipe before its fd is replaced. */
+    _EL_DEL_READ(ac);
+    _EL_DEL_WRITE(ac);
+
+    ac->resolver = NULL;
+    status = redisContextConnectResolved(c,job);
+    redisResolveJobRelease(job);
+    c->flags &= ~REDIS_CONNECTED;
+
+    if (status != REDIS_OK) {
+        __redisAsyncCopyError(ac);
+        if (ac->onConnect && ac->reconnect.attempts == 0)
+            ac->onConnect(ac,REDIS_ERR);
+        __redisAsyncDisconnect(ac);
+        return;
+    }
+
+    _EL_ADD_WRITE(ac);
+}
+
 /* This function should be called when the socket is readable.
  * It processes all replies that can be read and executes their callbacks.
  */
 void redisAsyncHandleRead(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
 
+    /* The socket is dead while waiting to reconnect. */
+    if (c->flags & REDIS_RECONNECT_TIMER) {
+        _EL_DEL_READ(ac);
+        return;
+    }
+
+    if (ac->resolver != NULL) {
+        __redisAsyncHandleResolve(ac);
+        return;
+    }
+
     if (!(c->flags & REDIS_CONNECTED)) {
         /* Abort connect was not successful. */
         if (__redisAsyncHandleConnect(ac) != REDIS_OK)
@@ -523,8 +1419,18 @@ void redisAsyncHandleRead(redisAsyncContext *ac) {
 
 void redisAsyncHandleWrite(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
+    size_t len;
     int done = 0;
 
+    if (c->flags & REDIS_RECONNECT_TIMER) {
+        _EL_DEL_WRITE(ac);
+        return;
+    }
+
+    /* Nothing to write to until the host name is resolved. */
+    if (ac->resolver != NULL)
+        return;
+
     if (!(c->flags & REDIS_CONNECTED)) {
         /* Abort connect was not successful. */
         if (__redisAsyncHandleConnect(ac) != REDIS_OK)
@@ -534,18 +1440,365 @@ void redisAsyncHandleWrite(redisAsyncContext *ac) {
             return;
     }
 
+    /* This is the end of the tick, or of the pipeline window, so the
+     * commands that were merged so far can be written. */
+    if (ac->merge != NULL)
+        __redisMergeFlush(ac);
+
+    len = sdslen(c->obuf);
     if (redisBufferWrite(c,&done) == REDIS_ERR) {
         __redisAsyncDisconnect(ac);
     } else {
+        __redisAsyncWritten(ac,len-sdslen(c->obuf));
+
         /* Continue writing when not done, stop writing otherwise */
-        if (!done)
+        if (!done) {
             _EL_ADD_WRITE(ac);
-        else
+        } else {
             _EL_DEL_WRITE(ac);
+            if (ac->pipeline.pending > 0) {
+                ac->pipeline.batches++;
+                ac->pipeline.commands += ac->pipeline.pending;
+                ac->pipeline.last = ac->pipeline.pending;
+                ac->pipeline.pending = 0;
+            }
+        }
 
         /* Always schedule reads after writes */
         _EL_ADD_READ(ac);
+        __redisAsyncCheckWatermarks(ac);
+    }
+}
+
+/* Connect again once the reconnect delay has passed. The new socket takes
+ * over the fd of the context, which is then watched as on the first connect. */
+static void __redisAsyncConnectAgain(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+    redisContext *tmp;
+    struct redisResolveJob *job = NULL;
+
+    if ((tmp = redisContextInit()) == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        __redisAsyncDisconnect(ac);
+        return;
+    }
+
+    tmp->flags &= ~REDIS_BLOCK;
+    tmp->sockopts = c->sockopts;
+    if (ac->reconnect.path != NULL)
+        redisContextConnectUnix(tmp,ac->reconnect.path,NULL);
+    else if (ac->reconnect.addr != NULL)
+        redisContextConnectAddr(tmp,ac->reconnect.addr,ac->reconnect.addrlen,NULL);
+    else
+        job = redisContextResolveTcp(tmp,ac->reconnect.host,ac->reconnect.port,
+                                     ac->reconnect.source_addr);
+
+    if (tmp->err == 0 && dup2(tmp->fd,c->fd) == -1)
+        __redisSetError(tmp,REDIS_ERR_IO,NULL);
+    if (tmp->err != 0) {
+        __redisSetError(c,tmp->err,tmp->errstr);
+        if (job != NULL)
+            redisResolveJobRelease(job);
+        redisFree(tmp);
+        __redisAsyncDisconnect(ac);
+        return;
+    }
+
+    close(tmp->fd);
+    tmp->fd = -1;
+    c->flags = (c->flags & ~REDIS_FASTOPEN) | (tmp->flags & REDIS_FASTOPEN);
+    redisFree(tmp);
+
+    ac->resolver = job;
+    if (job == NULL)
+        _EL_ADD_WRITE(ac);
+    else if (ac->connectTimeout.tv_sec != 0 || ac->connectTimeout.tv_usec != 0)
+        redisResolveJobSetTimeout(job,&ac->connectTimeout);
+    __redisAsyncWatchConnect(ac);
+}
+
+/* This function should be called when the timer scheduled through the
+ * scheduleTimer hook fires. Timers added with redisAsyncAddTimer() that are
+ * due are run first. When the context is still connecting, the connection
+ * attempt is aborted: the connect callback is called with a REDIS_ERR status
+ * and the context is free'd. Otherwise, the pipeline window has passed and
+ * the output buffer can be written, or it is time to try to reconnect. */
+void redisAsyncHandleTimeout(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+    redisAsyncTimer *t;
+    long long now = __redisAsyncUsec();
+
+    while ((t = ac->timers.head) != NULL && t->when <= now) {
+        __redisAsyncUnlinkTimer(ac,t);
+        c->flags |= REDIS_IN_CALLBACK;
+        t->fn(ac,t->privdata);
+        c->flags &= ~REDIS_IN_CALLBACK;
+        free(t);
+
+        /* Proceed with free'ing when redisAsyncFree() was called. */
+        if (c->flags & REDIS_FREEING) {
+            __redisAsyncFree(ac);
+            return;
+        }
+        if ((c->flags & REDIS_DISCONNECTING) && ac->replies.len == 0) {
+            __redisAsyncDisconnect(ac);
+            return;
+        }
+    }
+
+    if (ac->timers.internal == 0 || ac->timers.internal > now) {
+        __redisAsyncArmTimer(ac,now);
+        return;
+    }
+    ac->timers.internal = 0;
+    __redisAsyncArmTimer(ac,now);
+
+    if (c->flags & REDIS_PIPELINE_TIMER) {
+        c->flags &= ~REDIS_PIPELINE_TIMER;
+        _EL_ADD_WRITE(ac);
+        return;
+    }
+
+    if (c->flags & REDIS_RECONNECT_TIMER) {
+        c->flags &= ~REDIS_RECONNECT_TIMER;
+        __redisAsyncConnectAgain(ac);
+        return;
+    }
+
+    /* A timer that fires after the connection was established is stale. */
+    if (c->flags & (REDIS_CONNECTED | REDIS_FREEING))
+        return;
+
+    errno = ETIMEDOUT;
+    __redisSetError(c,REDIS_ERR_TIMEOUT,"Timeout");
+    __redisAsyncCopyError(ac);
+    if (ac->onConnect && ac->reconnect.attempts == 0)
+        ac->onConnect(ac,REDIS_ERR);
+    __redisAsyncDisconnect(ac);
+}
+
+/* Merging of GET and HGET commands. Commands that are issued before the next
+ * write are collected in a batch, and written as a single MGET, or HMGET when
+ * they read fields of the same hash. The array reply is then split over the
+ * callbacks. Any other command writes the batch first, to keep the order in
+ * which commands are executed. */
+typedef struct redisMergeBatch {
+    sds hash; /* Hash read by HGET commands, or NULL for GET commands */
+    sds *args; /* Keys or fields */
+    redisCallback *cbs;
+    size_t len;
+    size_t size; /* Allocated entries */
+} redisMergeBatch;
+
+/* Callbacks for a merged command, in the order of its arguments. */
+typedef struct redisMergedCallbacks {
+    size_t len;
+    redisCallback cb[1];
+} redisMergedCallbacks;
+
+/* Maximum number of commands merged into one */
+#define REDIS_MERGE_MAX_BATCH 128
+
+/* Commands that are waiting for their reply, including those that are still
+ * waiting to be merged. */
+static size_t __redisAsyncPendingCallbacks(redisAsyncContext *ac) {
+    size_t len = ac->replies.len+ac->sub.invalid.len;
+    if (ac->merge != NULL)
+        len += ac->merge->len;
+    return len;
+}
+
+static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, redisMessageCallbackFn *msgfn,
+                               void *privdata, char *cmd, size_t len);
+static char *nextArgument(char *start, char **str, size_t *len);
+
+/* Merge GET and HGET commands. Replies are the elements of the MGET or HMGET
+ * reply, so a key holding a value of the wrong type gives a nil reply instead
+ * of an error. This requires the default reply object functions. */
+int redisAsyncEnableMerging(redisAsyncContext *ac) {
+    if (ac->merge == NULL) {
+        ac->merge = calloc(1,sizeof(redisMergeBatch));
+        if (ac->merge == NULL)
+            return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Runs as a callback, so the callbacks of the merged commands are called
+ * directly. */
+static void __redisMergedReply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisMergedCallbacks *m = privdata;
+    redisReply *reply = r;
+    size_t j;
+
+    for (j = 0; j < m->len; j++) {
+        if (m->cb[j].fn == NULL)
+            continue;
+        /* Errors and NULL replies are passed to every callback. */
+        if (reply != NULL && reply->type == REDIS_REPLY_ARRAY && reply->elements == m->len)
+            m->cb[j].fn(ac,reply->element[j],m->cb[j].privdata);
+        else
+            m->cb[j].fn(ac,reply,m->cb[j].privdata);
+    }
+    free(m);
+}
+
+/* Clear the batch, executing callbacks with NULL reply when requested. */
+static void __redisMergeReset(redisAsyncContext *ac, int fail) {
+    redisMergeBatch *b = ac->merge;
+    size_t j;
+
+    for (j = 0; j < b->len; j++) {
+        if (fail)
+            __redisRunCallback(ac,&b->cbs[j],NULL);
+        sdsfree(b->args[j]);
     }
+    sdsfree(b->hash);
+    b->hash = NULL;
+    b->len = 0;
+}
+
+static void __redisMergeFree(redisAsyncContext *ac) {
+    __redisMergeReset(ac,1);
+    free(ac->merge->args);
+    free(ac->merge->cbs);
+    free(ac->merge);
+    ac->merge = NULL;
+}
+
+/* Append the batch to the output buffer. */
+static void __redisMergeFlush(redisAsyncContext *ac) {
+    redisMergeBatch *b = ac->merge;
+    redisMergedCallbacks *m = NULL;
+    redisCallback cb;
+    const char **argv;
+    size_t *argvlen;
+    size_t argc, j;
+    char *cmd;
+    int len;
+
+    if (b->len == 0)
+        return;
+
+    argc = b->len+1+(b->hash != NULL);
+    argv = malloc(sizeof(*argv)*argc);
+    argvlen = malloc(sizeof(*argvlen)*argc);
+    if (b->len > 1)
+        m = malloc(sizeof(*m)+sizeof(redisCallback)*(b->len-1));
+    if (argv == NULL || argvlen == NULL || (b->len > 1 && m == NULL)) {
+        free(argv);
+        free(argvlen);
+        free(m);
+        __redisMergeReset(ac,1);
+        return;
+    }
+
+    /* A single command is written as it was issued. */
+    argc = 0;
+    if (b->hash != NULL) {
+        argv[argc] = (b->len > 1) ? "HMGET" : "HGET";
+        argvlen[argc++] = strlen(argv[0]);
+        argv[argc] = b->hash;
+        argvlen[argc++] = sdslen(b->hash);
+    } else {
+        argv[argc] = (b->len > 1) ? "MGET" : "GET";
+        argvlen[argc++] = strlen(argv[0]);
+    }
+    for (j = 0; j < b->len; j++) {
+        argv[argc] = b->args[j];
+        argvlen[argc++] = sdslen(b->args[j]);
+    }
+
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    free(argv);
+    free(argvlen);
+    if (len == -1) {
+        free(m);
+        __redisMergeReset(ac,1);
+        return;
+    }
+
+    /* Merging is disabled while the command is added, so that a single GET
+     * is not merged again. */
+    ac->merge = NULL;
+    if (m != NULL) {
+        m->len = b->len;
+        memcpy(m->cb,b->cbs,sizeof(redisCallback)*b->len);
+        cb.fn = __redisMergedReply;
+        cb.msgfn = NULL;
+        cb.privdata = m;
+    } else {
+        cb = b->cbs[0];
+    }
+    if (__redisAsyncCommand(ac,cb.fn,NULL,cb.privdata,cmd,len) != REDIS_OK)
+        __redisRunCallback(ac,&cb,NULL);
+    ac->merge = b;
+    __redisMergeReset(ac,0);
+    free(cmd);
+}
+
+/* Add a command to the batch. Returns REDIS_ERR when it cannot be merged. */
+static int __redisMergeAdd(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata,
+                           char *cmd, char *cstr, size_t clen, char *p) {
+    redisContext *c = &(ac->c);
+    redisMergeBatch *b = ac->merge;
+    char *hash = NULL, *arg;
+    size_t hashlen = 0, arglen;
+    long argc;
+    void *ptr;
+
+    /* Replies in these modes are not matched to commands in order. Inside
+     * a transaction, every command gets its own QUEUED reply and an element
+     * of the EXEC reply. */
+    if (c->flags & (REDIS_SUBSCRIBED | REDIS_MONITORING | REDIS_IN_MULTI | REDIS_WATCHING))
+        return REDIS_ERR;
+
+    argc = strtol(cmd+1,NULL,10);
+    if (argc == 2 && clen == 3 && strncasecmp(cstr,"get",3) == 0) {
+        if (nextArgument(p,&arg,&arglen) == NULL)
+            return REDIS_ERR;
+    } else if (argc == 3 && clen == 4 && strncasecmp(cstr,"hget",4) == 0) {
+        if ((p = nextArgument(p,&hash,&hashlen)) == NULL ||
+            nextArgument(p,&arg,&arglen) == NULL)
+            return REDIS_ERR;
+    } else {
+        return REDIS_ERR;
+    }
+
+    /* Only commands of the same kind, or reading the same hash, merge. */
+    if (b->len > 0 && ((hash == NULL) != (b->hash == NULL) ||
+        (hash != NULL && (sdslen(b->hash) != hashlen || memcmp(b->hash,hash,hashlen) != 0))))
+        __redisMergeFlush(ac);
+
+    if (b->len == b->size) {
+        size_t size = b->size ? b->size*2 : 16;
+        if ((ptr = realloc(b->args,sizeof(sds)*size)) == NULL)
+            return REDIS_ERR;
+        b->args = ptr;
+        if ((ptr = realloc(b->cbs,sizeof(redisCallback)*size)) == NULL)
+            return REDIS_ERR;
+        b->cbs = ptr;
+        b->size = size;
+    }
+
+    if ((b->args[b->len] = sdsnewlen(arg,arglen)) == NULL)
+        return REDIS_ERR;
+    if (b->len == 0 && hash != NULL && (b->hash = sdsnewlen(hash,hashlen)) == NULL) {
+        sdsfree(b->args[b->len]);
+        return REDIS_ERR;
+    }
+    b->cbs[b->len].fn = fn;
+    b->cbs[b->len].msgfn = NULL;
+    b->cbs[b->len].privdata = privdata;
+    b->len++;
+
+    if (b->len == REDIS_MERGE_MAX_BATCH)
+        __redisMergeFlush(ac);
+
+    __redisAsyncScheduleWrite(ac);
+    __redisAsyncWatchConnect(ac);
+    __redisAsyncCheckWatermarks(ac);
+    return REDIS_OK;
 }
 
 /* Sets a pointer to the first argument and its length starting at p. Returns
@@ -564,44 +1817,86 @@ static char *nextArgument(char *start, char **str, size_t *len) {
     return p+2+(*len)+2;
 }
 
+/* Keep track of open transactions in the flags of the context. The flags
+ * follow the commands in the order they are written. */
+static void __redisTrackTransaction(redisContext *c, const char *cstr, size_t clen) {
+    if (clen == 5 && strncasecmp(cstr,"multi",5) == 0)
+        c->flags |= REDIS_IN_MULTI;
+    else if (clen == 5 && strncasecmp(cstr,"watch",5) == 0)
+        c->flags |= REDIS_WATCHING;
+    else if (clen == 7 && strncasecmp(cstr,"unwatch",7) == 0)
+        c->flags &= ~REDIS_WATCHING;
+    else if ((clen == 4 && strncasecmp(cstr,"exec",4) == 0) ||
+             (clen == 7 && strncasecmp(cstr,"discard",7) == 0))
+        c->flags &= ~(REDIS_IN_MULTI | REDIS_WATCHING);
+}
+
 /* Helper function for the redisAsyncCommand* family of functions. Writes a
  * formatted command to the output buffer and registers the provided callback
  * function with the context. */
-static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, char *cmd, size_t len) {
+static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, redisMessageCallbackFn *msgfn,
+                               void *privdata, char *cmd, size_t len) {
     redisContext *c = &(ac->c);
     redisCallback cb;
     int pvariant, hasnext;
     char *cstr, *astr;
     size_t clen, alen;
     char *p;
-    sds sname;
 
     /* Don't accept new commands when the connection is about to be closed. */
     if (c->flags & (REDIS_DISCONNECTING | REDIS_FREEING)) return REDIS_ERR;
 
     /* Setup callback */
     cb.fn = fn;
+    cb.msgfn = msgfn;
     cb.privdata = privdata;
+    cb.end = ac->reconnect.appended+len;
 
     /* Find out which command will be appended. */
     p = nextArgument(cmd,&cstr,&clen);
     assert(p != NULL);
+    __redisTrackTransaction(c,cstr,clen);
+
+    if (ac->merge != NULL && msgfn == NULL) {
+        if (__redisMergeAdd(ac,fn,privdata,cmd,cstr,clen,p) == REDIS_OK)
+            return REDIS_OK;
+        __redisMergeFlush(ac);
+    }
+
     hasnext = (p[0] == '$');
     pvariant = (tolower(cstr[0]) == 'p') ? 1 : 0;
     cstr += pvariant;
     clen -= pvariant;
 
     if (hasnext && strncasecmp(cstr,"subscribe\r\n",11) == 0) {
+        subdict *callbacks = pvariant ? ac->sub.patterns : ac->sub.channels;
+        redisSubscription *sub = NULL;
+        subdictEntry *de;
+
+        if (msgfn != NULL) {
+            if ((sub = malloc(sizeof(*sub))) == NULL)
+                return REDIS_ERR;
+            sub->privdata = privdata;
+            sub->refcount = 1;
+            cb.privdata = sub;
+        }
         c->flags |= REDIS_SUBSCRIBED;
 
-        /* Add every channel/pattern to the list of subscription callbacks. */
+        /* Add every channel/pattern to the list of subscription callbacks. A
+         * subscription that is replaced ends. */
         while ((p = nextArgument(p,&astr,&alen)) != NULL) {
-            sname = sdsnewlen(astr,alen);
-            if (pvariant)
-                dictReplace(ac->sub.patterns,sname,&cb);
-            else
-                dictReplace(ac->sub.channels,sname,&cb);
+            if ((de = subdictFind(callbacks,astr,alen)) != NULL) {
+                if (sub != NULL && de->cb.privdata == sub)
+                    continue;
+                if (de->cb.msgfn != NULL)
+                    __redisReleaseSubscription(ac,&de->cb);
+            }
+            if (subdictReplace(callbacks,astr,alen,&cb) == REDIS_OK && sub != NULL)
+                sub->refcount++;
         }
+        /* Drop the reference held while adding. */
+        if (sub != NULL && --sub->refcount == 0)
+            free(sub);
     } else if (strncasecmp(cstr,"unsubscribe\r\n",13) == 0) {
         /* It is only useful to call (P)UNSUBSCRIBE when the context is
          * subscribed to one or more channels or patterns. */
@@ -623,10 +1918,13 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
             __redisPushCallback(&ac->replies,&cb);
     }
 
-    __redisAppendCommand(c,cmd,len);
+    __redisAsyncAppend(ac,cmd,len);
+    ac->pipeline.pending++;
 
     /* Always schedule a write when the write buffer is non-empty */
-    _EL_ADD_WRITE(ac);
+    __redisAsyncScheduleWrite(ac);
+    __redisAsyncWatchConnect(ac);
+    __redisAsyncCheckWatermarks(ac);
 
     return REDIS_OK;
 }
@@ -635,8 +1933,10 @@ int redisvAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdat
     char *cmd;
     int len;
     int status;
+    if (__redisAsyncFailFast(ac))
+        return REDIS_ERR;
     len = redisvFormatCommand(&cmd,format,ap);
-    status = __redisAsyncCommand(ac,fn,privdata,cmd,len);
+    status = __redisAsyncCommand(ac,fn,NULL,privdata,cmd,len);
     free(cmd);
     return status;
 }
@@ -654,8 +1954,452 @@ int redisAsyncCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *priv
     char *cmd;
     int len;
     int status;
+    if (__redisAsyncFailFast(ac))
+        return REDIS_ERR;
     len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
-    status = __redisAsyncCommand(ac,fn,privdata,cmd,len);
+    status = __redisAsyncCommand(ac,fn,NULL,privdata,cmd,len);
     free(cmd);
     return status;
 }
+
+int redisAsyncFormattedCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *cmd, size_t len) {
+    if (__redisAsyncFailFast(ac))
+        return REDIS_ERR;
+    return __redisAsyncCommand(ac,fn,NULL,privdata,(char*)cmd,len);
+}
+
+static int __redisAsyncSubscribe(redisAsyncContext *ac, const char *command,
+                                 redisMessageCallbackFn *fn, void *privdata,
+                                 int count, const char **names, const size_t *namelen) {
+    const char **argv;
+    size_t *argvlen;
+    char *cmd;
+    int i, len, status;
+
+    if (count <= 0 || __redisAsyncFailFast(ac))
+        return REDIS_ERR;
+
+    argv = malloc(sizeof(*argv)*(count+1));
+    argvlen = malloc(sizeof(*argvlen)*(count+1));
+    if (argv == NULL || argvlen == NULL) {
+        free(argv);
+        free(argvlen);
+        return REDIS_ERR;
+    }
+    argv[0] = command;
+    argvlen[0] = strlen(command);
+    for (i = 0; i < count; i++) {
+        argv[i+1] = names[i];
+        argvlen[i+1] = namelen ? namelen[i] : strlen(names[i]);
+    }
+
+    len = redisFormatCommandArgv(&cmd,count+1,argv,argvlen);
+    free(argv);
+    free(argvlen);
+    if (len == -1)
+        return REDIS_ERR;
+
+    status = __redisAsyncCommand(ac,NULL,fn,privdata,cmd,len);
+    free(cmd);
+    return status;
+}
+
+/* The lengths may be NULL when the names are NUL-terminated. */
+int redisAsyncSubscribe(redisAsyncContext *ac, redisMessageCallbackFn *fn, void *privdata, int count, const char **channels, const size_t *channellen) {
+    return __redisAsyncSubscribe(ac,"SUBSCRIBE",fn,privdata,count,channels,channellen);
+}
+
+int redisAsyncPSubscribe(redisAsyncContext *ac, redisMessageCallbackFn *fn, void *privdata, int count, const char **patterns, const size_t *patternlen) {
+    return __redisAsyncSubscribe(ac,"PSUBSCRIBE",fn,privdata,count,patterns,patternlen);
+}
+
+/* Commands submitted from other threads. They are kept in an intrusive
+ * multi-producer, single-consumer list: a producer links its command in with
+ * one atomic exchange on the head, and only the event loop thread pops from
+ * the tail, so submitting never takes a lock. */
+typedef struct redisQueuedCommand {
+    struct redisQueuedCommand *next;
+    redisCallbackFn *fn;
+    void *privdata;
+    char *cmd;
+    size_t len;
+} redisQueuedCommand;
+
+struct redisAsyncQueue {
+    redisAsyncContext *ac; /* NULL once the context is free'd */
+    redisQueuedCommand *head; /* Last pushed command, updated by producers */
+    redisQueuedCommand *tail; /* Next command to pop, owned by the loop */
+    redisQueuedCommand stub; /* Keeps the list non-empty */
+    int signalled; /* Set when the wakeup descriptor is readable */
+    int closed; /* Set when new commands are rejected */
+    int producers; /* Threads that are queueing a command right now */
+    int rfd; /* Watched by the event loop */
+    int wfd; /* Written by producers, the same as rfd for an eventfd */
+    long long waitusec; /* Longest wait for a reply, 0 for no limit */
+};
+
+/* Block the calling thread until the reply to a queued command arrives. A
+ * waiter that gives up leaves it to the callback to free this. */
+typedef struct redisQueueWaiter {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int refcount;
+    redisReply *reply;
+} redisQueueWaiter;
+
+static void __redisQueuePush(redisAsyncQueue *q, redisQueuedCommand *qc) {
+    redisQueuedCommand *prev;
+
+    qc->next = NULL;
+    prev = __atomic_exchange_n(&q->head,qc,__ATOMIC_ACQ_REL);
+    /* Until this store, the list is cut between prev and qc. The consumer
+     * sees this as an empty list and waits for the wakeup that follows. */
+    __atomic_store_n(&prev->next,qc,__ATOMIC_RELEASE);
+}
+
+static redisQueuedCommand *__redisQueuePop(redisAsyncQueue *q) {
+    redisQueuedCommand *tail = q->tail;
+    redisQueuedCommand *next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+        if (next == NULL)
+            return NULL;
+        q->tail = tail = next;
+        next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    /* The tail can only be popped when it is not the last command, so push
+     * the stub behind it, unless a producer is already doing that. */
+    if (tail != __atomic_load_n(&q->head,__ATOMIC_ACQUIRE))
+        return NULL;
+    __redisQueuePush(q,&q->stub);
+    next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* An eventfd needs an 8 byte counter, which works for a pipe as well. When
+ * the write fails, the descriptor is already readable. */
+static void __redisQueueWakeup(redisAsyncQueue *q) {
+    uint64_t one = 1;
+    if (write(q->wfd,&one,sizeof(one))) {}
+}
+
+static void __redisQueueClearWakeup(redisAsyncQueue *q) {
+    char buf[64];
+    while (read(q->rfd,buf,sizeof(buf)) > 0) {}
+}
+
+/* Move queued commands to the context. This runs in the event loop thread,
+ * so all commands of a wakeup end up in the output buffer together and are
+ * written in a single pipeline. */
+static void __redisQueueDrain(redisAsyncQueue *q) {
+    redisQueuedCommand *qc;
+    int status;
+
+    while ((qc = __redisQueuePop(q)) != NULL) {
+        status = REDIS_ERR;
+        if (q->ac != NULL && !__redisAsyncFailFast(q->ac))
+            status = __redisAsyncCommand(q->ac,qc->fn,NULL,qc->privdata,qc->cmd,qc->len);
+        if (status != REDIS_OK && qc->fn != NULL)
+            qc->fn(q->ac,NULL,qc->privdata);
+        free(qc->cmd);
+        free(qc);
+    }
+}
+
+/* Reject new commands. A producer that did not see the flag is still
+ * pushing its command, which takes a few instructions, so wait for it to
+ * be done. Afterwards, draining the queue once empties it for good. */
+static void __redisQueueClose(redisAsyncQueue *q) {
+    __atomic_store_n(&q->closed,1,__ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&q->producers,__ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+}
+
+/* Called when the context is free'd. Commands that are still queued are
+ * rejected while the context is valid, so their callbacks never get a NULL
+ * context. The queue rejects commands from now on. */
+static void __redisAsyncQueueDetach(redisAsyncQueue *q) {
+    __redisQueueClose(q);
+    __redisQueueDrain(q);
+    q->ac->queue = NULL;
+    q->ac = NULL;
+}
+
+#ifndef __linux__
+static int __redisSetNonBlockCloexec(int fd) {
+    int flags;
+
+    if ((flags = fcntl(fd,F_GETFL)) == -1 ||
+        fcntl(fd,F_SETFL,flags|O_NONBLOCK) == -1 ||
+        fcntl(fd,F_SETFD,FD_CLOEXEC) == -1)
+        return REDIS_ERR;
+    return REDIS_OK;
+}
+#endif
+
+redisAsyncQueue *redisAsyncQueueCreate(redisAsyncContext *ac) {
+    redisAsyncQueue *q;
+#ifndef __linux__
+    int fds[2];
+#endif
+
+    /* A context can only have a single queue. */
+    if (ac->queue != NULL)
+        return NULL;
+
+    q = calloc(1,sizeof(*q));
+    if (q == NULL)
+        return NULL;
+
+#ifdef __linux__
+    q->rfd = q->wfd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+    if (q->rfd == -1) {
+        free(q);
+        return NULL;
+    }
+#else
+    if (pipe(fds) == -1) {
+        free(q);
+        return NULL;
+    }
+    q->rfd = fds[0];
+    q->wfd = fds[1];
+    if (__redisSetNonBlockCloexec(q->rfd) != REDIS_OK ||
+        __redisSetNonBlockCloexec(q->wfd) != REDIS_OK) {
+        close(q->rfd);
+        close(q->wfd);
+        free(q);
+        return NULL;
+    }
+#endif
+
+    q->head = q->tail = &q->stub;
+    q->ac = ac;
+    ac->queue = q;
+    return q;
+}
+
+int redisAsyncQueueGetFd(redisAsyncQueue *q) {
+    return q->rfd;
+}
+
+/* Limit how long redisAsyncQueueCommandWait() waits for a reply. */
+void redisAsyncQueueSetWaitTimeout(redisAsyncQueue *q, const struct timeval tv) {
+    q->waitusec = (long long)tv.tv_sec*1000000+tv.tv_usec;
+}
+
+void redisAsyncQueueHandleRead(redisAsyncQueue *q) {
+    /* Producers only write to the descriptor when the flag is not set, so it
+     * must be cleared after the descriptor has been drained, but before the
+     * queue is, to never miss a wakeup. */
+    __redisQueueClearWakeup(q);
+    __atomic_store_n(&q->signalled,0,__ATOMIC_SEQ_CST);
+    __redisQueueDrain(q);
+}
+
+/* Free the queue. Commands that are still queued are sent when the context
+ * is valid. Every call that queues a command must have returned before, and
+ * no other thread may use the queue after this call. */
+void redisAsyncQueueFree(redisAsyncQueue *q) {
+    __redisQueueClose(q);
+    __redisQueueDrain(q);
+    if (q->ac != NULL)
+        q->ac->queue = NULL;
+    if (q->wfd != q->rfd)
+        close(q->wfd);
+    close(q->rfd);
+    free(q);
+}
+
+/* Takes ownership of the formatted command. */
+static int __redisAsyncQueueCommand(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, char *cmd, int len) {
+    redisQueuedCommand *qc;
+
+    if (len == -1)
+        return REDIS_ERR;
+    if ((qc = malloc(sizeof(*qc))) == NULL) {
+        free(cmd);
+        return REDIS_ERR;
+    }
+
+    /* Announce the push before checking the flag, see __redisQueueClose(). */
+    __atomic_add_fetch(&q->producers,1,__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->closed,__ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&q->producers,1,__ATOMIC_SEQ_CST);
+        free(qc);
+        free(cmd);
+        return REDIS_ERR;
+    }
+
+    qc->fn = fn;
+    qc->privdata = privdata;
+    qc->cmd = cmd;
+    qc->len = len;
+    __redisQueuePush(q,qc);
+
+    /* Only wake up the loop when it is not about to drain the queue. */
+    if (__atomic_exchange_n(&q->signalled,1,__ATOMIC_SEQ_CST) == 0)
+        __redisQueueWakeup(q);
+    __atomic_sub_fetch(&q->producers,1,__ATOMIC_SEQ_CST);
+    return REDIS_OK;
+}
+
+int redisvAsyncQueueCommand(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, const char *format, va_list ap) {
+    char *cmd;
+    int len;
+    len = redisvFormatCommand(&cmd,format,ap);
+    return __redisAsyncQueueCommand(q,fn,privdata,cmd,len);
+}
+
+int redisAsyncQueueCommand(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, const char *format, ...) {
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = redisvAsyncQueueCommand(q,fn,privdata,format,ap);
+    va_end(ap);
+    return status;
+}
+
+int redisAsyncQueueCommandArgv(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen) {
+    char *cmd;
+    int len;
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    return __redisAsyncQueueCommand(q,fn,privdata,cmd,len);
+}
+
+/* The reply is free'd when the callback returns, so the waiting thread gets
+ * a deep copy. */
+static redisReply *__redisCopyReply(const redisReply *r) {
+    redisReply *copy;
+    size_t j;
+
+    copy = calloc(1,sizeof(*copy));
+    if (copy == NULL)
+        return NULL;
+
+    copy->type = r->type;
+    copy->integer = r->integer;
+    copy->len = r->len;
+    if (r->str != NULL) {
+        copy->str = malloc(r->len+1);
+        if (copy->str == NULL)
+            goto oom;
+        memcpy(copy->str,r->str,r->len+1);
+    }
+    if (r->element != NULL) {
+        copy->element = calloc(r->elements,sizeof(redisReply*));
+        if (copy->element == NULL)
+            goto oom;
+        copy->elements = r->elements;
+        for (j = 0; j < r->elements; j++) {
+            copy->element[j] = __redisCopyReply(r->element[j]);
+            if (copy->element[j] == NULL)
+                goto oom;
+        }
+    }
+    return copy;
+
+oom:
+    freeReplyObject(copy);
+    return NULL;
+}
+
+/* Drop a reference to the waiter, freeing it and any reply that was not
+ * picked up when it was the last one. Must be called with the lock held. */
+static void __redisQueueWaiterRelease(redisQueueWaiter *w) {
+    if (--w->refcount > 0) {
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (w->reply != NULL)
+        freeReplyObject(w->reply);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+}
+
+static void __redisQueueWaitCallback(redisAsyncContext *ac, void *r, void *privdata) {
+    redisQueueWaiter *w = privdata;
+    ((void)ac);
+
+    pthread_mutex_lock(&w->lock);
+    /* Only copy the reply when the waiter is still there. */
+    if (w->refcount > 1 && r != NULL)
+        w->reply = __redisCopyReply(r);
+    w->done = 1;
+    pthread_cond_signal(&w->cond);
+    __redisQueueWaiterRelease(w);
+}
+
+/* The deadline is measured with the clock of the condition variable. */
+#ifdef __linux__
+#define REDIS_WAIT_CLOCK CLOCK_MONOTONIC
+#else
+#define REDIS_WAIT_CLOCK CLOCK_REALTIME
+#endif
+
+void *redisvAsyncQueueCommandWait(redisAsyncQueue *q, const char *format, va_list ap) {
+    redisQueueWaiter *w;
+    pthread_condattr_t attr;
+    struct timespec deadline;
+    redisReply *reply = NULL;
+    long long usec = q->waitusec;
+    int timedout = 0;
+
+    if ((w = calloc(1,sizeof(*w))) == NULL)
+        return NULL;
+    pthread_condattr_init(&attr);
+#ifdef __linux__
+    pthread_condattr_setclock(&attr,REDIS_WAIT_CLOCK);
+#endif
+    pthread_mutex_init(&w->lock,NULL);
+    pthread_cond_init(&w->cond,&attr);
+    pthread_condattr_destroy(&attr);
+    w->refcount = 2;
+
+    if (redisvAsyncQueueCommand(q,__redisQueueWaitCallback,w,format,ap) != REDIS_OK)
+        w->refcount--;
+
+    if (usec > 0) {
+        clock_gettime(REDIS_WAIT_CLOCK,&deadline);
+        usec += deadline.tv_nsec/1000;
+        deadline.tv_sec += usec/1000000;
+        deadline.tv_nsec = (usec%1000000)*1000;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (w->refcount > 1 && !w->done && !timedout) {
+        if (usec > 0)
+            timedout = pthread_cond_timedwait(&w->cond,&w->lock,&deadline) == ETIMEDOUT;
+        else
+            pthread_cond_wait(&w->cond,&w->lock);
+    }
+    if (w->done) {
+        reply = w->reply;
+        w->reply = NULL;
+    } else if (timedout) {
+        errno = ETIMEDOUT;
+    }
+    __redisQueueWaiterRelease(w);
+    return reply;
+}
+
+void *redisAsyncQueueCommandWait(redisAsyncQueue *q, const char *format, ...) {
+    va_list ap;
+    void *reply;
+    va_start(ap,format);
+    reply = redisvAsyncQueueCommandWait(q,format,ap);
+    va_end(ap);
+    return reply;
+}
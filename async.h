@@ -38,25 +38,98 @@ extern "C" {
 #endif
 
 struct redisAsyncContext; /* need forward declaration of redisAsyncContext */
-struct dict; /* dictionary header is included in async.c */
+struct subdict; /* subscription table header is included in async.c */
+struct redisResolveJob; /* defined in net.c */
+typedef struct redisAsyncQueue redisAsyncQueue; /* defined in async.c */
+struct redisMergeBatch; /* defined in async.c */
+
+/* View of a pub/sub message. The strings point into the read buffer, so they
+ * are not NUL-terminated and are only valid during the callback. The pattern
+ * is NULL when the message matched a channel subscription. */
+typedef struct redisMessage {
+    const char *channel;
+    size_t channellen;
+    const char *pattern;
+    size_t patternlen;
+    const char *payload;
+    size_t payloadlen;
+} redisMessage;
 
 /* Reply callback prototype and container */
 typedef void (redisCallbackFn)(struct redisAsyncContext*, void*, void*);
+
+/* Message callback prototype. The message is NULL when the subscription ends,
+ * either by unsubscribing or because the context is free'd. The channels or
+ * patterns of one subscribe call share their privdata, so this happens once,
+ * when the last of them ends. */
+typedef void (redisMessageCallbackFn)(struct redisAsyncContext*, const redisMessage*, void*);
+
 typedef struct redisCallback {
-    struct redisCallback *next; /* simple singly linked list */
     redisCallbackFn *fn;
+    redisMessageCallbackFn *msgfn; /* Set for message subscriptions */
     void *privdata;
+    unsigned long long end; /* End of the command in the output stream */
 } redisCallback;
 
-/* List of callbacks for either regular replies or pub/sub */
+/* FIFO of callbacks for either regular replies or pub/sub. Callbacks are
+ * stored inline in a ring buffer that doubles in size when it is full, so
+ * no allocation is needed once it has grown to the pipeline depth. */
 typedef struct redisCallbackList {
-    redisCallback *head, *tail;
+    redisCallback *buf;
+    size_t size; /* Allocated entries, a power of two (or 0) */
+    size_t head; /* Index of the oldest callback */
+    size_t len; /* Number of callbacks in the list */
 } redisCallbackList;
 
+/* Timer callback prototype */
+typedef void (redisTimerCallback)(struct redisAsyncContext*, void*);
+
+/* Timer added with redisAsyncAddTimer() */
+typedef struct redisAsyncTimer {
+    long long when; /* Microseconds on the monotonic clock */
+    redisTimerCallback *fn;
+    void *privdata;
+    struct redisAsyncTimer *prev, *next;
+} redisAsyncTimer;
+
 /* Connection callback prototypes */
 typedef void (redisDisconnectCallback)(const struct redisAsyncContext*, int status);
 typedef void (redisConnectCallback)(const struct redisAsyncContext*, int status);
 
+/* Watermark callback prototype. Called with 1 when the context crosses one
+ * of its high watermarks, and with 0 when it is back below all of its low
+ * watermarks. The context must not be free'd from this callback. */
+typedef void (redisWatermarkCallback)(const struct redisAsyncContext*, int above);
+
+/* Limits on the work queued on an async context. A zero high watermark
+ * means no limit. */
+typedef struct redisWatermarks {
+    size_t highbytes; /* Bytes of commands that were not written yet */
+    size_t lowbytes;
+    size_t highcallbacks; /* Commands waiting for their reply */
+    size_t lowcallbacks;
+    int failfast; /* Reject new commands while above a high watermark */
+} redisWatermarks;
+
+/* Reconnect callback prototype. Called with REDIS_ERR when the connection
+ * is lost and will be re-established, with the error set on the context, and
+ * with REDIS_OK once it is. */
+typedef void (redisReconnectCallback)(const struct redisAsyncContext*, int status);
+
+/* What to do with commands that were issued before the connection was lost,
+ * but not written to the socket. Commands that were written always receive a
+ * NULL reply, since it is unknown whether they were executed. */
+#define REDIS_REPLAY_NONE 0 /* They receive a NULL reply */
+#define REDIS_REPLAY_UNSENT 1 /* They are written after reconnecting */
+
+typedef struct redisReconnectOptions {
+    struct timeval delay; /* Before the first attempt, doubled after every
+                           * failed attempt */
+    struct timeval maxdelay; /* Upper bound of the delay */
+    int maxattempts; /* Give up after this many failed attempts, 0 never */
+    int replay; /* REDIS_REPLAY_* */
+} redisReconnectOptions;
+
 /* Context for an async connection to Redis */
 typedef struct redisAsyncContext {
     /* Hold the regular context, so it can be realloc'ed. */
@@ -80,6 +153,17 @@ typedef struct redisAsyncContext {
         void (*addWrite)(void *privdata);
         void (*delWrite)(void *privdata);
         void (*cleanup)(void *privdata);
+
+        /* Hook that is called when the library needs to be woken up after
+         * the given interval. Scheduling a timer replaces the previous one.
+         * The event library should call redisAsyncHandleTimeout() when it
+         * fires. This hook is optional. */
+        void (*scheduleTimer)(void *privdata, struct timeval tv);
+
+        /* Hook that is called when no timer is needed anymore, so that the
+         * timer of the event library does not keep its loop alive. This hook
+         * is optional. */
+        void (*cancelTimer)(void *privdata);
     } ev;
 
     /* Called when either the connection is terminated due to an error or per
@@ -89,35 +173,144 @@ typedef struct redisAsyncContext {
     /* Called when the first write event was received. */
     redisConnectCallback *onConnect;
 
+    /* Maximum time to wait for the connection to be established. Zero means
+     * no limit. Requires the event library to provide scheduleTimer. */
+    struct timeval connectTimeout;
+
+    /* Name resolution in progress, or NULL. */
+    struct redisResolveJob *resolver;
+
     /* Regular command callbacks */
     redisCallbackList replies;
 
     /* Subscription callbacks */
     struct {
         redisCallbackList invalid;
-        struct dict *channels;
-        struct dict *patterns;
+        struct subdict *channels;
+        struct subdict *patterns;
     } sub;
+
+    /* Queue of commands submitted from other threads, or NULL. */
+    redisAsyncQueue *queue;
+
+    /* Delay before writing new commands, so that commands issued in the
+     * meantime are written together. Zero writes them on the next write
+     * event. Requires the event library to provide scheduleTimer. */
+    struct timeval pipelineWindow;
+
+    /* Pipelining statistics. A batch is every command written between two
+     * moments when the output buffer was empty. */
+    struct {
+        unsigned long long batches;
+        unsigned long long commands; /* Written in all batches */
+        unsigned int last; /* Commands in the last batch */
+        unsigned int pending; /* Commands in the output buffer */
+    } pipeline;
+
+    /* GET and HGET commands waiting to be merged, or NULL when merging is
+     * not enabled. */
+    struct redisMergeBatch *merge;
+
+    /* Backpressure limits, see redisAsyncSetWatermarks() */
+    redisWatermarks watermarks;
+    redisWatermarkCallback *onWatermark;
+
+    /* Automatic reconnection, see redisAsyncSetReconnect() */
+    struct {
+        int enabled;
+        redisReconnectOptions opts;
+        redisReconnectCallback *fn;
+        int attempts; /* Failed attempts since the connection was lost */
+
+        /* Where to connect to */
+        char *host;
+        int port;
+        char *source_addr;
+        char *path;
+        struct sockaddr *addr;
+        size_t addrlen;
+
+        /* Bytes added to and written from the output buffer, and the end
+         * of the last command that was written completely */
+        unsigned long long appended;
+        unsigned long long written;
+        unsigned long long flushed;
+
+        /* Ring buffer with the end of every command that was not written
+         * completely, to find the commands that can be replayed. */
+        unsigned long long *ends;
+        size_t size;
+        size_t head;
+        size_t len;
+    } reconnect;
+
+    /* Timers added with redisAsyncAddTimer(), ordered by when they fire, and
+     * when the timer of the library itself fires, 0 for never. They share
+     * the scheduleTimer hook, which is set to the earliest of them. */
+    struct {
+        redisAsyncTimer *head, *tail;
+        long long internal;
+    } timers;
 } redisAsyncContext;
 
 /* Functions that proxy to hiredis */
 redisAsyncContext *redisAsyncConnect(const char *ip, int port);
 redisAsyncContext *redisAsyncConnectBind(const char *ip, int port, const char *source_addr);
+redisAsyncContext *redisAsyncConnectWithOptions(const char *ip, int port,
+                                                const redisSocketOptions *opts);
 redisAsyncContext *redisAsyncConnectUnix(const char *path);
+redisAsyncContext *redisAsyncConnectAddr(const struct sockaddr *addr, size_t addrlen);
 int redisAsyncSetConnectCallback(redisAsyncContext *ac, redisConnectCallback *fn);
 int redisAsyncSetDisconnectCallback(redisAsyncContext *ac, redisDisconnectCallback *fn);
+int redisAsyncSetConnectTimeout(redisAsyncContext *ac, const struct timeval tv);
+int redisAsyncSetPipelineWindow(redisAsyncContext *ac, const struct timeval tv);
+int redisAsyncEnableMerging(redisAsyncContext *ac);
+int redisAsyncSetWatermarks(redisAsyncContext *ac, const redisWatermarks *wm, redisWatermarkCallback *fn);
+int redisAsyncSetReconnect(redisAsyncContext *ac, const redisReconnectOptions *opts, redisReconnectCallback *fn);
+redisAsyncTimer *redisAsyncAddTimer(redisAsyncContext *ac, struct timeval tv, redisTimerCallback *fn, void *privdata);
+void redisAsyncCancelTimer(redisAsyncContext *ac, redisAsyncTimer *t);
 void redisAsyncDisconnect(redisAsyncContext *ac);
 void redisAsyncFree(redisAsyncContext *ac);
 
 /* Handle read/write events */
 void redisAsyncHandleRead(redisAsyncContext *ac);
 void redisAsyncHandleWrite(redisAsyncContext *ac);
+void redisAsyncHandleTimeout(redisAsyncContext *ac);
 
 /* Command functions for an async context. Write the command to the
  * output buffer and register the provided callback. */
 int redisvAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
 int redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, ...);
 int redisAsyncCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+int redisAsyncFormattedCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *cmd, size_t len);
+
+/* Subscribe to channels or patterns, receiving messages as a redisMessage
+ * instead of a reply. Messages are parsed in place without allocating. */
+int redisAsyncSubscribe(redisAsyncContext *ac, redisMessageCallbackFn *fn, void *privdata, int count, const char **channels, const size_t *channellen);
+int redisAsyncPSubscribe(redisAsyncContext *ac, redisMessageCallbackFn *fn, void *privdata, int count, const char **patterns, const size_t *patternlen);
+
+/* Thread-safe command submission. The queue is created and free'd in the
+ * event loop thread, which must watch the file descriptor returned by
+ * redisAsyncQueueGetFd() for readability and call redisAsyncQueueHandleRead()
+ * when it fires. Commands can then be queued from any thread. Callbacks are
+ * always executed in the event loop thread. */
+redisAsyncQueue *redisAsyncQueueCreate(redisAsyncContext *ac);
+int redisAsyncQueueGetFd(redisAsyncQueue *q);
+void redisAsyncQueueHandleRead(redisAsyncQueue *q);
+void redisAsyncQueueFree(redisAsyncQueue *q);
+int redisvAsyncQueueCommand(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
+int redisAsyncQueueCommand(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, const char *format, ...);
+int redisAsyncQueueCommandArgv(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+
+/* Queue a command and block the calling thread until its reply arrives. The
+ * reply is a copy that must be free'd with freeReplyObject(), or NULL when
+ * the command could not be executed or the wait timeout expired, in which
+ * case errno is ETIMEDOUT. Must not be called from the event loop thread,
+ * and requires the default reply object functions. The timeout must be set
+ * before other threads use the queue. */
+void redisAsyncQueueSetWaitTimeout(redisAsyncQueue *q, const struct timeval tv);
+void *redisvAsyncQueueCommandWait(redisAsyncQueue *q, const char *format, va_list ap);
+void *redisAsyncQueueCommandWait(redisAsyncQueue *q, const char *format, ...);
 
 #ifdef __cplusplus
 }
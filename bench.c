@@ -0,0 +1,204 @@
+#include "fmacros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "cluster.h"
+
+/* The subscription table is private to async.c, which includes it. */
+#include "subdict.c"
+
+/* Benchmarks of functions that do not need a server. */
+
+#define KEYS (1024*1024)
+#define ROUNDS 10
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+/* Bit by bit CRC16, to check the table driven functions against. */
+static unsigned int reference_slot(const char *key, size_t keylen) {
+    unsigned int crc = 0;
+    size_t s, e, i;
+    int j;
+
+    for (s = 0; s < keylen && key[s] != '{'; s++);
+    if (s < keylen) {
+        for (e = s+1; e < keylen && key[e] != '}'; e++);
+        if (e < keylen && e != s+1) {
+            key += s+1;
+            keylen = e-s-1;
+        }
+    }
+
+    for (i = 0; i < keylen; i++) {
+        crc ^= (unsigned char)key[i] << 8;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? ((crc<<1) ^ 0x1021) : (crc<<1);
+    }
+    return crc & 0x3fff;
+}
+
+/* Byte by byte CRC16 with a single table, as the key slots were computed
+ * before the slicing tables. */
+static unsigned short bytewise_table[256];
+
+static void bytewise_init(void) {
+    unsigned int crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i << 8;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? ((crc<<1) ^ 0x1021) : (crc<<1);
+        bytewise_table[i] = crc & 0xffff;
+    }
+}
+
+static unsigned int bytewise_slot(const char *key, size_t keylen) {
+    unsigned int crc = 0;
+    size_t s, e, i;
+
+    for (s = 0; s < keylen && key[s] != '{'; s++);
+    if (s < keylen) {
+        for (e = s+1; e < keylen && key[e] != '}'; e++);
+        if (e < keylen && e != s+1) {
+            key += s+1;
+            keylen = e-s-1;
+        }
+    }
+
+    for (i = 0; i < keylen; i++)
+        crc = ((crc<<8) ^ bytewise_table[((crc>>8) ^ (unsigned char)key[i]) & 0xff]) & 0xffff;
+    return crc & 0x3fff;
+}
+
+static void report(const char *name, long long t) {
+    printf("%-24s %8.1f Mkeys/sec\n",name,(double)KEYS*ROUNDS/t);
+}
+
+static void bench_key_slot(const char *name, const char *fmt) {
+    const char **keys = malloc(sizeof(*keys)*KEYS);
+    size_t *keylens = malloc(sizeof(*keylens)*KEYS);
+    unsigned int *slots = malloc(sizeof(*slots)*KEYS);
+    unsigned int sum = 0;
+    char *buf = malloc(KEYS*64);
+    long long t;
+    int i, r;
+
+    for (i = 0; i < KEYS; i++) {
+        keys[i] = buf+i*64;
+        keylens[i] = snprintf(buf+i*64,64,fmt,i);
+    }
+
+    printf("\n%s (e.g. \"%s\"):\n",name,keys[12345]);
+    for (i = 0; i < KEYS; i++) {
+        if (redisKeySlot(keys[i],keylens[i]) != reference_slot(keys[i],keylens[i]) ||
+            bytewise_slot(keys[i],keylens[i]) != reference_slot(keys[i],keylens[i])) {
+            printf("Mismatch for key \"%s\"\n",keys[i]);
+            exit(1);
+        }
+    }
+
+    t = usec();
+    for (r = 0; r < ROUNDS; r++)
+        for (i = 0; i < KEYS; i++)
+            sum += reference_slot(keys[i],keylens[i]);
+    report("bitwise",usec()-t);
+
+    t = usec();
+    for (r = 0; r < ROUNDS; r++)
+        for (i = 0; i < KEYS; i++)
+            sum += bytewise_slot(keys[i],keylens[i]);
+    report("bytewise",usec()-t);
+
+    t = usec();
+    for (r = 0; r < ROUNDS; r++)
+        for (i = 0; i < KEYS; i++)
+            sum += redisKeySlot(keys[i],keylens[i]);
+    report("redisKeySlot",usec()-t);
+
+    t = usec();
+    for (r = 0; r < ROUNDS; r++) {
+        redisKeySlotsBatch(keys,keylens,KEYS,slots);
+        sum += slots[r];
+    }
+    report("redisKeySlotsBatch",usec()-t);
+
+    /* Keep the compiler from dropping the loops. */
+    if (sum == 1) printf("\n");
+
+    free(buf);
+    free(slots);
+    free(keylens);
+    free(keys);
+}
+
+/* Subscribing to many channels. The table grows incrementally, so the
+ * slowest subscription should be far from the time it takes to move all
+ * entries at once, which is what a single resize of the full table costs. */
+static void bench_subscriptions(void) {
+    subdict *d = subdictCreate();
+    redisCallback cb;
+    long long t, start, slowest = 0;
+    unsigned long cursor = 0;
+    char name[32];
+    int i, len;
+
+    memset(&cb,0,sizeof(cb));
+    printf("\nSubscribing to %d channels:\n",KEYS);
+    start = usec();
+    for (i = 0; i < KEYS; i++) {
+        len = snprintf(name,sizeof(name),"channel:%d",i);
+        t = usec();
+        subdictReplace(d,name,len,&cb);
+        t = usec()-t;
+        if (t > slowest) slowest = t;
+    }
+    t = usec()-start;
+    printf("%-24s %8.1f Msubs/sec\n","Total",(double)KEYS/t);
+    printf("%-24s %8lld usec\n","Slowest subscription",slowest);
+
+    t = usec();
+    for (i = 0; i < KEYS; i++) {
+        len = snprintf(name,sizeof(name),"channel:%d",i);
+        if (subdictFind(d,name,len) == NULL)
+            printf("Missing channel \"%s\"\n",name);
+    }
+    t = usec()-t;
+    printf("%-24s %8.1f Mlookups/sec\n","Lookup",(double)KEYS/t);
+
+    /* Finish any resize in progress, then move the full table at once. */
+    _subdictRehash(d,d->ht[1].size);
+    t = usec();
+    _subdictResize(d);
+    _subdictRehash(d,d->ht[1].size);
+    t = usec()-t;
+    printf("%-24s %8lld usec\n","Resize all at once",t);
+
+    slowest = 0;
+    for (i = 0; i < KEYS; i++) {
+        len = snprintf(name,sizeof(name),"channel:%d",i);
+        t = usec();
+        subdictDelete(d,subdictFind(d,name,len));
+        t = usec()-t;
+        if (t > slowest) slowest = t;
+    }
+    printf("%-24s %8lld usec\n","Slowest unsubscription",slowest);
+    if (subdictNext(d,&cursor) != NULL)
+        printf("Channels left after unsubscribing\n");
+    subdictRelease(d);
+}
+
+int main(void) {
+    bytewise_init();
+    bench_key_slot("Short keys","user:%d");
+    bench_key_slot("Long keys","session:%08d:profile:preferences:v2");
+    bench_key_slot("Hash tags","{user%d}:following");
+    bench_subscriptions();
+    return 0;
+}
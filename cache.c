@@ -0,0 +1,804 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "cache.h"
+
+/* Forward declaration of functions in hiredis.c */
+redisReply *__redisTakeReply(redisReply *r);
+void __redisCopyError(int *err, char *errstr, int type, const char *str);
+int __redisSplitAddress(const char *addr, size_t len, const char **host, size_t *hostlen, int *port);
+
+/* Forward declaration of function in async.c */
+redisAsyncContext *__redisAsyncOpen(const char *ip, int port, const struct timeval *timeout,
+                                    int (*attach)(redisAsyncContext *, void *), void *data,
+                                    int *err, char *errstr);
+
+/* Request for a command whose reply may be cached */
+typedef struct redisCacheRequest {
+    redisCallbackFn *fn;
+    void *privdata;
+    redisCacheKey *key; /* NULL when the reply is not cached */
+    sds id;
+    unsigned long long stamp; /* Of the key when the command was sent */
+    unsigned long long generation; /* Of the cache */
+} redisCacheRequest;
+
+static void __redisCacheSetError(redisCache *cache, int type, const char *str) {
+    __redisCopyError(&cache->err,cache->errstr,type,str);
+}
+
+/* FNV-1a */
+static uint64_t __redisCacheHash(const char *s, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)s[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static redisCacheKey *__redisCacheFindKey(redisCache *cache, const char *name, size_t len, uint64_t hash) {
+    redisCacheKey *key;
+
+    if (cache->size == 0)
+        return NULL;
+    for (key = cache->table[hash & (cache->size-1)]; key != NULL; key = key->next) {
+        if (key->hash == hash && sdslen(key->name) == len && memcmp(key->name,name,len) == 0)
+            return key;
+    }
+    return NULL;
+}
+
+/* Double the number of buckets. The cache keeps working at its current size
+ * when this fails. */
+static void __redisCacheResize(redisCache *cache) {
+    redisCacheKey **table, *key, *next;
+    unsigned long size, i;
+
+    size = cache->size ? cache->size*2 : REDIS_CACHE_INITIAL_SIZE;
+    if ((table = calloc(size,sizeof(*table))) == NULL)
+        return;
+    for (i = 0; i < cache->size; i++) {
+        for (key = cache->table[i]; key != NULL; key = next) {
+            next = key->next;
+            key->next = table[key->hash & (size-1)];
+            table[key->hash & (size-1)] = key;
+        }
+    }
+    free(cache->table);
+    cache->table = table;
+    cache->size = size;
+}
+
+static redisCacheKey *__redisCacheAddKey(redisCache *cache, const char *name, size_t len, uint64_t hash) {
+    redisCacheKey *key;
+    unsigned long i;
+
+    if (cache->keys >= cache->size)
+        __redisCacheResize(cache);
+    if (cache->size == 0 || (key = calloc(1,sizeof(*key))) == NULL)
+        return NULL;
+    if ((key->name = sdsnewlen(name,len)) == NULL) {
+        free(key);
+        return NULL;
+    }
+    key->hash = hash;
+    i = hash & (cache->size-1);
+    key->next = cache->table[i];
+    cache->table[i] = key;
+    cache->keys++;
+    cache->used += sizeof(*key)+len;
+    return key;
+}
+
+/* Remove a key once it has no entries and no commands that may fill one. */
+static void __redisCacheReleaseKey(redisCache *cache, redisCacheKey *key) {
+    redisCacheKey **p;
+
+    if (key->entries != NULL || key->fills > 0)
+        return;
+    for (p = &cache->table[key->hash & (cache->size-1)]; *p != key; p = &(*p)->next);
+    *p = key->next;
+    cache->keys--;
+    cache->used -= sizeof(*key)+sdslen(key->name);
+    sdsfree(key->name);
+    free(key);
+}
+
+static size_t __redisCacheReplySize(const redisReply *r) {
+    size_t size = sizeof(*r)+r->len, j;
+
+    for (j = 0; j < r->elements; j++)
+        size += sizeof(redisReply*)+__redisCacheReplySize(r->element[j]);
+    return size;
+}
+
+/* Move an entry to the front of the least recently used list. */
+static void __redisCacheTouch(redisCache *cache, redisCacheEntry *e) {
+    if (cache->newest == e)
+        return;
+    if (e->prev != NULL)
+        e->prev->older = e->older;
+    if (e->older != NULL)
+        e->older->prev = e->prev;
+    else if (cache->oldest == e)
+        cache->oldest = e->prev;
+    e->prev = NULL;
+    e->older = cache->newest;
+    if (cache->newest != NULL)
+        cache->newest->prev = e;
+    cache->newest = e;
+    if (cache->oldest == NULL)
+        cache->oldest = e;
+}
+
+static void __redisCacheFreeEntry(redisCacheEntry *e) {
+    freeReplyObject(e->reply);
+    sdsfree(e->id);
+    free(e);
+}
+
+/* Drop an entry. Its key is left alone, see __redisCacheReleaseKey(). */
+static void __redisCacheDropEntry(redisCache *cache, redisCacheEntry *e) {
+    redisCacheEntry **p;
+
+    for (p = &e->key->entries; *p != e; p = &(*p)->next);
+    *p = e->next;
+    if (e->prev != NULL)
+        e->prev->older = e->older;
+    else
+        cache->newest = e->older;
+    if (e->older != NULL)
+        e->older->prev = e->prev;
+    else
+        cache->oldest = e->prev;
+    cache->used -= e->size;
+    if (e->refs > 0)
+        e->key = NULL;
+    else
+        __redisCacheFreeEntry(e);
+}
+
+/* Drop the entries of a key, and keep replies that are on their way from
+ * being cached. */
+static void __redisCacheInvalidateKey(redisCache *cache, redisCacheKey *key) {
+    key->stamp++;
+    while (key->entries != NULL)
+        __redisCacheDropEntry(cache,key->entries);
+    __redisCacheReleaseKey(cache,key);
+}
+
+/* Drop all entries, including replies that are on their way. */
+void redisCacheFlush(redisCache *cache) {
+    redisCacheKey *key;
+
+    cache->generation++;
+    while (cache->oldest != NULL) {
+        key = cache->oldest->key;
+        __redisCacheDropEntry(cache,cache->oldest);
+        __redisCacheReleaseKey(cache,key);
+    }
+}
+
+/* Cache the reply of a command. The reply is owned by the connection, which
+ * free's the empty shell after the callback. */
+static void __redisCacheStore(redisCache *cache, redisCacheKey *key, sds id, redisReply *r) {
+    redisCacheEntry *e, *old;
+    size_t size;
+
+    size = sizeof(*e)+sdslen(id)+__redisCacheReplySize(r);
+    if (size > cache->maxmemory || (e = calloc(1,sizeof(*e))) == NULL) {
+        sdsfree(id);
+        __redisCacheReleaseKey(cache,key);
+        return;
+    }
+    if ((e->reply = __redisTakeReply(r)) == NULL) {
+        free(e);
+        sdsfree(id);
+        __redisCacheReleaseKey(cache,key);
+        return;
+    }
+
+    e->id = id;
+    e->size = size;
+    e->key = key;
+    e->next = key->entries;
+    key->entries = e;
+    __redisCacheTouch(cache,e);
+    cache->used += size;
+
+    while (cache->used > cache->maxmemory && cache->oldest != e) {
+        old = cache->oldest;
+        key = old->key;
+        __redisCacheDropEntry(cache,old);
+        __redisCacheReleaseKey(cache,key);
+        cache->evictions++;
+    }
+}
+
+/* Tracking stopped, or invalidation messages may have been missed. */
+static void __redisCacheUntrack(redisCache *cache) {
+    cache->tracking = REDIS_CACHE_TRACKING_OFF;
+    redisCacheFlush(cache);
+}
+
+static void __redisCacheTrackingReply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisCache *cache = ac->data;
+    redisReply *reply = r;
+    ((void)privdata);
+
+    if (cache == NULL || cache->tracking != REDIS_CACHE_TRACKING_REQUESTED)
+        return;
+    if (reply != NULL && reply->type != REDIS_REPLY_ERROR) {
+        cache->tracking = REDIS_CACHE_TRACKING_ON;
+    } else {
+        if (reply != NULL)
+            __redisCacheSetError(cache,REDIS_ERR_OTHER,reply->str);
+        __redisCacheUntrack(cache);
+    }
+}
+
+/* Let the server send invalidation messages for the keys read over the
+ * command connection to the subscription. Commands are executed in order, so
+ * every read sent after this is tracked. */
+static void __redisCacheTrack(redisCache *cache) {
+    if (cache->ac == NULL || cache->subid == 0 || cache->tracking != REDIS_CACHE_TRACKING_OFF)
+        return;
+    if (redisAsyncCommand(cache->ac,__redisCacheTrackingReply,NULL,
+                          "CLIENT TRACKING on REDIRECT %lld",cache->subid) == REDIS_OK)
+        cache->tracking = REDIS_CACHE_TRACKING_REQUESTED;
+}
+
+static void __redisCacheConnected(const redisAsyncContext *ac, int status) {
+    redisCache *cache = ac->data;
+    if (cache != NULL && status != REDIS_OK) {
+        cache->ac = NULL;
+        cache->timer = NULL;
+        __redisCacheUntrack(cache);
+    }
+}
+
+static void __redisCacheDisconnected(const redisAsyncContext *ac, int status) {
+    redisCache *cache = ac->data;
+    ((void)status);
+    if (cache != NULL) {
+        /* The timer goes with the context. Hits that wait for it are
+         * passed on after the next reply. */
+        cache->ac = NULL;
+        cache->timer = NULL;
+        __redisCacheUntrack(cache);
+    }
+}
+
+/* Tracking does not survive the connection. */
+static void __redisCacheReconnected(const redisAsyncContext *ac, int status) {
+    redisCache *cache = ac->data;
+    if (cache == NULL)
+        return;
+    if (status == REDIS_OK)
+        __redisCacheTrack(cache);
+    else
+        __redisCacheUntrack(cache);
+}
+
+static void __redisCacheSubLost(const redisAsyncContext *ac) {
+    redisCache *cache = ac->data;
+    if (cache != NULL) {
+        cache->sub = NULL;
+        cache->subid = 0;
+        __redisCacheUntrack(cache);
+    }
+}
+
+static void __redisCacheSubConnected(const redisAsyncContext *ac, int status) {
+    if (status != REDIS_OK)
+        __redisCacheSubLost(ac);
+}
+
+static void __redisCacheSubDisconnected(const redisAsyncContext *ac, int status) {
+    ((void)status);
+    __redisCacheSubLost(ac);
+}
+
+static void __redisCacheClientId(redisAsyncContext *ac, void *r, void *privdata) {
+    redisCache *cache = ac->data;
+    redisReply *reply = r;
+    ((void)privdata);
+
+    if (cache != NULL && reply != NULL && reply->type == REDIS_REPLY_INTEGER) {
+        cache->subid = reply->integer;
+        __redisCacheTrack(cache);
+    }
+}
+
+/* Invalidation message. The payload holds the keys that changed, or is nil
+ * when the database was flushed. */
+static void __redisCacheInvalidate(redisAsyncContext *ac, void *r, void *privdata) {
+    redisCache *cache = ac->data;
+    redisReply *reply = r, *keys, *name;
+    redisCacheKey *key;
+    size_t j;
+    ((void)privdata);
+
+    if (cache == NULL || reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 3 ||
+        reply->element[0]->type != REDIS_REPLY_STRING || strcasecmp(reply->element[0]->str,"message") != 0)
+        return;
+
+    keys = reply->element[2];
+    if (keys->type != REDIS_REPLY_ARRAY) {
+        redisCacheFlush(cache);
+        return;
+    }
+    for (j = 0; j < keys->elements; j++) {
+        name = keys->element[j];
+        if (name->type != REDIS_REPLY_STRING)
+            continue;
+        key = __redisCacheFindKey(cache,name->str,name->len,__redisCacheHash(name->str,name->len));
+        if (key != NULL) {
+            __redisCacheInvalidateKey(cache,key);
+            cache->invalidations++;
+        }
+    }
+}
+
+static redisAsyncContext *__redisCacheOpen(redisCache *cache) {
+    redisAsyncContext *ac;
+
+    ac = __redisAsyncOpen(cache->host,cache->port,NULL,cache->attach,cache->attachdata,
+                          &cache->err,cache->errstr);
+    if (ac == NULL)
+        return NULL;
+    return ac;
+}
+
+/* Open the connections that are missing. The command connection reconnects
+ * on its own when the event library supports timers. The subscription is
+ * opened again by the next command instead, since its client ID changes and
+ * tracking has to be enabled again. Until then, nothing is cached. */
+static int __redisCacheConnect(redisCache *cache) {
+    redisReconnectOptions opts;
+    redisAsyncContext *ac;
+
+    if (cache->sub == NULL && (ac = __redisCacheOpen(cache)) != NULL) {
+        ac->data = cache;
+        redisAsyncSetConnectCallback(ac,__redisCacheSubConnected);
+        redisAsyncSetDisconnectCallback(ac,__redisCacheSubDisconnected);
+        cache->sub = ac;
+        if (redisAsyncCommand(ac,__redisCacheClientId,NULL,"CLIENT ID") != REDIS_OK ||
+            redisAsyncCommand(ac,__redisCacheInvalidate,NULL,"SUBSCRIBE __redis__:invalidate") != REDIS_OK) {
+            ac->data = NULL;
+            redisAsyncFree(ac);
+            cache->sub = NULL;
+        }
+    }
+
+    if (cache->ac != NULL)
+        return REDIS_OK;
+    if ((ac = __redisCacheOpen(cache)) == NULL)
+        return REDIS_ERR;
+
+    memset(&opts,0,sizeof(opts));
+    opts.delay.tv_usec = REDIS_CACHE_RECONNECT_DELAY*1000;
+    opts.maxdelay.tv_sec = REDIS_CACHE_RECONNECT_MAXDELAY/1000;
+    opts.replay = REDIS_REPLAY_UNSENT;
+    redisAsyncSetReconnect(ac,&opts,__redisCacheReconnected);
+
+    ac->data = cache;
+    redisAsyncSetConnectCallback(ac,__redisCacheConnected);
+    redisAsyncSetDisconnectCallback(ac,__redisCacheDisconnected);
+    cache->ac = ac;
+    __redisCacheTrack(cache);
+    return REDIS_OK;
+}
+
+/* Connect to a server at a host:port address, and cache up to maxmemory
+ * bytes of replies. The connections are attached to the event library with
+ * the attach function. */
+redisCache *redisCacheConnect(const char *addr, size_t maxmemory, redisCacheAttachFn *attach, void *data) {
+    redisCache *cache;
+    const char *host;
+    size_t hostlen;
+
+    cache = calloc(1,sizeof(*cache));
+    if (cache == NULL)
+        return NULL;
+
+    cache->attach = attach;
+    cache->attachdata = data;
+    cache->maxmemory = maxmemory;
+    if (__redisSplitAddress(addr,strlen(addr),&host,&hostlen,&cache->port) != REDIS_OK) {
+        __redisCacheSetError(cache,REDIS_ERR_OTHER,"Invalid server address");
+        return cache;
+    }
+    if ((cache->host = malloc(hostlen+1)) == NULL) {
+        __redisCacheSetError(cache,REDIS_ERR_OOM,"Out of memory");
+        return cache;
+    }
+    memcpy(cache->host,host,hostlen);
+    cache->host[hostlen] = '\0';
+    __redisCacheConnect(cache);
+    return cache;
+}
+
+/* Next argument of a formatted command. Returns 0 when there is none. */
+static int __redisCacheNextArg(const char **p, const char *end, const char **str, size_t *len) {
+    const char *s = *p;
+    size_t n = 0;
+
+    if (s == end || *s++ != '$')
+        return 0;
+    while (s < end && *s >= '0' && *s <= '9')
+        n = n*10+(*s++ - '0');
+    if (end-s < 2 || (size_t)(end-s-2) < n+2)
+        return 0;
+    *str = s+2;
+    *len = n;
+    *p = s+2+n+2;
+    return 1;
+}
+
+/* First argument of a formatted command, after the argument count. */
+static const char *__redisCacheFirstArg(const char *cmd, size_t len, int *argc) {
+    const char *p = cmd, *end = cmd+len;
+
+    *argc = 0;
+    if (p == end || *p++ != '*')
+        return NULL;
+    while (p < end && *p >= '0' && *p <= '9')
+        *argc = *argc*10+(*p++ - '0');
+    if (end-p < 2)
+        return NULL;
+    return p+2;
+}
+
+/* Returns the entry id of a GET, HGET or HGETALL command, and points the key
+ * to its key. Returns NULL when the reply is not cached, or when out of
+ * memory. */
+static sds __redisCacheEntryId(const char *cmd, size_t len, const char **key, size_t *keylen) {
+    const char *end = cmd+len, *p, *name, *field;
+    size_t namelen, fieldlen;
+    int argc;
+
+    if ((p = __redisCacheFirstArg(cmd,len,&argc)) == NULL || argc < 2 || argc > 3 ||
+        !__redisCacheNextArg(&p,end,&name,&namelen) ||
+        !__redisCacheNextArg(&p,end,key,keylen))
+        return NULL;
+
+    if (argc == 2 && namelen == 3 && strncasecmp(name,"GET",3) == 0)
+        return sdsnew("GET");
+    if (argc == 2 && namelen == 7 && strncasecmp(name,"HGETALL",7) == 0)
+        return sdsnew("HGETALL");
+    if (argc == 3 && namelen == 4 && strncasecmp(name,"HGET",4) == 0 &&
+        __redisCacheNextArg(&p,end,&field,&fieldlen))
+        return sdscatlen(sdsnew("HGET:"),field,fieldlen);
+    return NULL;
+}
+
+/* Other commands may change a cached key. The server invalidates it soon,
+ * but a read right after the write must not see the old reply until then.
+ * The arguments are not known to be keys, so any argument that names a
+ * cached key invalidates it. */
+static void __redisCacheInvalidateArgs(redisCache *cache, const char *cmd, size_t len) {
+    const char *end = cmd+len, *p, *arg;
+    redisCacheKey *key;
+    size_t arglen;
+    int argc, i;
+
+    if (cache->keys == 0 || (p = __redisCacheFirstArg(cmd,len,&argc)) == NULL)
+        return;
+    for (i = 0; i < argc && __redisCacheNextArg(&p,end,&arg,&arglen); i++) {
+        if (i > 0 && (key = __redisCacheFindKey(cache,arg,arglen,__redisCacheHash(arg,arglen))) != NULL)
+            __redisCacheInvalidateKey(cache,key);
+    }
+}
+
+/* Pass a cached reply on to a hit, or NULL when the cache is free'd. */
+static void __redisCacheDeliver(redisAsyncContext *ac, redisCacheHit *h, redisReply *r) {
+    redisCacheEntry *e = h->entry;
+
+    if (h->fn != NULL)
+        h->fn(ac,r,h->privdata);
+    if (--e->refs == 0 && e->key == NULL)
+        __redisCacheFreeEntry(e);
+    free(h);
+}
+
+/* Pass on the hits whose earlier commands have all been answered. */
+static void __redisCacheRunHits(redisCache *cache, redisAsyncContext *ac) {
+    redisCacheHit *h;
+
+    while ((h = cache->deferred) != NULL && h->after <= cache->answered) {
+        if ((cache->deferred = h->next) == NULL)
+            cache->deferredtail = NULL;
+        __redisCacheDeliver(ac,h,h->entry->reply);
+
+        /* The callback may have free'd the cache. */
+        if (ac->data == NULL)
+            return;
+    }
+}
+
+static void __redisCacheHitTimer(redisAsyncContext *ac, void *privdata) {
+    redisCache *cache = privdata;
+
+    cache->timer = NULL;
+    __redisCacheRunHits(cache,ac);
+}
+
+/* Make sure that a hit is passed on from the event loop, by the next reply,
+ * or by a timer when no reply is expected. Returns REDIS_ERR when neither
+ * will come, because the event library does not support timers. */
+static int __redisCacheWakeHits(redisCache *cache) {
+    struct timeval tv = { 0, 0 };
+
+    if (cache->answered < cache->sent || cache->timer != NULL)
+        return REDIS_OK;
+    cache->timer = redisAsyncAddTimer(cache->ac,tv,__redisCacheHitTimer,cache);
+    return cache->timer != NULL ? REDIS_OK : REDIS_ERR;
+}
+
+static void __redisCacheReply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisCacheRequest *req = privdata;
+    redisReply *reply = r;
+    redisCache *cache;
+    redisCacheKey *key = req->key;
+
+    if (req->fn != NULL)
+        req->fn(ac,r,req->privdata);
+
+    /* The callback may have free'd the cache. */
+    if ((cache = ac->data) == NULL) {
+        sdsfree(req->id);
+        free(req);
+        return;
+    }
+    cache->answered++;
+    if (key == NULL) {
+        /* Not cached. */
+    } else if (reply != NULL && reply->type != REDIS_REPLY_ERROR &&
+               cache->tracking == REDIS_CACHE_TRACKING_ON &&
+               req->generation == cache->generation && req->stamp == key->stamp) {
+        key->fills--;
+        __redisCacheStore(cache,key,req->id,reply);
+    } else {
+        key->fills--;
+        sdsfree(req->id);
+        __redisCacheReleaseKey(cache,key);
+    }
+    free(req);
+    __redisCacheRunHits(cache,ac);
+}
+
+/* Send a command whose reply is not cached. */
+static int __redisCacheSend(redisCache *cache, redisCallbackFn *fn, void *privdata, const char *cmd, size_t len) {
+    redisCacheRequest *req;
+
+    if ((req = calloc(1,sizeof(*req))) == NULL) {
+        __redisCacheSetError(cache,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    req->fn = fn;
+    req->privdata = privdata;
+    if (redisAsyncFormattedCommand(cache->ac,__redisCacheReply,req,cmd,len) != REDIS_OK) {
+        free(req);
+        __redisCacheSetError(cache,REDIS_ERR_OTHER,"Cannot send the command");
+        return REDIS_ERR;
+    }
+    cache->sent++;
+    return REDIS_OK;
+}
+
+/* Like replies, hits are passed on from the event loop, never before the
+ * command returns. A hit waits for the replies of the commands sent before
+ * it, so callbacks are called in the order of the commands. */
+static int __redisCacheHit(redisCache *cache, redisCallbackFn *fn, void *privdata, redisCacheEntry *e) {
+    redisCacheHit *h;
+
+    if ((h = malloc(sizeof(*h))) == NULL) {
+        __redisCacheSetError(cache,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    h->fn = fn;
+    h->privdata = privdata;
+    h->entry = e;
+    h->after = cache->sent;
+    h->next = NULL;
+    e->refs++;
+    if (cache->deferredtail != NULL)
+        cache->deferredtail->next = h;
+    else
+        cache->deferred = h;
+    cache->deferredtail = h;
+    return REDIS_OK;
+}
+
+/* Send a command whose reply is cached once it arrives. */
+static int __redisCacheFill(redisCache *cache, redisCallbackFn *fn, void *privdata, sds id,
+                            const char *name, size_t namelen, uint64_t hash, const char *cmd, size_t len) {
+    redisCacheRequest *req;
+    redisCacheKey *key;
+
+    key = __redisCacheFindKey(cache,name,namelen,hash);
+    if (key == NULL && (key = __redisCacheAddKey(cache,name,namelen,hash)) == NULL) {
+        sdsfree(id);
+        __redisCacheSetError(cache,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    if ((req = malloc(sizeof(*req))) == NULL) {
+        sdsfree(id);
+        __redisCacheReleaseKey(cache,key);
+        __redisCacheSetError(cache,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    req->fn = fn;
+    req->privdata = privdata;
+    req->key = key;
+    req->id = id;
+    req->stamp = key->stamp;
+    req->generation = cache->generation;
+    if (redisAsyncFormattedCommand(cache->ac,__redisCacheReply,req,cmd,len) != REDIS_OK) {
+        sdsfree(id);
+        free(req);
+        __redisCacheReleaseKey(cache,key);
+        __redisCacheSetError(cache,REDIS_ERR_OTHER,"Cannot send the command");
+        return REDIS_ERR;
+    }
+    key->fills++;
+    cache->sent++;
+    return REDIS_OK;
+}
+
+static int __redisCacheCommand(redisCache *cache, redisCallbackFn *fn, void *privdata, const char *cmd, size_t len) {
+    const char *name;
+    size_t namelen;
+    redisCacheKey *key;
+    redisCacheEntry *e;
+    uint64_t hash;
+    sds id;
+
+    if (cache->host == NULL)
+        return REDIS_ERR;
+    cache->err = 0;
+    cache->errstr[0] = '\0';
+    if (__redisCacheConnect(cache) != REDIS_OK)
+        return REDIS_ERR;
+
+    if ((id = __redisCacheEntryId(cmd,len,&name,&namelen)) == NULL) {
+        __redisCacheInvalidateArgs(cache,cmd,len);
+        return __redisCacheSend(cache,fn,privdata,cmd,len);
+    }
+
+    hash = __redisCacheHash(name,namelen);
+    if ((key = __redisCacheFindKey(cache,name,namelen,hash)) != NULL) {
+        for (e = key->entries; e != NULL; e = e->next) {
+            if (sdscmp(e->id,id) == 0)
+                break;
+        }
+        if (e != NULL && __redisCacheWakeHits(cache) == REDIS_OK) {
+            sdsfree(id);
+            __redisCacheTouch(cache,e);
+            cache->hits++;
+            return __redisCacheHit(cache,fn,privdata,e);
+        } else if (e != NULL) {
+            /* Without timers, the server answers instead. */
+            sdsfree(id);
+            cache->misses++;
+            return __redisCacheSend(cache,fn,privdata,cmd,len);
+        }
+    }
+
+    cache->misses++;
+    if (cache->tracking != REDIS_CACHE_TRACKING_OFF)
+        return __redisCacheFill(cache,fn,privdata,id,name,namelen,hash,cmd,len);
+    sdsfree(id);
+    return __redisCacheSend(cache,fn,privdata,cmd,len);
+}
+
+int redisvCacheCommand(redisCache *cache, redisCallbackFn *fn, void *privdata, const char *format, va_list ap) {
+    char *cmd;
+    int len;
+    int status;
+
+    len = redisvFormatCommand(&cmd,format,ap);
+    if (len == -1) {
+        __redisCacheSetError(cache,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    status = __redisCacheCommand(cache,fn,privdata,cmd,len);
+    free(cmd);
+    return status;
+}
+
+int redisCacheCommand(redisCache *cache, redisCallbackFn *fn, void *privdata, const char *format, ...) {
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = redisvCacheCommand(cache,fn,privdata,format,ap);
+    va_end(ap);
+    return status;
+}
+
+int redisCacheCommandArgv(redisCache *cache, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen) {
+    char *cmd;
+    int len;
+    int status;
+
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1) {
+        __redisCacheSetError(cache,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    status = __redisCacheCommand(cache,fn,privdata,cmd,len);
+    free(cmd);
+    return status;
+}
+
+/* Free the cache and its connections. Pending callbacks, and hits that wait
+ * for them, receive a NULL reply. This may be called from a callback. */
+void redisCacheFree(redisCache *cache) {
+    redisAsyncContext *ac;
+    redisCacheKey *key, *next;
+    redisCacheHit *h;
+    unsigned long i;
+
+    if (cache == NULL)
+        return;
+    if ((ac = cache->ac) != NULL) {
+        ac->data = NULL;
+        redisAsyncFree(ac);
+    }
+    if ((ac = cache->sub) != NULL) {
+        ac->data = NULL;
+        redisAsyncFree(ac);
+    }
+    while ((h = cache->deferred) != NULL) {
+        cache->deferred = h->next;
+        __redisCacheDeliver(NULL,h,NULL);
+    }
+    while (cache->oldest != NULL)
+        __redisCacheDropEntry(cache,cache->oldest);
+    for (i = 0; i < cache->size; i++) {
+        for (key = cache->table[i]; key != NULL; key = next) {
+            next = key->next;
+            sdsfree(key->name);
+            free(key);
+        }
+    }
+    free(cache->table);
+    free(cache->host);
+    free(cache);
+}
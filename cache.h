@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HIREDIS_CACHE_H
+#define __HIREDIS_CACHE_H
+#include <stdint.h>
+#include "hiredis.h"
+#include "async.h"
+#include "sds.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Delays between attempts to reconnect to the server, in milliseconds */
+#define REDIS_CACHE_RECONNECT_DELAY 100
+#define REDIS_CACHE_RECONNECT_MAXDELAY 5000
+
+/* Initial number of buckets of the key table */
+#define REDIS_CACHE_INITIAL_SIZE 64
+
+/* State of server assisted tracking on the command connection */
+#define REDIS_CACHE_TRACKING_OFF 0
+#define REDIS_CACHE_TRACKING_REQUESTED 1 /* Waiting for the reply */
+#define REDIS_CACHE_TRACKING_ON 2
+
+/* Cached reply of a command on a key */
+typedef struct redisCacheEntry {
+    sds id; /* Command and the arguments after the key */
+    redisReply *reply;
+    size_t size; /* Memory used by the entry */
+    struct redisCacheKey *key;
+    struct redisCacheEntry *next; /* Other entries of the key */
+    struct redisCacheEntry *prev, *older; /* Least recently used list */
+    unsigned int refs; /* Hits waiting to be passed on. A dropped entry is
+                        * kept until they are, with a NULL key. */
+} redisCacheEntry;
+
+typedef struct redisCacheKey {
+    sds name;
+    uint64_t hash;
+    struct redisCacheKey *next; /* Hash chain */
+    redisCacheEntry *entries;
+    unsigned int fills; /* Commands waiting for a reply to cache */
+    unsigned long long stamp; /* Changed when the key is invalidated */
+} redisCacheKey;
+
+/* Hit that waits for the replies of commands sent before it */
+typedef struct redisCacheHit {
+    redisCallbackFn *fn;
+    void *privdata;
+    redisCacheEntry *entry;
+    unsigned long long after; /* Replies to wait for */
+    struct redisCacheHit *next;
+} redisCacheHit;
+
+/* Attaches a connection to the event library, and should return REDIS_OK on
+ * success, like the redisLibeventAttach() family. */
+typedef int (redisCacheAttachFn)(redisAsyncContext *ac, void *data);
+
+/* Connection with a cache of GET, HGET and HGETALL replies, which the server
+ * invalidates through a second connection */
+typedef struct redisCache {
+    int err; /* Error flags, 0 when there is no error */
+    char errstr[128]; /* String representation of error when applicable */
+
+    redisCacheAttachFn *attach;
+    void *attachdata;
+    char *host;
+    int port;
+
+    redisAsyncContext *ac; /* Commands, or NULL */
+    redisAsyncContext *sub; /* Invalidation messages, or NULL */
+    long long subid; /* Client ID of sub, 0 when not known yet */
+    int tracking; /* REDIS_CACHE_TRACKING_* */
+    unsigned long long generation; /* Changed when the cache is flushed */
+    unsigned long long sent; /* Commands sent through the cache */
+    unsigned long long answered; /* Of those, the ones that got a reply */
+    redisCacheHit *deferred, *deferredtail;
+    redisAsyncTimer *timer; /* Passes on hits that wait for no reply */
+
+    redisCacheKey **table;
+    unsigned long size; /* Buckets, a power of two */
+    unsigned long keys;
+    redisCacheEntry *newest, *oldest;
+    size_t used; /* Memory used by entries and keys */
+    size_t maxmemory;
+
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long invalidations; /* Keys invalidated by the server */
+    unsigned long long evictions; /* Entries dropped to stay in maxmemory */
+} redisCache;
+
+redisCache *redisCacheConnect(const char *addr, size_t maxmemory, redisCacheAttachFn *attach, void *data);
+int redisvCacheCommand(redisCache *cache, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
+int redisCacheCommand(redisCache *cache, redisCallbackFn *fn, void *privdata, const char *format, ...);
+int redisCacheCommandArgv(redisCache *cache, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+void redisCacheFlush(redisCache *cache);
+void redisCacheFree(redisCache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
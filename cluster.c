@@ -0,0 +1,1384 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <assert.h>
+#include "cluster.h"
+#include "sds.h"
+
+/* Forward declaration of functions in hiredis.c */
+redisReply *__redisTakeReply(redisReply *r);
+void __redisCopyError(int *err, char *errstr, int type, const char *str);
+int __redisSplitAddress(const char *addr, size_t len, const char **host, size_t *hostlen, int *port);
+
+/* Forward declaration of function in async.c */
+redisAsyncContext *__redisAsyncOpen(const char *ip, int port, const struct timeval *timeout,
+                                    int (*attach)(redisAsyncContext *, void *), void *data,
+                                    int *err, char *errstr);
+
+/* CRC16 (XMODEM), as used by Redis Cluster to map keys to slots. The
+ * table of every byte is followed by the tables of the byte followed by one,
+ * two and three zero bytes, so four bytes can be hashed with independent
+ * lookups (slicing-by-4). */
+static const unsigned short crc16tab[4][256] = {
+    {
+        0x0000,0x1021,0x2042,0x3063,0x4084,0x50a5,0x60c6,0x70e7,
+        0x8108,0x9129,0xa14a,0xb16b,0xc18c,0xd1ad,0xe1ce,0xf1ef,
+        0x1231,0x0210,0x3273,0x2252,0x52b5,0x4294,0x72f7,0x62d6,
+        0x9339,0x8318,0xb37b,0xa35a,0xd3bd,0xc39c,0xf3ff,0xe3de,
+        0x2462,0x3443,0x0420,0x1401,0x64e6,0x74c7,0x44a4,0x5485,
+        0xa56a,0xb54b,0x8528,0x9509,0xe5ee,0xf5cf,0xc5ac,0xd58d,
+        0x3653,0x2672,0x1611,0x0630,0x76d7,0x66f6,0x5695,0x46b4,
+        0xb75b,0xa77a,0x9719,0x8738,0xf7df,0xe7fe,0xd79d,0xc7bc,
+        0x48c4,0x58e5,0x6886,0x78a7,0x0840,0x1861,0x2802,0x3823,
+        0xc9cc,0xd9ed,0xe98e,0xf9af,0x8948,0x9969,0xa90a,0xb92b,
+        0x5af5,0x4ad4,0x7ab7,0x6a96,0x1a71,0x0a50,0x3a33,0x2a12,
+        0xdbfd,0xcbdc,0xfbbf,0xeb9e,0x9b79,0x8b58,0xbb3b,0xab1a,
+        0x6ca6,0x7c87,0x4ce4,0x5cc5,0x2c22,0x3c03,0x0c60,0x1c41,
+        0xedae,0xfd8f,0xcdec,0xddcd,0xad2a,0xbd0b,0x8d68,0x9d49,
+        0x7e97,0x6eb6,0x5ed5,0x4ef4,0x3e13,0x2e32,0x1e51,0x0e70,
+        0xff9f,0xefbe,0xdfdd,0xcffc,0xbf1b,0xaf3a,0x9f59,0x8f78,
+        0x9188,0x81a9,0xb1ca,0xa1eb,0xd10c,0xc12d,0xf14e,0xe16f,
+        0x1080,0x00a1,0x30c2,0x20e3,0x5004,0x4025,0x7046,0x6067,
+        0x83b9,0x9398,0xa3fb,0xb3da,0xc33d,0xd31c,0xe37f,0xf35e,
+        0x02b1,0x1290,0x22f3,0x32d2,0x4235,0x5214,0x6277,0x7256,
+        0xb5ea,0xa5cb,0x95a8,0x8589,0xf56e,0xe54f,0xd52c,0xc50d,
+        0x34e2,0x24c3,0x14a0,0x0481,0x7466,0x6447,0x5424,0x4405,
+        0xa7db,0xb7fa,0x8799,0x97b8,0xe75f,0xf77e,0xc71d,0xd73c,
+        0x26d3,0x36f2,0x0691,0x16b0,0x6657,0x7676,0x4615,0x5634,
+        0xd94c,0xc96d,0xf90e,0xe92f,0x99c8,0x89e9,0xb98a,0xa9ab,
+        0x5844,0x4865,0x7806,0x6827,0x18c0,0x08e1,0x3882,0x28a3,
+        0xcb7d,0xdb5c,0xeb3f,0xfb1e,0x8bf9,0x9bd8,0xabbb,0xbb9a,
+        0x4a75,0x5a54,0x6a37,0x7a16,0x0af1,0x1ad0,0x2ab3,0x3a92,
+        0xfd2e,0xed0f,0xdd6c,0xcd4d,0xbdaa,0xad8b,0x9de8,0x8dc9,
+        0x7c26,0x6c07,0x5c64,0x4c45,0x3ca2,0x2c83,0x1ce0,0x0cc1,
+        0xef1f,0xff3e,0xcf5d,0xdf7c,0xaf9b,0xbfba,0x8fd9,0x9ff8,
+        0x6e17,0x7e36,0x4e55,0x5e74,0x2e93,0x3eb2,0x0ed1,0x1ef0
+    },
+    {
+        0x0000,0x3331,0x6662,0x5553,0xccc4,0xfff5,0xaaa6,0x9997,
+        0x89a9,0xba98,0xefcb,0xdcfa,0x456d,0x765c,0x230f,0x103e,
+        0x0373,0x3042,0x6511,0x5620,0xcfb7,0xfc86,0xa9d5,0x9ae4,
+        0x8ada,0xb9eb,0xecb8,0xdf89,0x461e,0x752f,0x207c,0x134d,
+        0x06e6,0x35d7,0x6084,0x53b5,0xca22,0xf913,0xac40,0x9f71,
+        0x8f4f,0xbc7e,0xe92d,0xda1c,0x438b,0x70ba,0x25e9,0x16d8,
+        0x0595,0x36a4,0x63f7,0x50c6,0xc951,0xfa60,0xaf33,0x9c02,
+        0x8c3c,0xbf0d,0xea5e,0xd96f,0x40f8,0x73c9,0x269a,0x15ab,
+        0x0dcc,0x3efd,0x6bae,0x589f,0xc108,0xf239,0xa76a,0x945b,
+        0x8465,0xb754,0xe207,0xd136,0x48a1,0x7b90,0x2ec3,0x1df2,
+        0x0ebf,0x3d8e,0x68dd,0x5bec,0xc27b,0xf14a,0xa419,0x9728,
+        0x8716,0xb427,0xe174,0xd245,0x4bd2,0x78e3,0x2db0,0x1e81,
+        0x0b2a,0x381b,0x6d48,0x5e79,0xc7ee,0xf4df,0xa18c,0x92bd,
+        0x8283,0xb1b2,0xe4e1,0xd7d0,0x4e47,0x7d76,0x2825,0x1b14,
+        0x0859,0x3b68,0x6e3b,0x5d0a,0xc49d,0xf7ac,0xa2ff,0x91ce,
+        0x81f0,0xb2c1,0xe792,0xd4a3,0x4d34,0x7e05,0x2b56,0x1867,
+        0x1b98,0x28a9,0x7dfa,0x4ecb,0xd75c,0xe46d,0xb13e,0x820f,
+        0x9231,0xa100,0xf453,0xc762,0x5ef5,0x6dc4,0x3897,0x0ba6,
+        0x18eb,0x2bda,0x7e89,0x4db8,0xd42f,0xe71e,0xb24d,0x817c,
+        0x9142,0xa273,0xf720,0xc411,0x5d86,0x6eb7,0x3be4,0x08d5,
+        0x1d7e,0x2e4f,0x7b1c,0x482d,0xd1ba,0xe28b,0xb7d8,0x84e9,
+        0x94d7,0xa7e6,0xf2b5,0xc184,0x5813,0x6b22,0x3e71,0x0d40,
+        0x1e0d,0x2d3c,0x786f,0x4b5e,0xd2c9,0xe1f8,0xb4ab,0x879a,
+        0x97a4,0xa495,0xf1c6,0xc2f7,0x5b60,0x6851,0x3d02,0x0e33,
+        0x1654,0x2565,0x7036,0x4307,0xda90,0xe9a1,0xbcf2,0x8fc3,
+        0x9ffd,0xaccc,0xf99f,0xcaae,0x5339,0x6008,0x355b,0x066a,
+        0x1527,0x2616,0x7345,0x4074,0xd9e3,0xead2,0xbf81,0x8cb0,
+        0x9c8e,0xafbf,0xfaec,0xc9dd,0x504a,0x637b,0x3628,0x0519,
+        0x10b2,0x2383,0x76d0,0x45e1,0xdc76,0xef47,0xba14,0x8925,
+        0x991b,0xaa2a,0xff79,0xcc48,0x55df,0x66ee,0x33bd,0x008c,
+        0x13c1,0x20f0,0x75a3,0x4692,0xdf05,0xec34,0xb967,0x8a56,
+        0x9a68,0xa959,0xfc0a,0xcf3b,0x56ac,0x659d,0x30ce,0x03ff
+    },
+    {
+        0x0000,0x3730,0x6e60,0x5950,0xdcc0,0xebf0,0xb2a0,0x8590,
+        0xa9a1,0x9e91,0xc7c1,0xf0f1,0x7561,0x4251,0x1b01,0x2c31,
+        0x4363,0x7453,0x2d03,0x1a33,0x9fa3,0xa893,0xf1c3,0xc6f3,
+        0xeac2,0xddf2,0x84a2,0xb392,0x3602,0x0132,0x5862,0x6f52,
+        0x86c6,0xb1f6,0xe8a6,0xdf96,0x5a06,0x6d36,0x3466,0x0356,
+        0x2f67,0x1857,0x4107,0x7637,0xf3a7,0xc497,0x9dc7,0xaaf7,
+        0xc5a5,0xf295,0xabc5,0x9cf5,0x1965,0x2e55,0x7705,0x4035,
+        0x6c04,0x5b34,0x0264,0x3554,0xb0c4,0x87f4,0xdea4,0xe994,
+        0x1dad,0x2a9d,0x73cd,0x44fd,0xc16d,0xf65d,0xaf0d,0x983d,
+        0xb40c,0x833c,0xda6c,0xed5c,0x68cc,0x5ffc,0x06ac,0x319c,
+        0x5ece,0x69fe,0x30ae,0x079e,0x820e,0xb53e,0xec6e,0xdb5e,
+        0xf76f,0xc05f,0x990f,0xae3f,0x2baf,0x1c9f,0x45cf,0x72ff,
+        0x9b6b,0xac5b,0xf50b,0xc23b,0x47ab,0x709b,0x29cb,0x1efb,
+        0x32ca,0x05fa,0x5caa,0x6b9a,0xee0a,0xd93a,0x806a,0xb75a,
+        0xd808,0xef38,0xb668,0x8158,0x04c8,0x33f8,0x6aa8,0x5d98,
+        0x71a9,0x4699,0x1fc9,0x28f9,0xad69,0x9a59,0xc309,0xf439,
+        0x3b5a,0x0c6a,0x553a,0x620a,0xe79a,0xd0aa,0x89fa,0xbeca,
+        0x92fb,0xa5cb,0xfc9b,0xcbab,0x4e3b,0x790b,0x205b,0x176b,
+        0x7839,0x4f09,0x1659,0x2169,0xa4f9,0x93c9,0xca99,0xfda9,
+        0xd198,0xe6a8,0xbff8,0x88c8,0x0d58,0x3a68,0x6338,0x5408,
+        0xbd9c,0x8aac,0xd3fc,0xe4cc,0x615c,0x566c,0x0f3c,0x380c,
+        0x143d,0x230d,0x7a5d,0x4d6d,0xc8fd,0xffcd,0xa69d,0x91ad,
+        0xfeff,0xc9cf,0x909f,0xa7af,0x223f,0x150f,0x4c5f,0x7b6f,
+        0x575e,0x606e,0x393e,0x0e0e,0x8b9e,0xbcae,0xe5fe,0xd2ce,
+        0x26f7,0x11c7,0x4897,0x7fa7,0xfa37,0xcd07,0x9457,0xa367,
+        0x8f56,0xb866,0xe136,0xd606,0x5396,0x64a6,0x3df6,0x0ac6,
+        0x6594,0x52a4,0x0bf4,0x3cc4,0xb954,0x8e64,0xd734,0xe004,
+        0xcc35,0xfb05,0xa255,0x9565,0x10f5,0x27c5,0x7e95,0x49a5,
+        0xa031,0x9701,0xce51,0xf961,0x7cf1,0x4bc1,0x1291,0x25a1,
+        0x0990,0x3ea0,0x67f0,0x50c0,0xd550,0xe260,0xbb30,0x8c00,
+        0xe352,0xd462,0x8d32,0xba02,0x3f92,0x08a2,0x51f2,0x66c2,
+        0x4af3,0x7dc3,0x2493,0x13a3,0x9633,0xa103,0xf853,0xcf63
+    },
+    {
+        0x0000,0x76b4,0xed68,0x9bdc,0xcaf1,0xbc45,0x2799,0x512d,
+        0x85c3,0xf377,0x68ab,0x1e1f,0x4f32,0x3986,0xa25a,0xd4ee,
+        0x1ba7,0x6d13,0xf6cf,0x807b,0xd156,0xa7e2,0x3c3e,0x4a8a,
+        0x9e64,0xe8d0,0x730c,0x05b8,0x5495,0x2221,0xb9fd,0xcf49,
+        0x374e,0x41fa,0xda26,0xac92,0xfdbf,0x8b0b,0x10d7,0x6663,
+        0xb28d,0xc439,0x5fe5,0x2951,0x787c,0x0ec8,0x9514,0xe3a0,
+        0x2ce9,0x5a5d,0xc181,0xb735,0xe618,0x90ac,0x0b70,0x7dc4,
+        0xa92a,0xdf9e,0x4442,0x32f6,0x63db,0x156f,0x8eb3,0xf807,
+        0x6e9c,0x1828,0x83f4,0xf540,0xa46d,0xd2d9,0x4905,0x3fb1,
+        0xeb5f,0x9deb,0x0637,0x7083,0x21ae,0x571a,0xccc6,0xba72,
+        0x753b,0x038f,0x9853,0xeee7,0xbfca,0xc97e,0x52a2,0x2416,
+        0xf0f8,0x864c,0x1d90,0x6b24,0x3a09,0x4cbd,0xd761,0xa1d5,
+        0x59d2,0x2f66,0xb4ba,0xc20e,0x9323,0xe597,0x7e4b,0x08ff,
+        0xdc11,0xaaa5,0x3179,0x47cd,0x16e0,0x6054,0xfb88,0x8d3c,
+        0x4275,0x34c1,0xaf1d,0xd9a9,0x8884,0xfe30,0x65ec,0x1358,
+        0xc7b6,0xb102,0x2ade,0x5c6a,0x0d47,0x7bf3,0xe02f,0x969b,
+        0xdd38,0xab8c,0x3050,0x46e4,0x17c9,0x617d,0xfaa1,0x8c15,
+        0x58fb,0x2e4f,0xb593,0xc327,0x920a,0xe4be,0x7f62,0x09d6,
+        0xc69f,0xb02b,0x2bf7,0x5d43,0x0c6e,0x7ada,0xe106,0x97b2,
+        0x435c,0x35e8,0xae34,0xd880,0x89ad,0xff19,0x64c5,0x1271,
+        0xea76,0x9cc2,0x071e,0x71aa,0x2087,0x5633,0xcdef,0xbb5b,
+        0x6fb5,0x1901,0x82dd,0xf469,0xa544,0xd3f0,0x482c,0x3e98,
+        0xf1d1,0x8765,0x1cb9,0x6a0d,0x3b20,0x4d94,0xd648,0xa0fc,
+        0x7412,0x02a6,0x997a,0xefce,0xbee3,0xc857,0x538b,0x253f,
+        0xb3a4,0xc510,0x5ecc,0x2878,0x7955,0x0fe1,0x943d,0xe289,
+        0x3667,0x40d3,0xdb0f,0xadbb,0xfc96,0x8a22,0x11fe,0x674a,
+        0xa803,0xdeb7,0x456b,0x33df,0x62f2,0x1446,0x8f9a,0xf92e,
+        0x2dc0,0x5b74,0xc0a8,0xb61c,0xe731,0x9185,0x0a59,0x7ced,
+        0x84ea,0xf25e,0x6982,0x1f36,0x4e1b,0x38af,0xa373,0xd5c7,
+        0x0129,0x779d,0xec41,0x9af5,0xcbd8,0xbd6c,0x26b0,0x5004,
+        0x9f4d,0xe9f9,0x7225,0x0491,0x55bc,0x2308,0xb8d4,0xce60,
+        0x1a8e,0x6c3a,0xf7e6,0x8152,0xd07f,0xa6cb,0x3d17,0x4ba3
+    }
+};
+
+/* Continue the CRC of preceding data with more bytes. */
+static unsigned int __redisCrc16(unsigned int crc, const unsigned char *p, size_t len) {
+    for (; len >= 4; p += 4, len -= 4) {
+        crc ^= ((unsigned int)p[0]<<8) | p[1];
+        crc = crc16tab[3][crc>>8] ^ crc16tab[2][crc&0xff] ^
+              crc16tab[1][p[2]] ^ crc16tab[0][p[3]];
+    }
+    for (; len > 0; p++, len--)
+        crc = ((crc<<8) ^ crc16tab[0][(crc>>8) ^ *p]) & 0xffff;
+    return crc;
+}
+
+/* Only the part between the first { and the next } is hashed when it is not
+ * empty, so related keys can be forced into the same slot. */
+static void __redisKeyHashPart(const char **key, size_t *keylen) {
+    const char *s, *e;
+
+    if ((s = memchr(*key,'{',*keylen)) == NULL)
+        return;
+    e = memchr(s+1,'}',*keylen-(s+1-*key));
+    if (e == NULL || e == s+1)
+        return;
+    *key = s+1;
+    *keylen = e-s-1;
+}
+
+unsigned int redisKeySlot(const char *key, size_t keylen) {
+    __redisKeyHashPart(&key,&keylen);
+    return __redisCrc16(0,(const unsigned char*)key,keylen) & (REDIS_CLUSTER_SLOTS-1);
+}
+
+/* Hash four keys at a time. Every CRC is a chain of dependent lookups, so
+ * interleaving the chains of different keys keeps the CPU busy while a
+ * lookup is in flight. */
+void redisKeySlotsBatch(const char **keys, const size_t *keylens, size_t count, unsigned int *slots) {
+    const unsigned char *p[4];
+    size_t len[4], min, i, j, k;
+    unsigned int crc[4];
+
+    for (i = 0; i+4 <= count; i += 4) {
+        for (j = 0; j < 4; j++) {
+            const char *key = keys[i+j];
+            size_t keylen = keylens[i+j];
+            __redisKeyHashPart(&key,&keylen);
+            p[j] = (const unsigned char*)key;
+            len[j] = keylen;
+            crc[j] = 0;
+        }
+
+        min = len[0];
+        for (j = 1; j < 4; j++)
+            if (len[j] < min) min = len[j];
+        for (k = 0; k+4 <= min; k += 4) {
+            for (j = 0; j < 4; j++) {
+                crc[j] ^= ((unsigned int)p[j][k]<<8) | p[j][k+1];
+                crc[j] = crc16tab[3][crc[j]>>8] ^ crc16tab[2][crc[j]&0xff] ^
+                         crc16tab[1][p[j][k+2]] ^ crc16tab[0][p[j][k+3]];
+            }
+        }
+
+        /* Finish every key on its own. */
+        for (j = 0; j < 4; j++)
+            slots[i+j] = __redisCrc16(crc[j],p[j]+k,len[j]-k) & (REDIS_CLUSTER_SLOTS-1);
+    }
+
+    for (; i < count; i++)
+        slots[i] = redisKeySlot(keys[i],keylens[i]);
+}
+
+/* Read the next bulk argument of a formatted command. Returns a pointer past
+ * the argument, or NULL when there is none. */
+static const char *__redisClusterArgument(const char *p, const char *end, const char **arg, size_t *len) {
+    size_t n = 0;
+
+    if (p >= end || *p != '$')
+        return NULL;
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+        n = n*10+(*p-'0');
+    if (end-p < 2 || (size_t)(end-p-2) < n+2)
+        return NULL;
+    *arg = p+2;
+    *len = n;
+    return p+2+n+2;
+}
+
+/* Commands that do not take a key. They are sent to any node. */
+static const char *keylessCommands[] = {
+    "ASKING", "AUTH", "BGREWRITEAOF", "BGSAVE", "CLIENT", "CLUSTER", "COMMAND",
+    "CONFIG", "DBSIZE", "DEBUG", "DISCARD", "ECHO", "EXEC", "FLUSHALL",
+    "FLUSHDB", "INFO", "KEYS", "LASTSAVE", "MULTI", "PING", "PUBLISH", "QUIT",
+    "RANDOMKEY", "READONLY", "READWRITE", "ROLE", "SAVE", "SCAN", "SCRIPT",
+    "SELECT", "SHUTDOWN", "SLOWLOG", "TIME", "UNWATCH", "WAIT", NULL
+};
+
+static int __redisClusterIs(const char *arg, size_t len, const char *name) {
+    return strlen(name) == len && strncasecmp(arg,name,len) == 0;
+}
+
+/* Returns the slot of the first key of a formatted command, or -1 when the
+ * command does not take a key. */
+static int __redisClusterCommandSlot(const char *cmd, size_t len) {
+    const char *end = cmd+len, *p, *arg, *name;
+    size_t arglen, namelen;
+    long numkeys;
+    int i;
+
+    if ((p = memchr(cmd,'\n',len)) == NULL)
+        return -1;
+    if ((p = __redisClusterArgument(p+1,end,&name,&namelen)) == NULL)
+        return -1;
+
+    for (i = 0; keylessCommands[i] != NULL; i++)
+        if (__redisClusterIs(name,namelen,keylessCommands[i]))
+            return -1;
+
+    if (__redisClusterIs(name,namelen,"EVAL") || __redisClusterIs(name,namelen,"EVALSHA")) {
+        /* EVAL script numkeys key ... */
+        if ((p = __redisClusterArgument(p,end,&arg,&arglen)) == NULL ||
+            (p = __redisClusterArgument(p,end,&arg,&arglen)) == NULL)
+            return -1;
+        numkeys = strtol(arg,NULL,10);
+        if (numkeys <= 0)
+            return -1;
+    } else if (__redisClusterIs(name,namelen,"XREAD") ||
+               __redisClusterIs(name,namelen,"XREADGROUP")) {
+        /* The keys follow the STREAMS option. */
+        do {
+            if ((p = __redisClusterArgument(p,end,&arg,&arglen)) == NULL)
+                return -1;
+        } while (!__redisClusterIs(arg,arglen,"STREAMS"));
+    }
+
+    if (__redisClusterArgument(p,end,&arg,&arglen) == NULL)
+        return -1;
+    return redisKeySlot(arg,arglen);
+}
+
+static void __redisClusterSetError(redisClusterContext *cc, int type, const char *str) {
+    __redisCopyError(&cc->err,cc->errstr,type,str);
+}
+
+static redisClusterNode *__redisClusterFindNode(redisClusterContext *cc, const char *host, size_t hostlen, int port) {
+    redisClusterNode *node;
+
+    for (node = cc->nodes; node != NULL; node = node->next)
+        if (node->port == port && strlen(node->host) == hostlen &&
+            memcmp(node->host,host,hostlen) == 0)
+            return node;
+    return NULL;
+}
+
+/* Returns the node with the given address, adding it when it is new. */
+static redisClusterNode *__redisClusterGetNode(redisClusterContext *cc, const char *host, size_t hostlen, int port) {
+    redisClusterNode *node;
+
+    if ((node = __redisClusterFindNode(cc,host,hostlen,port)) != NULL)
+        return node;
+
+    node = calloc(1,sizeof(*node));
+    if (node == NULL || (node->host = malloc(hostlen+1)) == NULL) {
+        free(node);
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    memcpy(node->host,host,hostlen);
+    node->host[hostlen] = '\0';
+    node->port = port;
+    node->next = cc->nodes;
+    cc->nodes = node;
+    return node;
+}
+
+/* Add the nodes of a comma separated list of host:port addresses. */
+static int __redisClusterAddNodes(redisClusterContext *cc, const char *addrs) {
+    const char *p = addrs, *end, *host;
+    size_t hostlen;
+    int port;
+
+    while (*p != '\0') {
+        end = strchr(p,',');
+        if (end == NULL) end = p+strlen(p);
+        if (__redisSplitAddress(p,end-p,&host,&hostlen,&port) != REDIS_OK) {
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,"Invalid node address");
+            return REDIS_ERR;
+        }
+        if (__redisClusterGetNode(cc,host,hostlen,port) == NULL)
+            return REDIS_ERR;
+        p = (*end == ',') ? end+1 : end;
+    }
+
+    if (cc->nodes == NULL) {
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"No nodes given");
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Replace the slot map with a CLUSTER SLOTS reply. A node without a host
+ * name is the node that sent the reply. */
+static int __redisClusterUpdateSlots(redisClusterContext *cc, redisReply *r, redisClusterNode *from) {
+    redisClusterNode *node;
+    redisReply *e, *m;
+    long long start, end, i;
+    size_t j;
+
+    if (r->type != REDIS_REPLY_ARRAY || r->elements == 0)
+        return REDIS_ERR;
+    for (j = 0; j < r->elements; j++) {
+        e = r->element[j];
+        if (e->type != REDIS_REPLY_ARRAY || e->elements < 3 ||
+            e->element[0]->type != REDIS_REPLY_INTEGER ||
+            e->element[1]->type != REDIS_REPLY_INTEGER ||
+            e->element[2]->type != REDIS_REPLY_ARRAY ||
+            e->element[2]->elements < 2 ||
+            e->element[2]->element[0]->type != REDIS_REPLY_STRING ||
+            e->element[2]->element[1]->type != REDIS_REPLY_INTEGER)
+            return REDIS_ERR;
+        start = e->element[0]->integer;
+        end = e->element[1]->integer;
+        if (start < 0 || end >= REDIS_CLUSTER_SLOTS || start > end)
+            return REDIS_ERR;
+    }
+
+    memset(cc->slots,0,sizeof(cc->slots));
+    for (j = 0; j < r->elements; j++) {
+        e = r->element[j];
+        m = e->element[2];
+        if (m->element[0]->len == 0 && from != NULL)
+            node = from;
+        else
+            node = __redisClusterGetNode(cc,m->element[0]->str,m->element[0]->len,
+                                         (int)m->element[1]->integer);
+        if (node == NULL)
+            return REDIS_ERR;
+        for (i = e->element[0]->integer; i <= e->element[1]->integer; i++)
+            cc->slots[i] = node;
+    }
+    return REDIS_OK;
+}
+
+/* Parse a MOVED or ASK error. Returns REDIS_OK with the node to try next,
+ * and whether it must be preceded by ASKING. A MOVED slot is moved in the
+ * slot map right away, and the whole map is reloaded lazily. */
+static int __redisClusterRedirect(redisClusterContext *cc, redisReply *r, redisClusterNode **node, int *asking) {
+    const char *host;
+    char *p, *addr;
+    size_t hostlen;
+    long slot;
+    int port;
+
+    if (r->type != REDIS_REPLY_ERROR)
+        return REDIS_ERR;
+    if (strncmp(r->str,"MOVED ",6) == 0)
+        *asking = 0;
+    else if (strncmp(r->str,"ASK ",4) == 0)
+        *asking = 1;
+    else
+        return REDIS_ERR;
+
+    p = strchr(r->str,' ')+1;
+    slot = strtol(p,&addr,10);
+    if (slot < 0 || slot >= REDIS_CLUSTER_SLOTS || *addr != ' ')
+        return REDIS_ERR;
+    addr++;
+    if (__redisSplitAddress(addr,strlen(addr),&host,&hostlen,&port) != REDIS_OK)
+        return REDIS_ERR;
+    if ((*node = __redisClusterGetNode(cc,host,hostlen,port)) == NULL)
+        return REDIS_ERR;
+
+    if (!*asking) {
+        cc->slots[slot] = *node;
+        cc->refresh = 1;
+    }
+    return REDIS_OK;
+}
+
+/* Node that serves a formatted command. Commands without a key, or for a
+ * slot that is not covered, go to any node. */
+static redisClusterNode *__redisClusterRoute(redisClusterContext *cc, const char *cmd, size_t len) {
+    int slot = __redisClusterCommandSlot(cmd,len);
+    if (slot >= 0 && cc->slots[slot] != NULL)
+        return cc->slots[slot];
+    return cc->nodes;
+}
+
+static int __redisClusterInit(redisClusterContext *cc, const char *nodes, const struct timeval *tv) {
+    memset(cc,0,sizeof(*cc));
+    if (tv != NULL)
+        cc->timeout = *tv;
+    return __redisClusterAddNodes(cc,nodes);
+}
+
+static void __redisClusterFreeNodes(redisClusterContext *cc) {
+    redisClusterNode *node, *next;
+
+    for (node = cc->nodes; node != NULL; node = next) {
+        next = node->next;
+        if (node->c != NULL)
+            redisFree(node->c);
+        free(node->host);
+        free(node);
+    }
+    cc->nodes = NULL;
+}
+
+/* Multi-key commands with keys in more than one slot are split into a
+ * command per slot. The commands are sent to all nodes before any reply is
+ * read, and the replies are put back together in the order of the keys. */
+#define REDIS_CLUSTER_GATHER_ARRAY 1 /* MGET: the values of the keys */
+#define REDIS_CLUSTER_GATHER_SUM 2 /* DEL, EXISTS: the sum of the counts */
+#define REDIS_CLUSTER_GATHER_STATUS 3 /* MSET: the status of any command */
+
+struct redisClusterScatter;
+
+typedef struct redisClusterPart {
+    struct redisClusterScatter *scatter;
+    int slot;
+    char *cmd;
+    size_t len;
+    int *index; /* Position of every key in the original command */
+    int nkeys;
+    redisClusterNode *node;
+    redisReply *reply;
+} redisClusterPart;
+
+typedef struct redisClusterScatter {
+    int gather; /* REDIS_CLUSTER_GATHER_* */
+    int nkeys;
+    int nparts;
+    redisClusterPart *parts;
+
+    /* Used by the async API */
+    redisClusterCallbackFn *fn;
+    void *privdata;
+    int pending;
+} redisClusterScatter;
+
+typedef struct redisClusterKey {
+    const char *arg[2]; /* Key, and its value for MSET */
+    size_t len[2];
+    int slot;
+    int pos;
+} redisClusterKey;
+
+static int __redisClusterKeyCompare(const void *a, const void *b) {
+    const redisClusterKey *ka = a, *kb = b;
+    if (ka->slot != kb->slot)
+        return ka->slot-kb->slot;
+    return ka->pos-kb->pos;
+}
+
+static void __redisClusterFreeScatter(redisClusterScatter *s) {
+    int i;
+
+    for (i = 0; i < s->nparts; i++) {
+        free(s->parts[i].cmd);
+        free(s->parts[i].index);
+        freeReplyObject(s->parts[i].reply);
+    }
+    free(s->parts);
+    free(s);
+}
+
+/* Build a command for the keys in keys[0..n) that share a slot. */
+static int __redisClusterBuildPart(redisClusterPart *part, const char *name, size_t namelen,
+                                   redisClusterKey *keys, int n, int step) {
+    const char **argv;
+    size_t *argvlen;
+    int argc = 1, i, len;
+
+    argv = malloc(sizeof(*argv)*(n*step+1));
+    argvlen = malloc(sizeof(*argvlen)*(n*step+1));
+    part->index = malloc(sizeof(*part->index)*n);
+    if (argv == NULL || argvlen == NULL || part->index == NULL) {
+        free(argv);
+        free(argvlen);
+        return REDIS_ERR;
+    }
+
+    argv[0] = name;
+    argvlen[0] = namelen;
+    for (i = 0; i < n; i++) {
+        argv[argc] = keys[i].arg[0];
+        argvlen[argc++] = keys[i].len[0];
+        if (step == 2) {
+            argv[argc] = keys[i].arg[1];
+            argvlen[argc++] = keys[i].len[1];
+        }
+        part->index[i] = keys[i].pos;
+    }
+
+    part->slot = keys[0].slot;
+    part->nkeys = n;
+    len = redisFormatCommandArgv(&part->cmd,argc,argv,argvlen);
+    free(argv);
+    free(argvlen);
+    if (len == -1)
+        return REDIS_ERR;
+    part->len = len;
+    return REDIS_OK;
+}
+
+/* Split a formatted command when it is a multi-key command with keys in
+ * more than one slot. Returns NULL otherwise, and when out of memory, in
+ * which case the command is sent as is. */
+static redisClusterScatter *__redisClusterSplit(const char *cmd, size_t len) {
+    const char *end = cmd+len, *p, *name;
+    size_t namelen;
+    redisClusterScatter *s = NULL;
+    redisClusterKey *keys = NULL;
+    int gather, step = 1, argc, nkeys, i, j, n;
+
+    if (*cmd != '*' || (p = memchr(cmd,'\n',len)) == NULL)
+        return NULL;
+    argc = atoi(cmd+1);
+    if ((p = __redisClusterArgument(p+1,end,&name,&namelen)) == NULL)
+        return NULL;
+
+    if (__redisClusterIs(name,namelen,"MGET")) {
+        gather = REDIS_CLUSTER_GATHER_ARRAY;
+    } else if (__redisClusterIs(name,namelen,"DEL") ||
+               __redisClusterIs(name,namelen,"UNLINK") ||
+               __redisClusterIs(name,namelen,"EXISTS") ||
+               __redisClusterIs(name,namelen,"TOUCH")) {
+        gather = REDIS_CLUSTER_GATHER_SUM;
+    } else if (__redisClusterIs(name,namelen,"MSET")) {
+        gather = REDIS_CLUSTER_GATHER_STATUS;
+        step = 2;
+    } else {
+        return NULL;
+    }
+
+    nkeys = (argc-1)/step;
+    if (nkeys < 2 || (argc-1) % step != 0)
+        return NULL;
+    if ((keys = malloc(sizeof(*keys)*nkeys)) == NULL)
+        return NULL;
+
+    for (i = 0; i < nkeys; i++) {
+        if ((p = __redisClusterArgument(p,end,&keys[i].arg[0],&keys[i].len[0])) == NULL)
+            goto error;
+        if (step == 2 && (p = __redisClusterArgument(p,end,&keys[i].arg[1],&keys[i].len[1])) == NULL)
+            goto error;
+        keys[i].slot = redisKeySlot(keys[i].arg[0],keys[i].len[0]);
+        keys[i].pos = i;
+    }
+
+    qsort(keys,nkeys,sizeof(*keys),__redisClusterKeyCompare);
+    if (keys[0].slot == keys[nkeys-1].slot)
+        goto error;
+
+    if ((s = calloc(1,sizeof(*s))) == NULL)
+        goto error;
+    s->gather = gather;
+    s->nkeys = nkeys;
+    for (i = 0; i < nkeys; i++)
+        if (i == 0 || keys[i].slot != keys[i-1].slot)
+            s->nparts++;
+    if ((s->parts = calloc(s->nparts,sizeof(*s->parts))) == NULL)
+        goto error;
+
+    for (i = 0, n = 0; i < nkeys; i = j, n++) {
+        for (j = i+1; j < nkeys && keys[j].slot == keys[i].slot; j++);
+        s->parts[n].scatter = s;
+        if (__redisClusterBuildPart(&s->parts[n],name,namelen,keys+i,j-i,step) != REDIS_OK)
+            goto error;
+    }
+    free(keys);
+    return s;
+
+error:
+    free(keys);
+    if (s != NULL) {
+        if (s->parts != NULL)
+            __redisClusterFreeScatter(s);
+        else
+            free(s);
+    }
+    return NULL;
+}
+
+static redisReply *__redisClusterErrorReply(const char *str) {
+    redisReply *r = calloc(1,sizeof(*r));
+    if (r == NULL)
+        return NULL;
+    r->type = REDIS_REPLY_ERROR;
+    r->len = strlen(str);
+    if ((r->str = strdup(str)) == NULL) {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/* Put the replies of the parts together. The first error is returned as
+ * is. Returns NULL when a part has no reply. */
+static redisReply *__redisClusterGather(redisClusterScatter *s) {
+    redisClusterPart *part;
+    redisReply *r;
+    int i, j;
+
+    for (i = 0; i < s->nparts; i++)
+        if (s->parts[i].reply == NULL)
+            return NULL;
+    for (i = 0; i < s->nparts; i++) {
+        part = &s->parts[i];
+        if (part->reply->type == REDIS_REPLY_ERROR ||
+            (s->gather == REDIS_CLUSTER_GATHER_ARRAY &&
+             (part->reply->type != REDIS_REPLY_ARRAY ||
+              part->reply->elements != (size_t)part->nkeys)) ||
+            (s->gather == REDIS_CLUSTER_GATHER_SUM &&
+             part->reply->type != REDIS_REPLY_INTEGER))
+        {
+            if (part->reply->type != REDIS_REPLY_ERROR)
+                return __redisClusterErrorReply("ERR Unexpected reply to a split command");
+            r = part->reply;
+            part->reply = NULL;
+            return r;
+        }
+    }
+
+    if (s->gather == REDIS_CLUSTER_GATHER_STATUS) {
+        r = s->parts[0].reply;
+        s->parts[0].reply = NULL;
+        return r;
+    }
+
+    if ((r = calloc(1,sizeof(*r))) == NULL)
+        return NULL;
+    if (s->gather == REDIS_CLUSTER_GATHER_SUM) {
+        r->type = REDIS_REPLY_INTEGER;
+        for (i = 0; i < s->nparts; i++)
+            r->integer += s->parts[i].reply->integer;
+        return r;
+    }
+
+    r->type = REDIS_REPLY_ARRAY;
+    if ((r->element = calloc(s->nkeys,sizeof(*r->element))) == NULL) {
+        free(r);
+        return NULL;
+    }
+    r->elements = s->nkeys;
+    for (i = 0; i < s->nparts; i++) {
+        part = &s->parts[i];
+        for (j = 0; j < part->nkeys; j++) {
+            r->element[part->index[j]] = part->reply->element[j];
+            part->reply->element[j] = NULL;
+        }
+    }
+    return r;
+}
+
+/* Blocking API */
+
+static redisContext *__redisClusterConnectNode(redisClusterContext *cc, redisClusterNode *node) {
+    redisContext *c;
+
+    if (node->c != NULL)
+        return node->c;
+
+    if (cc->timeout.tv_sec || cc->timeout.tv_usec)
+        c = redisConnectWithTimeout(node->host,node->port,cc->timeout);
+    else
+        c = redisConnect(node->host,node->port);
+    if (c == NULL) {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    if (c->err == 0 && (cc->timeout.tv_sec || cc->timeout.tv_usec))
+        redisSetTimeout(c,cc->timeout);
+    if (c->err) {
+        __redisClusterSetError(cc,c->err,c->errstr);
+        redisFree(c);
+        return NULL;
+    }
+    node->c = c;
+    return c;
+}
+
+/* Blocking connection to a node, which is opened when needed. Replies to
+ * commands sent over it directly are not redirected. */
+redisContext *redisClusterNodeContext(redisClusterContext *cc, redisClusterNode *node) {
+    return __redisClusterConnectNode(cc,node);
+}
+
+/* The connection to a node is closed after an I/O error, and its slots may
+ * have moved to another node. */
+static void __redisClusterNodeFailed(redisClusterContext *cc, redisClusterNode *node) {
+    if (node->c->err)
+        __redisClusterSetError(cc,node->c->err,node->c->errstr);
+    redisFree(node->c);
+    node->c = NULL;
+    cc->refresh = 1;
+}
+
+/* Load the slot map from the first node that answers CLUSTER SLOTS. */
+static int __redisClusterRefresh(redisClusterContext *cc) {
+    redisClusterNode *node;
+    redisContext *c;
+    redisReply *r;
+    int status;
+
+    for (node = cc->nodes; node != NULL; node = node->next) {
+        if ((c = __redisClusterConnectNode(cc,node)) == NULL)
+            continue;
+        if ((r = redisCommand(c,"CLUSTER SLOTS")) == NULL) {
+            __redisClusterNodeFailed(cc,node);
+            continue;
+        }
+        status = __redisClusterUpdateSlots(cc,r,node);
+        if (status != REDIS_OK && r->type == REDIS_REPLY_ERROR)
+            __redisClusterSetError(cc,REDIS_ERR_OTHER,r->str);
+        freeReplyObject(r);
+        if (status == REDIS_OK) {
+            cc->refresh = 0;
+            cc->err = 0;
+            cc->errstr[0] = '\0';
+            return REDIS_OK;
+        }
+    }
+
+    if (cc->err == 0)
+        __redisClusterSetError(cc,REDIS_ERR_OTHER,"No node returned the slot map");
+    return REDIS_ERR;
+}
+
+static redisClusterContext *__redisClusterConnect(const char *nodes, const struct timeval *tv) {
+    redisClusterContext *cc;
+
+    cc = malloc(sizeof(*cc));
+    if (cc == NULL)
+        return NULL;
+    if (__redisClusterInit(cc,nodes,tv) == REDIS_OK)
+        __redisClusterRefresh(cc);
+    return cc;
+}
+
+/* Connect to the cluster that one of the comma separated host:port
+ * addresses belongs to, and load the slot map. */
+redisClusterContext *redisClusterConnect(const char *nodes) {
+    return __redisClusterConnect(nodes,NULL);
+}
+
+redisClusterContext *redisClusterConnectWithTimeout(const char *nodes, const struct timeval tv) {
+    return __redisClusterConnect(nodes,&tv);
+}
+
+/* Send a formatted command to the node that serves it, following
+ * redirects. */
+static void *__redisClusterSend(redisClusterContext *cc, const char *cmd, size_t len) {
+    redisClusterNode *node;
+    redisContext *c;
+    redisReply *reply = NULL;
+    int asking = 0, redirects;
+
+    node = __redisClusterRoute(cc,cmd,len);
+    for (redirects = 0; ; redirects++) {
+        if ((c = __redisClusterConnectNode(cc,node)) == NULL) {
+            cc->refresh = 1;
+            return NULL;
+        }
+
+        if (asking)
+            redisAppendCommand(c,"ASKING");
+        redisAppendFormattedCommand(c,cmd,len);
+        if (asking) {
+            if (redisGetReply(c,(void**)&reply) != REDIS_OK) {
+                __redisClusterNodeFailed(cc,node);
+                return NULL;
+            }
+            freeReplyObject(reply);
+        }
+        if (redisGetReply(c,(void**)&reply) != REDIS_OK) {
+            __redisClusterNodeFailed(cc,node);
+            return NULL;
+        }
+
+        if (redirects == REDIS_CLUSTER_MAX_REDIRECTS ||
+            __redisClusterRedirect(cc,reply,&node,&asking) != REDIS_OK)
+            return reply;
+        freeReplyObject(reply);
+    }
+}
+
+/* Send the parts of a split command. Every node receives all of its parts
+ * before any reply is read, so the nodes work on them at the same time.
+ * Redirected parts are sent again one by one. */
+static void *__redisClusterScatterCommand(redisClusterContext *cc, redisClusterScatter *s) {
+    redisClusterPart *part;
+    redisReply *reply;
+    redisContext *c;
+    redisClusterNode *node;
+    int i, j, done, asking;
+
+    for (i = 0; i < s->nparts; i++) {
+        part = &s->parts[i];
+        part->node = __redisClusterRoute(cc,part->cmd,part->len);
+        if ((c = __redisClusterConnectNode(cc,part->node)) == NULL) {
+            cc->refresh = 1;
+            part->node = NULL;
+            continue;
+        }
+        redisAppendFormattedCommand(c,part->cmd,part->len);
+    }
+
+    /* Flush every connection once. */
+    for (i = 0; i < s->nparts; i++) {
+        node = s->parts[i].node;
+        for (j = 0; j < i && s->parts[j].node != node; j++);
+        if (node == NULL || j < i || node->c == NULL)
+            continue;
+        do {
+            if (redisBufferWrite(node->c,&done) != REDIS_OK) {
+                __redisClusterNodeFailed(cc,node);
+                break;
+            }
+        } while (!done);
+    }
+
+    for (i = 0; i < s->nparts; i++) {
+        part = &s->parts[i];
+        if (part->node == NULL || part->node->c == NULL)
+            continue;
+        if (redisGetReply(part->node->c,(void**)&part->reply) != REDIS_OK) {
+            __redisClusterNodeFailed(cc,part->node);
+            part->reply = NULL;
+        }
+    }
+
+    for (i = 0; i < s->nparts; i++) {
+        part = &s->parts[i];
+        if (part->reply != NULL &&
+            __redisClusterRedirect(cc,part->reply,&node,&asking) == REDIS_OK)
+        {
+            freeReplyObject(part->reply);
+            part->reply = __redisClusterSend(cc,part->cmd,part->len);
+        }
+    }
+
+    reply = __redisClusterGather(s);
+    if (reply == NULL && cc->err == 0)
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+    return reply;
+}
+
+/* Send a formatted command, splitting it when its keys are in different
+ * slots. The slot map is reloaded first when it is known to be stale. */
+static void *__redisClusterCommand(redisClusterContext *cc, const char *cmd, size_t len) {
+    redisClusterScatter *s;
+    void *reply;
+
+    cc->err = 0;
+    cc->errstr[0] = '\0';
+    if (cc->refresh && __redisClusterRefresh(cc) != REDIS_OK) {
+        /* Keep using the old map, the nodes may still know better. */
+        cc->err = 0;
+        cc->errstr[0] = '\0';
+    }
+
+    if ((s = __redisClusterSplit(cmd,len)) == NULL)
+        return __redisClusterSend(cc,cmd,len);
+    reply = __redisClusterScatterCommand(cc,s);
+    __redisClusterFreeScatter(s);
+    return reply;
+}
+
+void *redisvClusterCommand(redisClusterContext *cc, const char *format, va_list ap) {
+    char *cmd;
+    int len;
+    void *reply;
+
+    len = redisvFormatCommand(&cmd,format,ap);
+    if (len == -1) {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    reply = __redisClusterCommand(cc,cmd,len);
+    free(cmd);
+    return reply;
+}
+
+void *redisClusterCommand(redisClusterContext *cc, const char *format, ...) {
+    va_list ap;
+    void *reply;
+    va_start(ap,format);
+    reply = redisvClusterCommand(cc,format,ap);
+    va_end(ap);
+    return reply;
+}
+
+void *redisClusterCommandArgv(redisClusterContext *cc, int argc, const char **argv, const size_t *argvlen) {
+    char *cmd;
+    int len;
+    void *reply;
+
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1) {
+        __redisClusterSetError(cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    reply = __redisClusterCommand(cc,cmd,len);
+    free(cmd);
+    return reply;
+}
+
+void redisClusterFree(redisClusterContext *cc) {
+    if (cc == NULL)
+        return;
+    __redisClusterFreeNodes(cc);
+    free(cc);
+}
+
+/* Async API */
+
+/* A command waiting for its reply. The command is kept to send it again
+ * when it is redirected. Requests without a callback reload the slot map. */
+typedef struct redisClusterRequest {
+    redisClusterAsyncContext *acc; /* NULL once the context is free'd */
+    redisClusterCallbackFn *fn;
+    void *privdata;
+    char *cmd;
+    size_t len;
+    int redirects;
+    struct redisClusterRequest *prev, *next;
+} redisClusterRequest;
+
+static void __redisClusterAsyncCopyError(redisClusterAsyncContext *acc) {
+    acc->err = acc->cc.err;
+    acc->errstr = acc->cc.errstr;
+}
+
+static void __redisClusterAsyncUnlink(redisClusterAsyncContext *acc, redisClusterRequest *req) {
+    if (req->prev != NULL)
+        req->prev->next = req->next;
+    else
+        acc->requests = req->next;
+    if (req->next != NULL)
+        req->next->prev = req->prev;
+    req->prev = req->next = NULL;
+}
+
+static void __redisClusterAsyncFreeRequest(redisClusterRequest *req) {
+    free(req->cmd);
+    free(req);
+}
+
+static void __redisClusterAsyncNodeConnect(const redisAsyncContext *ac, int status) {
+    redisClusterNode *node = ac->data;
+    if (status != REDIS_OK && node != NULL)
+        node->ac = NULL;
+}
+
+static void __redisClusterAsyncNodeDisconnect(const redisAsyncContext *ac, int status) {
+    redisClusterNode *node = ac->data;
+    ((void)status);
+    if (node != NULL)
+        node->ac = NULL;
+}
+
+static redisAsyncContext *__redisClusterAsyncConnectNode(redisClusterAsyncContext *acc, redisClusterNode *node) {
+    const struct timeval *tv = NULL;
+    redisAsyncContext *ac;
+
+    if (node->ac != NULL)
+        return node->ac;
+
+    if (acc->cc.timeout.tv_sec || acc->cc.timeout.tv_usec)
+        tv = &acc->cc.timeout;
+    ac = __redisAsyncOpen(node->host,node->port,tv,acc->attach,acc->attachdata,&acc->cc.err,acc->cc.errstr);
+    if (ac == NULL)
+        return NULL;
+
+    ac->data = node;
+    redisAsyncSetConnectCallback(ac,__redisClusterAsyncNodeConnect);
+    redisAsyncSetDisconnectCallback(ac,__redisClusterAsyncNodeDisconnect);
+    node->ac = ac;
+    return ac;
+}
+
+/* Async connection to a node, which is opened when needed. Replies to
+ * commands sent over it directly are not redirected. */
+redisAsyncContext *redisClusterAsyncNodeContext(redisClusterAsyncContext *acc, redisClusterNode *node) {
+    redisAsyncContext *ac = __redisClusterAsyncConnectNode(acc,node);
+    if (ac == NULL)
+        __redisClusterAsyncCopyError(acc);
+    return ac;
+}
+
+static void __redisClusterAsyncReply(redisAsyncContext *ac, void *r, void *privdata);
+static void __redisClusterAsyncSlots(redisAsyncContext *ac, void *r, void *privdata);
+static void __redisClusterAsyncFree(redisClusterAsyncContext *acc);
+
+/* Send a request to a node. */
+static int __redisClusterAsyncSend(redisClusterAsyncContext *acc, redisClusterRequest *req,
+                                   redisClusterNode *node, int asking) {
+    redisAsyncContext *ac;
+
+    if ((ac = __redisClusterAsyncConnectNode(acc,node)) == NULL)
+        return REDIS_ERR;
+    if (asking && redisAsyncCommand(ac,NULL,NULL,"ASKING") != REDIS_OK)
+        return REDIS_ERR;
+    return redisAsyncFormattedCommand(ac,req->fn ? __redisClusterAsyncReply : __redisClusterAsyncSlots,
+                                      req,req->cmd,req->len);
+}
+
+static redisClusterRequest *__redisClusterAsyncRequest(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn,
+                                                       void *privdata, const char *cmd, size_t len) {
+    redisClusterRequest *req;
+
+    req = calloc(1,sizeof(*req));
+    if (req == NULL || (req->cmd = malloc(len)) == NULL) {
+        free(req);
+        __redisClusterSetError(&acc->cc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    memcpy(req->cmd,cmd,len);
+    req->len = len;
+    req->acc = acc;
+    req->fn = fn;
+    req->privdata = privdata;
+    req->next = acc->requests;
+    if (acc->requests != NULL)
+        acc->requests->prev = req;
+    acc->requests = req;
+    return req;
+}
+
+/* Reload the slot map in the background. Commands keep using the old map in
+ * the meantime, and are redirected when needed. */
+static void __redisClusterAsyncRefresh(redisClusterAsyncContext *acc, redisClusterNode *node) {
+    redisClusterRequest *req;
+    static const char cmd[] = "*2\r\n$7\r\nCLUSTER\r\n$5\r\nSLOTS\r\n";
+
+    if (acc->refreshing)
+        return;
+    if ((req = __redisClusterAsyncRequest(acc,NULL,NULL,cmd,sizeof(cmd)-1)) == NULL)
+        return;
+    if (__redisClusterAsyncSend(acc,req,node,0) != REDIS_OK) {
+        __redisClusterAsyncUnlink(acc,req);
+        __redisClusterAsyncFreeRequest(req);
+        return;
+    }
+    acc->refreshing = 1;
+}
+
+static void __redisClusterAsyncSlots(redisAsyncContext *ac, void *r, void *privdata) {
+    redisClusterRequest *req = privdata;
+    redisClusterAsyncContext *acc = req->acc;
+
+    if (acc != NULL) {
+        __redisClusterAsyncUnlink(acc,req);
+        acc->refreshing = 0;
+        if (r != NULL && __redisClusterUpdateSlots(&acc->cc,r,ac->data) == REDIS_OK)
+            acc->cc.refresh = 0;
+    }
+    __redisClusterAsyncFreeRequest(req);
+}
+
+/* Reply to a request. Redirects are followed by sending the command again,
+ * anything else is passed to the callback. */
+static void __redisClusterAsyncReply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisClusterRequest *req = privdata;
+    redisClusterAsyncContext *acc = req->acc;
+    redisClusterNode *node;
+    int asking;
+    ((void)ac);
+
+    if (acc == NULL) {
+        __redisClusterAsyncFreeRequest(req);
+        return;
+    }
+
+    if (r == NULL) {
+        acc->cc.refresh = 1;
+    } else if (req->redirects < REDIS_CLUSTER_MAX_REDIRECTS &&
+               __redisClusterRedirect(&acc->cc,r,&node,&asking) == REDIS_OK)
+    {
+        req->redirects++;
+        if (__redisClusterAsyncSend(acc,req,node,asking) == REDIS_OK)
+            return;
+        __redisClusterAsyncCopyError(acc);
+        r = NULL;
+    }
+
+    __redisClusterAsyncUnlink(acc,req);
+    acc->incallback++;
+    req->fn(acc,r,req->privdata);
+    acc->incallback--;
+    __redisClusterAsyncFreeRequest(req);
+
+    /* Proceed with free'ing when redisClusterAsyncFree() was called. */
+    if (acc->freeing && acc->incallback == 0)
+        __redisClusterAsyncFree(acc);
+}
+
+static redisClusterAsyncContext *__redisClusterAsyncConnect(const char *nodes, const struct timeval *tv,
+                                                             redisClusterAttachFn *attach, void *data) {
+    redisClusterAsyncContext *acc;
+    redisClusterNode *node;
+
+    acc = calloc(1,sizeof(*acc));
+    if (acc == NULL)
+        return NULL;
+
+    acc->attach = attach;
+    acc->attachdata = data;
+    if (__redisClusterInit(&acc->cc,nodes,tv) == REDIS_OK)
+        __redisClusterRefresh(&acc->cc);
+
+    /* The blocking connections are not used after bootstrapping. */
+    for (node = acc->cc.nodes; node != NULL; node = node->next) {
+        if (node->c != NULL) {
+            redisFree(node->c);
+            node->c = NULL;
+        }
+    }
+    __redisClusterAsyncCopyError(acc);
+    return acc;
+}
+
+/* Connect to the cluster that one of the comma separated host:port
+ * addresses belongs to. The slot map is loaded before this returns, over a
+ * blocking connection. Connections to the nodes are opened when they are
+ * first used, and attached to the event library with the attach function. */
+redisClusterAsyncContext *redisClusterAsyncConnect(const char *nodes, redisClusterAttachFn *attach, void *data) {
+    return __redisClusterAsyncConnect(nodes,NULL,attach,data);
+}
+
+/* Like redisClusterAsyncConnect(), but loading the slot map takes at most
+ * the timeout for every node that is tried. The timeout also bounds the
+ * connects of the async connections, when the event library has timers. */
+redisClusterAsyncContext *redisClusterAsyncConnectWithTimeout(const char *nodes, const struct timeval tv,
+                                                              redisClusterAttachFn *attach, void *data) {
+    return __redisClusterAsyncConnect(nodes,&tv,attach,data);
+}
+
+/* Reply to a part of a split command. The callback of the command is called
+ * once all parts have their reply. */
+static void __redisClusterAsyncGatherReply(redisClusterAsyncContext *acc, void *r, void *privdata) {
+    redisClusterPart *part = privdata;
+    redisClusterScatter *s = part->scatter;
+    redisReply *reply;
+
+    if (r != NULL)
+        part->reply = __redisTakeReply(r);
+    if (--s->pending > 0)
+        return;
+
+    reply = __redisClusterGather(s);
+    s->fn(acc,reply,s->privdata);
+    freeReplyObject(reply);
+    __redisClusterFreeScatter(s);
+}
+
+static int __redisClusterAsyncCommand(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn,
+                                      void *privdata, const char *cmd, size_t len);
+
+/* Send the parts of a split command. They are written to their nodes in
+ * the same loop iteration, so the nodes work on them at the same time. */
+static int __redisClusterAsyncScatter(redisClusterAsyncContext *acc, redisClusterScatter *s,
+                                      redisClusterCallbackFn *fn, void *privdata) {
+    int i, sent = 0;
+
+    s->fn = fn;
+    s->privdata = privdata;
+    s->pending = s->nparts;
+    for (i = 0; i < s->nparts; i++) {
+        if (__redisClusterAsyncCommand(acc,__redisClusterAsyncGatherReply,&s->parts[i],
+                                       s->parts[i].cmd,s->parts[i].len) == REDIS_OK)
+            sent++;
+        else
+            s->pending--;
+    }
+
+    if (sent == 0) {
+        __redisClusterFreeScatter(s);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+static int __redisClusterAsyncCommand(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn,
+                                      void *privdata, const char *cmd, size_t len) {
+    redisClusterRequest *req;
+    redisClusterNode *node;
+    redisClusterScatter *s;
+
+    /* Don't accept new commands when the context is about to be free'd. */
+    if (acc->freeing)
+        return REDIS_ERR;
+
+    if ((s = __redisClusterSplit(cmd,len)) != NULL)
+        return __redisClusterAsyncScatter(acc,s,fn,privdata);
+
+    node = __redisClusterRoute(&acc->cc,cmd,len);
+    if (acc->cc.refresh)
+        __redisClusterAsyncRefresh(acc,node);
+
+    if ((req = __redisClusterAsyncRequest(acc,fn,privdata,cmd,len)) == NULL) {
+        __redisClusterAsyncCopyError(acc);
+        return REDIS_ERR;
+    }
+    if (__redisClusterAsyncSend(acc,req,node,0) != REDIS_OK) {
+        __redisClusterAsyncUnlink(acc,req);
+        __redisClusterAsyncFreeRequest(req);
+        __redisClusterAsyncCopyError(acc);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* The callback is required, so it can be told apart from a slot map reload. */
+static void __redisClusterAsyncDiscard(redisClusterAsyncContext *acc, void *r, void *privdata) {
+    ((void)acc); ((void)r); ((void)privdata);
+}
+
+int redisvClusterAsyncCommand(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, const char *format, va_list ap) {
+    char *cmd;
+    int len;
+    int status;
+
+    len = redisvFormatCommand(&cmd,format,ap);
+    if (len == -1)
+        return REDIS_ERR;
+    status = __redisClusterAsyncCommand(acc,fn ? fn : __redisClusterAsyncDiscard,privdata,cmd,len);
+    free(cmd);
+    return status;
+}
+
+int redisClusterAsyncCommand(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, const char *format, ...) {
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = redisvClusterAsyncCommand(acc,fn,privdata,format,ap);
+    va_end(ap);
+    return status;
+}
+
+int redisClusterAsyncCommandArgv(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen) {
+    char *cmd;
+    int len;
+    int status;
+
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1)
+        return REDIS_ERR;
+    status = __redisClusterAsyncCommand(acc,fn ? fn : __redisClusterAsyncDiscard,privdata,cmd,len);
+    free(cmd);
+    return status;
+}
+
+/* Pending callbacks receive a NULL reply. The requests themselves are free'd
+ * by the connections that still hold them. */
+static void __redisClusterAsyncFree(redisClusterAsyncContext *acc) {
+    redisClusterRequest *req;
+    redisClusterNode *node, *next;
+    redisAsyncContext *ac;
+
+    acc->incallback++;
+    while ((req = acc->requests) != NULL) {
+        __redisClusterAsyncUnlink(acc,req);
+        req->acc = NULL;
+        if (req->fn != NULL)
+            req->fn(acc,NULL,req->privdata);
+    }
+    acc->incallback--;
+
+    for (node = acc->cc.nodes; node != NULL; node = next) {
+        next = node->next;
+        if ((ac = node->ac) != NULL) {
+            ac->data = NULL;
+            node->ac = NULL;
+            redisAsyncFree(ac);
+        }
+        if (node->c != NULL)
+            redisFree(node->c);
+        free(node->host);
+        free(node);
+    }
+    free(acc);
+}
+
+/* Free the context. When this is called from a callback, the context is
+ * free'd once the callback returns. */
+void redisClusterAsyncFree(redisClusterAsyncContext *acc) {
+    if (acc == NULL)
+        return;
+    acc->freeing = 1;
+    if (acc->incallback == 0)
+        __redisClusterAsyncFree(acc);
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HIREDIS_CLUSTER_H
+#define __HIREDIS_CLUSTER_H
+#include "hiredis.h"
+#include "async.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of hash slots in a Redis Cluster */
+#define REDIS_CLUSTER_SLOTS 16384
+
+/* Maximum number of MOVED or ASK redirects followed for one command */
+#define REDIS_CLUSTER_MAX_REDIRECTS 5
+
+typedef struct redisClusterNode {
+    char *host;
+    int port;
+    redisContext *c; /* Blocking connection, or NULL */
+    redisAsyncContext *ac; /* Async connection, or NULL */
+    struct redisClusterNode *next;
+} redisClusterNode;
+
+/* Context for blocking commands to a Redis Cluster */
+typedef struct redisClusterContext {
+    int err; /* Error flags, 0 when there is no error */
+    char errstr[128]; /* String representation of error when applicable */
+
+    struct timeval timeout; /* Connect and command timeout, zero for none */
+    redisClusterNode *nodes; /* Every node that was seen */
+    redisClusterNode *slots[REDIS_CLUSTER_SLOTS]; /* Master of every slot */
+    int refresh; /* Reload the slot map before the next command */
+} redisClusterContext;
+
+struct redisClusterAsyncContext;
+struct redisClusterRequest;
+
+/* Attaches the connection to a node to the event library. It is called for
+ * every node the first time a command is sent to it, and should return
+ * REDIS_OK on success, like the redisLibeventAttach() family. */
+typedef int (redisClusterAttachFn)(redisAsyncContext *ac, void *data);
+
+/* Reply callback prototype */
+typedef void (redisClusterCallbackFn)(struct redisClusterAsyncContext*, void*, void*);
+
+/* Context for async commands to a Redis Cluster */
+typedef struct redisClusterAsyncContext {
+    /* Slot map and nodes, also used to bootstrap the slot map */
+    redisClusterContext cc;
+
+    /* Setup error flags so they can be used directly. */
+    int err;
+    const char *errstr;
+
+    redisClusterAttachFn *attach;
+    void *attachdata;
+
+    /* Requests waiting for a reply */
+    struct redisClusterRequest *requests;
+    int refreshing; /* CLUSTER SLOTS is in flight */
+    int incallback; /* Depth of nested callbacks */
+    int freeing; /* Free the context when the callbacks return */
+} redisClusterAsyncContext;
+
+/* Slot of a key, or of every key in an array */
+unsigned int redisKeySlot(const char *key, size_t keylen);
+void redisKeySlotsBatch(const char **keys, const size_t *keylens, size_t count, unsigned int *slots);
+
+redisClusterContext *redisClusterConnect(const char *nodes);
+redisClusterContext *redisClusterConnectWithTimeout(const char *nodes, const struct timeval tv);
+void *redisvClusterCommand(redisClusterContext *cc, const char *format, va_list ap);
+void *redisClusterCommand(redisClusterContext *cc, const char *format, ...);
+void *redisClusterCommandArgv(redisClusterContext *cc, int argc, const char **argv, const size_t *argvlen);
+redisContext *redisClusterNodeContext(redisClusterContext *cc, redisClusterNode *node);
+void redisClusterFree(redisClusterContext *cc);
+
+redisClusterAsyncContext *redisClusterAsyncConnect(const char *nodes, redisClusterAttachFn *attach, void *data);
+redisClusterAsyncContext *redisClusterAsyncConnectWithTimeout(const char *nodes, const struct timeval tv,
+                                                              redisClusterAttachFn *attach, void *data);
+int redisvClusterAsyncCommand(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, const char *format, va_list ap);
+int redisClusterAsyncCommand(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, const char *format, ...);
+int redisClusterAsyncCommandArgv(redisClusterAsyncContext *acc, redisClusterCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+redisAsyncContext *redisClusterAsyncNodeContext(redisClusterAsyncContext *acc, redisClusterNode *node);
+void redisClusterAsyncFree(redisClusterAsyncContext *acc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -97,6 +97,19 @@ void freeReplyObject(void *reply) {
     free(r);
 }
 
+/* Take over the contents of a reply that is owned by a reader, which free's
+ * the empty shell after the callback. Returns NULL when out of memory. */
+redisReply *__redisTakeReply(redisReply *r) {
+    redisReply *copy = malloc(sizeof(*copy));
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy,r,sizeof(*copy));
+    r->str = NULL;
+    r->element = NULL;
+    r->elements = 0;
+    return copy;
+}
+
 static void *createStringObject(const redisReadTask *task, char *str, size_t len) {
     redisReply *r, *parent;
     char *buf;
@@ -973,23 +986,51 @@ int redisFormatCommandArgv(char **target, int argc, const char **argv, const siz
     return totlen;
 }
 
-void __redisSetError(redisContext *c, int type, const char *str) {
-    size_t len;
+/* Set the error of any context. The errstr fields of all contexts are as
+ * large as the one of redisContext. */
+void __redisCopyError(int *err, char *errstr, int type, const char *str) {
+    size_t len, max = sizeof(((redisContext *)NULL)->errstr)-1;
 
-    c->err = type;
+    *err = type;
+    len = strlen(str);
+    len = len < max ? len : max;
+    memcpy(errstr,str,len);
+    errstr[len] = '\0';
+}
+
+void __redisSetError(redisContext *c, int type, const char *str) {
     if (str != NULL) {
-        len = strlen(str);
-        len = len < (sizeof(c->errstr)-1) ? len : (sizeof(c->errstr)-1);
-        memcpy(c->errstr,str,len);
-        c->errstr[len] = '\0';
+        __redisCopyError(&c->err,c->errstr,type,str);
     } else {
+        c->err = type;
         /* Only REDIS_ERR_IO may lack a description! */
         assert(type == REDIS_ERR_IO);
         strerror_r(errno,c->errstr,sizeof(c->errstr));
     }
 }
 
-static redisContext *redisContextInit(void) {
+/* Split the first len bytes of a host:port address. The host of an IPv6
+ * address may be in brackets, as in [::1]:6379, which are not part of the
+ * host name. */
+int __redisSplitAddress(const char *addr, size_t len, const char **host, size_t *hostlen, int *port) {
+    const char *colon;
+
+    for (colon = addr+len; colon > addr && *colon != ':'; colon--);
+    if (colon == addr)
+        return REDIS_ERR;
+    *host = addr;
+    *hostlen = colon-addr;
+    if (addr[0] == '[' && colon[-1] == ']') {
+        if (*hostlen == 2)
+            return REDIS_ERR;
+        *host = addr+1;
+        *hostlen -= 2;
+    }
+    *port = atoi(colon+1);
+    return REDIS_OK;
+}
+
+redisContext *redisContextInit(void) {
     redisContext *c;
 
     c = calloc(1,sizeof(redisContext));
@@ -1069,6 +1110,38 @@ redisContext *redisConnectBindNonBlock(const char *ip, int port,
     return c;
 }
 
+/* Connect with the given socket options. A NULL timeout blocks until the
+ * connection is established or fails. */
+redisContext *redisConnectWithOptions(const char *ip, int port, const struct timeval *tv,
+                                     const redisSocketOptions *opts) {
+    redisContext *c;
+
+    c = redisContextInit();
+    if (c == NULL)
+        return NULL;
+
+    c->flags |= REDIS_BLOCK;
+    if (opts != NULL)
+        c->sockopts = *opts;
+    redisContextConnectTcp(c,ip,port,tv);
+    return c;
+}
+
+redisContext *redisConnectNonBlockWithOptions(const char *ip, int port,
+                                             const redisSocketOptions *opts) {
+    redisContext *c;
+
+    c = redisContextInit();
+    if (c == NULL)
+        return NULL;
+
+    c->flags &= ~REDIS_BLOCK;
+    if (opts != NULL)
+        c->sockopts = *opts;
+    redisContextConnectTcp(c,ip,port,NULL);
+    return c;
+}
+
 redisContext *redisConnectUnix(const char *path) {
     redisContext *c;
 
@@ -1105,6 +1178,44 @@ redisContext *redisConnectUnixNonBlock(const char *path) {
     return c;
 }
 
+/* Connect to an address resolved by the caller, skipping name resolution. */
+redisContext *redisConnectAddr(const struct sockaddr *addr, size_t addrlen) {
+    redisContext *c;
+
+    c = redisContextInit();
+    if (c == NULL)
+        return NULL;
+
+    c->flags |= REDIS_BLOCK;
+    redisContextConnectAddr(c,addr,(socklen_t)addrlen,NULL);
+    return c;
+}
+
+redisContext *redisConnectAddrWithTimeout(const struct sockaddr *addr, size_t addrlen,
+                                          const struct timeval tv) {
+    redisContext *c;
+
+    c = redisContextInit();
+    if (c == NULL)
+        return NULL;
+
+    c->flags |= REDIS_BLOCK;
+    redisContextConnectAddr(c,addr,(socklen_t)addrlen,&tv);
+    return c;
+}
+
+redisContext *redisConnectAddrNonBlock(const struct sockaddr *addr, size_t addrlen) {
+    redisContext *c;
+
+    c = redisContextInit();
+    if (c == NULL)
+        return NULL;
+
+    c->flags &= ~REDIS_BLOCK;
+    redisContextConnectAddr(c,addr,(socklen_t)addrlen,NULL);
+    return c;
+}
+
 redisContext *redisConnectFd(int fd) {
     redisContext *c;
 
@@ -1183,7 +1294,11 @@ int redisBufferWrite(redisContext *c, int *done) {
     if (sdslen(c->obuf) > 0) {
         nwritten = write(c->fd,c->obuf,sdslen(c->obuf));
         if (nwritten == -1) {
-            if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
+            /* With TCP Fast Open, the first write on a non-blocking socket
+             * starts the handshake and fails with EINPROGRESS when the data
+             * couldn't be sent with the SYN. */
+            if (((errno == EAGAIN || errno == EINPROGRESS) && !(c->flags & REDIS_BLOCK)) ||
+                (errno == EINTR)) {
                 /* Try again later */
             } else {
                 __redisSetError(c,REDIS_ERR_IO,NULL);
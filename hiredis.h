@@ -50,6 +50,7 @@
 #define REDIS_ERR_EOF 3 /* End of file */
 #define REDIS_ERR_PROTOCOL 4 /* Protocol error */
 #define REDIS_ERR_OOM 5 /* Out of memory */
+#define REDIS_ERR_TIMEOUT 6 /* Timed out */
 #define REDIS_ERR_OTHER 2 /* Everything else... */
 
 /* Connection type can be blocking or non-blocking and is set in the
@@ -79,6 +80,35 @@
 /* Flag that is set when monitor mode is active */
 #define REDIS_MONITORING 0x40
 
+/* Flag that is set when the async connect timeout has been scheduled. */
+#define REDIS_CONNECT_TIMER 0x80
+
+/* Flag that is set when a write is delayed by the async pipeline window. */
+#define REDIS_PIPELINE_TIMER 0x100
+
+/* Flag that is set when the async context is above a high watermark. */
+#define REDIS_ABOVE_WATERMARK 0x200
+
+/* Flag that is set while the async context waits before reconnecting. */
+#define REDIS_RECONNECT_TIMER 0x400
+
+/* Flag that is set between MULTI and EXEC or DISCARD on an async context. */
+#define REDIS_IN_MULTI 0x800
+
+/* Flag that is set between WATCH and EXEC, DISCARD or UNWATCH on an async
+ * context. */
+#define REDIS_WATCHING 0x1000
+
+/* Flag that is set when TCP Fast Open was enabled on the socket, which only
+ * happens when the fastopen socket option is set, the platform supports it,
+ * and the host has a single address. */
+#define REDIS_FASTOPEN 0x2000
+
+/* Flag that is set on an async context from a NOSCRIPT error of a script
+ * call until the SCRIPT LOAD sent for it is answered. Script calls are sent
+ * with EVAL meanwhile. */
+#define REDIS_SCRIPTS_LOADING 0x4000
+
 #define REDIS_REPLY_STRING 1
 #define REDIS_REPLY_ARRAY 2
 #define REDIS_REPLY_INTEGER 3
@@ -94,6 +124,8 @@
 extern "C" {
 #endif
 
+struct sockaddr; /* only used by pointer, see <sys/socket.h> */
+
 /* This is the reply object returned by redisCommand() */
 typedef struct redisReply {
     int type; /* REDIS_REPLY_* */
@@ -162,6 +194,20 @@ int redisvFormatCommand(char **target, const char *format, va_list ap);
 int redisFormatCommand(char **target, const char *format, ...);
 int redisFormatCommandArgv(char **target, int argc, const char **argv, const size_t *argvlen);
 
+/* Socket options for TCP connections, applied before connecting. Fields that
+ * are 0 leave the system default in place. Setting any of the keepalive
+ * fields enables SO_KEEPALIVE. */
+typedef struct redisSocketOptions {
+    int rcvbuf; /* SO_RCVBUF in bytes */
+    int sndbuf; /* SO_SNDBUF in bytes */
+    int user_timeout; /* TCP_USER_TIMEOUT in milliseconds */
+    int keepalive_idle; /* Idle seconds before the first keepalive probe */
+    int keepalive_interval; /* Seconds between keepalive probes */
+    int keepalive_count; /* Unanswered probes before the peer is dead */
+    int busy_poll; /* SO_BUSY_POLL in microseconds */
+    int fastopen; /* Send the first commands with the SYN (TCP Fast Open) */
+} redisSocketOptions;
+
 /* Context for a connection to Redis */
 typedef struct redisContext {
     int err; /* Error flags, 0 when there is no error */
@@ -170,17 +216,30 @@ typedef struct redisContext {
     int flags;
     char *obuf; /* Write buffer */
     redisReader *reader; /* Protocol reader */
+    redisSocketOptions sockopts;
 } redisContext;
 
 redisContext *redisConnect(const char *ip, int port);
 redisContext *redisConnectWithTimeout(const char *ip, int port, const struct timeval tv);
 redisContext *redisConnectNonBlock(const char *ip, int port);
 redisContext *redisConnectBindNonBlock(const char *ip, int port, const char *source_addr);
+redisContext *redisConnectWithOptions(const char *ip, int port, const struct timeval *tv,
+                                     const redisSocketOptions *opts);
+redisContext *redisConnectNonBlockWithOptions(const char *ip, int port,
+                                             const redisSocketOptions *opts);
 redisContext *redisConnectUnix(const char *path);
 redisContext *redisConnectUnixWithTimeout(const char *path, const struct timeval tv);
 redisContext *redisConnectUnixNonBlock(const char *path);
+redisContext *redisConnectAddr(const struct sockaddr *addr, size_t addrlen);
+redisContext *redisConnectAddrWithTimeout(const struct sockaddr *addr, size_t addrlen, const struct timeval tv);
+redisContext *redisConnectAddrNonBlock(const struct sockaddr *addr, size_t addrlen);
 redisContext *redisConnectFd(int fd);
 int redisSetTimeout(redisContext *c, const struct timeval tv);
+
+/* Process-wide cache of resolved host names used by the connect functions.
+ * It is disabled by default; a TTL of 0 disables and empties it. */
+void redisSetResolveCacheTTL(int seconds);
+void redisResolveCacheFlush(void);
 int redisEnableKeepAlive(redisContext *c);
 void redisFree(redisContext *c);
 int redisFreeKeepFd(redisContext *c);
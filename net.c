@@ -34,6 +34,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/time.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -47,6 +48,9 @@
 #include <stdio.h>
 #include <poll.h>
 #include <limits.h>
+#include <time.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #include "net.h"
 #include "sds.h"
@@ -173,23 +177,109 @@ static int redisSetTcpNoDelay(redisContext *c) {
     return REDIS_OK;
 }
 
+/* Socket options that are not available everywhere. They are -1 when the
+ * platform doesn't support them, which fails with ENOPROTOOPT when used. */
+#ifdef TCP_USER_TIMEOUT
+#define REDIS_TCP_USER_TIMEOUT TCP_USER_TIMEOUT
+#else
+#define REDIS_TCP_USER_TIMEOUT -1
+#endif
+#if defined(TCP_KEEPIDLE)
+#define REDIS_TCP_KEEPIDLE TCP_KEEPIDLE
+#elif defined(TCP_KEEPALIVE)
+#define REDIS_TCP_KEEPIDLE TCP_KEEPALIVE
+#else
+#define REDIS_TCP_KEEPIDLE -1
+#endif
+#ifdef TCP_KEEPINTVL
+#define REDIS_TCP_KEEPINTVL TCP_KEEPINTVL
+#else
+#define REDIS_TCP_KEEPINTVL -1
+#endif
+#ifdef TCP_KEEPCNT
+#define REDIS_TCP_KEEPCNT TCP_KEEPCNT
+#else
+#define REDIS_TCP_KEEPCNT -1
+#endif
+#ifdef SO_BUSY_POLL
+#define REDIS_SO_BUSY_POLL SO_BUSY_POLL
+#else
+#define REDIS_SO_BUSY_POLL -1
+#endif
+
+/* Set an integer socket option when val is positive. */
+static int redisSetSockOpt(redisContext *c, int level, int name, int val,
+                           const char *what) {
+    if (val <= 0)
+        return REDIS_OK;
+    if (name == -1) {
+        errno = ENOPROTOOPT;
+    } else if (setsockopt(c->fd, level, name, &val, sizeof(val)) != -1) {
+        return REDIS_OK;
+    }
+    __redisSetErrorFromErrno(c,REDIS_ERR_IO,what);
+    return REDIS_ERR;
+}
+
+/* Apply the socket options of the context to a TCP socket that is about to
+ * connect. Buffer sizes need to be set before connect(2) because they
+ * determine the window scale negotiated in the handshake. */
+static int redisApplySocketOptions(redisContext *c) {
+    const redisSocketOptions *o = &c->sockopts;
+    int keepalive = o->keepalive_idle > 0 || o->keepalive_interval > 0 ||
+                    o->keepalive_count > 0;
+
+    if (redisSetSockOpt(c,SOL_SOCKET,SO_RCVBUF,o->rcvbuf,
+                        "setsockopt(SO_RCVBUF)") != REDIS_OK ||
+        redisSetSockOpt(c,SOL_SOCKET,SO_SNDBUF,o->sndbuf,
+                        "setsockopt(SO_SNDBUF)") != REDIS_OK ||
+        redisSetSockOpt(c,IPPROTO_TCP,REDIS_TCP_USER_TIMEOUT,o->user_timeout,
+                        "setsockopt(TCP_USER_TIMEOUT)") != REDIS_OK ||
+        redisSetSockOpt(c,SOL_SOCKET,SO_KEEPALIVE,keepalive,
+                        "setsockopt(SO_KEEPALIVE)") != REDIS_OK ||
+        redisSetSockOpt(c,IPPROTO_TCP,REDIS_TCP_KEEPIDLE,o->keepalive_idle,
+                        "setsockopt(TCP_KEEPIDLE)") != REDIS_OK ||
+        redisSetSockOpt(c,IPPROTO_TCP,REDIS_TCP_KEEPINTVL,o->keepalive_interval,
+                        "setsockopt(TCP_KEEPINTVL)") != REDIS_OK ||
+        redisSetSockOpt(c,IPPROTO_TCP,REDIS_TCP_KEEPCNT,o->keepalive_count,
+                        "setsockopt(TCP_KEEPCNT)") != REDIS_OK ||
+        redisSetSockOpt(c,SOL_SOCKET,REDIS_SO_BUSY_POLL,o->busy_poll,
+                        "setsockopt(SO_BUSY_POLL)") != REDIS_OK)
+        return REDIS_ERR;
+    return REDIS_OK;
+}
+
+/* Enable TCP Fast Open on a socket that is about to connect. connect(2) then
+ * returns right away and the SYN is sent by the first write, carrying the
+ * output buffer when the kernel has a cookie for the peer. Failure is not
+ * fatal: the connection then uses a regular handshake, just like when the
+ * peer doesn't support Fast Open. REDIS_FASTOPEN tells which one it was. */
+static void redisSetFastOpen(redisContext *c) {
+#ifdef TCP_FASTOPEN_CONNECT
+    int yes = 1;
+
+    if (setsockopt(c->fd,IPPROTO_TCP,TCP_FASTOPEN_CONNECT,&yes,sizeof(yes)) != -1)
+        c->flags |= REDIS_FASTOPEN;
+#else
+    ((void)c);
+#endif
+}
+
 #define __MAX_MSEC (((LONG_MAX) - 999) / 1000)
 
-static int redisContextWaitReady(redisContext *c, const struct timeval *timeout) {
-    struct pollfd   wfd[1];
-    long msec;
+/* Delay between starting connection attempts to successive addresses of a
+ * host, as recommended by RFC 8305. */
+#define REDIS_CONNECT_ATTEMPT_DELAY 250 /* milliseconds */
 
-    msec          = -1;
-    wfd[0].fd     = c->fd;
-    wfd[0].events = POLLOUT;
+/* Convert a connect timeout to milliseconds for poll(2), -1 meaning no
+ * timeout. Returns REDIS_ERR when the timeout is out of range. */
+static int redisTimeoutMsec(const struct timeval *timeout, long *result) {
+    long msec = -1;
 
     /* Only use timeout when not NULL. */
     if (timeout != NULL) {
-        if (timeout->tv_usec > 1000000 || timeout->tv_sec > __MAX_MSEC) {
-            __redisSetErrorFromErrno(c, REDIS_ERR_IO, NULL);
-            redisContextCloseFd(c);
+        if (timeout->tv_usec > 1000000 || timeout->tv_sec > __MAX_MSEC)
             return REDIS_ERR;
-        }
 
         msec = (timeout->tv_sec * 1000) + ((timeout->tv_usec + 999) / 1000);
 
@@ -198,6 +288,23 @@ static int redisContextWaitReady(redisContext *c, const struct timeval *timeout)
         }
     }
 
+    *result = msec;
+    return REDIS_OK;
+}
+
+static int redisContextWaitReady(redisContext *c, const struct timeval *timeout) {
+    struct pollfd   wfd[1];
+    long msec;
+
+    wfd[0].fd     = c->fd;
+    wfd[0].events = POLLOUT;
+
+    if (redisTimeoutMsec(timeout,&msec) != REDIS_OK) {
+        __redisSetErrorFromErrno(c, REDIS_ERR_IO, NULL);
+        redisContextCloseFd(c);
+        return REDIS_ERR;
+    }
+
     if (errno == EINPROGRESS) {
         int res;
 
@@ -253,60 +360,290 @@ int redisContextSetTimeout(redisContext *c, const struct timeval tv) {
     return REDIS_OK;
 }
 
-static int _redisContextConnectTcp(redisContext *c, const char *addr, int port,
-                                   const struct timeval *timeout,
-                                   const char *source_addr) {
-    int s, rv;
+/* Reorder the list so that address families alternate, starting with the
+ * family of the first address (RFC 8305, section 4). getaddrinfo(3) already
+ * sorts by preference, which is kept within each family. */
+static struct addrinfo *redisInterleaveFamilies(struct addrinfo *servinfo) {
+    struct addrinfo *first = NULL, **ftail = &first;
+    struct addrinfo *other = NULL, **otail = &other;
+    struct addrinfo *head = NULL, **tail = &head;
+    struct addrinfo *p, *next;
+    int family = servinfo->ai_family;
+
+    for (p = servinfo; p != NULL; p = next) {
+        next = p->ai_next;
+        p->ai_next = NULL;
+        if (p->ai_family == family) {
+            *ftail = p;
+            ftail = &p->ai_next;
+        } else {
+            *otail = p;
+            otail = &p->ai_next;
+        }
+    }
+
+    while (first != NULL || other != NULL) {
+        if (first != NULL) {
+            *tail = first;
+            tail = &first->ai_next;
+            first = first->ai_next;
+        }
+        if (other != NULL) {
+            *tail = other;
+            tail = &other->ai_next;
+            other = other->ai_next;
+        }
+    }
+    return head;
+}
+
+/* Copy an address list into a single allocation, so that it can be cached
+ * and released with free(3). */
+static struct addrinfo *redisCopyAddrList(const struct addrinfo *servinfo) {
+    const struct addrinfo *p;
+    struct addrinfo *copy, *ai;
+    struct sockaddr_storage *sa;
+    size_t n = 0, i;
+
+    for (p = servinfo; p != NULL; p = p->ai_next)
+        n++;
+    if (n == 0)
+        return NULL;
+
+    copy = malloc(n*(sizeof(struct addrinfo)+sizeof(struct sockaddr_storage)));
+    if (copy == NULL)
+        return NULL;
+
+    sa = (struct sockaddr_storage*)(copy+n);
+    for (p = servinfo, i = 0; p != NULL; p = p->ai_next, i++) {
+        ai = &copy[i];
+        memset(ai,0,sizeof(*ai));
+        ai->ai_family = p->ai_family;
+        ai->ai_socktype = p->ai_socktype;
+        ai->ai_protocol = p->ai_protocol;
+        ai->ai_addrlen = p->ai_addrlen;
+        ai->ai_addr = (struct sockaddr*)&sa[i];
+        memcpy(ai->ai_addr,p->ai_addr,p->ai_addrlen);
+        ai->ai_next = (i+1 < n) ? &copy[i+1] : NULL;
+    }
+    return copy;
+}
+
+/* Process-wide cache of resolved host names. It is disabled until a TTL is
+ * set with redisSetResolveCacheTTL(). Entries are kept in most recently
+ * inserted order and the list is capped at REDIS_RESOLVE_CACHE_SIZE. */
+#define REDIS_RESOLVE_CACHE_SIZE 64
+
+typedef struct redisResolveCacheEntry {
+    struct redisResolveCacheEntry *next;
+    char *addr;
+    int port;
+    time_t expires;
+    struct addrinfo *servinfo;
+} redisResolveCacheEntry;
+
+static struct {
+    pthread_mutex_t lock;
+    int ttl;
+    int size;
+    redisResolveCacheEntry *head;
+} resolveCache = { PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL };
+
+static void redisResolveCacheFreeEntry(redisResolveCacheEntry *e) {
+    free(e->addr);
+    free(e->servinfo);
+    free(e);
+}
+
+/* Remove expired entries, and all entries when "all" is set. Must be called
+ * with the lock held. */
+static void redisResolveCachePurge(time_t now, int all) {
+    redisResolveCacheEntry **pe = &resolveCache.head, *e;
+
+    while ((e = *pe) != NULL) {
+        if (all || e->expires <= now) {
+            *pe = e->next;
+            resolveCache.size--;
+            redisResolveCacheFreeEntry(e);
+        } else {
+            pe = &e->next;
+        }
+    }
+}
+
+static struct addrinfo *redisResolveCacheLookup(const char *addr, int port) {
+    redisResolveCacheEntry *e;
+    struct addrinfo *servinfo = NULL;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&resolveCache.lock);
+    for (e = resolveCache.head; e != NULL; e = e->next) {
+        if (e->port == port && e->expires > now && strcmp(e->addr,addr) == 0) {
+            servinfo = redisCopyAddrList(e->servinfo);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&resolveCache.lock);
+    return servinfo;
+}
+
+static void redisResolveCacheInsert(const char *addr, int port,
+                                    const struct addrinfo *servinfo) {
+    redisResolveCacheEntry *e, **pe;
+    time_t now = time(NULL);
+
+    if ((e = malloc(sizeof(*e))) == NULL)
+        return;
+    e->addr = strdup(addr);
+    e->port = port;
+    e->servinfo = redisCopyAddrList(servinfo);
+    if (e->addr == NULL || e->servinfo == NULL) {
+        redisResolveCacheFreeEntry(e);
+        return;
+    }
+
+    pthread_mutex_lock(&resolveCache.lock);
+    if (resolveCache.ttl <= 0) {
+        pthread_mutex_unlock(&resolveCache.lock);
+        redisResolveCacheFreeEntry(e);
+        return;
+    }
+    e->expires = now+resolveCache.ttl;
+    redisResolveCachePurge(now,0);
+
+    /* Evict the oldest entry when the cache is full. */
+    if (resolveCache.size >= REDIS_RESOLVE_CACHE_SIZE) {
+        pe = &resolveCache.head;
+        while ((*pe)->next != NULL)
+            pe = &(*pe)->next;
+        redisResolveCacheFreeEntry(*pe);
+        *pe = NULL;
+        resolveCache.size--;
+    }
+    e->next = resolveCache.head;
+    resolveCache.head = e;
+    resolveCache.size++;
+    pthread_mutex_unlock(&resolveCache.lock);
+}
+
+/* Enable the resolve cache with the given TTL in seconds, or disable and
+ * empty it with a TTL of 0. */
+void redisSetResolveCacheTTL(int seconds) {
+    pthread_mutex_lock(&resolveCache.lock);
+    resolveCache.ttl = seconds > 0 ? seconds : 0;
+    if (resolveCache.ttl == 0)
+        redisResolveCachePurge(0,1);
+    pthread_mutex_unlock(&resolveCache.lock);
+}
+
+/* Drop all cached entries, e.g. after a failover changed DNS records. */
+void redisResolveCacheFlush(void) {
+    pthread_mutex_lock(&resolveCache.lock);
+    redisResolveCachePurge(0,1);
+    pthread_mutex_unlock(&resolveCache.lock);
+}
+
+/* Cache addresses for addr:port as if the name had resolved to them, with
+ * the families interleaved the same way. Connections to addr then race
+ * them. Mostly useful for tests. */
+int redisResolveCacheAdd(const char *addr, int port, const struct addrinfo *servinfo) {
+    struct addrinfo *copy;
+
+    if ((copy = redisCopyAddrList(servinfo)) == NULL)
+        return REDIS_ERR;
+    /* The first address stays first, so copy is still the allocation. */
+    redisResolveCacheInsert(addr,port,redisInterleaveFamilies(copy));
+    free(copy);
+    return REDIS_OK;
+}
+
+/* Resolve addr:port to a list of stream socket addresses for all address
+ * families, consulting the resolve cache first. The list should be released
+ * with free(3). Returns 0 on success or a getaddrinfo(3) error code. */
+static int redisResolveTcp(const char *addr, int port, struct addrinfo **servinfo) {
+    int rv, ttl;
     char _port[6];  /* strlen("65535"); */
-    struct addrinfo hints, *servinfo, *bservinfo, *p, *b;
-    int blocking = (c->flags & REDIS_BLOCK);
+    struct addrinfo hints, *res;
+
+    pthread_mutex_lock(&resolveCache.lock);
+    ttl = resolveCache.ttl;
+    pthread_mutex_unlock(&resolveCache.lock);
+    if (ttl > 0 && (*servinfo = redisResolveCacheLookup(addr,port)) != NULL)
+        return 0;
 
     snprintf(_port, 6, "%d", port);
     memset(&hints,0,sizeof(hints));
-    hints.ai_family = AF_INET;
+    hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
-    /* Try with IPv6 if no IPv4 address was found. We do it in this order since
-     * in a Redis client you can't afford to test if you have IPv6 connectivity
-     * as this would add latency to every connect. Otherwise a more sensible
-     * route could be: Use IPv6 if both addresses are available and there is IPv6
-     * connectivity. */
-    if ((rv = getaddrinfo(addr,_port,&hints,&servinfo)) != 0) {
-         hints.ai_family = AF_INET6;
-         if ((rv = getaddrinfo(addr,_port,&hints,&servinfo)) != 0) {
-            __redisSetError(c,REDIS_ERR_OTHER,gai_strerror(rv));
-            return REDIS_ERR;
+    if ((rv = getaddrinfo(addr,_port,&hints,&res)) != 0)
+        return rv;
+    res = redisInterleaveFamilies(res);
+    *servinfo = redisCopyAddrList(res);
+    freeaddrinfo(res);
+    if (*servinfo == NULL)
+        return EAI_MEMORY;
+
+    if (ttl > 0)
+        redisResolveCacheInsert(addr,port,*servinfo);
+    return 0;
+}
+
+/* Bind socket s to source_addr, using an address of the given family. */
+static int redisBindSource(redisContext *c, int s, int family, const char *source_addr) {
+    struct addrinfo hints, *bservinfo, *b;
+    int rv, bound = 0;
+
+    /* Using getaddrinfo saves us from self-determining IPv4 vs IPv6 */
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(source_addr, NULL, &hints, &bservinfo)) != 0) {
+        char buf[128];
+        snprintf(buf,sizeof(buf),"Can't get addr: %s",gai_strerror(rv));
+        __redisSetError(c,REDIS_ERR_OTHER,buf);
+        return REDIS_ERR;
+    }
+    for (b = bservinfo; b != NULL; b = b->ai_next) {
+        if (bind(s,b->ai_addr,b->ai_addrlen) != -1) {
+            bound = 1;
+            break;
         }
     }
+    freeaddrinfo(bservinfo);
+    if (!bound) {
+        char buf[128];
+        snprintf(buf,sizeof(buf),"Can't bind socket: %s",strerror(errno));
+        __redisSetError(c,REDIS_ERR_OTHER,buf);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Connect to the first reachable address in servinfo. */
+static int redisContextConnectList(redisContext *c, struct addrinfo *servinfo,
+                                   const struct timeval *timeout,
+                                   const char *source_addr) {
+    int s;
+    struct addrinfo *p;
+    int blocking = (c->flags & REDIS_BLOCK);
+
+    c->flags &= ~REDIS_FASTOPEN;
     for (p = servinfo; p != NULL; p = p->ai_next) {
         if ((s = socket(p->ai_family,p->ai_socktype,p->ai_protocol)) == -1)
             continue;
 
         c->fd = s;
         if (redisSetBlocking(c,0) != REDIS_OK)
-            goto error;
-        if (source_addr) {
-            int bound = 0;
-            /* Using getaddrinfo saves us from self-determining IPv4 vs IPv6 */
-            if ((rv = getaddrinfo(source_addr, NULL, &hints, &bservinfo)) != 0) {
-                char buf[128];
-                snprintf(buf,sizeof(buf),"Can't get addr: %s",gai_strerror(rv));
-                __redisSetError(c,REDIS_ERR_OTHER,buf);
-                goto error;
-            }
-            for (b = bservinfo; b != NULL; b = b->ai_next) {
-                if (bind(s,b->ai_addr,b->ai_addrlen) != -1) {
-                    bound = 1;
-                    break;
-                }
-            }
-            if (!bound) {
-                char buf[128];
-                snprintf(buf,sizeof(buf),"Can't bind socket: %s",strerror(errno));
-                __redisSetError(c,REDIS_ERR_OTHER,buf);
-                goto error;
-            }
-        }
+            return REDIS_ERR;
+        if (p->ai_family != AF_LOCAL && redisApplySocketOptions(c) != REDIS_OK)
+            return REDIS_ERR;
+        /* Fast Open would hide an unreachable address until the first
+         * write, so it is only used when there is no other to try. */
+        if (p->ai_family != AF_LOCAL && c->sockopts.fastopen && servinfo->ai_next == NULL)
+            redisSetFastOpen(c);
+        if (source_addr && redisBindSource(c,s,p->ai_family,source_addr) != REDIS_OK)
+            return REDIS_ERR;
         if (connect(s,p->ai_addr,p->ai_addrlen) == -1) {
             if (errno == EHOSTUNREACH) {
                 redisContextCloseFd(c);
@@ -315,30 +652,226 @@ static int _redisContextConnectTcp(redisContext *c, const char *addr, int port,
                 /* This is ok. */
             } else {
                 if (redisContextWaitReady(c,timeout) != REDIS_OK)
-                    goto error;
+                    return REDIS_ERR;
             }
         }
         if (blocking && redisSetBlocking(c,1) != REDIS_OK)
-            goto error;
-        if (redisSetTcpNoDelay(c) != REDIS_OK)
-            goto error;
+            return REDIS_ERR;
+        if (p->ai_family != AF_LOCAL && redisSetTcpNoDelay(c) != REDIS_OK)
+            return REDIS_ERR;
 
         c->flags |= REDIS_CONNECTED;
-        rv = REDIS_OK;
-        goto end;
+        return REDIS_OK;
     }
-    if (p == NULL) {
+
+    {
         char buf[128];
         snprintf(buf,sizeof(buf),"Can't create socket: %s",strerror(errno));
         __redisSetError(c,REDIS_ERR_OTHER,buf);
+        return REDIS_ERR;
+    }
+}
+
+static long long redisMstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec*1000)+(tv.tv_usec/1000);
+}
+
+/* Start a non-blocking connect to p, with TCP Fast Open when fastopen is
+ * set. Returns the socket, or -1 with errno set when the attempt failed
+ * right away. Sets *done when the connection was established without
+ * waiting. */
+static int redisStartAttempt(redisContext *c, struct addrinfo *p,
+                             const char *source_addr, int fastopen, int *done) {
+    int s, err;
+
+    *done = 0;
+    if ((s = socket(p->ai_family,p->ai_socktype,p->ai_protocol)) == -1)
+        return -1;
+
+    c->fd = s;
+    if (redisSetBlocking(c,0) != REDIS_OK)
+        return -1;
+    if (redisApplySocketOptions(c) != REDIS_OK)
+        goto error;
+    if (fastopen)
+        redisSetFastOpen(c);
+    if (source_addr && redisBindSource(c,s,p->ai_family,source_addr) != REDIS_OK)
         goto error;
+    if (connect(s,p->ai_addr,p->ai_addrlen) == -1) {
+        if (errno != EINPROGRESS)
+            goto error;
+    } else {
+        *done = 1;
     }
+    c->fd = -1;
+    return s;
 
 error:
-    rv = REDIS_ERR;
-end:
-    freeaddrinfo(servinfo);
-    return rv;  // Need to return REDIS_OK if alright
+    err = errno;
+    close(s);
+    c->fd = -1;
+    errno = err;
+    return -1;
+}
+
+/* Race connection attempts to all addresses in servinfo, staggered by
+ * REDIS_CONNECT_ATTEMPT_DELAY (RFC 8305, "Happy Eyeballs"). A new attempt is
+ * started when the delay elapses or as soon as all running attempts failed,
+ * so an unreachable address does not hold up the next one. The first socket
+ * to connect wins and all others are closed. With TCP Fast Open, connect(2)
+ * completes without a handshake, so that the first address would always
+ * win: it is only used when there is a single address. The race is
+ * abandoned when cancelfd, unless it is -1, becomes readable. */
+static int redisContextConnectRace(redisContext *c, struct addrinfo *servinfo,
+                                   const struct timeval *timeout,
+                                   const char *source_addr, int cancelfd) {
+    struct addrinfo *p = servinfo;
+    struct pollfd *pfd;
+    long msec;
+    long long now, deadline = -1, next = 0;
+    int i, n, count = 0, npending = 0, winner = -1, lasterr = 0;
+
+    if (redisTimeoutMsec(timeout,&msec) != REDIS_OK) {
+        __redisSetErrorFromErrno(c,REDIS_ERR_IO,NULL);
+        return REDIS_ERR;
+    }
+    for (p = servinfo; p != NULL; p = p->ai_next)
+        count++;
+    if ((pfd = malloc(sizeof(*pfd)*(count+1))) == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+
+    now = redisMstime();
+    if (msec >= 0)
+        deadline = now+msec;
+
+    p = servinfo;
+    c->err = 0;
+    c->flags &= ~REDIS_FASTOPEN;
+    while (winner == -1) {
+        int wait, res, done;
+
+        /* Start the next attempt when it is due. */
+        if (p != NULL && (npending == 0 || now >= next)) {
+            int s = redisStartAttempt(c,p,source_addr,c->sockopts.fastopen && count == 1,&done);
+            p = p->ai_next;
+            next = now+REDIS_CONNECT_ATTEMPT_DELAY;
+            if (s == -1) {
+                lasterr = errno;
+                continue;
+            }
+            if (done) {
+                winner = s;
+                break;
+            }
+            pfd[npending].fd = s;
+            pfd[npending].events = POLLOUT;
+            pfd[npending].revents = 0;
+            npending++;
+            continue;
+        }
+
+        if (npending == 0)
+            break;
+
+        /* Wait for a running attempt to complete, or for the next one to
+         * become due. */
+        wait = -1;
+        if (p != NULL)
+            wait = (int)(next-now);
+        if (deadline != -1) {
+            if (now >= deadline) {
+                lasterr = ETIMEDOUT;
+                break;
+            }
+            if (wait == -1 || deadline-now < wait)
+                wait = (int)(deadline-now);
+        }
+
+        if (cancelfd != -1) {
+            pfd[npending].fd = cancelfd;
+            pfd[npending].events = POLLIN;
+            pfd[npending].revents = 0;
+        }
+        if ((res = poll(pfd,npending+(cancelfd != -1),wait)) == -1) {
+            if (errno == EINTR) {
+                now = redisMstime();
+                continue;
+            }
+            lasterr = errno;
+            break;
+        }
+        now = redisMstime();
+        if (cancelfd != -1 && pfd[npending].revents != 0) {
+            lasterr = ECANCELED;
+            break;
+        }
+
+        for (i = 0, n = 0; i < npending; i++) {
+            if (winner == -1 && pfd[i].revents != 0) {
+                int err = 0;
+                socklen_t errlen = sizeof(err);
+
+                if (getsockopt(pfd[i].fd,SOL_SOCKET,SO_ERROR,&err,&errlen) == -1)
+                    err = errno;
+                if (err == 0) {
+                    winner = pfd[i].fd;
+                    continue;
+                }
+                lasterr = err;
+                close(pfd[i].fd);
+                continue;
+            }
+            pfd[n++] = pfd[i];
+        }
+        npending = n;
+    }
+
+    /* Close attempts that lost the race. */
+    for (i = 0; i < npending; i++)
+        close(pfd[i].fd);
+    free(pfd);
+
+    if (winner == -1) {
+        /* Keep errors that were set while binding or creating sockets. */
+        if (c->err == 0 || lasterr == ETIMEDOUT) {
+            errno = lasterr ? lasterr : ECONNREFUSED;
+            __redisSetErrorFromErrno(c,REDIS_ERR_IO,NULL);
+        }
+        return REDIS_ERR;
+    }
+
+    c->err = 0;
+    c->errstr[0] = '\0';
+    c->fd = winner;
+    if ((c->flags & REDIS_BLOCK) && redisSetBlocking(c,1) != REDIS_OK)
+        return REDIS_ERR;
+    if (redisSetTcpNoDelay(c) != REDIS_OK)
+        return REDIS_ERR;
+
+    c->flags |= REDIS_CONNECTED;
+    return REDIS_OK;
+}
+
+static int _redisContextConnectTcp(redisContext *c, const char *addr, int port,
+                                   const struct timeval *timeout,
+                                   const char *source_addr) {
+    int rv;
+    struct addrinfo *servinfo;
+
+    if ((rv = redisResolveTcp(addr,port,&servinfo)) != 0) {
+        __redisSetError(c,REDIS_ERR_OTHER,gai_strerror(rv));
+        return REDIS_ERR;
+    }
+    if (c->flags & REDIS_BLOCK)
+        rv = redisContextConnectRace(c,servinfo,timeout,source_addr,-1);
+    else
+        rv = redisContextConnectList(c,servinfo,timeout,source_addr);
+    free(servinfo);
+    return rv;
 }
 
 int redisContextConnectTcp(redisContext *c, const char *addr, int port,
@@ -352,6 +885,248 @@ int redisContextConnectBindTcp(redisContext *c, const char *addr, int port,
     return _redisContextConnectTcp(c, addr, port, timeout, source_addr);
 }
 
+/* Connect to an address that was resolved by the caller. */
+int redisContextConnectAddr(redisContext *c, const struct sockaddr *sa,
+                            socklen_t salen, const struct timeval *timeout) {
+    struct addrinfo ai;
+
+    memset(&ai,0,sizeof(ai));
+    ai.ai_family = sa->sa_family;
+    ai.ai_socktype = SOCK_STREAM;
+    ai.ai_addrlen = salen;
+    ai.ai_addr = (struct sockaddr*)sa;
+    return redisContextConnectList(c,&ai,timeout,NULL);
+}
+
+/* Name resolution for non-blocking contexts.
+ *
+ * getaddrinfo(3) blocks, so it is executed on a detached thread together with
+ * the connection race over the resolved addresses. While this is in progress,
+ * the context fd is the read end of a pipe. The thread closes the write end
+ * when it is done, which makes the fd readable. The owner of the context then
+ * calls redisContextConnectResolved(), which moves the connected socket to
+ * the same fd number so that event library registrations remain valid. When
+ * the context drops the job first, it closes the write end of a second pipe,
+ * which makes the thread give up on connecting. */
+struct redisResolveJob {
+    pthread_mutex_t lock;
+    int refcount; /* Context and thread */
+    int done;
+    int notify; /* Write end of the pipe */
+    int cancel[2]; /* Pipe the context closes when it drops the job */
+    char *addr;
+    char *source_addr;
+    int port;
+    struct addrinfo *servinfo; /* Cached addresses, NULL to resolve addr */
+    redisSocketOptions sockopts;
+    struct timeval timeout; /* Of the connection race */
+    int hastimeout;
+    int fd; /* Connected socket */
+    int fastopen; /* TCP Fast Open is enabled on the socket */
+    int err;
+    char errstr[128];
+};
+
+static void redisResolveJobDecr(struct redisResolveJob *job) {
+    int refcount;
+
+    pthread_mutex_lock(&job->lock);
+    refcount = --job->refcount;
+    pthread_mutex_unlock(&job->lock);
+    if (refcount > 0)
+        return;
+
+    if (job->fd >= 0)
+        close(job->fd);
+    if (job->notify >= 0)
+        close(job->notify);
+    if (job->cancel[0] >= 0)
+        close(job->cancel[0]);
+    if (job->cancel[1] >= 0)
+        close(job->cancel[1]);
+    pthread_mutex_destroy(&job->lock);
+    free(job->servinfo);
+    free(job->addr);
+    free(job->source_addr);
+    free(job);
+}
+
+static void *redisResolveThread(void *arg) {
+    struct redisResolveJob *job = arg;
+    struct addrinfo *servinfo;
+    struct timeval timeout;
+    redisContext c;
+    int rv, notify, hastimeout;
+
+    /* Scratch context for error reporting; the socket is left non-blocking. */
+    memset(&c,0,sizeof(c));
+    c.fd = -1;
+    c.sockopts = job->sockopts;
+    servinfo = job->servinfo;
+    job->servinfo = NULL;
+    if (servinfo == NULL && (rv = redisResolveTcp(job->addr,job->port,&servinfo)) != 0) {
+        __redisSetError(&c,REDIS_ERR_OTHER,gai_strerror(rv));
+    } else {
+        /* The timeout can be set while the name is resolved. */
+        pthread_mutex_lock(&job->lock);
+        timeout = job->timeout;
+        hastimeout = job->hastimeout;
+        pthread_mutex_unlock(&job->lock);
+        redisContextConnectRace(&c,servinfo,hastimeout ? &timeout : NULL,
+                                job->source_addr,job->cancel[0]);
+        free(servinfo);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->err = c.err;
+    memcpy(job->errstr,c.errstr,sizeof(job->errstr));
+    if (c.err == 0) {
+        job->fd = c.fd;
+        job->fastopen = (c.flags & REDIS_FASTOPEN) != 0;
+    } else if (c.fd >= 0) {
+        close(c.fd);
+    }
+    job->done = 1;
+    notify = job->notify;
+    job->notify = -1;
+    pthread_mutex_unlock(&job->lock);
+
+    /* EOF on the read end wakes up the event loop. */
+    close(notify);
+    redisResolveJobDecr(job);
+    return NULL;
+}
+
+static int redisIsNumericHost(const char *addr) {
+    struct in6_addr buf;
+    return inet_pton(AF_INET,addr,&buf) == 1 ||
+           inet_pton(AF_INET6,addr,&buf) == 1;
+}
+
+/* Connect a non-blocking context to addr:port without blocking on name
+ * resolution. Returns NULL when the connection was started right away,
+ * either because addr is numeric or cached with a single address, or
+ * because a resolver thread could not be started; check c->err in that
+ * case. Otherwise, returns the pending job and c->fd becomes readable when
+ * the connection race is done. Cached lists of several addresses are raced
+ * on the thread as well, which then skips the lookup. */
+struct redisResolveJob *redisContextResolveTcp(redisContext *c, const char *addr,
+                                               int port, const char *source_addr) {
+    struct redisResolveJob *job;
+    struct addrinfo *servinfo = NULL;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int fds[2];
+
+    if (redisIsNumericHost(addr))
+        goto sync;
+    if ((servinfo = redisResolveCacheLookup(addr,port)) != NULL &&
+        servinfo->ai_next == NULL)
+    {
+        redisContextConnectList(c,servinfo,NULL,source_addr);
+        free(servinfo);
+        return NULL;
+    }
+    if ((job = calloc(1,sizeof(*job))) == NULL)
+        goto sync;
+    if (pipe(job->cancel) == -1) {
+        free(job);
+        goto sync;
+    }
+    if (pipe(fds) == -1) {
+        close(job->cancel[0]);
+        close(job->cancel[1]);
+        free(job);
+        goto sync;
+    }
+
+    pthread_mutex_init(&job->lock,NULL);
+    job->refcount = 2;
+    job->notify = fds[1];
+    job->fd = -1;
+    job->addr = strdup(addr);
+    job->source_addr = source_addr ? strdup(source_addr) : NULL;
+    job->port = port;
+    job->servinfo = servinfo;
+    servinfo = NULL;
+    job->sockopts = c->sockopts;
+
+    c->fd = fds[0];
+    if (redisSetBlocking(c,0) != REDIS_OK ||
+        job->addr == NULL || (source_addr && job->source_addr == NULL))
+        goto error;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread,&attr,redisResolveThread,job) != 0) {
+        pthread_attr_destroy(&attr);
+        goto error;
+    }
+    pthread_attr_destroy(&attr);
+    return job;
+
+error:
+    redisContextCloseFd(c);
+    job->refcount = 1;
+    redisResolveJobDecr(job);
+    if (c->err)
+        return NULL;
+sync:
+    free(servinfo);
+    _redisContextConnectTcp(c,addr,port,NULL,source_addr);
+    return NULL;
+}
+
+/* Returns non-zero when the resolver thread has finished. */
+int redisResolveJobDone(struct redisResolveJob *job) {
+    int done;
+
+    pthread_mutex_lock(&job->lock);
+    done = job->done;
+    pthread_mutex_unlock(&job->lock);
+    return done;
+}
+
+/* Bound the time the resolver thread spends connecting, once the name is
+ * resolved. */
+void redisResolveJobSetTimeout(struct redisResolveJob *job, const struct timeval *tv) {
+    pthread_mutex_lock(&job->lock);
+    job->timeout = *tv;
+    job->hastimeout = 1;
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Drop the context's reference to the job, and stop the thread from
+ * connecting when it is still at it. */
+void redisResolveJobRelease(struct redisResolveJob *job) {
+    pthread_mutex_lock(&job->lock);
+    close(job->cancel[1]);
+    job->cancel[1] = -1;
+    pthread_mutex_unlock(&job->lock);
+    redisResolveJobDecr(job);
+}
+
+/* Take over the connected socket. It replaces the pipe that signalled
+ * completion, keeping the same fd number. */
+int redisContextConnectResolved(redisContext *c, struct redisResolveJob *job) {
+    if (job->err != 0) {
+        __redisSetError(c,job->err,job->errstr);
+        return REDIS_ERR;
+    }
+
+    if (dup2(job->fd,c->fd) == -1) {
+        __redisSetErrorFromErrno(c,REDIS_ERR_IO,"dup2(2)");
+        return REDIS_ERR;
+    }
+    close(job->fd);
+    job->fd = -1;
+    c->flags &= ~REDIS_FASTOPEN;
+    if (job->fastopen)
+        c->flags |= REDIS_FASTOPEN;
+    c->flags |= REDIS_CONNECTED;
+    return REDIS_OK;
+}
+
 int redisContextConnectUnix(redisContext *c, const char *path, const struct timeval *timeout) {
     int blocking = (c->flags & REDIS_BLOCK);
     struct sockaddr_un sa;
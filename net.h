@@ -33,6 +33,8 @@
 #ifndef __NET_H
 #define __NET_H
 
+#include <sys/socket.h>
+#include <netdb.h>
 #include "hiredis.h"
 
 #if defined(__sun)
@@ -46,6 +48,15 @@ int redisContextConnectBindTcp(redisContext *c, const char *addr, int port,
                                const struct timeval *timeout,
                                const char *source_addr);
 int redisContextConnectUnix(redisContext *c, const char *path, const struct timeval *timeout);
+int redisContextConnectAddr(redisContext *c, const struct sockaddr *sa,
+                            socklen_t salen, const struct timeval *timeout);
+struct redisResolveJob *redisContextResolveTcp(redisContext *c, const char *addr,
+                                               int port, const char *source_addr);
+int redisResolveJobDone(struct redisResolveJob *job);
+void redisResolveJobSetTimeout(struct redisResolveJob *job, const struct timeval *tv);
+void redisResolveJobRelease(struct redisResolveJob *job);
+int redisContextConnectResolved(redisContext *c, struct redisResolveJob *job);
 int redisKeepAlive(redisContext *c, int interval);
+int redisResolveCacheAdd(const char *addr, int port, const struct addrinfo *servinfo);
 
 #endif
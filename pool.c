@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include "pool.h"
+#include "sds.h"
+
+/* Forward declaration of function in hiredis.c */
+void __redisCopyError(int *err, char *errstr, int type, const char *str);
+
+static long long __redisPoolUsec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec*1000000)+tv.tv_usec;
+}
+
+static void __redisPoolSetError(redisPool *p, int type, const char *str) {
+    pthread_mutex_lock(&p->lock);
+    if (p->err == 0)
+        __redisCopyError(&p->err,p->errstr,type,str);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Wake up a thread waiting for a connection. The fence pairs with the one in
+ * __redisPoolGet(), so either the waiter sees the change that was just made,
+ * or this function sees the waiter. */
+static void __redisPoolNotify(redisPool *p) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->waiters,__ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/* Reserve room for a new connection. Returns 0 when maxsize is reached. */
+static int __redisPoolReserve(redisPool *p) {
+    int total = __atomic_load_n(&p->total,__ATOMIC_RELAXED);
+    do {
+        if (total >= p->config.maxsize)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&p->total,&total,total+1,0,
+                __ATOMIC_SEQ_CST,__ATOMIC_RELAXED));
+    return 1;
+}
+
+/* Give back the room of a closed connection, but never drop below minsize
+ * when asked to. Returns 0 when the connection should stay open. Waiters
+ * must be notified by the caller. */
+static int __redisPoolRelease(redisPool *p, int keepmin) {
+    int total = __atomic_load_n(&p->total,__ATOMIC_RELAXED);
+    do {
+        if (keepmin && total <= p->config.minsize)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&p->total,&total,total-1,0,
+                __ATOMIC_SEQ_CST,__ATOMIC_RELAXED));
+    return 1;
+}
+
+/* Open a connection after reserving room for it. A connection that failed
+ * is returned with its error set and keeps its room until it is put back. */
+static redisContext *__redisPoolConnect(redisPool *p) {
+    redisPoolConfig *cfg = &p->config;
+    int hastimeout = cfg->timeout.tv_sec || cfg->timeout.tv_usec;
+    redisContext *c;
+
+    if (cfg->path != NULL) {
+        if (hastimeout)
+            c = redisConnectUnixWithTimeout(cfg->path,cfg->timeout);
+        else
+            c = redisConnectUnix(cfg->path);
+    } else {
+        c = redisConnectWithOptions(cfg->ip,cfg->port,
+                hastimeout ? &cfg->timeout : NULL,&cfg->sockopts);
+    }
+
+    if (c == NULL) {
+        __redisPoolRelease(p,0);
+        __redisPoolNotify(p);
+    }
+    return c;
+}
+
+/* The oldest connections are at the bottom of the stack. Move up to
+ * REDIS_POOL_SHARDS of them that have been idle too long to evict[], keeping
+ * the top "keep" connections. Must be called with the lock of the shard
+ * held. Returns the number of connections that were moved. */
+static int __redisPoolEvict(redisPool *p, redisPoolShard *s, long long now,
+                            int keep, redisContext **evict) {
+    long long idle = p->config.idletimeout.tv_sec*1000000LL+p->config.idletimeout.tv_usec;
+    int nevict = 0;
+
+    if (idle <= 0)
+        return 0;
+    while (nevict < REDIS_POOL_SHARDS && s->len > keep &&
+           now-s->idle[0].since >= idle && __redisPoolRelease(p,1))
+    {
+        evict[nevict++] = s->idle[0].c;
+        memmove(s->idle,s->idle+1,sizeof(*s->idle)*(s->len-1));
+        __atomic_store_n(&s->len,s->len-1,__ATOMIC_RELAXED);
+    }
+    return nevict;
+}
+
+/* An idle connection has nothing to read, so data or EOF means that the
+ * server closed it, or that it is out of sync. */
+static int __redisPoolAlive(redisContext *c) {
+    char buf;
+    ssize_t n = recv(c->fd,&buf,1,MSG_PEEK|MSG_DONTWAIT);
+    return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Connections are pushed on the shard where the next lookup starts, so that
+ * a single thread keeps reusing the same connections. */
+static void __redisPoolPush(redisPool *p, redisContext *c) {
+    unsigned int idx = __atomic_load_n(&p->next,__ATOMIC_RELAXED);
+    redisPoolShard *s = &p->shard[idx % REDIS_POOL_SHARDS];
+    redisContext *evict[REDIS_POOL_SHARDS];
+    long long now = __redisPoolUsec();
+    int nevict, j;
+
+    pthread_mutex_lock(&s->lock);
+    s->idle[s->len].c = c;
+    s->idle[s->len].since = now;
+    __atomic_store_n(&s->len,s->len+1,__ATOMIC_RELAXED);
+    nevict = __redisPoolEvict(p,s,now,1,evict);
+    pthread_mutex_unlock(&s->lock);
+
+    for (j = 0; j < nevict; j++)
+        redisFree(evict[j]);
+    __redisPoolNotify(p);
+}
+
+/* Take an idle connection. Connections that have been idle too long are
+ * closed on the way, and so is a connection that turns out to be dead. */
+static redisContext *__redisPoolPop(redisPool *p) {
+    unsigned int idx = __atomic_fetch_add(&p->next,1,__ATOMIC_RELAXED);
+    redisContext *evict[REDIS_POOL_SHARDS];
+    long long now = 0;
+    redisPoolShard *s;
+    redisContext *c;
+    int nevict, j, k;
+
+    for (j = 0; j < REDIS_POOL_SHARDS; j++) {
+        s = &p->shard[(idx+j) % REDIS_POOL_SHARDS];
+        if (__atomic_load_n(&s->len,__ATOMIC_RELAXED) == 0)
+            continue;
+        if (now == 0)
+            now = __redisPoolUsec();
+
+        c = NULL;
+        pthread_mutex_lock(&s->lock);
+        nevict = __redisPoolEvict(p,s,now,0,evict);
+        if (s->len > 0) {
+            c = s->idle[s->len-1].c;
+            __atomic_store_n(&s->len,s->len-1,__ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        for (k = 0; k < nevict; k++)
+            redisFree(evict[k]);
+        if (c != NULL && !__redisPoolAlive(c)) {
+            redisFree(c);
+            __redisPoolRelease(p,0);
+            nevict++;
+            c = NULL;
+            j--; /* The shard can have more connections. */
+        }
+        if (nevict > 0)
+            __redisPoolNotify(p);
+        if (c != NULL)
+            return c;
+    }
+    return NULL;
+}
+
+typedef struct redisPoolWarmup {
+    redisPool *p;
+    int next; /* Connections that were started */
+} redisPoolWarmup;
+
+static void *__redisPoolWarmupThread(void *arg) {
+    redisPoolWarmup *w = arg;
+    redisPool *p = w->p;
+    redisContext *c;
+
+    while (__atomic_fetch_add(&w->next,1,__ATOMIC_RELAXED) < p->config.minsize) {
+        c = __redisPoolConnect(p);
+        if (c == NULL) {
+            __redisPoolSetError(p,REDIS_ERR_OOM,"Out of memory");
+        } else if (c->err) {
+            __redisPoolSetError(p,c->err,c->errstr);
+            redisFree(c);
+            __redisPoolRelease(p,0);
+            __redisPoolNotify(p);
+        } else {
+            __redisPoolPush(p,c);
+        }
+    }
+    return NULL;
+}
+
+/* Open minsize connections, using a few threads to not wait for every
+ * connection to be established in turn. */
+static void __redisPoolWarmup(redisPool *p) {
+    pthread_t threads[REDIS_POOL_WARMUP_THREADS];
+    redisPoolWarmup w;
+    int nthreads, j;
+
+    w.p = p;
+    w.next = 0;
+    p->total = p->config.minsize;
+
+    nthreads = 0;
+    while (nthreads < REDIS_POOL_WARMUP_THREADS && nthreads+1 < p->config.minsize) {
+        if (pthread_create(&threads[nthreads],NULL,__redisPoolWarmupThread,&w) != 0)
+            break;
+        nthreads++;
+    }
+
+    /* The calling thread helps, and finishes when no thread was created. */
+    __redisPoolWarmupThread(&w);
+    for (j = 0; j < nthreads; j++)
+        pthread_join(threads[j],NULL);
+}
+
+/* Create a pool and open minsize connections. When some of them cannot be
+ * opened, the error of the first one is set on the pool. Returns NULL when
+ * out of memory or when the sizes are invalid. */
+redisPool *redisPoolCreate(const redisPoolConfig *config) {
+    redisPool *p;
+    int j;
+
+    if (config->maxsize <= 0 || config->minsize < 0 ||
+        config->minsize > config->maxsize)
+        return NULL;
+
+    p = calloc(1,sizeof(*p));
+    if (p == NULL)
+        return NULL;
+
+    p->config = *config;
+    p->config.ip = p->config.path = NULL;
+    if (config->path != NULL) {
+        if ((p->config.path = strdup(config->path)) == NULL)
+            goto oom;
+    } else if (config->ip != NULL) {
+        if ((p->config.ip = strdup(config->ip)) == NULL)
+            goto oom;
+    }
+
+    for (j = 0; j < REDIS_POOL_SHARDS; j++) {
+        p->shard[j].idle = malloc(sizeof(redisPoolEntry)*config->maxsize);
+        if (p->shard[j].idle == NULL)
+            goto oom;
+        pthread_mutex_init(&p->shard[j].lock,NULL);
+    }
+    pthread_mutex_init(&p->lock,NULL);
+    pthread_cond_init(&p->cond,NULL);
+
+    __redisPoolWarmup(p);
+    return p;
+
+oom:
+    for (j = 0; j < REDIS_POOL_SHARDS; j++) {
+        if (p->shard[j].idle == NULL)
+            break;
+        free(p->shard[j].idle);
+        pthread_mutex_destroy(&p->shard[j].lock);
+    }
+    free((char*)p->config.ip);
+    free((char*)p->config.path);
+    free(p);
+    return NULL;
+}
+
+/* Check out a connection. An idle connection is used when there is one,
+ * otherwise a new one is opened when there is room for it. Otherwise, this
+ * waits until a connection is returned or the deadline passes (-1 means no
+ * deadline). */
+static redisContext *__redisPoolGet(redisPool *p, long long deadline) {
+    struct timespec ts;
+    redisContext *c;
+    int reserved, rv;
+
+    for (;;) {
+        if ((c = __redisPoolPop(p)) != NULL)
+            return c;
+        if (__redisPoolReserve(p))
+            return __redisPoolConnect(p);
+
+        /* Look again after registering as a waiter, so that a connection
+         * returned in the meantime cannot be missed. */
+        pthread_mutex_lock(&p->lock);
+        __atomic_add_fetch(&p->waiters,1,__ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        c = __redisPoolPop(p);
+        reserved = (c == NULL) ? __redisPoolReserve(p) : 0;
+        rv = 0;
+        if (c == NULL && !reserved) {
+            if (deadline == -1) {
+                rv = pthread_cond_wait(&p->cond,&p->lock);
+            } else {
+                ts.tv_sec = deadline/1000000;
+                ts.tv_nsec = (deadline%1000000)*1000;
+                rv = pthread_cond_timedwait(&p->cond,&p->lock,&ts);
+            }
+        }
+        __atomic_sub_fetch(&p->waiters,1,__ATOMIC_RELAXED);
+        pthread_mutex_unlock(&p->lock);
+
+        if (c != NULL)
+            return c;
+        if (reserved)
+            return __redisPoolConnect(p);
+        if (rv == ETIMEDOUT)
+            return __redisPoolPop(p);
+    }
+}
+
+/* Check out a connection, waiting for as long as it takes when maxsize
+ * connections are in use. When a new connection could not be opened, it is
+ * returned with its error set, and should be put back like any other. */
+redisContext *redisPoolGet(redisPool *p) {
+    return __redisPoolGet(p,-1);
+}
+
+/* Like redisPoolGet(), but returns NULL when no connection became available
+ * within the timeout. */
+redisContext *redisPoolGetWithTimeout(redisPool *p, const struct timeval tv) {
+    return __redisPoolGet(p,__redisPoolUsec()+tv.tv_sec*1000000LL+tv.tv_usec);
+}
+
+/* Return a connection to the pool. It is closed instead when its error is
+ * set, or when it has unsent commands or unread replies in its buffers, and
+ * a new connection will be opened on demand to replace it. */
+void redisPoolPut(redisPool *p, redisContext *c) {
+    if (c->err || sdslen(c->obuf) > 0 || c->reader->pos < c->reader->len) {
+        redisFree(c);
+        __redisPoolRelease(p,0);
+        __redisPoolNotify(p);
+        return;
+    }
+    __redisPoolPush(p,c);
+}
+
+/* Close all connections and free the pool. Every connection that was
+ * checked out must have been returned. */
+void redisPoolFree(redisPool *p) {
+    redisPoolShard *s;
+    int j, k;
+
+    for (j = 0; j < REDIS_POOL_SHARDS; j++) {
+        s = &p->shard[j];
+        for (k = 0; k < s->len; k++)
+            redisFree(s->idle[k].c);
+        free(s->idle);
+        pthread_mutex_destroy(&s->lock);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free((char*)p->config.ip);
+    free((char*)p->config.path);
+    free(p);
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HIREDIS_POOL_H
+#define __HIREDIS_POOL_H
+#include <pthread.h>
+#include "hiredis.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Idle connections are spread over this many independently locked lists.
+ * Every checkout starts at the next list, so threads rarely contend. */
+#define REDIS_POOL_SHARDS 8
+
+/* Maximum number of threads that open connections when creating a pool. */
+#define REDIS_POOL_WARMUP_THREADS 8
+
+typedef struct redisPoolConfig {
+    const char *ip; /* Host to connect to over TCP */
+    int port;
+    const char *path; /* Unix socket to connect to instead, or NULL */
+    struct timeval timeout; /* Connect timeout, zero for none */
+    redisSocketOptions sockopts; /* Applied to TCP connections */
+    int minsize; /* Connections opened on creation and kept open */
+    int maxsize; /* Upper bound on open connections */
+    struct timeval idletimeout; /* Close connections above minsize that were
+                                 * idle this long, zero to never close them */
+} redisPoolConfig;
+
+typedef struct redisPoolEntry {
+    redisContext *c;
+    long long since; /* Time it was returned, in microseconds */
+} redisPoolEntry;
+
+typedef struct redisPoolShard {
+    pthread_mutex_t lock;
+    redisPoolEntry *idle; /* Stack of maxsize entries, newest on top */
+    int len;
+} redisPoolShard;
+
+/* Pool of blocking connections that can be shared by threads */
+typedef struct redisPool {
+    int err; /* Error flags of the first failed connection on creation */
+    char errstr[128]; /* String representation of error when applicable */
+
+    redisPoolConfig config;
+    redisPoolShard shard[REDIS_POOL_SHARDS];
+    int total; /* Open connections, including checked out and connecting */
+    unsigned int next; /* Shard where the next lookup starts */
+
+    /* Threads wait here when maxsize connections are checked out. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int waiters;
+} redisPool;
+
+redisPool *redisPoolCreate(const redisPoolConfig *config);
+redisContext *redisPoolGet(redisPool *p);
+redisContext *redisPoolGetWithTimeout(redisPool *p, const struct timeval tv);
+void redisPoolPut(redisPool *p, redisContext *c);
+void redisPoolFree(redisPool *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
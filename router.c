@@ -0,0 +1,653 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/time.h>
+#include "router.h"
+
+/* Forward declaration of functions in hiredis.c */
+void __redisCopyError(int *err, char *errstr, int type, const char *str);
+int __redisSplitAddress(const char *addr, size_t len, const char **host, size_t *hostlen, int *port);
+
+/* Forward declaration of function in async.c */
+redisAsyncContext *__redisAsyncOpen(const char *ip, int port, const struct timeval *timeout,
+                                    int (*attach)(redisAsyncContext *, void *), void *data,
+                                    int *err, char *errstr);
+
+/* Commands that only read data. They are sent to a replica. Commands that
+ * keep a cursor or state on the server, like SCAN and MULTI, are not in
+ * here, since the next command may go to another replica. Sorted ignoring
+ * case, so it can be searched with bsearch(). */
+static const char * const readOnlyCommands[] = {
+    "BITCOUNT", "BITFIELD_RO", "BITPOS", "DBSIZE", "DUMP", "EVAL_RO",
+    "EVALSHA_RO", "EXISTS", "EXPIRETIME", "GEODIST", "GEOHASH", "GEOPOS",
+    "GEORADIUS_RO", "GEORADIUSBYMEMBER_RO", "GEOSEARCH", "GET", "GETBIT",
+    "GETRANGE", "HEXISTS", "HGET", "HGETALL", "HKEYS", "HLEN", "HMGET",
+    "HRANDFIELD", "HSTRLEN", "HVALS", "KEYS", "LCS", "LINDEX", "LLEN", "LPOS",
+    "LRANGE", "MGET", "PEXPIRETIME", "PTTL", "SCARD", "SDIFF", "SINTER",
+    "SINTERCARD", "SISMEMBER", "SMEMBERS", "SMISMEMBER", "SORT_RO",
+    "SRANDMEMBER", "STRLEN", "SUBSTR", "SUNION", "TTL", "TYPE", "XLEN",
+    "XPENDING", "XRANGE", "XREVRANGE", "ZCARD", "ZCOUNT", "ZDIFF", "ZINTER",
+    "ZINTERCARD", "ZLEXCOUNT", "ZMSCORE", "ZRANDMEMBER", "ZRANGE",
+    "ZRANGEBYLEX", "ZRANGEBYSCORE", "ZRANK", "ZREVRANGE", "ZREVRANGEBYLEX",
+    "ZREVRANGEBYSCORE", "ZREVRANK", "ZSCORE", "ZUNION"
+};
+
+typedef struct redisRouterName {
+    const char *str;
+    size_t len;
+} redisRouterName;
+
+static int __redisRouterNameCompare(const void *key, const void *elem) {
+    const redisRouterName *name = key;
+    const char *cmd = *(const char * const *)elem;
+    size_t len = strlen(cmd);
+    int cmp;
+
+    cmp = strncasecmp(name->str,cmd,name->len < len ? name->len : len);
+    if (cmp != 0)
+        return cmp;
+    return name->len < len ? -1 : (name->len > len);
+}
+
+/* Find the name of a formatted command, which is its first bulk argument. */
+static int __redisRouterCommandName(const char *cmd, size_t len, redisRouterName *name) {
+    const char *end = cmd+len, *p;
+    size_t n = 0;
+
+    if ((p = memchr(cmd,'\n',len)) == NULL || ++p >= end || *p != '$')
+        return REDIS_ERR;
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+        n = n*10+(*p-'0');
+    if (end-p < 2 || (size_t)(end-p-2) < n)
+        return REDIS_ERR;
+    name->str = p+2;
+    name->len = n;
+    return REDIS_OK;
+}
+
+static int __redisRouterNameIs(const redisRouterName *name, const char *str) {
+    return name->len == strlen(str) && strncasecmp(name->str,str,name->len) == 0;
+}
+
+/* Returns 1 when a command only reads data. */
+static int __redisRouterReadOnly(const redisRouterName *name) {
+    return bsearch(name,readOnlyCommands,sizeof(readOnlyCommands)/sizeof(readOnlyCommands[0]),
+                   sizeof(readOnlyCommands[0]),__redisRouterNameCompare) != NULL;
+}
+
+/* The commands that may be sent to a replica, sorted ignoring case. */
+const char * const *redisRouterReadOnlyCommands(size_t *count) {
+    *count = sizeof(readOnlyCommands)/sizeof(readOnlyCommands[0]);
+    return readOnlyCommands;
+}
+
+static long long __redisRouterUsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ((long long)ts.tv_sec*1000000)+ts.tv_nsec/1000;
+}
+
+static void __redisRouterSetError(redisRouter *rt, int type, const char *str) {
+    __redisCopyError(&rt->err,rt->errstr,type,str);
+}
+
+static redisRouterConn *__redisRouterNewConn(redisRouter *rt, const char *addr, size_t len) {
+    redisRouterConn *conn;
+    const char *host;
+    size_t hostlen;
+    int port;
+
+    if (__redisSplitAddress(addr,len,&host,&hostlen,&port) != REDIS_OK) {
+        __redisRouterSetError(rt,REDIS_ERR_OTHER,"Invalid server address");
+        return NULL;
+    }
+
+    conn = calloc(1,sizeof(*conn));
+    if (conn == NULL || (conn->host = malloc(hostlen+1)) == NULL) {
+        free(conn);
+        __redisRouterSetError(rt,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    memcpy(conn->host,host,hostlen);
+    conn->host[hostlen] = '\0';
+    conn->port = port;
+    return conn;
+}
+
+/* Add the replicas of a comma separated list of host:port addresses. */
+static int __redisRouterAddReplicas(redisRouter *rt, const char *addrs) {
+    const char *p = addrs, *end;
+    redisRouterConn **replicas, *conn;
+
+    while (*p != '\0') {
+        end = strchr(p,',');
+        if (end == NULL) end = p+strlen(p);
+        replicas = realloc(rt->replicas,sizeof(*replicas)*(rt->nreplicas+1));
+        if (replicas == NULL) {
+            __redisRouterSetError(rt,REDIS_ERR_OOM,"Out of memory");
+            return REDIS_ERR;
+        }
+        rt->replicas = replicas;
+        if ((conn = __redisRouterNewConn(rt,p,end-p)) == NULL)
+            return REDIS_ERR;
+        rt->replicas[rt->nreplicas++] = conn;
+        p = (*end == ',') ? end+1 : end;
+    }
+    return REDIS_OK;
+}
+
+static void __redisRouterConnected(const redisAsyncContext *ac, int status) {
+    redisRouterConn *conn = ac->data;
+    if (conn == NULL)
+        return;
+    conn->up = (status == REDIS_OK);
+    if (status != REDIS_OK)
+        conn->ac = NULL;
+}
+
+static void __redisRouterDisconnected(const redisAsyncContext *ac, int status) {
+    redisRouterConn *conn = ac->data;
+    ((void)status);
+    if (conn != NULL) {
+        conn->up = 0;
+        conn->ac = NULL;
+    }
+}
+
+static void __redisRouterReconnected(const redisAsyncContext *ac, int status) {
+    redisRouterConn *conn = ac->data;
+    if (conn != NULL)
+        conn->up = (status == REDIS_OK);
+}
+
+/* Open the connection to a server. It reconnects on its own when the event
+ * library supports timers, and is opened again by the next command that
+ * needs it otherwise. */
+static redisAsyncContext *__redisRouterConnect(redisRouter *rt, redisRouterConn *conn) {
+    redisReconnectOptions opts;
+    redisAsyncContext *ac;
+
+    if (conn->ac != NULL)
+        return conn->ac;
+
+    ac = __redisAsyncOpen(conn->host,conn->port,NULL,rt->attach,rt->attachdata,&rt->err,rt->errstr);
+    if (ac == NULL)
+        return NULL;
+
+    memset(&opts,0,sizeof(opts));
+    opts.delay.tv_usec = REDIS_ROUTER_RECONNECT_DELAY*1000;
+    opts.maxdelay.tv_sec = REDIS_ROUTER_RECONNECT_MAXDELAY/1000;
+    opts.replay = REDIS_REPLAY_UNSENT;
+    redisAsyncSetReconnect(ac,&opts,__redisRouterReconnected);
+
+    ac->data = conn;
+    redisAsyncSetConnectCallback(ac,__redisRouterConnected);
+    redisAsyncSetDisconnectCallback(ac,__redisRouterDisconnected);
+    conn->ac = ac;
+    return ac;
+}
+
+/* Connect to a primary at a host:port address, and to its replicas at a
+ * comma separated list of addresses, which may be empty. The connections are
+ * attached to the event library with the attach function. */
+redisRouter *redisRouterConnect(const char *primary, const char *replicas, redisRouterAttachFn *attach, void *data) {
+    redisRouter *rt;
+    int i;
+
+    rt = calloc(1,sizeof(*rt));
+    if (rt == NULL)
+        return NULL;
+
+    rt->attach = attach;
+    rt->attachdata = data;
+    if ((rt->primary = __redisRouterNewConn(rt,primary,strlen(primary))) == NULL ||
+        (replicas != NULL && __redisRouterAddReplicas(rt,replicas) != REDIS_OK))
+        return rt;
+
+    __redisRouterConnect(rt,rt->primary);
+    for (i = 0; i < rt->nreplicas; i++)
+        __redisRouterConnect(rt,rt->replicas[i]);
+    return rt;
+}
+
+/* Replica for a read. The cost of a replica is its average reply time,
+ * times the number of commands it would have to answer first, so a fast
+ * replica is preferred until it builds up a queue. Replicas without a reply
+ * time yet are taken to be as fast as the fastest one. Returns NULL when no
+ * replica is up, and the read goes to the primary. */
+static redisRouterConn *__redisRouterPickReplica(redisRouter *rt) {
+    redisRouterConn *conn, *best = NULL;
+    unsigned long long cost, bestcost = 0;
+    long long minrtt = 0;
+    int i;
+
+    for (i = 0; i < rt->nreplicas; i++) {
+        conn = rt->replicas[i];
+        if (!conn->up) {
+            /* Lost for good, try again. */
+            if (conn->ac == NULL)
+                __redisRouterConnect(rt,conn);
+        } else if (conn->rtt > 0 && (minrtt == 0 || conn->rtt < minrtt)) {
+            minrtt = conn->rtt;
+        }
+    }
+    if (minrtt == 0)
+        minrtt = 1;
+
+    for (i = 0; i < rt->nreplicas; i++) {
+        conn = rt->replicas[i];
+        if (!conn->up)
+            continue;
+        cost = (unsigned long long)(conn->rtt > 0 ? conn->rtt : minrtt)*(conn->outstanding+1);
+        if (best == NULL || cost < bestcost) {
+            best = conn;
+            bestcost = cost;
+        }
+    }
+    return best;
+}
+
+/* Reply time histogram. Times below 4 microseconds have a bucket each,
+ * after that every power of two is split in four buckets. */
+static int __redisRouterBucket(long long usec) {
+    int bits = 2, i;
+
+    if (usec < 4)
+        return usec < 0 ? 0 : (int)usec;
+    while (bits < 62 && (usec >> (bits+1)) != 0)
+        bits++;
+    i = (bits-1)*4+(int)((usec >> (bits-2)) & 3);
+    return i < REDIS_ROUTER_HISTOGRAM_SIZE ? i : REDIS_ROUTER_HISTOGRAM_SIZE-1;
+}
+
+/* Largest reply time that falls in a bucket. */
+static long long __redisRouterBucketMax(int i) {
+    int bits = i/4+1;
+
+    if (i < 4)
+        return i;
+    return ((long long)(4+i%4+1) << (bits-2))-1;
+}
+
+static void __redisRouterHistogramAdd(redisRouterConn *conn, long long usec) {
+    int i;
+
+    if (conn->samples == REDIS_ROUTER_HISTOGRAM_WINDOW) {
+        conn->samples = 0;
+        for (i = 0; i < REDIS_ROUTER_HISTOGRAM_SIZE; i++) {
+            conn->histogram[i] /= 2;
+            conn->samples += conn->histogram[i];
+        }
+    }
+    conn->histogram[__redisRouterBucket(usec)]++;
+    conn->samples++;
+    conn->fresh++;
+}
+
+/* Delay before a read that was sent to a replica is sent again. The
+ * percentile is computed again after every 64 reply times. */
+static long long __redisRouterHedgeDelay(redisRouter *rt, redisRouterConn *conn) {
+    long long mindelay, maxdelay, delay;
+    unsigned int target, seen = 0;
+    int i;
+
+    mindelay = (long long)rt->hedge.mindelay.tv_sec*1000000+rt->hedge.mindelay.tv_usec;
+    maxdelay = (long long)rt->hedge.maxdelay.tv_sec*1000000+rt->hedge.maxdelay.tv_usec;
+    if (conn->samples < REDIS_ROUTER_HEDGE_MINSAMPLES)
+        return maxdelay;
+
+    if (conn->percentile == 0 || conn->fresh >= 64) {
+        target = (unsigned int)(conn->samples*rt->hedge.percentile/100);
+        for (i = 0; i < REDIS_ROUTER_HISTOGRAM_SIZE-1; i++) {
+            seen += conn->histogram[i];
+            if (seen > target)
+                break;
+        }
+        conn->percentile = __redisRouterBucketMax(i)+1;
+        conn->fresh = 0;
+    }
+
+    delay = conn->percentile;
+    if (delay < mindelay)
+        delay = mindelay;
+    if (delay > maxdelay)
+        delay = maxdelay;
+    return delay;
+}
+
+/* Send reads that take longer than the given percentile of the reply times
+ * of their replica to a second replica as well. Passing NULL options disables
+ * it. */
+int redisRouterSetHedging(redisRouter *rt, const redisHedgeOptions *opts) {
+    int i;
+
+    if (opts == NULL) {
+        rt->hedging = 0;
+        return REDIS_OK;
+    }
+    if (opts->percentile <= 0 || opts->percentile >= 100 ||
+        opts->mindelay.tv_sec < 0 || opts->mindelay.tv_usec < 0 ||
+        opts->maxdelay.tv_sec < 0 || opts->maxdelay.tv_usec < 0 ||
+        opts->mindelay.tv_usec >= 1000000 || opts->maxdelay.tv_usec >= 1000000)
+        return REDIS_ERR;
+
+    rt->hedging = 1;
+    rt->hedge = *opts;
+    for (i = 0; i < rt->nreplicas; i++)
+        rt->replicas[i]->percentile = 0;
+    return REDIS_OK;
+}
+
+/* A read that may be sent to a second replica. The first reply is passed
+ * on, and the other one is dropped. A copy that fails waits for the other
+ * one, or is sent again right away when there is none yet. */
+typedef struct redisRouterHedge {
+    redisRouter *rt;
+    redisCallbackFn *fn;
+    void *privdata;
+    char *cmd;
+    size_t len;
+    redisRouterConn *first; /* Replica that got the read first */
+    redisAsyncContext *timerac; /* Connection of the timer */
+    redisAsyncTimer *timer; /* Until the read is sent again, or NULL */
+    int pending; /* Copies waiting for their reply */
+    int hedged; /* Sent to a second replica */
+    int done; /* Reply passed on */
+} redisRouterHedge;
+
+typedef struct redisRouterRequest {
+    redisCallbackFn *fn;
+    void *privdata;
+    long long start;
+    redisRouterHedge *hedge; /* The read this is a copy of, or NULL */
+} redisRouterRequest;
+
+static void __redisRouterReply(redisAsyncContext *ac, void *r, void *privdata);
+
+static int __redisRouterSend(redisRouter *rt, redisRouterConn *conn, redisCallbackFn *fn, void *privdata,
+                             redisRouterHedge *h, const char *cmd, size_t len) {
+    redisRouterRequest *req;
+    redisAsyncContext *ac;
+
+    if ((ac = __redisRouterConnect(rt,conn)) == NULL)
+        return REDIS_ERR;
+    if ((req = malloc(sizeof(*req))) == NULL) {
+        __redisRouterSetError(rt,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    req->fn = fn;
+    req->privdata = privdata;
+    req->start = __redisRouterUsec();
+    req->hedge = h;
+    if (redisAsyncFormattedCommand(ac,__redisRouterReply,req,cmd,len) != REDIS_OK) {
+        free(req);
+        __redisRouterSetError(rt,REDIS_ERR_OTHER,"Cannot send the command");
+        return REDIS_ERR;
+    }
+    conn->outstanding++;
+    if (h != NULL)
+        h->pending++;
+    return REDIS_OK;
+}
+
+static void __redisRouterFreeHedge(redisRouterHedge *h) {
+    free(h->cmd);
+    free(h);
+}
+
+/* Send a read to the best replica other than the first one. */
+static int __redisRouterHedge(redisRouterHedge *h) {
+    redisRouterConn *conn;
+    int up = h->first->up, status;
+
+    h->first->up = 0;
+    conn = __redisRouterPickReplica(h->rt);
+    h->first->up = up;
+    if (conn == NULL)
+        return REDIS_ERR;
+
+    status = __redisRouterSend(h->rt,conn,NULL,NULL,h,h->cmd,h->len);
+    if (status == REDIS_OK) {
+        h->hedged = 1;
+        h->rt->hedges++;
+    }
+    return status;
+}
+
+static void __redisRouterHedgeTimer(redisAsyncContext *ac, void *privdata) {
+    redisRouterHedge *h = privdata;
+    ((void)ac);
+
+    h->timer = NULL;
+    if (!h->done && !h->hedged)
+        __redisRouterHedge(h);
+}
+
+static void __redisRouterHedgeReply(redisAsyncContext *ac, void *r, redisRouterHedge *h, redisRouterConn *conn) {
+    h->pending--;
+    if (h->timer != NULL) {
+        redisAsyncCancelTimer(h->timerac,h->timer);
+        h->timer = NULL;
+    }
+
+    if (!h->done) {
+        /* A NULL reply with a live router means the copy failed. */
+        if (r == NULL && conn != NULL && !h->hedged && __redisRouterHedge(h) == REDIS_OK) {
+            /* Wait for the second replica. */
+        } else if (r != NULL || h->pending == 0) {
+            h->done = 1;
+            if (r != NULL && conn != NULL && conn != h->first)
+                h->rt->hedgewins++;
+            /* Freeing the router from the callback drops the other copy,
+             * which must not free the read yet. */
+            h->pending++;
+            if (h->fn != NULL)
+                h->fn(ac,r,h->privdata);
+            h->pending--;
+        }
+    }
+    if (h->pending == 0)
+        __redisRouterFreeHedge(h);
+}
+
+/* Update the reply time of the server before passing on the reply. The
+ * average gives every reply a weight of 1/8, like the TCP round trip time
+ * estimator. */
+static void __redisRouterReply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisRouterRequest *req = privdata;
+    redisRouterConn *conn = ac->data;
+    long long rtt;
+
+    if (conn != NULL) {
+        conn->outstanding--;
+        if (r != NULL) {
+            rtt = __redisRouterUsec()-req->start;
+            if (conn->rtt == 0)
+                conn->rtt = rtt;
+            else
+                conn->rtt += (rtt-conn->rtt)/8;
+            __redisRouterHistogramAdd(conn,rtt);
+        }
+    }
+    if (req->hedge != NULL)
+        __redisRouterHedgeReply(ac,r,req->hedge,conn);
+    else if (req->fn != NULL)
+        req->fn(ac,r,req->privdata);
+    free(req);
+}
+
+/* Send a read to a replica, and set a timer to send it to a second one.
+ * Without timers it is sent once, like any other command. */
+static int __redisRouterHedgedRead(redisRouter *rt, redisRouterConn *conn, redisCallbackFn *fn, void *privdata,
+                                   const char *cmd, size_t len) {
+    redisRouterHedge *h;
+    struct timeval tv;
+    long long delay;
+
+    h = calloc(1,sizeof(*h));
+    if (h == NULL || (h->cmd = malloc(len)) == NULL) {
+        free(h);
+        __redisRouterSetError(rt,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    memcpy(h->cmd,cmd,len);
+    h->len = len;
+    h->rt = rt;
+    h->fn = fn;
+    h->privdata = privdata;
+    h->first = conn;
+
+    if (__redisRouterSend(rt,conn,NULL,NULL,h,cmd,len) != REDIS_OK) {
+        __redisRouterFreeHedge(h);
+        return REDIS_ERR;
+    }
+
+    delay = __redisRouterHedgeDelay(rt,conn);
+    tv.tv_sec = delay/1000000;
+    tv.tv_usec = delay%1000000;
+    h->timerac = conn->ac;
+    h->timer = redisAsyncAddTimer(conn->ac,tv,__redisRouterHedgeTimer,h);
+    return REDIS_OK;
+}
+
+/* Track the transaction state of the primary connection, like async.c does
+ * for a single connection. */
+static void __redisRouterTrackTransaction(redisRouter *rt, const redisRouterName *name) {
+    if (__redisRouterNameIs(name,"MULTI"))
+        rt->flags |= REDIS_IN_MULTI;
+    else if (__redisRouterNameIs(name,"WATCH"))
+        rt->flags |= REDIS_WATCHING;
+    else if (__redisRouterNameIs(name,"UNWATCH"))
+        rt->flags &= ~REDIS_WATCHING;
+    else if (__redisRouterNameIs(name,"EXEC") || __redisRouterNameIs(name,"DISCARD"))
+        rt->flags &= ~(REDIS_IN_MULTI | REDIS_WATCHING);
+}
+
+static int __redisRouterCommand(redisRouter *rt, redisCallbackFn *fn, void *privdata, const char *cmd, size_t len) {
+    redisRouterConn *conn = NULL;
+    redisRouterName name;
+    int pinned;
+
+    rt->err = 0;
+    rt->errstr[0] = '\0';
+    if (__redisRouterCommandName(cmd,len,&name) != REDIS_OK)
+        return __redisRouterSend(rt,rt->primary,fn,privdata,NULL,cmd,len);
+
+    /* The connections are shared by every database, and would not agree on
+     * the selected one after a reconnect. */
+    if (__redisRouterNameIs(&name,"SELECT")) {
+        __redisRouterSetError(rt,REDIS_ERR_OTHER,"SELECT is not supported by the router");
+        return REDIS_ERR;
+    }
+
+    /* Inside a transaction, and between WATCH and EXEC, everything goes to
+     * the primary. The command that ends it goes there too. */
+    pinned = rt->flags & (REDIS_IN_MULTI | REDIS_WATCHING);
+    __redisRouterTrackTransaction(rt,&name);
+    if (!pinned && __redisRouterReadOnly(&name))
+        conn = __redisRouterPickReplica(rt);
+    if (conn == NULL)
+        return __redisRouterSend(rt,rt->primary,fn,privdata,NULL,cmd,len);
+    if (rt->hedging && rt->nreplicas > 1)
+        return __redisRouterHedgedRead(rt,conn,fn,privdata,cmd,len);
+    return __redisRouterSend(rt,conn,fn,privdata,NULL,cmd,len);
+}
+
+int redisvRouterCommand(redisRouter *rt, redisCallbackFn *fn, void *privdata, const char *format, va_list ap) {
+    char *cmd;
+    int len;
+    int status;
+
+    len = redisvFormatCommand(&cmd,format,ap);
+    if (len == -1) {
+        __redisRouterSetError(rt,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    status = __redisRouterCommand(rt,fn,privdata,cmd,len);
+    free(cmd);
+    return status;
+}
+
+int redisRouterCommand(redisRouter *rt, redisCallbackFn *fn, void *privdata, const char *format, ...) {
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = redisvRouterCommand(rt,fn,privdata,format,ap);
+    va_end(ap);
+    return status;
+}
+
+int redisRouterCommandArgv(redisRouter *rt, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen) {
+    char *cmd;
+    int len;
+    int status;
+
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1) {
+        __redisRouterSetError(rt,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    status = __redisRouterCommand(rt,fn,privdata,cmd,len);
+    free(cmd);
+    return status;
+}
+
+static void __redisRouterFreeConn(redisRouterConn *conn) {
+    redisAsyncContext *ac;
+
+    if (conn == NULL)
+        return;
+    if ((ac = conn->ac) != NULL) {
+        ac->data = NULL;
+        redisAsyncFree(ac);
+    }
+    free(conn->host);
+    free(conn);
+}
+
+/* Free the router and its connections. Pending callbacks receive a NULL
+ * reply. This may be called from a callback. */
+void redisRouterFree(redisRouter *rt) {
+    int i;
+
+    if (rt == NULL)
+        return;
+    __redisRouterFreeConn(rt->primary);
+    for (i = 0; i < rt->nreplicas; i++)
+        __redisRouterFreeConn(rt->replicas[i]);
+    free(rt->replicas);
+    free(rt);
+}
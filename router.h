@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HIREDIS_ROUTER_H
+#define __HIREDIS_ROUTER_H
+#include "hiredis.h"
+#include "async.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Delays between attempts to reconnect to a server, in milliseconds */
+#define REDIS_ROUTER_RECONNECT_DELAY 100
+#define REDIS_ROUTER_RECONNECT_MAXDELAY 5000
+
+/* Buckets of the reply time histogram of a connection, which cover up to
+ * about 30 seconds */
+#define REDIS_ROUTER_HISTOGRAM_SIZE 96
+
+/* The histogram is halved when it holds this many reply times, so it keeps
+ * following the recent ones */
+#define REDIS_ROUTER_HISTOGRAM_WINDOW 1024
+
+/* Reply times a replica needs before its percentile is used for hedging */
+#define REDIS_ROUTER_HEDGE_MINSAMPLES 32
+
+typedef struct redisRouterConn {
+    char *host;
+    int port;
+    redisAsyncContext *ac; /* Connection, or NULL */
+    int up; /* Connected, and not waiting to reconnect */
+    long long rtt; /* Moving average of the reply time in microseconds, 0
+                    * before the first reply */
+    unsigned int outstanding; /* Commands waiting for their reply */
+
+    /* Reply times of recent commands, in buckets that get wider as the times
+     * get longer, and the hedging percentile of them. */
+    unsigned int histogram[REDIS_ROUTER_HISTOGRAM_SIZE];
+    unsigned int samples; /* Reply times in the histogram */
+    unsigned int fresh; /* Reply times added since the percentile was
+                         * computed */
+    long long percentile; /* In microseconds, 0 when not computed */
+} redisRouterConn;
+
+/* Hedged reads, see redisRouterSetHedging() */
+typedef struct redisHedgeOptions {
+    double percentile; /* Send a read again when it takes longer than this
+                        * percentile of the reply times of its replica */
+    struct timeval mindelay; /* Bounds of the delay before sending again. */
+    struct timeval maxdelay; /* The upper bound is used until there are
+                              * enough reply times. */
+} redisHedgeOptions;
+
+/* Attaches a connection to the event library, and should return REDIS_OK on
+ * success, like the redisLibeventAttach() family. */
+typedef int (redisRouterAttachFn)(redisAsyncContext *ac, void *data);
+
+/* Sends writes to a primary, and reads to its replicas */
+typedef struct redisRouter {
+    int err; /* Error flags, 0 when there is no error */
+    char errstr[128]; /* String representation of error when applicable */
+
+    redisRouterAttachFn *attach;
+    void *attachdata;
+
+    redisRouterConn *primary;
+    redisRouterConn **replicas;
+    int nreplicas;
+    int flags; /* REDIS_IN_MULTI and REDIS_WATCHING, while every command goes
+                * to the primary */
+
+    int hedging;
+    redisHedgeOptions hedge;
+    unsigned long long hedges; /* Reads that were sent again */
+    unsigned long long hedgewins; /* Of those, the ones answered first by
+                                   * the second replica */
+} redisRouter;
+
+redisRouter *redisRouterConnect(const char *primary, const char *replicas, redisRouterAttachFn *attach, void *data);
+int redisRouterSetHedging(redisRouter *rt, const redisHedgeOptions *opts);
+int redisvRouterCommand(redisRouter *rt, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
+int redisRouterCommand(redisRouter *rt, redisCallbackFn *fn, void *privdata, const char *format, ...);
+int redisRouterCommandArgv(redisRouter *rt, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+void redisRouterFree(redisRouter *rt);
+const char * const *redisRouterReadOnlyCommands(size_t *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,536 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <poll.h>
+#include <sys/time.h>
+#include "scan.h"
+
+/* Forward declaration of function in hiredis.c */
+void __redisCopyError(int *err, char *errstr, int type, const char *str);
+
+static long long __redisScanUsec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec*1000000)+tv.tv_usec;
+}
+
+static char *__redisScanStrdup(const char *s, size_t len) {
+    char *copy = malloc(len+1);
+    if (copy != NULL) {
+        memcpy(copy,s,len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+static void __redisScanArgsFree(redisScanArgs *args) {
+    free(args->name);
+    free(args->key);
+    free(args->match);
+}
+
+static int __redisScanArgsInit(redisScanArgs *args, const char *command, const char *key, size_t keylen,
+                               const redisScanOptions *opts) {
+    memset(args,0,sizeof(*args));
+    strcpy(args->cursor,"0");
+    args->count = REDIS_SCAN_COUNT;
+    args->maxcount = REDIS_SCAN_MAXCOUNT;
+    if (opts != NULL) {
+        if (opts->count > 0)
+            args->count = opts->count;
+        if (opts->maxcount > 0)
+            args->maxcount = opts->maxcount;
+        args->target = (long long)opts->target.tv_sec*1000000+opts->target.tv_usec;
+    }
+    if (args->count > args->maxcount)
+        args->count = args->maxcount;
+
+    if ((args->name = __redisScanStrdup(command,strlen(command))) == NULL ||
+        (key != NULL && (args->key = __redisScanStrdup(key,keylen)) == NULL) ||
+        (opts != NULL && opts->match != NULL &&
+         (args->match = __redisScanStrdup(opts->match,strlen(opts->match))) == NULL))
+    {
+        __redisScanArgsFree(args);
+        return REDIS_ERR;
+    }
+    args->keylen = keylen;
+    return REDIS_OK;
+}
+
+/* Format the call for the current cursor. */
+static int __redisScanFormat(redisScanArgs *args, char **cmd) {
+    const char *argv[7];
+    size_t argvlen[7];
+    char count[24];
+    int argc = 0;
+
+    argv[argc] = args->name;
+    argvlen[argc++] = strlen(args->name);
+    if (args->key != NULL) {
+        argv[argc] = args->key;
+        argvlen[argc++] = args->keylen;
+    }
+    argv[argc] = args->cursor;
+    argvlen[argc++] = strlen(args->cursor);
+    if (args->match != NULL) {
+        argv[argc] = "MATCH";
+        argvlen[argc++] = 5;
+        argv[argc] = args->match;
+        argvlen[argc++] = strlen(args->match);
+    }
+    argv[argc] = "COUNT";
+    argvlen[argc++] = 5;
+    argv[argc] = count;
+    argvlen[argc++] = snprintf(count,sizeof(count),"%ld",args->count);
+    return redisFormatCommandArgv(cmd,argc,argv,argvlen);
+}
+
+/* Scale COUNT by how far the reply time of the last call was from the
+ * target, at most by a factor of two per call. The reply time includes the
+ * round trip, which COUNT does not change, so the target should be above
+ * it. */
+static void __redisScanAdapt(redisScanArgs *args, long long elapsed) {
+    double scale;
+
+    if (args->target == 0)
+        return;
+    scale = (double)args->target/(elapsed > 0 ? elapsed : 1);
+    if (scale > 2) scale = 2;
+    if (scale < 0.5) scale = 0.5;
+    args->count = (long)(args->count*scale);
+    if (args->count < REDIS_SCAN_MINCOUNT)
+        args->count = REDIS_SCAN_MINCOUNT;
+    if (args->count > args->maxcount)
+        args->count = args->maxcount;
+}
+
+/* Take the cursor from a reply, and return the batch in it. Returns NULL when
+ * it is not a reply to a SCAN family command. */
+static redisReply *__redisScanParse(redisScanArgs *args, redisReply *r) {
+    if (r->type != REDIS_REPLY_ARRAY || r->elements != 2 ||
+        r->element[0]->type != REDIS_REPLY_STRING || (size_t)r->element[0]->len >= sizeof(args->cursor) ||
+        r->element[1]->type != REDIS_REPLY_ARRAY)
+        return NULL;
+    memcpy(args->cursor,r->element[0]->str,r->element[0]->len+1);
+    return r->element[1];
+}
+
+static int __redisScanSend(redisScanIterator *it) {
+    char *cmd;
+    int len, done = 0;
+
+    if ((len = __redisScanFormat(&it->args,&cmd)) == -1) {
+        __redisCopyError(&it->err,it->errstr,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    if (redisAppendFormattedCommand(it->c,cmd,len) != REDIS_OK) {
+        free(cmd);
+        __redisCopyError(&it->err,it->errstr,it->c->err,it->c->errstr);
+        return REDIS_ERR;
+    }
+    free(cmd);
+
+    /* Write the call now, so it is on its way while the caller works on the
+     * current batch. */
+    do {
+        if (redisBufferWrite(it->c,&done) == REDIS_ERR) {
+            __redisCopyError(&it->err,it->errstr,it->c->err,it->c->errstr);
+            return REDIS_ERR;
+        }
+    } while (!done);
+    it->args.sent = __redisScanUsec();
+    it->inflight = 1;
+    return REDIS_OK;
+}
+
+/* Iterate with SCAN, or with HSCAN, SSCAN or ZSCAN over a key, on a blocking
+ * connection. The first call is sent right away. Other commands can not be
+ * sent over the connection until the iteration is over or free'd. */
+redisScanIterator *redisScanStart(redisContext *c, const char *command, const char *key, size_t keylen, const redisScanOptions *opts) {
+    redisScanIterator *it;
+
+    it = calloc(1,sizeof(*it));
+    if (it == NULL)
+        return NULL;
+    it->c = c;
+    if (__redisScanArgsInit(&it->args,command,key,keylen,opts) != REDIS_OK) {
+        __redisCopyError(&it->err,it->errstr,REDIS_ERR_OOM,"Out of memory");
+        return it;
+    }
+    __redisScanSend(it);
+    return it;
+}
+
+/* Iterate over the keys of every master of a cluster, one master after the
+ * other. The first call to the next master is sent before the last batch of
+ * the current one is handed out. The cluster can not be used for other
+ * commands until the iteration is over or free'd. Keys in slots that move
+ * while the iteration is running may be missed or returned twice. */
+redisScanIterator *redisClusterScanStart(redisClusterContext *cc, const redisScanOptions *opts) {
+    redisClusterNode *node, *last = NULL;
+    redisScanIterator *it;
+    redisContext *c, **nodes;
+    int i, j;
+
+    it = calloc(1,sizeof(*it));
+    if (it == NULL)
+        return NULL;
+    for (i = 0; i < REDIS_CLUSTER_SLOTS; i++) {
+        if ((node = cc->slots[i]) == NULL || node == last)
+            continue;
+        last = node;
+        if ((c = redisClusterNodeContext(cc,node)) == NULL) {
+            __redisCopyError(&it->err,it->errstr,cc->err,cc->errstr);
+            return it;
+        }
+        for (j = 0; j < it->nnodes && it->nodes[j] != c; j++);
+        if (j < it->nnodes)
+            continue;
+        if ((nodes = realloc(it->nodes,sizeof(*nodes)*(it->nnodes+1))) == NULL) {
+            __redisCopyError(&it->err,it->errstr,REDIS_ERR_OOM,"Out of memory");
+            return it;
+        }
+        it->nodes = nodes;
+        it->nodes[it->nnodes++] = c;
+    }
+    if (it->nnodes == 0) {
+        __redisCopyError(&it->err,it->errstr,REDIS_ERR_OTHER,"No node serves the slots");
+        return it;
+    }
+
+    it->c = it->nodes[0];
+    if (__redisScanArgsInit(&it->args,"SCAN",NULL,0,opts) != REDIS_OK) {
+        __redisCopyError(&it->err,it->errstr,REDIS_ERR_OOM,"Out of memory");
+        return it;
+    }
+    __redisScanSend(it);
+    return it;
+}
+
+/* Move on to the next master of a cluster, whose cursor starts at 0 like
+ * the one that ended. Returns 0 when there is none. */
+static int __redisScanNextNode(redisScanIterator *it) {
+    if (it->node+1 >= it->nnodes)
+        return 0;
+    it->c = it->nodes[++it->node];
+    return 1;
+}
+
+/* Return the next batch, as an array reply that the caller free's. The call
+ * for the batch after it is sent before this returns. Returns NULL when the
+ * iteration is over, or failed, in which case the error is set. */
+redisReply *redisScanNext(redisScanIterator *it) {
+    redisReader *r = it->c->reader;
+    redisReply *reply, *batch;
+    struct pollfd pfd;
+    long long elapsed;
+    int ready;
+
+    if (!it->inflight)
+        return NULL;
+
+    /* When the reply was already there, the time it took is only known to
+     * be shorter than the time since it was sent. */
+    pfd.fd = it->c->fd;
+    pfd.events = POLLIN;
+    ready = (r->pos < r->len) || poll(&pfd,1,0) > 0;
+
+    it->inflight = 0;
+    if (redisGetReply(it->c,(void**)&reply) != REDIS_OK || reply == NULL) {
+        __redisCopyError(&it->err,it->errstr,it->c->err ? it->c->err : REDIS_ERR_OTHER,
+                            it->c->err ? it->c->errstr : "No reply");
+        return NULL;
+    }
+    if (reply->type == REDIS_REPLY_ERROR) {
+        __redisCopyError(&it->err,it->errstr,REDIS_ERR_OTHER,reply->str);
+        freeReplyObject(reply);
+        return NULL;
+    }
+    if ((batch = __redisScanParse(&it->args,reply)) == NULL) {
+        __redisCopyError(&it->err,it->errstr,REDIS_ERR_PROTOCOL,"Invalid SCAN reply");
+        freeReplyObject(reply);
+        return NULL;
+    }
+    reply->element[1] = NULL;
+    freeReplyObject(reply);
+
+    elapsed = __redisScanUsec()-it->args.sent;
+    if (!ready || elapsed < it->args.target)
+        __redisScanAdapt(&it->args,elapsed);
+    if (strcmp(it->args.cursor,"0") != 0 || __redisScanNextNode(it))
+        __redisScanSend(it);
+    return batch;
+}
+
+/* Free the iterator. A call that is still in flight is read and dropped, so
+ * the connection can be used again. */
+void redisScanFree(redisScanIterator *it) {
+    void *reply;
+
+    if (it == NULL)
+        return;
+    if (it->inflight && redisGetReply(it->c,&reply) == REDIS_OK)
+        freeReplyObject(reply);
+    __redisScanArgsFree(&it->args);
+    free(it->nodes);
+    free(it);
+}
+
+static void __redisAsyncScanReply(redisAsyncContext *ac, void *r, void *privdata);
+
+static int __redisAsyncScanSend(redisAsyncScan *scan) {
+    char *cmd;
+    int len, status;
+
+    if ((len = __redisScanFormat(&scan->args,&cmd)) == -1) {
+        __redisCopyError(&scan->err,scan->errstr,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    status = redisAsyncFormattedCommand(scan->ac,__redisAsyncScanReply,scan,cmd,len);
+    free(cmd);
+    if (status != REDIS_OK) {
+        __redisCopyError(&scan->err,scan->errstr,REDIS_ERR_OTHER,"Cannot send the command");
+        return REDIS_ERR;
+    }
+    scan->args.sent = __redisScanUsec();
+    scan->inflight = 1;
+    return REDIS_OK;
+}
+
+static void __redisAsyncScanFree(redisAsyncScan *scan) {
+    __redisScanArgsFree(&scan->args);
+    free(scan->children);
+    free(scan);
+}
+
+/* Free a scan of a master, and the scan of the cluster with the last one. */
+static void __redisAsyncScanFreeChild(redisAsyncScan *scan) {
+    redisAsyncScan *parent = scan->parent;
+    int i;
+
+    for (i = 0; i < parent->nchildren; i++) {
+        if (parent->children[i] == scan)
+            parent->children[i] = NULL;
+    }
+    parent->alive--;
+    __redisAsyncScanFree(scan);
+    if (parent->alive == 0 && parent->incallback == 0) {
+        if (!parent->stopped) {
+            parent->incallback++;
+            parent->fn(parent,NULL,parent->privdata);
+        }
+        __redisAsyncScanFree(parent);
+    }
+}
+
+/* The iteration is over, or failed. The last call has a NULL batch. */
+static void __redisAsyncScanFinish(redisAsyncScan *scan) {
+    if (scan->parent != NULL) {
+        if (scan->err && !scan->parent->err)
+            __redisCopyError(&scan->parent->err,scan->parent->errstr,scan->err,scan->errstr);
+        __redisAsyncScanFreeChild(scan);
+        return;
+    }
+    if (!scan->stopped) {
+        scan->incallback++;
+        scan->fn(scan,NULL,scan->privdata);
+    }
+    __redisAsyncScanFree(scan);
+}
+
+static void __redisAsyncScanEmit(redisAsyncScan *scan, redisReply *batch) {
+    redisAsyncScan *target = scan->parent ? scan->parent : scan;
+
+    scan->incallback++;
+    target->incallback++;
+    target->fn(target,batch,target->privdata);
+    target->incallback--;
+    scan->incallback--;
+}
+
+/* Send the call for the next batch before passing on the current one, so it
+ * is on its way while the callback runs. */
+static void __redisAsyncScanReply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisAsyncScan *scan = privdata;
+    redisReply *reply = r, *batch;
+    int done;
+
+    scan->inflight = 0;
+    if (scan->stopped) {
+        __redisAsyncScanFinish(scan);
+        return;
+    }
+    if (reply == NULL) {
+        __redisCopyError(&scan->err,scan->errstr,ac->err ? ac->err : REDIS_ERR_EOF,
+                            ac->err ? ac->errstr : "Connection lost");
+        __redisAsyncScanFinish(scan);
+        return;
+    }
+    if (reply->type == REDIS_REPLY_ERROR) {
+        __redisCopyError(&scan->err,scan->errstr,REDIS_ERR_OTHER,reply->str);
+        __redisAsyncScanFinish(scan);
+        return;
+    }
+    if ((batch = __redisScanParse(&scan->args,reply)) == NULL) {
+        __redisCopyError(&scan->err,scan->errstr,REDIS_ERR_PROTOCOL,"Invalid SCAN reply");
+        __redisAsyncScanFinish(scan);
+        return;
+    }
+
+    __redisScanAdapt(&scan->args,__redisScanUsec()-scan->args.sent);
+    done = (strcmp(scan->args.cursor,"0") == 0 || __redisAsyncScanSend(scan) != REDIS_OK);
+    __redisAsyncScanEmit(scan,batch);
+    if ((done || scan->stopped) && !scan->inflight)
+        __redisAsyncScanFinish(scan);
+}
+
+/* Iterate with SCAN, or with HSCAN, SSCAN or ZSCAN over a key, on an async
+ * connection. The callback is called with every batch, and one last time with
+ * a NULL batch when the iteration is over or failed, after which the scan is
+ * free'd. Returns NULL when the first call could not be sent. */
+redisAsyncScan *redisAsyncScanStart(redisAsyncContext *ac, const char *command, const char *key, size_t keylen,
+                                    const redisScanOptions *opts, redisScanCallback *fn, void *privdata) {
+    redisAsyncScan *scan;
+
+    scan = calloc(1,sizeof(*scan));
+    if (scan == NULL)
+        return NULL;
+    scan->ac = ac;
+    scan->fn = fn;
+    scan->privdata = privdata;
+    if (__redisScanArgsInit(&scan->args,command,key,keylen,opts) != REDIS_OK ||
+        __redisAsyncScanSend(scan) != REDIS_OK)
+    {
+        __redisAsyncScanFree(scan);
+        return NULL;
+    }
+    return scan;
+}
+
+/* Iterate over the keys of every master of a cluster, with a SCAN per
+ * master that run in parallel. Batches are passed to the callback as they
+ * arrive, and the last call comes when every master is done. Keys in slots
+ * that move while the iteration is running may be missed or returned
+ * twice. */
+redisAsyncScan *redisClusterAsyncScan(redisClusterAsyncContext *acc, const redisScanOptions *opts,
+                                      redisScanCallback *fn, void *privdata) {
+    redisClusterNode *node, *last = NULL;
+    redisAsyncScan *scan, *child, **children;
+    redisAsyncContext *ac;
+    int i, j;
+
+    scan = calloc(1,sizeof(*scan));
+    if (scan == NULL)
+        return NULL;
+    scan->fn = fn;
+    scan->privdata = privdata;
+
+    /* Connect to every master before sending anything, so nothing has to be
+     * undone. */
+    for (i = 0; i < REDIS_CLUSTER_SLOTS; i++) {
+        if ((node = acc->cc.slots[i]) == NULL || node == last)
+            continue;
+        last = node;
+        for (j = 0; j < scan->nchildren && scan->children[j]->ac != node->ac; j++);
+        if (j < scan->nchildren)
+            continue;
+        if ((ac = redisClusterAsyncNodeContext(acc,node)) == NULL)
+            goto error;
+        children = realloc(scan->children,sizeof(*children)*(scan->nchildren+1));
+        if (children == NULL)
+            goto error;
+        scan->children = children;
+        if ((child = calloc(1,sizeof(*child))) == NULL)
+            goto error;
+        scan->children[scan->nchildren++] = child;
+        child->ac = ac;
+        child->parent = scan;
+        if (__redisScanArgsInit(&child->args,"SCAN",NULL,0,opts) != REDIS_OK)
+            goto error;
+    }
+    if (scan->nchildren == 0)
+        goto error;
+
+    for (i = 0; i < scan->nchildren; i++) {
+        if (__redisAsyncScanSend(scan->children[i]) == REDIS_OK) {
+            scan->alive++;
+        } else {
+            if (!scan->err)
+                __redisCopyError(&scan->err,scan->errstr,scan->children[i]->err,scan->children[i]->errstr);
+            __redisAsyncScanFree(scan->children[i]);
+            scan->children[i] = NULL;
+        }
+    }
+    if (scan->alive == 0)
+        goto error;
+    return scan;
+
+error:
+    for (i = 0; i < scan->nchildren; i++) {
+        if (scan->children[i] != NULL)
+            __redisAsyncScanFree(scan->children[i]);
+    }
+    __redisAsyncScanFree(scan);
+    return NULL;
+}
+
+/* Stop an iteration. The callback is not called again. The scan is free'd
+ * once the call in flight returns. */
+void redisAsyncScanStop(redisAsyncScan *scan) {
+    redisAsyncScan *child;
+    int i;
+
+    if (scan->stopped)
+        return;
+    scan->stopped = 1;
+    if (scan->children == NULL) {
+        if (!scan->inflight && !scan->incallback)
+            __redisAsyncScanFree(scan);
+        return;
+    }
+
+    scan->incallback++;
+    for (i = 0; i < scan->nchildren; i++) {
+        if ((child = scan->children[i]) == NULL)
+            continue;
+        child->stopped = 1;
+        if (!child->inflight && !child->incallback)
+            __redisAsyncScanFreeChild(child);
+    }
+    scan->incallback--;
+    if (scan->alive == 0 && scan->incallback == 0)
+        __redisAsyncScanFree(scan);
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __HIREDIS_SCAN_H
+#define __HIREDIS_SCAN_H
+#include "hiredis.h"
+#include "async.h"
+#include "cluster.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Default COUNT, and the bounds it is adapted within */
+#define REDIS_SCAN_COUNT 10
+#define REDIS_SCAN_MINCOUNT 10
+#define REDIS_SCAN_MAXCOUNT 10000
+
+typedef struct redisScanOptions {
+    const char *match; /* MATCH pattern, or NULL */
+    long count; /* COUNT of the first call, 0 for REDIS_SCAN_COUNT */
+    long maxcount; /* Upper bound of COUNT, 0 for REDIS_SCAN_MAXCOUNT */
+    struct timeval target; /* Reply time to adapt COUNT to, zero to keep
+                            * COUNT as it is */
+} redisScanOptions;
+
+/* Command and cursor of an iteration */
+typedef struct redisScanArgs {
+    char *name; /* SCAN, HSCAN, SSCAN or ZSCAN */
+    char *key; /* NULL for SCAN */
+    size_t keylen;
+    char *match;
+    char cursor[24];
+    long count;
+    long maxcount;
+    long long target; /* In microseconds, 0 when COUNT is not adapted */
+    long long sent; /* When the call in flight was sent */
+} redisScanArgs;
+
+/* Iteration over a blocking connection */
+typedef struct redisScanIterator {
+    int err; /* Error flags, 0 when there is no error */
+    char errstr[128]; /* String representation of error when applicable */
+
+    redisContext *c;
+    redisScanArgs args;
+    int inflight; /* A call was sent, and its reply was not read yet */
+
+    /* A cluster is iterated one master after the other. */
+    redisContext **nodes; /* Connections to the masters, or NULL */
+    int nnodes;
+    int node; /* Index of the master that c is connected to */
+} redisScanIterator;
+
+struct redisAsyncScan;
+
+/* Batch callback prototype. The batch is NULL for the last call. */
+typedef void (redisScanCallback)(struct redisAsyncScan*, redisReply*, void*);
+
+/* Iteration over an async connection, or over every master of a cluster */
+typedef struct redisAsyncScan {
+    int err; /* Error flags, 0 when there is no error */
+    char errstr[128]; /* String representation of error when applicable */
+
+    redisAsyncContext *ac; /* NULL for a cluster */
+    redisScanArgs args;
+    redisScanCallback *fn;
+    void *privdata;
+    int inflight;
+    int incallback;
+    int stopped;
+
+    /* A cluster is iterated by a scan per master, which pass their batches
+     * to the scan of the cluster. */
+    struct redisAsyncScan *parent;
+    struct redisAsyncScan **children;
+    int nchildren;
+    int alive; /* Children that were not free'd yet */
+} redisAsyncScan;
+
+redisScanIterator *redisScanStart(redisContext *c, const char *command, const char *key, size_t keylen, const redisScanOptions *opts);
+redisScanIterator *redisClusterScanStart(redisClusterContext *cc, const redisScanOptions *opts);
+redisReply *redisScanNext(redisScanIterator *it);
+void redisScanFree(redisScanIterator *it);
+
+redisAsyncScan *redisAsyncScanStart(redisAsyncContext *ac, const char *command, const char *key, size_t keylen,
+                                    const redisScanOptions *opts, redisScanCallback *fn, void *privdata);
+redisAsyncScan *redisClusterAsyncScan(redisClusterAsyncContext *acc, const redisScanOptions *opts,
+                                      redisScanCallback *fn, void *privdata);
+void redisAsyncScanStop(redisAsyncScan *scan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
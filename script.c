@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "script.h"
+
+/* Forward declaration of functions in hiredis.c */
+void __redisSetError(redisContext *c, int type, const char *str);
+redisReply *__redisTakeReply(redisReply *r);
+
+#define ROL32(x,n) (((x) << (n)) | ((x) >> (32-(n))))
+
+static void __redisSha1Block(uint32_t h[5], const unsigned char *p) {
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((uint32_t)p[4*i] << 24) | ((uint32_t)p[4*i+1] << 16) |
+               ((uint32_t)p[4*i+2] << 8) | (uint32_t)p[4*i+3];
+    for (; i < 80; i++)
+        w[i] = ROL32(w[i-3]^w[i-8]^w[i-14]^w[i-16],1);
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+    for (i = 0; i < 80; i++) {
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        t = ROL32(a,5)+f+e+k+w[i];
+        e = d;
+        d = c;
+        c = ROL32(b,30);
+        b = a;
+        a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+/* SHA1 digest of a script in lower case hex, like Redis computes it. */
+static void __redisSha1Hex(const char *data, size_t len, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint64_t bits = (uint64_t)len*8;
+    unsigned char block[64], byte;
+    size_t i, rest;
+
+    for (i = 0; len-i >= 64; i += 64)
+        __redisSha1Block(h,(const unsigned char*)data+i);
+
+    /* Pad with a one bit, zeros and the length in bits. */
+    rest = len-i;
+    memcpy(block,data+i,rest);
+    block[rest++] = 0x80;
+    if (rest > 56) {
+        memset(block+rest,0,64-rest);
+        __redisSha1Block(h,block);
+        rest = 0;
+    }
+    memset(block+rest,0,56-rest);
+    for (i = 0; i < 8; i++)
+        block[56+i] = (unsigned char)(bits >> (56-8*i));
+    __redisSha1Block(h,block);
+
+    for (i = 0; i < 20; i++) {
+        byte = (unsigned char)(h[i/4] >> (24-8*(i%4)));
+        hex[2*i] = digits[byte >> 4];
+        hex[2*i+1] = digits[byte & 15];
+    }
+    hex[40] = '\0';
+}
+
+redisScripts *redisScriptsCreate(void) {
+    return calloc(1,sizeof(redisScripts));
+}
+
+/* Add a script, and return it to call it with. A script that was added before
+ * is returned again. Returns NULL when out of memory. */
+redisScript *redisScriptsAdd(redisScripts *s, const char *body, size_t len) {
+    redisScript *script, **scripts;
+    char sha[41];
+    int i;
+
+    __redisSha1Hex(body,len,sha);
+    for (i = 0; i < s->count; i++) {
+        if (memcmp(s->scripts[i]->sha,sha,sizeof(sha)) == 0)
+            return s->scripts[i];
+    }
+
+    scripts = realloc(s->scripts,sizeof(*scripts)*(s->count+1));
+    if (scripts == NULL)
+        return NULL;
+    s->scripts = scripts;
+    script = malloc(sizeof(*script));
+    if (script == NULL || (script->body = malloc(len+1)) == NULL) {
+        free(script);
+        return NULL;
+    }
+    memcpy(script->sha,sha,sizeof(sha));
+    memcpy(script->body,body,len);
+    script->body[len] = '\0';
+    script->len = len;
+    s->scripts[s->count++] = script;
+    return script;
+}
+
+void redisScriptsFree(redisScripts *s) {
+    int i;
+
+    if (s == NULL)
+        return;
+    for (i = 0; i < s->count; i++) {
+        free(s->scripts[i]->body);
+        free(s->scripts[i]);
+    }
+    free(s->scripts);
+    free(s);
+}
+
+static int __redisScriptMissing(const redisReply *reply) {
+    return reply != NULL && reply->type == REDIS_REPLY_ERROR &&
+           reply->len >= 8 && memcmp(reply->str,"NOSCRIPT",8) == 0;
+}
+
+/* Turn the formatted arguments of a script into an EVALSHA command, or an
+ * EVAL command with the body of the script when eval is set. */
+static int __redisScriptFormat(char **target, const redisScript *script, int eval, const char *args, int argslen) {
+    const char *p = args+1, *end = args+argslen;
+    char header[64], *cmd;
+    int argc = 0, len;
+    size_t bodylen = 0;
+
+    if (argslen < 4 || *args != '*')
+        return -1;
+    while (p < end && *p >= '0' && *p <= '9')
+        argc = argc*10+(*p++ - '0');
+    p += 2;
+    if (p > end)
+        return -1;
+
+    if (eval) {
+        len = snprintf(header,sizeof(header),"*%d\r\n$4\r\nEVAL\r\n$%zu\r\n",argc+2,script->len);
+        bodylen = script->len+2;
+    } else {
+        len = snprintf(header,sizeof(header),"*%d\r\n$7\r\nEVALSHA\r\n$40\r\n%s\r\n",argc+2,script->sha);
+    }
+    cmd = malloc(len+bodylen+(end-p));
+    if (cmd == NULL)
+        return -1;
+    memcpy(cmd,header,len);
+    if (eval) {
+        memcpy(cmd+len,script->body,script->len);
+        memcpy(cmd+len+script->len,"\r\n",2);
+    }
+    memcpy(cmd+len+bodylen,p,end-p);
+    *target = cmd;
+    return len+(int)bodylen+(int)(end-p);
+}
+
+/* Load the scripts on a connection, so that calling them does not need a
+ * round trip to load them first. Returns REDIS_ERR when the connection failed
+ * or a script could not be loaded. */
+int redisScriptsLoad(redisContext *c, const redisScripts *s) {
+    redisReply *reply;
+    int i, status = REDIS_OK;
+
+    for (i = 0; i < s->count; i++) {
+        if (redisAppendCommand(c,"SCRIPT LOAD %b",s->scripts[i]->body,s->scripts[i]->len) != REDIS_OK)
+            return REDIS_ERR;
+    }
+    for (i = 0; i < s->count; i++) {
+        if (redisGetReply(c,(void**)&reply) != REDIS_OK)
+            return REDIS_ERR;
+        if (reply == NULL || reply->type == REDIS_REPLY_ERROR)
+            status = REDIS_ERR;
+        freeReplyObject(reply);
+    }
+    return status;
+}
+
+/* Call a script. When the server does not have it, it is loaded and called
+ * again, in a single round trip. The error of a script that does not load is
+ * returned instead of the NOSCRIPT error. */
+static void *__redisScriptCommand(redisContext *c, const redisScript *script, const char *cmd, size_t len) {
+    redisReply *reply, *load;
+
+    if (redisAppendFormattedCommand(c,cmd,len) != REDIS_OK || !(c->flags & REDIS_BLOCK) ||
+        redisGetReply(c,(void**)&reply) != REDIS_OK)
+        return NULL;
+    if (!__redisScriptMissing(reply))
+        return reply;
+    freeReplyObject(reply);
+
+    if (redisAppendCommand(c,"SCRIPT LOAD %b",script->body,script->len) != REDIS_OK ||
+        redisAppendFormattedCommand(c,cmd,len) != REDIS_OK ||
+        redisGetReply(c,(void**)&load) != REDIS_OK)
+        return NULL;
+    if (redisGetReply(c,(void**)&reply) != REDIS_OK) {
+        freeReplyObject(load);
+        return NULL;
+    }
+    if (load != NULL && load->type == REDIS_REPLY_ERROR) {
+        freeReplyObject(reply);
+        return load;
+    }
+    freeReplyObject(load);
+    return reply;
+}
+
+/* The format string holds the arguments after the script, starting with the
+ * number of keys, like "1 %s %s". */
+void *redisvScriptCommand(redisContext *c, const redisScript *script, const char *format, va_list ap) {
+    char *args, *cmd;
+    int len;
+    void *reply;
+
+    len = redisvFormatCommand(&args,format,ap);
+    if (len == -1) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    len = __redisScriptFormat(&cmd,script,0,args,len);
+    free(args);
+    if (len == -1) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    reply = __redisScriptCommand(c,script,cmd,len);
+    free(cmd);
+    return reply;
+}
+
+void *redisScriptCommand(redisContext *c, const redisScript *script, const char *format, ...) {
+    va_list ap;
+    void *reply;
+    va_start(ap,format);
+    reply = redisvScriptCommand(c,script,format,ap);
+    va_end(ap);
+    return reply;
+}
+
+void *redisScriptCommandArgv(redisContext *c, const redisScript *script, int argc, const char **argv, const size_t *argvlen) {
+    char *args, *cmd;
+    int len;
+    void *reply;
+
+    len = redisFormatCommandArgv(&args,argc,argv,argvlen);
+    if (len == -1) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    len = __redisScriptFormat(&cmd,script,0,args,len);
+    free(args);
+    if (len == -1) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    reply = __redisScriptCommand(c,script,cmd,len);
+    free(cmd);
+    return reply;
+}
+
+/* Load the scripts on an async connection. This can be called from the
+ * connect and reconnect callbacks. */
+int redisAsyncScriptsLoad(redisAsyncContext *ac, const redisScripts *s) {
+    int i;
+
+    for (i = 0; i < s->count; i++) {
+        if (redisAsyncCommand(ac,NULL,NULL,"SCRIPT LOAD %b",s->scripts[i]->body,s->scripts[i]->len) != REDIS_OK)
+            return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Script call on an async connection, kept until its final reply */
+typedef struct redisScriptRequest {
+    redisCallbackFn *fn;
+    void *privdata;
+    const redisScript *script;
+    char *cmd;
+    size_t len;
+    int retried; /* Loaded the script and sent the call again */
+    redisReply *loaderr; /* Error of loading the script, or NULL */
+    int refs; /* Callbacks that still refer to the request */
+} redisScriptRequest;
+
+static void __redisScriptReleaseRequest(redisScriptRequest *req) {
+    if (--req->refs > 0)
+        return;
+    freeReplyObject(req->loaderr);
+    free(req->cmd);
+    free(req);
+}
+
+/* Keep the error of a script that does not load, to pass it on instead of
+ * the NOSCRIPT error that follows. The reply is owned by the connection,
+ * which free's the empty shell after the callback. */
+static void __redisScriptLoaded(redisAsyncContext *ac, void *r, void *privdata) {
+    redisScriptRequest *req = privdata;
+    redisReply *reply = r;
+
+    ac->c.flags &= ~REDIS_SCRIPTS_LOADING;
+    if (reply != NULL && reply->type == REDIS_REPLY_ERROR && req->loaderr == NULL)
+        req->loaderr = __redisTakeReply(reply);
+    __redisScriptReleaseRequest(req);
+}
+
+/* The call is sent again after the commands that were pipelined behind it,
+ * which may run before it. The server probably lost its other scripts as
+ * well, so until the SCRIPT LOAD is answered, calls are sent with EVAL and
+ * cannot be reordered the same way. The SCRIPT LOAD can be queued while the
+ * call cannot, for example when it crosses a watermark, so both hold a
+ * reference to the request. */
+static void __redisScriptReply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisScriptRequest *req = privdata;
+
+    if (!req->retried && __redisScriptMissing(r)) {
+        req->retried = 1;
+        if (redisAsyncCommand(ac,__redisScriptLoaded,req,"SCRIPT LOAD %b",req->script->body,req->script->len) == REDIS_OK) {
+            req->refs++;
+            ac->c.flags |= REDIS_SCRIPTS_LOADING;
+            if (redisAsyncFormattedCommand(ac,__redisScriptReply,req,req->cmd,req->len) == REDIS_OK)
+                return;
+        }
+    }
+    if (req->loaderr != NULL && __redisScriptMissing(r))
+        r = req->loaderr;
+    if (req->fn != NULL)
+        req->fn(ac,r,req->privdata);
+    __redisScriptReleaseRequest(req);
+}
+
+/* Send a call with the formatted arguments of the script. */
+static int __redisAsyncScriptCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata,
+                                     const redisScript *script, const char *args, int argslen) {
+    redisScriptRequest *req;
+    char *cmd;
+    int len, status;
+
+    /* EVAL has no NOSCRIPT error to retry. */
+    if (ac->c.flags & REDIS_SCRIPTS_LOADING) {
+        if ((len = __redisScriptFormat(&cmd,script,1,args,argslen)) == -1)
+            return REDIS_ERR;
+        status = redisAsyncFormattedCommand(ac,fn,privdata,cmd,len);
+        free(cmd);
+        return status;
+    }
+
+    if ((len = __redisScriptFormat(&cmd,script,0,args,argslen)) == -1)
+        return REDIS_ERR;
+    if ((req = calloc(1,sizeof(*req))) == NULL) {
+        free(cmd);
+        return REDIS_ERR;
+    }
+    req->fn = fn;
+    req->privdata = privdata;
+    req->script = script;
+    req->cmd = cmd;
+    req->len = len;
+    req->refs = 1;
+    if (redisAsyncFormattedCommand(ac,__redisScriptReply,req,cmd,len) != REDIS_OK) {
+        __redisScriptReleaseRequest(req);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+int redisvAsyncScriptCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisScript *script, const char *format, va_list ap) {
+    char *args;
+    int len, status;
+
+    len = redisvFormatCommand(&args,format,ap);
+    if (len == -1)
+        return REDIS_ERR;
+    status = __redisAsyncScriptCommand(ac,fn,privdata,script,args,len);
+    free(args);
+    return status;
+}
+
+int redisAsyncScriptCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisScript *script, const char *format, ...) {
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = redisvAsyncScriptCommand(ac,fn,privdata,script,format,ap);
+    va_end(ap);
+    return status;
+}
+
+int redisAsyncScriptCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisScript *script, int argc, const char **argv, const size_t *argvlen) {
+    char *args;
+    int len, status;
+
+    len = redisFormatCommandArgv(&args,argc,argv,argvlen);
+    if (len == -1)
+        return REDIS_ERR;
+    status = __redisAsyncScriptCommand(ac,fn,privdata,script,args,len);
+    free(args);
+    return status;
+}
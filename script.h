@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __HIREDIS_SCRIPT_H
+#define __HIREDIS_SCRIPT_H
+#include "hiredis.h"
+#include "async.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Lua script, called by its SHA1 digest */
+typedef struct redisScript {
+    char sha[41]; /* Hex digest, as used by EVALSHA */
+    char *body;
+    size_t len;
+} redisScript;
+
+/* Scripts to load on every connection */
+typedef struct redisScripts {
+    redisScript **scripts;
+    int count;
+} redisScripts;
+
+redisScripts *redisScriptsCreate(void);
+redisScript *redisScriptsAdd(redisScripts *s, const char *body, size_t len);
+void redisScriptsFree(redisScripts *s);
+
+/* Blocking API */
+int redisScriptsLoad(redisContext *c, const redisScripts *s);
+void *redisvScriptCommand(redisContext *c, const redisScript *script, const char *format, va_list ap);
+void *redisScriptCommand(redisContext *c, const redisScript *script, const char *format, ...);
+void *redisScriptCommandArgv(redisContext *c, const redisScript *script, int argc, const char **argv, const size_t *argvlen);
+
+/* Async API. A call that gets a NOSCRIPT error loads the script and is sent
+ * again after the commands that were pipelined behind it, which therefore
+ * run first. Later calls go out with EVAL until the SCRIPT LOAD is answered.
+ * Call redisAsyncScriptsLoad() from the connect and reconnect callbacks when
+ * the order of writes matters. */
+int redisAsyncScriptsLoad(redisAsyncContext *ac, const redisScripts *s);
+int redisvAsyncScriptCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisScript *script, const char *format, va_list ap);
+int redisAsyncScriptCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisScript *script, const char *format, ...);
+int redisAsyncScriptCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisScript *script, int argc, const char **argv, const size_t *argvlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,881 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include "sentinel.h"
+#include "sds.h"
+
+/* Forward declaration of functions in hiredis.c */
+void __redisCopyError(int *err, char *errstr, int type, const char *str);
+int __redisSplitAddress(const char *addr, size_t len, const char **host, size_t *hostlen, int *port);
+
+/* Forward declaration of function in async.c */
+redisAsyncContext *__redisAsyncOpen(const char *ip, int port, const struct timeval *timeout,
+                                    int (*attach)(redisAsyncContext *, void *), void *data,
+                                    int *err, char *errstr);
+
+static void __redisSentinelSetError(redisSentinelContext *sc, int type, const char *str) {
+    __redisCopyError(&sc->err,sc->errstr,type,str);
+}
+
+static void __redisSentinelClearError(redisSentinelContext *sc) {
+    sc->err = 0;
+    sc->errstr[0] = '\0';
+}
+
+static long long __redisSentinelMsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ((long long)ts.tv_sec)*1000+ts.tv_nsec/1000000;
+}
+
+/* Whether the sentinels may be asked for the address of the master. After
+ * none of them answered, they are asked again once the retry interval has
+ * passed, instead of connecting to each of them for every command. */
+static int __redisSentinelMayResolve(redisSentinelContext *sc) {
+    return sc->retryat == 0 || __redisSentinelMsec() >= sc->retryat;
+}
+
+static void __redisSentinelResolved(redisSentinelContext *sc, int status) {
+    sc->retryat = status == REDIS_OK ? 0 : __redisSentinelMsec()+REDIS_SENTINEL_RETRY_INTERVAL;
+}
+
+/* Add the sentinels of a comma separated list of host:port addresses. */
+static int __redisSentinelAddNodes(redisSentinelContext *sc, const char *addrs) {
+    const char *p = addrs, *end, *host;
+    redisSentinelNode *node, **tail = &sc->sentinels;
+    size_t hostlen;
+    int port;
+
+    while (*p != '\0') {
+        end = strchr(p,',');
+        if (end == NULL) end = p+strlen(p);
+        if (__redisSplitAddress(p,end-p,&host,&hostlen,&port) != REDIS_OK) {
+            __redisSentinelSetError(sc,REDIS_ERR_OTHER,"Invalid sentinel address");
+            return REDIS_ERR;
+        }
+
+        node = calloc(1,sizeof(*node));
+        if (node == NULL || (node->host = malloc(hostlen+1)) == NULL) {
+            free(node);
+            __redisSentinelSetError(sc,REDIS_ERR_OOM,"Out of memory");
+            return REDIS_ERR;
+        }
+        memcpy(node->host,host,hostlen);
+        node->host[hostlen] = '\0';
+        node->port = port;
+        *tail = node;
+        tail = &node->next;
+        p = (*end == ',') ? end+1 : end;
+    }
+
+    if (sc->sentinels == NULL) {
+        __redisSentinelSetError(sc,REDIS_ERR_OTHER,"No sentinels given");
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+static int __redisSentinelInit(redisSentinelContext *sc, const char *sentinels, const char *name, const struct timeval *tv) {
+    memset(sc,0,sizeof(*sc));
+    if (tv != NULL)
+        sc->timeout = *tv;
+    if ((sc->name = strdup(name)) == NULL) {
+        __redisSentinelSetError(sc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    return __redisSentinelAddNodes(sc,sentinels);
+}
+
+static void __redisSentinelFreeContents(redisSentinelContext *sc) {
+    redisSentinelNode *node, *next;
+
+    for (node = sc->sentinels; node != NULL; node = next) {
+        next = node->next;
+        free(node->host);
+        free(node);
+    }
+    if (sc->c != NULL)
+        redisFree(sc->c);
+    if (sc->sub != NULL)
+        redisFree(sc->sub);
+    free(sc->name);
+    free(sc->host);
+}
+
+/* Remember a new address of the master. Returns 1 when it changed, and
+ * closes the connection to the old address. */
+static int __redisSentinelSetMaster(redisSentinelContext *sc, const char *host, size_t hostlen, int port) {
+    char *copy;
+
+    if (sc->host != NULL && sc->port == port && strlen(sc->host) == hostlen &&
+        memcmp(sc->host,host,hostlen) == 0)
+        return 0;
+
+    if ((copy = malloc(hostlen+1)) == NULL) {
+        __redisSentinelSetError(sc,REDIS_ERR_OOM,"Out of memory");
+        return -1;
+    }
+    memcpy(copy,host,hostlen);
+    copy[hostlen] = '\0';
+    free(sc->host);
+    sc->host = copy;
+    sc->port = port;
+    if (sc->c != NULL) {
+        redisFree(sc->c);
+        sc->c = NULL;
+    }
+    return 1;
+}
+
+/* Use the reply to SENTINEL get-master-addr-by-name, which is the host and
+ * port of the master, or nil when the sentinel does not know it. */
+static int __redisSentinelAddressReply(redisSentinelContext *sc, redisReply *r, int *changed) {
+    if (r->type == REDIS_REPLY_ERROR) {
+        __redisSentinelSetError(sc,REDIS_ERR_OTHER,r->str);
+        return REDIS_ERR;
+    }
+    if (r->type != REDIS_REPLY_ARRAY || r->elements != 2 ||
+        r->element[0]->type != REDIS_REPLY_STRING ||
+        r->element[1]->type != REDIS_REPLY_STRING)
+    {
+        __redisSentinelSetError(sc,REDIS_ERR_OTHER,"The sentinel does not know the master");
+        return REDIS_ERR;
+    }
+    *changed = __redisSentinelSetMaster(sc,r->element[0]->str,r->element[0]->len,
+                                        atoi(r->element[1]->str));
+    return *changed < 0 ? REDIS_ERR : REDIS_OK;
+}
+
+/* Use a message published to +switch-master, which has the payload
+ * "<name> <old host> <old port> <new host> <new port>". Returns 1 when it
+ * moved the master of this context. */
+static int __redisSentinelSwitchMessage(redisSentinelContext *sc, redisReply *r) {
+    redisReply *payload;
+    sds *argv;
+    int argc, changed = 0;
+
+    if (r->type != REDIS_REPLY_ARRAY || r->elements != 3 ||
+        r->element[0]->type != REDIS_REPLY_STRING ||
+        strcmp(r->element[0]->str,"message") != 0 ||
+        r->element[2]->type != REDIS_REPLY_STRING)
+        return 0;
+
+    payload = r->element[2];
+    argv = sdssplitlen(payload->str,(int)payload->len," ",1,&argc);
+    if (argv != NULL && argc == 5 && strcmp(argv[0],sc->name) == 0)
+        changed = __redisSentinelSetMaster(sc,argv[3],sdslen(argv[3]),atoi(argv[4]));
+    sdsfreesplitres(argv,argc);
+    return changed == 1;
+}
+
+static redisContext *__redisSentinelConnectTo(redisSentinelContext *sc, const char *host, int port) {
+    redisContext *c;
+
+    if (sc->timeout.tv_sec || sc->timeout.tv_usec)
+        c = redisConnectWithTimeout(host,port,sc->timeout);
+    else
+        c = redisConnect(host,port);
+    if (c == NULL) {
+        __redisSentinelSetError(sc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    if (c->err == 0 && (sc->timeout.tv_sec || sc->timeout.tv_usec))
+        redisSetTimeout(c,sc->timeout);
+    if (c->err) {
+        __redisSentinelSetError(sc,c->err,c->errstr);
+        redisFree(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* Blocking API */
+
+/* Ask the sentinels for the address of the master, and subscribe to
+ * +switch-master on the first one that knows it. Both commands are sent
+ * at once, so no switch can happen in between. */
+static int __redisSentinelResolve(redisSentinelContext *sc) {
+    redisSentinelNode *node, *prev = NULL;
+    redisContext *c;
+    redisReply *r;
+    int status, changed;
+
+    for (node = sc->sentinels; node != NULL; prev = node, node = node->next) {
+        if ((c = __redisSentinelConnectTo(sc,node->host,node->port)) == NULL)
+            continue;
+
+        redisAppendCommand(c,"SENTINEL get-master-addr-by-name %s",sc->name);
+        redisAppendCommand(c,"SUBSCRIBE +switch-master");
+        if (redisGetReply(c,(void**)&r) != REDIS_OK) {
+            __redisSentinelSetError(sc,c->err,c->errstr);
+            redisFree(c);
+            continue;
+        }
+        status = __redisSentinelAddressReply(sc,r,&changed);
+        freeReplyObject(r);
+        if (status == REDIS_OK) {
+            if (redisGetReply(c,(void**)&r) != REDIS_OK) {
+                __redisSentinelSetError(sc,c->err,c->errstr);
+                status = REDIS_ERR;
+            } else {
+                freeReplyObject(r);
+            }
+        }
+        if (status != REDIS_OK) {
+            redisFree(c);
+            continue;
+        }
+
+        /* Ask this sentinel first the next time. */
+        if (prev != NULL) {
+            prev->next = node->next;
+            node->next = sc->sentinels;
+            sc->sentinels = node;
+        }
+        if (sc->sub != NULL)
+            redisFree(sc->sub);
+        sc->sub = c;
+        __redisSentinelClearError(sc);
+        __redisSentinelResolved(sc,REDIS_OK);
+        return REDIS_OK;
+    }
+    __redisSentinelResolved(sc,REDIS_ERR);
+    return REDIS_ERR;
+}
+
+/* Read the messages that the sentinel has published since the last
+ * command, without waiting for more. */
+static void __redisSentinelPoll(redisSentinelContext *sc) {
+    struct pollfd pfd;
+    redisReply *r;
+
+    if (sc->sub == NULL)
+        return;
+
+    pfd.fd = sc->sub->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    while (poll(&pfd,1,0) == 1) {
+        if (redisBufferRead(sc->sub) != REDIS_OK)
+            goto failed;
+        do {
+            if (redisGetReplyFromReader(sc->sub,(void**)&r) != REDIS_OK)
+                goto failed;
+            if (r != NULL) {
+                __redisSentinelSwitchMessage(sc,r);
+                freeReplyObject(r);
+            }
+        } while (r != NULL);
+    }
+    return;
+
+failed:
+    /* Subscribe again before the next command. */
+    redisFree(sc->sub);
+    sc->sub = NULL;
+}
+
+static redisSentinelContext *__redisSentinelConnect(const char *sentinels, const char *name, const struct timeval *tv) {
+    redisSentinelContext *sc;
+
+    sc = malloc(sizeof(*sc));
+    if (sc == NULL)
+        return NULL;
+    if (__redisSentinelInit(sc,sentinels,name,tv) == REDIS_OK &&
+        __redisSentinelResolve(sc) == REDIS_OK &&
+        (sc->c = __redisSentinelConnectTo(sc,sc->host,sc->port)) != NULL)
+        __redisSentinelClearError(sc);
+    return sc;
+}
+
+/* Connect to the master with the given name, asking the comma separated
+ * host:port sentinels for its address. */
+redisSentinelContext *redisSentinelConnect(const char *sentinels, const char *name) {
+    return __redisSentinelConnect(sentinels,name,NULL);
+}
+
+redisSentinelContext *redisSentinelConnectWithTimeout(const char *sentinels, const char *name, const struct timeval tv) {
+    return __redisSentinelConnect(sentinels,name,&tv);
+}
+
+/* Forget the subscription, so the sentinels are asked for the address of
+ * the master before the next command. */
+static void __redisSentinelMasterFailed(redisSentinelContext *sc) {
+    redisFree(sc->c);
+    sc->c = NULL;
+    if (sc->sub != NULL) {
+        redisFree(sc->sub);
+        sc->sub = NULL;
+    }
+}
+
+/* Send a formatted command to the master. Switches published by the
+ * sentinel are applied first. The sentinels are asked again after the
+ * connection to the master is lost, and when the master has turned into a
+ * replica, in which case the command is sent again. */
+static void *__redisSentinelCommand(redisSentinelContext *sc, const char *cmd, size_t len) {
+    redisReply *reply;
+    int retried = 0;
+
+    __redisSentinelClearError(sc);
+    __redisSentinelPoll(sc);
+
+    while (1) {
+        if (sc->sub == NULL) {
+            /* Keep using the old address when no sentinel answers. */
+            if (!__redisSentinelMayResolve(sc)) {
+                if (sc->host == NULL) {
+                    __redisSentinelSetError(sc,REDIS_ERR_OTHER,"No sentinel answered");
+                    return NULL;
+                }
+            } else if (__redisSentinelResolve(sc) != REDIS_OK && sc->host == NULL) {
+                return NULL;
+            }
+            __redisSentinelClearError(sc);
+        }
+        if (sc->c == NULL &&
+            (sc->c = __redisSentinelConnectTo(sc,sc->host,sc->port)) == NULL)
+            return NULL;
+
+        redisAppendFormattedCommand(sc->c,cmd,len);
+        if (redisGetReply(sc->c,(void**)&reply) != REDIS_OK) {
+            __redisSentinelSetError(sc,sc->c->err,sc->c->errstr);
+            __redisSentinelMasterFailed(sc);
+            return NULL;
+        }
+
+        if (retried || reply->type != REDIS_REPLY_ERROR ||
+            strncmp(reply->str,"READONLY ",9) != 0)
+            return reply;
+        freeReplyObject(reply);
+        __redisSentinelMasterFailed(sc);
+        retried = 1;
+    }
+}
+
+void *redisvSentinelCommand(redisSentinelContext *sc, const char *format, va_list ap) {
+    char *cmd;
+    int len;
+    void *reply;
+
+    len = redisvFormatCommand(&cmd,format,ap);
+    if (len == -1) {
+        __redisSentinelSetError(sc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    reply = __redisSentinelCommand(sc,cmd,len);
+    free(cmd);
+    return reply;
+}
+
+void *redisSentinelCommand(redisSentinelContext *sc, const char *format, ...) {
+    va_list ap;
+    void *reply;
+    va_start(ap,format);
+    reply = redisvSentinelCommand(sc,format,ap);
+    va_end(ap);
+    return reply;
+}
+
+void *redisSentinelCommandArgv(redisSentinelContext *sc, int argc, const char **argv, const size_t *argvlen) {
+    char *cmd;
+    int len;
+    void *reply;
+
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1) {
+        __redisSentinelSetError(sc,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    reply = __redisSentinelCommand(sc,cmd,len);
+    free(cmd);
+    return reply;
+}
+
+void redisSentinelFree(redisSentinelContext *sc) {
+    if (sc == NULL)
+        return;
+    __redisSentinelFreeContents(sc);
+    free(sc);
+}
+
+/* Async API */
+
+/* A command to the master. It is kept to send it again when the master has
+ * turned into a replica. */
+typedef struct redisSentinelRequest {
+    redisCallbackFn *fn;
+    void *privdata;
+    char *cmd;
+    size_t len;
+    int retried;
+    struct redisSentinelRequest *next; /* Waiting for the address */
+} redisSentinelRequest;
+
+static void __redisSentinelAsyncCopyError(redisSentinelAsyncContext *sac) {
+    sac->err = sac->sc.err;
+    sac->errstr = sac->sc.errstr;
+}
+
+static redisAsyncContext *__redisSentinelAsyncConnectTo(redisSentinelAsyncContext *sac, const char *host, int port) {
+    const struct timeval *tv = NULL;
+    redisAsyncContext *ac;
+
+    if (sac->sc.timeout.tv_sec || sac->sc.timeout.tv_usec)
+        tv = &sac->sc.timeout;
+    ac = __redisAsyncOpen(host,port,tv,sac->attach,sac->attachdata,&sac->sc.err,sac->sc.errstr);
+    if (ac != NULL)
+        ac->data = sac;
+    return ac;
+}
+
+static void __redisSentinelAsyncFree(redisSentinelAsyncContext *sac);
+
+static void __redisSentinelAsyncMasterGone(const redisAsyncContext *ac, int status) {
+    redisSentinelAsyncContext *sac = ac->data;
+    ((void)status);
+    if (sac != NULL && sac->ac == ac)
+        sac->ac = NULL;
+    if (sac != NULL && sac->old == ac)
+        sac->old = NULL;
+}
+
+static void __redisSentinelAsyncMasterConnect(const redisAsyncContext *ac, int status) {
+    if (status != REDIS_OK)
+        __redisSentinelAsyncMasterGone(ac,status);
+}
+
+static redisAsyncContext *__redisSentinelAsyncConnectMaster(redisSentinelAsyncContext *sac) {
+    redisAsyncContext *ac;
+
+    if (sac->ac != NULL)
+        return sac->ac;
+    if (sac->sc.host == NULL) {
+        if (sac->sc.err == 0)
+            __redisSentinelSetError(&sac->sc,REDIS_ERR_OTHER,"The address of the master is unknown");
+        return NULL;
+    }
+    if ((ac = __redisSentinelAsyncConnectTo(sac,sac->sc.host,sac->sc.port)) == NULL)
+        return NULL;
+    redisAsyncSetConnectCallback(ac,__redisSentinelAsyncMasterConnect);
+    redisAsyncSetDisconnectCallback(ac,__redisSentinelAsyncMasterGone);
+    sac->ac = ac;
+    return ac;
+}
+
+/* Move to the address that the sentinel told about. Commands that were
+ * already sent to the old master still get their replies from it, new
+ * commands go to the new master right away. Returns REDIS_ERR when the
+ * switch callback free'd the context. */
+static int __redisSentinelAsyncSwitch(redisSentinelAsyncContext *sac) {
+    redisAsyncContext *old = sac->ac;
+
+    if (old != NULL) {
+        sac->ac = NULL;
+        old->data = NULL;
+        redisAsyncDisconnect(old);
+    }
+    __redisSentinelClearError(&sac->sc);
+    __redisSentinelAsyncConnectMaster(sac);
+
+    if (sac->onswitch != NULL) {
+        sac->incallback++;
+        sac->onswitch(sac,sac->sc.host,sac->sc.port);
+        sac->incallback--;
+        if (sac->freeing && sac->incallback == 0) {
+            __redisSentinelAsyncFree(sac);
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+static void __redisSentinelAsyncReply(redisAsyncContext *ac, void *r, void *privdata);
+
+static void __redisSentinelAsyncFreeRequest(redisSentinelRequest *req) {
+    free(req->cmd);
+    free(req);
+}
+
+static int __redisSentinelAsyncSend(redisSentinelAsyncContext *sac, redisSentinelRequest *req) {
+    redisAsyncContext *ac;
+
+    if ((ac = __redisSentinelAsyncConnectMaster(sac)) == NULL)
+        return REDIS_ERR;
+    return redisAsyncFormattedCommand(ac,__redisSentinelAsyncReply,req,req->cmd,req->len);
+}
+
+static void __redisSentinelAsyncWait(redisSentinelAsyncContext *sac, redisSentinelRequest *req) {
+    req->next = NULL;
+    if (sac->waitingtail != NULL)
+        sac->waitingtail->next = req;
+    else
+        sac->waiting = req;
+    sac->waitingtail = req;
+}
+
+/* Send the commands that waited for the address of the master, whether the
+ * sentinels told it or not. The callback of a command that cannot be sent
+ * receives a NULL reply, and a NULL context. */
+static void __redisSentinelAsyncFlush(redisSentinelAsyncContext *sac) {
+    redisSentinelRequest *req;
+
+    sac->resolving = 0;
+    sac->incallback++;
+    while ((req = sac->waiting) != NULL) {
+        sac->waiting = req->next;
+        if (sac->waiting == NULL)
+            sac->waitingtail = NULL;
+        if (__redisSentinelAsyncSend(sac,req) == REDIS_OK)
+            continue;
+        if (req->fn != NULL)
+            req->fn(NULL,NULL,req->privdata);
+        __redisSentinelAsyncFreeRequest(req);
+    }
+    sac->incallback--;
+    if (sac->freeing && sac->incallback == 0)
+        __redisSentinelAsyncFree(sac);
+}
+
+static void __redisSentinelAsyncSubscribe(redisSentinelAsyncContext *sac);
+
+/* The master has turned into a replica. Commands wait until a sentinel
+ * told the address of the master again, and are then sent once more. A
+ * subscribed connection cannot ask for the address, so a new one does. */
+static void __redisSentinelAsyncReadonly(redisSentinelAsyncContext *sac, redisSentinelRequest *req) {
+    redisAsyncContext *sub;
+
+    __redisSentinelAsyncWait(sac,req);
+    sac->resolving = 1;
+
+    /* Commands that were sent after this one wait as well, when their
+     * replies arrive. */
+    if (sac->old != NULL)
+        sac->old->data = NULL;
+    sac->old = sac->ac;
+    sac->ac = NULL;
+    redisAsyncDisconnect(sac->old);
+
+    if ((sub = sac->sub) != NULL) {
+        sac->sub = NULL;
+        sub->data = NULL;
+        redisAsyncFree(sub);
+    }
+    sac->subfailures = 0;
+    __redisSentinelAsyncSubscribe(sac);
+    if (sac->sub == NULL)
+        __redisSentinelAsyncFlush(sac);
+}
+
+/* Reply to a command sent to the master. A READONLY error is followed by
+ * sending the command once more, to the master the sentinels know about. */
+static void __redisSentinelAsyncReply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisSentinelRequest *req = privdata;
+    redisSentinelAsyncContext *sac = ac->data;
+    redisReply *reply = r;
+
+    if (sac != NULL && !sac->freeing && !req->retried && reply != NULL &&
+        reply->type == REDIS_REPLY_ERROR && strncmp(reply->str,"READONLY ",9) == 0)
+    {
+        req->retried = 1;
+        if (ac == sac->ac) {
+            __redisSentinelAsyncReadonly(sac,req);
+            return;
+        }
+        /* Sent to the old master, before the sentinels were asked. */
+        if (sac->resolving) {
+            __redisSentinelAsyncWait(sac,req);
+            return;
+        }
+        if (__redisSentinelAsyncSend(sac,req) == REDIS_OK)
+            return;
+    }
+
+    if (req->fn != NULL)
+        req->fn(ac,r,req->privdata);
+    __redisSentinelAsyncFreeRequest(req);
+}
+
+static void __redisSentinelAsyncAddress(redisAsyncContext *ac, void *r, void *privdata) {
+    redisSentinelAsyncContext *sac = ac->data;
+    int changed;
+    ((void)privdata);
+
+    if (sac == NULL || r == NULL)
+        return;
+    sac->subfailures = 0;
+    __redisSentinelResolved(&sac->sc,REDIS_OK);
+    if (__redisSentinelAddressReply(&sac->sc,r,&changed) == REDIS_OK && changed &&
+        __redisSentinelAsyncSwitch(sac) != REDIS_OK)
+        return;
+    if (sac->resolving)
+        __redisSentinelAsyncFlush(sac);
+}
+
+static void __redisSentinelAsyncMessage(redisAsyncContext *ac, void *r, void *privdata) {
+    redisSentinelAsyncContext *sac = ac->data;
+    ((void)privdata);
+
+    if (sac == NULL || r == NULL)
+        return;
+    if (__redisSentinelSwitchMessage(&sac->sc,r))
+        __redisSentinelAsyncSwitch(sac);
+}
+
+static void __redisSentinelAsyncSubGone(const redisAsyncContext *ac, int status) {
+    redisSentinelAsyncContext *sac = ac->data;
+
+    if (sac == NULL || sac->sub != ac)
+        return;
+    sac->sub = NULL;
+    if (status != REDIS_OK && !sac->freeing) {
+        sac->subfailures++;
+        sac->subnode = sac->subnode->next;
+        __redisSentinelAsyncSubscribe(sac);
+    }
+    if (sac->sub == NULL && sac->resolving && !sac->freeing)
+        __redisSentinelAsyncFlush(sac);
+}
+
+static void __redisSentinelAsyncSubConnect(const redisAsyncContext *ac, int status) {
+    if (status != REDIS_OK)
+        __redisSentinelAsyncSubGone(ac,status);
+}
+
+/* Subscribe to +switch-master, starting with the sentinel after the one
+ * that failed last. The address of the master is asked again as well, since
+ * switches may have been missed in the meantime. After every sentinel failed
+ * in a row, this is tried again by the next command. */
+static void __redisSentinelAsyncSubscribe(redisSentinelAsyncContext *sac) {
+    redisSentinelNode *node;
+    redisAsyncContext *ac;
+    int count = 0;
+
+    for (node = sac->sc.sentinels; node != NULL; node = node->next)
+        count++;
+
+    while (sac->sub == NULL && sac->subfailures < count) {
+        if (sac->subnode == NULL)
+            sac->subnode = sac->sc.sentinels;
+        node = sac->subnode;
+        if ((ac = __redisSentinelAsyncConnectTo(sac,node->host,node->port)) == NULL ||
+            redisAsyncCommand(ac,__redisSentinelAsyncAddress,NULL,
+                              "SENTINEL get-master-addr-by-name %s",sac->sc.name) != REDIS_OK ||
+            redisAsyncCommand(ac,__redisSentinelAsyncMessage,NULL,
+                              "SUBSCRIBE +switch-master") != REDIS_OK)
+        {
+            if (ac != NULL) {
+                ac->data = NULL;
+                redisAsyncFree(ac);
+            }
+            sac->subfailures++;
+            sac->subnode = node->next;
+            continue;
+        }
+        redisAsyncSetConnectCallback(ac,__redisSentinelAsyncSubConnect);
+        redisAsyncSetDisconnectCallback(ac,__redisSentinelAsyncSubGone);
+        sac->sub = ac;
+    }
+    if (sac->sub == NULL)
+        __redisSentinelResolved(&sac->sc,REDIS_ERR);
+}
+
+static redisSentinelAsyncContext *__redisSentinelAsyncConnect(const char *sentinels, const char *name, const struct timeval *tv,
+                                                               redisSentinelAttachFn *attach, void *data) {
+    redisSentinelAsyncContext *sac;
+
+    sac = calloc(1,sizeof(*sac));
+    if (sac == NULL)
+        return NULL;
+
+    sac->attach = attach;
+    sac->attachdata = data;
+    if (__redisSentinelInit(&sac->sc,sentinels,name,tv) == REDIS_OK &&
+        __redisSentinelResolve(&sac->sc) == REDIS_OK)
+    {
+        /* The blocking subscription is replaced by an async one. */
+        redisFree(sac->sc.sub);
+        sac->sc.sub = NULL;
+        __redisSentinelAsyncSubscribe(sac);
+        __redisSentinelAsyncConnectMaster(sac);
+    }
+    __redisSentinelAsyncCopyError(sac);
+    return sac;
+}
+
+/* Connect to the master with the given name, asking the comma separated
+ * host:port sentinels for its address. The address is known before this
+ * returns, using a blocking connection. The connection to the master and the
+ * subscription to one of the sentinels are attached to the event library
+ * with the attach function. */
+redisSentinelAsyncContext *redisSentinelAsyncConnect(const char *sentinels, const char *name, redisSentinelAttachFn *attach, void *data) {
+    return __redisSentinelAsyncConnect(sentinels,name,NULL,attach,data);
+}
+
+/* Like redisSentinelAsyncConnect(), but asking for the address takes at
+ * most the timeout for every sentinel that is tried. The timeout also bounds
+ * the connects of the async connections, when the event library has timers. */
+redisSentinelAsyncContext *redisSentinelAsyncConnectWithTimeout(const char *sentinels, const char *name, const struct timeval tv,
+                                                                redisSentinelAttachFn *attach, void *data) {
+    return __redisSentinelAsyncConnect(sentinels,name,&tv,attach,data);
+}
+
+void redisSentinelAsyncSetSwitchCallback(redisSentinelAsyncContext *sac, redisSentinelSwitchFn *fn) {
+    sac->onswitch = fn;
+}
+
+/* Connection to the master for a new command. */
+static redisAsyncContext *__redisSentinelAsyncMaster(redisSentinelAsyncContext *sac) {
+    redisAsyncContext *ac;
+
+    __redisSentinelClearError(&sac->sc);
+    if (sac->sub == NULL && __redisSentinelMayResolve(&sac->sc)) {
+        sac->subfailures = 0;
+        __redisSentinelAsyncSubscribe(sac);
+    }
+    ac = __redisSentinelAsyncConnectMaster(sac);
+    __redisSentinelAsyncCopyError(sac);
+    return ac;
+}
+
+/* Send a formatted command to the master, or have it wait while the
+ * sentinels are asked for the address of the master. */
+static int __redisSentinelAsyncCommand(redisSentinelAsyncContext *sac, redisCallbackFn *fn, void *privdata,
+                                       const char *cmd, size_t len) {
+    redisSentinelRequest *req;
+
+    req = calloc(1,sizeof(*req));
+    if (req == NULL || (req->cmd = malloc(len)) == NULL) {
+        free(req);
+        __redisSentinelSetError(&sac->sc,REDIS_ERR_OOM,"Out of memory");
+        __redisSentinelAsyncCopyError(sac);
+        return REDIS_ERR;
+    }
+    memcpy(req->cmd,cmd,len);
+    req->len = len;
+    req->fn = fn;
+    req->privdata = privdata;
+
+    if (sac->resolving) {
+        __redisSentinelClearError(&sac->sc);
+        __redisSentinelAsyncCopyError(sac);
+        __redisSentinelAsyncWait(sac,req);
+        return REDIS_OK;
+    }
+    if (__redisSentinelAsyncMaster(sac) == NULL ||
+        redisAsyncFormattedCommand(sac->ac,__redisSentinelAsyncReply,req,cmd,len) != REDIS_OK)
+    {
+        __redisSentinelAsyncFreeRequest(req);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+int redisvSentinelAsyncCommand(redisSentinelAsyncContext *sac, redisCallbackFn *fn, void *privdata, const char *format, va_list ap) {
+    char *cmd;
+    int len;
+    int status;
+
+    len = redisvFormatCommand(&cmd,format,ap);
+    if (len == -1)
+        return REDIS_ERR;
+    status = __redisSentinelAsyncCommand(sac,fn,privdata,cmd,len);
+    free(cmd);
+    return status;
+}
+
+int redisSentinelAsyncCommand(redisSentinelAsyncContext *sac, redisCallbackFn *fn, void *privdata, const char *format, ...) {
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = redisvSentinelAsyncCommand(sac,fn,privdata,format,ap);
+    va_end(ap);
+    return status;
+}
+
+int redisSentinelAsyncCommandArgv(redisSentinelAsyncContext *sac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen) {
+    char *cmd;
+    int len;
+    int status;
+
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1)
+        return REDIS_ERR;
+    status = __redisSentinelAsyncCommand(sac,fn,privdata,cmd,len);
+    free(cmd);
+    return status;
+}
+
+/* Pending callbacks receive a NULL reply, those of commands that wait for
+ * the address of the master a NULL context as well. */
+static void __redisSentinelAsyncFree(redisSentinelAsyncContext *sac) {
+    redisSentinelRequest *req;
+    redisAsyncContext *ac;
+
+    while ((req = sac->waiting) != NULL) {
+        sac->waiting = req->next;
+        if (req->fn != NULL)
+            req->fn(NULL,NULL,req->privdata);
+        __redisSentinelAsyncFreeRequest(req);
+    }
+    if ((ac = sac->old) != NULL) {
+        sac->old = NULL;
+        ac->data = NULL;
+        redisAsyncFree(ac);
+    }
+    if ((ac = sac->ac) != NULL) {
+        sac->ac = NULL;
+        ac->data = NULL;
+        redisAsyncFree(ac);
+    }
+    if ((ac = sac->sub) != NULL) {
+        sac->sub = NULL;
+        ac->data = NULL;
+        redisAsyncFree(ac);
+    }
+    __redisSentinelFreeContents(&sac->sc);
+    free(sac);
+}
+
+/* Free the context. When this is called from a callback, the context is
+ * free'd once the callback returns. */
+void redisSentinelAsyncFree(redisSentinelAsyncContext *sac) {
+    if (sac == NULL)
+        return;
+    sac->freeing = 1;
+    if (sac->incallback == 0)
+        __redisSentinelAsyncFree(sac);
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HIREDIS_SENTINEL_H
+#define __HIREDIS_SENTINEL_H
+#include "hiredis.h"
+#include "async.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Milliseconds between asking the sentinels for the address of the master,
+ * while none of them answers */
+#define REDIS_SENTINEL_RETRY_INTERVAL 1000
+
+typedef struct redisSentinelNode {
+    char *host;
+    int port;
+    struct redisSentinelNode *next;
+} redisSentinelNode;
+
+/* Context for blocking commands to the master of a Sentinel setup */
+typedef struct redisSentinelContext {
+    int err; /* Error flags, 0 when there is no error */
+    char errstr[128]; /* String representation of error when applicable */
+
+    char *name; /* Name of the master */
+    struct timeval timeout; /* Connect and command timeout, zero for none */
+    redisSentinelNode *sentinels; /* The last one that answered comes first */
+
+    char *host; /* Address of the master, NULL while unknown */
+    int port;
+    redisContext *c; /* Connection to the master, or NULL */
+    redisContext *sub; /* Subscribed to +switch-master on a sentinel, or NULL */
+    long long retryat; /* When the sentinels may be asked again, after none
+                        * answered, in monotonic milliseconds */
+} redisSentinelContext;
+
+struct redisSentinelAsyncContext;
+struct redisSentinelRequest;
+
+/* Attaches a connection to the event library, and should return REDIS_OK on
+ * success, like the redisLibeventAttach() family. */
+typedef int (redisSentinelAttachFn)(redisAsyncContext *ac, void *data);
+
+/* Called after the master has moved to a new address */
+typedef void (redisSentinelSwitchFn)(struct redisSentinelAsyncContext*, const char *host, int port);
+
+/* Context for async commands to the master of a Sentinel setup */
+typedef struct redisSentinelAsyncContext {
+    /* Sentinels and the address of the master */
+    redisSentinelContext sc;
+
+    /* Setup error flags so they can be used directly. */
+    int err;
+    const char *errstr;
+
+    redisSentinelAttachFn *attach;
+    void *attachdata;
+    redisSentinelSwitchFn *onswitch;
+
+    redisAsyncContext *ac; /* Connection to the master, or NULL */
+    redisAsyncContext *old; /* Master that turned into a replica, or NULL */
+    redisAsyncContext *sub; /* Subscribed to +switch-master, or NULL */
+    redisSentinelNode *subnode; /* Sentinel that sub is connected to */
+    int subfailures; /* Sentinels that failed in a row */
+
+    /* Commands waiting for the sentinel to tell the address of the master,
+     * after the master replied with a READONLY error */
+    struct redisSentinelRequest *waiting, *waitingtail;
+    int resolving;
+
+    int incallback; /* Depth of nested callbacks */
+    int freeing; /* Free the context when the callbacks return */
+} redisSentinelAsyncContext;
+
+redisSentinelContext *redisSentinelConnect(const char *sentinels, const char *name);
+redisSentinelContext *redisSentinelConnectWithTimeout(const char *sentinels, const char *name, const struct timeval tv);
+void *redisvSentinelCommand(redisSentinelContext *sc, const char *format, va_list ap);
+void *redisSentinelCommand(redisSentinelContext *sc, const char *format, ...);
+void *redisSentinelCommandArgv(redisSentinelContext *sc, int argc, const char **argv, const size_t *argvlen);
+void redisSentinelFree(redisSentinelContext *sc);
+
+redisSentinelAsyncContext *redisSentinelAsyncConnect(const char *sentinels, const char *name, redisSentinelAttachFn *attach, void *data);
+redisSentinelAsyncContext *redisSentinelAsyncConnectWithTimeout(const char *sentinels, const char *name, const struct timeval tv,
+                                                                redisSentinelAttachFn *attach, void *data);
+void redisSentinelAsyncSetSwitchCallback(redisSentinelAsyncContext *sac, redisSentinelSwitchFn *fn);
+int redisvSentinelAsyncCommand(redisSentinelAsyncContext *sac, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
+int redisSentinelAsyncCommand(redisSentinelAsyncContext *sac, redisCallbackFn *fn, void *privdata, const char *format, ...);
+int redisSentinelAsyncCommandArgv(redisSentinelAsyncContext *sac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+void redisSentinelAsyncFree(redisSentinelAsyncContext *sac);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,734 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include "stream.h"
+
+/* Forward declaration of functions in hiredis.c */
+void __redisCopyError(int *err, char *errstr, int type, const char *str);
+int __redisSplitAddress(const char *addr, size_t len, const char **host, size_t *hostlen, int *port);
+
+/* Forward declaration of function in async.c */
+redisAsyncContext *__redisAsyncOpen(const char *ip, int port, const struct timeval *timeout,
+                                    int (*attach)(redisAsyncContext *, void *), void *data,
+                                    int *err, char *errstr);
+
+/* Value inside an array of a reply */
+typedef struct redisStreamNode {
+    int type;
+    size_t len; /* Bytes of a string, elements of an array */
+    size_t off; /* Of a string in the buffer of the reply */
+} redisStreamNode;
+
+/* Reply read by the connection of a consumer. Arrays do not become a tree of
+ * redisReply objects: their values are kept as nodes in the order they were
+ * read, and their strings in one buffer. The reply starts with a redisReply
+ * that holds the type, and the string of error and status replies, so that
+ * code expecting a redisReply can still read an error. */
+typedef struct redisStreamReply {
+    redisReply reply;
+    redisStreamNode *nodes;
+    size_t count;
+    size_t slots;
+    char *buf;
+    size_t len;
+    size_t size;
+} redisStreamReply;
+
+static void __redisStreamSetError(redisStreamConsumer *sc, int type, const char *str) {
+    __redisCopyError(&sc->err,sc->errstr,type,str);
+}
+
+/* Returns the reply a task belongs to, which is created for the first task
+ * of the reply. */
+static redisStreamReply *__redisStreamReplyOf(const redisReadTask *task) {
+    redisStreamReply *r;
+
+    if (task->parent != NULL)
+        return task->parent->obj;
+    if ((r = calloc(1,sizeof(*r))) == NULL)
+        return NULL;
+    r->reply.type = task->type;
+    return r;
+}
+
+static redisStreamNode *__redisStreamAddNode(redisStreamReply *r, int type, size_t len) {
+    redisStreamNode *nodes;
+    size_t slots;
+
+    if (r->count == r->slots) {
+        slots = r->slots ? r->slots*2 : 16;
+        if ((nodes = realloc(r->nodes,slots*sizeof(*nodes))) == NULL)
+            return NULL;
+        r->nodes = nodes;
+        r->slots = slots;
+    }
+    nodes = &r->nodes[r->count++];
+    nodes->type = type;
+    nodes->len = len;
+    nodes->off = r->len;
+    return nodes;
+}
+
+static void *__redisStreamCreateString(const redisReadTask *task, char *str, size_t len) {
+    redisStreamReply *r;
+    char *buf;
+    size_t size;
+
+    if ((r = __redisStreamReplyOf(task)) == NULL)
+        return NULL;
+    if (task->parent == NULL) {
+        if ((r->reply.str = malloc(len+1)) == NULL) {
+            free(r);
+            return NULL;
+        }
+        memcpy(r->reply.str,str,len);
+        r->reply.str[len] = '\0';
+        r->reply.len = len;
+        return r;
+    }
+
+    /* Room for a nul terminator as well. */
+    if (r->len+len+1 > r->size) {
+        for (size = r->size ? r->size : 256; size < r->len+len+1; size *= 2);
+        if ((buf = realloc(r->buf,size)) == NULL)
+            return NULL;
+        r->buf = buf;
+        r->size = size;
+    }
+    if (__redisStreamAddNode(r,task->type,len) == NULL)
+        return NULL;
+    memcpy(r->buf+r->len,str,len);
+    r->buf[r->len+len] = '\0';
+    r->len += len+1;
+    return r;
+}
+
+static void *__redisStreamCreateArray(const redisReadTask *task, int elements) {
+    redisStreamReply *r;
+
+    if ((r = __redisStreamReplyOf(task)) == NULL)
+        return NULL;
+    if (task->parent == NULL)
+        r->reply.elements = elements;
+    if (__redisStreamAddNode(r,REDIS_REPLY_ARRAY,elements) == NULL) {
+        if (task->parent == NULL)
+            free(r);
+        return NULL;
+    }
+    return r;
+}
+
+static void *__redisStreamCreateInteger(const redisReadTask *task, long long value) {
+    redisStreamReply *r;
+
+    if ((r = __redisStreamReplyOf(task)) == NULL)
+        return NULL;
+    if (task->parent == NULL) {
+        r->reply.integer = value;
+        return r;
+    }
+    /* No reply of the consumer has integers inside an array. */
+    return __redisStreamAddNode(r,REDIS_REPLY_INTEGER,0) ? r : NULL;
+}
+
+static void *__redisStreamCreateNil(const redisReadTask *task) {
+    redisStreamReply *r;
+
+    if ((r = __redisStreamReplyOf(task)) == NULL)
+        return NULL;
+    if (task->parent == NULL)
+        return r;
+    return __redisStreamAddNode(r,REDIS_REPLY_NIL,0) ? r : NULL;
+}
+
+static void __redisStreamFreeReply(void *reply) {
+    redisStreamReply *r = reply;
+
+    if (r == NULL)
+        return;
+    free(r->reply.str);
+    free(r->nodes);
+    free(r->buf);
+    free(r);
+}
+
+static redisReplyObjectFunctions __redisStreamFunctions = {
+    __redisStreamCreateString,
+    __redisStreamCreateArray,
+    __redisStreamCreateInteger,
+    __redisStreamCreateNil,
+    __redisStreamFreeReply
+};
+
+/* Index of the node after the value at index i, and its contents. */
+static size_t __redisStreamSkip(const redisStreamReply *r, size_t i) {
+    size_t n;
+
+    if (i >= r->count)
+        return r->count;
+    if (r->nodes[i].type != REDIS_REPLY_ARRAY)
+        return i+1;
+    n = r->nodes[i].len;
+    for (i++; n > 0; n--)
+        i = __redisStreamSkip(r,i);
+    return i;
+}
+
+/* Fill a batch with the entries of the array at index i, as found in replies
+ * of XREADGROUP and XAUTOCLAIM. The entries and their fields share one
+ * allocation, which the caller frees. Before Redis 7.0, XAUTOCLAIM has nil
+ * in place of entries that were deleted. Their IDs are unknown, so they are
+ * left out of the batch. */
+static int __redisStreamDecode(const redisStreamReply *r, size_t i, redisStreamBatch *b) {
+    const redisStreamNode *n = r->nodes;
+    redisStreamEntry *e;
+    redisStreamField *f;
+    size_t count, nfields, j, k, end;
+
+    if (i >= r->count || n[i].type != REDIS_REPLY_ARRAY)
+        return REDIS_ERR;
+    count = n[i].len;
+    end = __redisStreamSkip(r,i);
+
+    /* Every entry is an array of its ID, and of its fields or nil. */
+    nfields = 0;
+    for (j = i+1; j < end; j = __redisStreamSkip(r,j)) {
+        if (n[j].type == REDIS_REPLY_NIL) {
+            count--;
+            continue;
+        }
+        if (n[j].type != REDIS_REPLY_ARRAY || n[j].len != 2 || j+2 >= end ||
+            n[j+1].type != REDIS_REPLY_STRING)
+            return REDIS_ERR;
+        if (n[j+2].type == REDIS_REPLY_ARRAY)
+            nfields += n[j+2].len/2;
+        else if (n[j+2].type != REDIS_REPLY_NIL)
+            return REDIS_ERR;
+    }
+
+    b->count = count;
+    b->entries = malloc(count*sizeof(redisStreamEntry)+nfields*sizeof(redisStreamField)+1);
+    if (b->entries == NULL)
+        return REDIS_ERR;
+    f = (redisStreamField*)(b->entries+count);
+    for (j = i+1, k = 0; k < count; j = __redisStreamSkip(r,j)) {
+        if (n[j].type == REDIS_REPLY_NIL)
+            continue;
+        e = &b->entries[k++];
+        e->id = r->buf+n[j+1].off;
+        e->idlen = n[j+1].len;
+        e->fields = NULL;
+        e->nfields = 0;
+        if (n[j+2].type != REDIS_REPLY_ARRAY)
+            continue;
+        e->fields = f;
+        e->nfields = n[j+2].len/2;
+        for (i = j+3; i+1 < j+3+n[j+2].len; i += 2, f++) {
+            if (n[i].type != REDIS_REPLY_STRING || n[i+1].type != REDIS_REPLY_STRING) {
+                free(b->entries);
+                return REDIS_ERR;
+            }
+            f->name = r->buf+n[i].off;
+            f->namelen = n[i].len;
+            f->value = r->buf+n[i+1].off;
+            f->valuelen = n[i+1].len;
+        }
+    }
+    return REDIS_OK;
+}
+
+/* Nothing is read anymore. The callback learns about it with a NULL batch. */
+static void __redisStreamStop(redisStreamConsumer *sc, int type, const char *str) {
+    if (sc->stopped)
+        return;
+    __redisStreamSetError(sc,type,str);
+    sc->stopped = 1;
+    if (sc->timer != NULL && sc->ctl != NULL) {
+        redisAsyncCancelTimer(sc->ctl,sc->timer);
+        sc->timer = NULL;
+    }
+    sc->fn(sc,NULL,sc->privdata);
+}
+
+static void __redisStreamRead(redisStreamConsumer *sc);
+static void __redisStreamClaim(redisStreamConsumer *sc);
+
+/* Add an ID to the ones that are sent with the next XACK. */
+static int __redisStreamQueueAck(redisStreamConsumer *sc, sds id) {
+    sds *acks;
+    size_t slots;
+
+    if (sc->nacks == sc->ackslots) {
+        slots = sc->ackslots*2;
+        if ((acks = realloc(sc->acks,slots*sizeof(*acks))) == NULL) {
+            __redisStreamSetError(sc,REDIS_ERR_OOM,"Out of memory");
+            return REDIS_ERR;
+        }
+        sc->acks = acks;
+        sc->ackslots = slots;
+    }
+    sc->acks[sc->nacks++] = id;
+    return REDIS_OK;
+}
+
+static void __redisStreamAckReply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisStreamConsumer *sc = ac->data;
+    redisStreamReply *reply = r;
+    sds *ids = privdata;
+    size_t j;
+
+    /* Acknowledging is idempotent, so IDs of a lost connection are sent
+     * again. */
+    for (j = 0; ids[j] != NULL; j++) {
+        if (sc != NULL && reply == NULL && !sc->stopped &&
+            __redisStreamQueueAck(sc,ids[j]) == REDIS_OK)
+            continue;
+        sdsfree(ids[j]);
+    }
+    free(ids);
+
+    if (sc == NULL || reply == NULL)
+        return;
+    if (reply->reply.type == REDIS_REPLY_ERROR)
+        __redisStreamStop(sc,REDIS_ERR_OTHER,reply->reply.str);
+    else if (reply->reply.type == REDIS_REPLY_INTEGER)
+        sc->acked += reply->reply.integer;
+}
+
+/* Send the IDs that were acknowledged, in commands of up to maxack IDs. They
+ * go over the second connection, so they do not wait for a blocked read. */
+int redisStreamFlushAcks(redisStreamConsumer *sc) {
+    const char **argv;
+    size_t *argvlen;
+    sds *ids;
+    size_t n, j;
+    int status;
+
+    while (sc->nacks > 0) {
+        if (sc->ctl == NULL || sc->stopped)
+            return REDIS_ERR;
+        n = sc->nacks < (size_t)sc->maxack ? sc->nacks : (size_t)sc->maxack;
+        argv = malloc((n+3)*sizeof(*argv));
+        argvlen = malloc((n+3)*sizeof(*argvlen));
+        ids = malloc((n+1)*sizeof(*ids));
+        if (argv == NULL || argvlen == NULL || ids == NULL) {
+            free(argv);
+            free(argvlen);
+            free(ids);
+            __redisStreamSetError(sc,REDIS_ERR_OOM,"Out of memory");
+            return REDIS_ERR;
+        }
+
+        argv[0] = "XACK";
+        argvlen[0] = 4;
+        argv[1] = sc->stream;
+        argvlen[1] = sdslen(sc->stream);
+        argv[2] = sc->group;
+        argvlen[2] = sdslen(sc->group);
+        for (j = 0; j < n; j++) {
+            ids[j] = sc->acks[j];
+            argv[j+3] = ids[j];
+            argvlen[j+3] = sdslen(ids[j]);
+        }
+        ids[n] = NULL;
+
+        status = redisAsyncCommandArgv(sc->ctl,__redisStreamAckReply,ids,n+3,argv,argvlen);
+        free(argv);
+        free(argvlen);
+        if (status != REDIS_OK) {
+            free(ids);
+            __redisStreamSetError(sc,sc->ctl->err ? sc->ctl->err : REDIS_ERR_OTHER,
+                                  sc->ctl->err ? sc->ctl->errstr : "Cannot send XACK");
+            return REDIS_ERR;
+        }
+        sc->nacks -= n;
+        memmove(sc->acks,sc->acks+n,sc->nacks*sizeof(*sc->acks));
+    }
+    return REDIS_OK;
+}
+
+/* Acknowledge an entry. The ID is sent with the others before the next read,
+ * or as soon as maxack IDs are waiting. */
+int redisStreamAck(redisStreamConsumer *sc, const char *id, size_t idlen) {
+    sds s;
+
+    if (sc->stopped)
+        return REDIS_ERR;
+    if ((s = sdsnewlen(id,idlen)) == NULL) {
+        __redisStreamSetError(sc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    if (__redisStreamQueueAck(sc,s) != REDIS_OK) {
+        sdsfree(s);
+        return REDIS_ERR;
+    }
+    if (sc->nacks >= (size_t)sc->maxack && sc->ctl != NULL)
+        return redisStreamFlushAcks(sc);
+    return REDIS_OK;
+}
+
+/* Hand the entries of the array at index i to the callback. The ID of the
+ * last entry is returned through last, and stays valid as long as the reply.
+ * Returns REDIS_ERR when the consumer stopped or was free'd meanwhile. */
+static int __redisStreamDeliver(redisAsyncContext *ac, redisStreamReply *reply, size_t i, int claimed,
+                                const char **last, size_t *lastlen) {
+    redisStreamConsumer *sc = ac->data;
+    redisStreamBatch b;
+
+    if (__redisStreamDecode(reply,i,&b) != REDIS_OK) {
+        __redisStreamStop(sc,REDIS_ERR_PROTOCOL,"Unexpected reply");
+        return REDIS_ERR;
+    }
+    b.claimed = claimed;
+    *last = NULL;
+    *lastlen = 0;
+    if (b.count > 0) {
+        *last = b.entries[b.count-1].id;
+        *lastlen = b.entries[b.count-1].idlen;
+        if (claimed)
+            sc->claimed += b.count;
+        else
+            sc->entries += b.count;
+        sc->fn(sc,&b,sc->privdata);
+    }
+    free(b.entries);
+    if (ac->data == NULL || sc->stopped)
+        return REDIS_ERR;
+    return REDIS_OK;
+}
+
+static void __redisStreamReadReply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisStreamConsumer *sc = ac->data;
+    redisStreamReply *reply = r;
+    const char *last = NULL;
+    size_t lastlen = 0;
+    ((void)privdata);
+
+    if (sc == NULL)
+        return;
+    sc->reading = 0;
+
+    /* After a lost connection, reading starts again once reconnected. */
+    if (reply == NULL || sc->stopped)
+        return;
+    if (reply->reply.type == REDIS_REPLY_ERROR) {
+        __redisStreamStop(sc,REDIS_ERR_OTHER,reply->reply.str);
+        return;
+    }
+
+    /* A single stream is read, so the reply is [[stream, [entry, ...]]], or
+     * nil when the read timed out. */
+    if (reply->reply.type == REDIS_REPLY_ARRAY) {
+        if (reply->count < 4 || reply->nodes[1].type != REDIS_REPLY_ARRAY || reply->nodes[1].len != 2) {
+            __redisStreamStop(sc,REDIS_ERR_PROTOCOL,"Unexpected reply");
+            return;
+        }
+        if (__redisStreamDeliver(ac,reply,3,0,&last,&lastlen) != REDIS_OK)
+            return;
+    }
+
+    /* Pending entries are read again until none is left after the last. */
+    if (sc->history != NULL) {
+        sdsfree(sc->history);
+        sc->history = last ? sdsnewlen(last,lastlen) : NULL;
+    }
+    redisStreamFlushAcks(sc);
+    __redisStreamRead(sc);
+}
+
+/* Read the next entries. Once the pending entries of the consumer were read
+ * again, the read waits for new entries on the server. */
+static void __redisStreamRead(redisStreamConsumer *sc) {
+    int status;
+
+    if (sc->ac == NULL || sc->reading || sc->stopped)
+        return;
+    if (sc->history != NULL)
+        status = redisAsyncCommand(sc->ac,__redisStreamReadReply,NULL,
+            "XREADGROUP GROUP %b %b COUNT %ld STREAMS %b %b",
+            sc->group,sdslen(sc->group),sc->name,sdslen(sc->name),sc->count,
+            sc->stream,sdslen(sc->stream),sc->history,sdslen(sc->history));
+    else
+        status = redisAsyncCommand(sc->ac,__redisStreamReadReply,NULL,
+            "XREADGROUP GROUP %b %b COUNT %ld BLOCK %ld STREAMS %b >",
+            sc->group,sdslen(sc->group),sc->name,sdslen(sc->name),sc->count,sc->block,
+            sc->stream,sdslen(sc->stream));
+    if (status == REDIS_OK)
+        sc->reading = 1;
+}
+
+static void __redisStreamClaimTimer(redisAsyncContext *ac, void *privdata) {
+    redisStreamConsumer *sc = privdata;
+    ((void)ac);
+    sc->timer = NULL;
+    __redisStreamClaim(sc);
+}
+
+static void __redisStreamClaimLater(redisStreamConsumer *sc) {
+    if (sc->ctl != NULL && sc->timer == NULL && !sc->stopped)
+        sc->timer = redisAsyncAddTimer(sc->ctl,sc->claim,__redisStreamClaimTimer,sc);
+}
+
+static void __redisStreamClaimReply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisStreamConsumer *sc = ac->data;
+    redisStreamReply *reply = r;
+    const char *last;
+    size_t lastlen;
+    sds cursor;
+    ((void)privdata);
+
+    if (sc == NULL)
+        return;
+    sc->claiming = 0;
+    if (sc->stopped)
+        return;
+    if (reply == NULL) {
+        __redisStreamClaimLater(sc);
+        return;
+    }
+    if (reply->reply.type == REDIS_REPLY_ERROR) {
+        __redisStreamStop(sc,REDIS_ERR_OTHER,reply->reply.str);
+        return;
+    }
+
+    /* [cursor, [entry, ...]], followed by the IDs of deleted entries since
+     * Redis 7.0. */
+    if (reply->reply.type != REDIS_REPLY_ARRAY || reply->count < 3 ||
+        reply->nodes[1].type != REDIS_REPLY_STRING) {
+        __redisStreamStop(sc,REDIS_ERR_PROTOCOL,"Unexpected reply");
+        return;
+    }
+    if ((cursor = sdsnewlen(reply->buf+reply->nodes[1].off,reply->nodes[1].len)) == NULL) {
+        __redisStreamStop(sc,REDIS_ERR_OOM,"Out of memory");
+        return;
+    }
+    sdsfree(sc->cursor);
+    sc->cursor = cursor;
+    if (__redisStreamDeliver(ac,reply,2,1,&last,&lastlen) != REDIS_OK)
+        return;
+
+    /* The scan of the pending entries goes on right away, and starts over
+     * after the interval once it is done. */
+    redisStreamFlushAcks(sc);
+    if (strcmp(sc->cursor,"0-0") != 0)
+        __redisStreamClaim(sc);
+    else
+        __redisStreamClaimLater(sc);
+}
+
+/* Take over the entries that other consumers did not acknowledge for
+ * minidle milliseconds. Like XACK, XAUTOCLAIM goes over the second
+ * connection, so the interval does not depend on how long reads block. */
+static void __redisStreamClaim(redisStreamConsumer *sc) {
+    if (sc->ctl == NULL || sc->claiming || sc->stopped)
+        return;
+    if (redisAsyncCommand(sc->ctl,__redisStreamClaimReply,NULL,
+            "XAUTOCLAIM %b %b %b %lld %b COUNT %ld",
+            sc->stream,sdslen(sc->stream),sc->group,sdslen(sc->group),sc->name,sdslen(sc->name),
+            sc->minidle,sc->cursor,sdslen(sc->cursor),sc->count) == REDIS_OK)
+        sc->claiming = 1;
+    else
+        __redisStreamClaimLater(sc);
+}
+
+/* One of the connections is lost for good. */
+static void __redisStreamLost(const redisAsyncContext *ac) {
+    redisStreamConsumer *sc = ac->data;
+
+    if (sc == NULL)
+        return;
+    if (ac == sc->ac) {
+        sc->ac = NULL;
+    } else {
+        /* The timer goes with the context. */
+        sc->ctl = NULL;
+        sc->timer = NULL;
+    }
+    __redisStreamStop(sc,ac->err ? ac->err : REDIS_ERR_EOF,ac->err ? ac->errstr : "Server closed the connection");
+}
+
+static void __redisStreamConnected(const redisAsyncContext *ac, int status) {
+    if (status != REDIS_OK)
+        __redisStreamLost(ac);
+}
+
+static void __redisStreamDisconnected(const redisAsyncContext *ac, int status) {
+    ((void)status);
+    __redisStreamLost(ac);
+}
+
+/* Entries delivered by a read that was lost are pending, so the pending
+ * entries are read again first. */
+static void __redisStreamReconnected(const redisAsyncContext *ac, int status) {
+    redisStreamConsumer *sc = ac->data;
+
+    if (sc == NULL || status != REDIS_OK || sc->stopped)
+        return;
+    sdsfree(sc->history);
+    sc->history = sdsnew("0");
+    __redisStreamRead(sc);
+}
+
+/* IDs of XACK commands that were lost are queued again, and the claim timer
+ * survives the reconnection. */
+static void __redisStreamCtlReconnected(const redisAsyncContext *ac, int status) {
+    redisStreamConsumer *sc = ac->data;
+
+    if (sc == NULL || status != REDIS_OK || sc->stopped)
+        return;
+    redisStreamFlushAcks(sc);
+}
+
+static redisAsyncContext *__redisStreamConnect(redisStreamConsumer *sc, redisReconnectCallback *fn) {
+    redisReconnectOptions opts;
+    redisAsyncContext *ac;
+
+    ac = __redisAsyncOpen(sc->host,sc->port,NULL,sc->attach,sc->attachdata,&sc->err,sc->errstr);
+    if (ac == NULL)
+        return NULL;
+    /* Claims run on a timer of the context. */
+    if ((sc->claim.tv_sec > 0 || sc->claim.tv_usec > 0) && ac->ev.scheduleTimer == NULL) {
+        __redisStreamSetError(sc,REDIS_ERR_OTHER,"The event library does not support timers");
+        redisAsyncFree(ac);
+        return NULL;
+    }
+    ac->c.reader->fn = &__redisStreamFunctions;
+
+    /* Commands of a lost connection are not sent again, their callbacks
+     * decide what to do. */
+    memset(&opts,0,sizeof(opts));
+    opts.delay.tv_usec = REDIS_STREAM_RECONNECT_DELAY*1000;
+    opts.maxdelay.tv_sec = REDIS_STREAM_RECONNECT_MAXDELAY/1000;
+    opts.replay = REDIS_REPLAY_NONE;
+    redisAsyncSetReconnect(ac,&opts,fn);
+
+    ac->data = sc;
+    redisAsyncSetConnectCallback(ac,__redisStreamConnected);
+    redisAsyncSetDisconnectCallback(ac,__redisStreamDisconnected);
+    return ac;
+}
+
+/* Connect to a server at a host:port address, and read a stream as a
+ * consumer of a group, which has to exist. The pending entries of the
+ * consumer are delivered first, then new entries. Every batch is handed to
+ * the callback. Reads block on one connection, XACK and XAUTOCLAIM are sent
+ * over a second one. Both are attached to the event library with the attach
+ * function. */
+redisStreamConsumer *redisStreamConnect(const char *addr, const char *stream, const char *group, const char *consumer,
+                                        const redisStreamOptions *opts, redisStreamCallback *fn, void *privdata,
+                                        redisStreamAttachFn *attach, void *data) {
+    redisStreamConsumer *sc;
+    const char *host;
+    size_t hostlen;
+
+    sc = calloc(1,sizeof(*sc));
+    if (sc == NULL)
+        return NULL;
+
+    sc->attach = attach;
+    sc->attachdata = data;
+    sc->fn = fn;
+    sc->privdata = privdata;
+    sc->count = (opts && opts->count > 0) ? opts->count : REDIS_STREAM_COUNT;
+    sc->block = (opts && opts->block > 0) ? opts->block : REDIS_STREAM_BLOCK;
+    sc->maxack = (opts && opts->maxack > 0) ? opts->maxack : REDIS_STREAM_MAXACK;
+    sc->minidle = (opts && opts->minidle > 0) ? opts->minidle : REDIS_STREAM_MINIDLE;
+    if (opts != NULL)
+        sc->claim = opts->claim;
+    sc->stopped = 1;
+
+    sc->stream = sdsnew(stream);
+    sc->group = sdsnew(group);
+    sc->name = sdsnew(consumer);
+    sc->history = sdsnew("0");
+    sc->cursor = sdsnew("0-0");
+    sc->ackslots = sc->maxack;
+    sc->acks = malloc(sc->ackslots*sizeof(*sc->acks));
+    if (sc->stream == NULL || sc->group == NULL || sc->name == NULL || sc->history == NULL ||
+        sc->cursor == NULL || sc->acks == NULL) {
+        __redisStreamSetError(sc,REDIS_ERR_OOM,"Out of memory");
+        return sc;
+    }
+    if (__redisSplitAddress(addr,strlen(addr),&host,&hostlen,&sc->port) != REDIS_OK) {
+        __redisStreamSetError(sc,REDIS_ERR_OTHER,"Invalid server address");
+        return sc;
+    }
+    if ((sc->host = malloc(hostlen+1)) == NULL) {
+        __redisStreamSetError(sc,REDIS_ERR_OOM,"Out of memory");
+        return sc;
+    }
+    memcpy(sc->host,host,hostlen);
+    sc->host[hostlen] = '\0';
+    if ((sc->ac = __redisStreamConnect(sc,__redisStreamReconnected)) == NULL)
+        return sc;
+    if ((sc->ctl = __redisStreamConnect(sc,__redisStreamCtlReconnected)) == NULL)
+        return sc;
+
+    sc->stopped = 0;
+    __redisStreamRead(sc);
+    if (sc->claim.tv_sec > 0 || sc->claim.tv_usec > 0)
+        __redisStreamClaimLater(sc);
+    return sc;
+}
+
+/* Acknowledgements that were not sent yet are sent before the connection is
+ * closed, which happens once the replies to the commands in flight arrived. */
+void redisStreamFree(redisStreamConsumer *sc) {
+    redisAsyncContext *ac;
+    size_t j;
+
+    if (sc == NULL)
+        return;
+    if ((ac = sc->ctl) != NULL) {
+        redisStreamFlushAcks(sc);
+        if (sc->timer != NULL)
+            redisAsyncCancelTimer(ac,sc->timer);
+        ac->data = NULL;
+        redisAsyncDisconnect(ac);
+    }
+    if ((ac = sc->ac) != NULL) {
+        ac->data = NULL;
+        redisAsyncDisconnect(ac);
+    }
+    for (j = 0; j < sc->nacks; j++)
+        sdsfree(sc->acks[j]);
+    free(sc->acks);
+    sdsfree(sc->stream);
+    sdsfree(sc->group);
+    sdsfree(sc->name);
+    sdsfree(sc->history);
+    sdsfree(sc->cursor);
+    free(sc->host);
+    free(sc);
+}
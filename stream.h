@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HIREDIS_STREAM_H
+#define __HIREDIS_STREAM_H
+#include "hiredis.h"
+#include "async.h"
+#include "sds.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Defaults of redisStreamOptions */
+#define REDIS_STREAM_COUNT 100 /* Entries read at once */
+#define REDIS_STREAM_BLOCK 5000 /* Milliseconds a read waits for entries */
+#define REDIS_STREAM_MAXACK 100 /* IDs acknowledged at once */
+#define REDIS_STREAM_MINIDLE 60000 /* Milliseconds before pending entries of
+                                    * other consumers are reclaimed */
+
+/* Delays between attempts to reconnect to the server, in milliseconds */
+#define REDIS_STREAM_RECONNECT_DELAY 100
+#define REDIS_STREAM_RECONNECT_MAXDELAY 5000
+
+typedef struct redisStreamField {
+    const char *name;
+    size_t namelen;
+    const char *value;
+    size_t valuelen;
+} redisStreamField;
+
+/* Entry of a batch. The strings are only valid during the callback. */
+typedef struct redisStreamEntry {
+    const char *id;
+    size_t idlen;
+    redisStreamField *fields; /* NULL when the entry was deleted */
+    size_t nfields;
+} redisStreamEntry;
+
+typedef struct redisStreamBatch {
+    redisStreamEntry *entries;
+    size_t count;
+    int claimed; /* Reclaimed from other consumers with XAUTOCLAIM */
+} redisStreamBatch;
+
+typedef struct redisStreamOptions {
+    long count; /* COUNT of reads, 0 for REDIS_STREAM_COUNT */
+    long block; /* BLOCK of reads, 0 for REDIS_STREAM_BLOCK */
+    long maxack; /* IDs per XACK, 0 for REDIS_STREAM_MAXACK */
+    struct timeval claim; /* Interval of XAUTOCLAIM, zero to not reclaim */
+    long long minidle; /* Idle time of reclaimed entries, 0 for
+                        * REDIS_STREAM_MINIDLE */
+} redisStreamOptions;
+
+struct redisStreamConsumer;
+
+/* Attaches a connection to the event library, and should return REDIS_OK on
+ * success, like the redisLibeventAttach() family. */
+typedef int (redisStreamAttachFn)(redisAsyncContext *ac, void *data);
+
+/* Called with every batch of entries. The batch is NULL when the consumer
+ * stopped because of an error. */
+typedef void (redisStreamCallback)(struct redisStreamConsumer *sc, const redisStreamBatch *batch, void *privdata);
+
+/* Member of a consumer group that reads a stream on its own connections */
+typedef struct redisStreamConsumer {
+    int err; /* Error flags, 0 when there is no error */
+    char errstr[128]; /* String representation of error when applicable */
+
+    redisStreamAttachFn *attach;
+    void *attachdata;
+    char *host;
+    int port;
+    redisAsyncContext *ac; /* Of reads, NULL once it is lost for good */
+    redisAsyncContext *ctl; /* Of XACK and XAUTOCLAIM, NULL once it is lost
+                             * for good */
+
+    sds stream;
+    sds group;
+    sds name;
+    long count;
+    long block;
+    long maxack;
+    struct timeval claim;
+    long long minidle;
+
+    redisStreamCallback *fn;
+    void *privdata;
+
+    sds history; /* Own pending entries after this ID are read again, NULL
+                  * once they were all read */
+    int reading; /* A read is in flight */
+    int claiming; /* An XAUTOCLAIM is in flight */
+    sds cursor; /* Of XAUTOCLAIM */
+    redisAsyncTimer *timer; /* Of the next XAUTOCLAIM */
+    int stopped;
+
+    sds *acks; /* IDs to acknowledge */
+    size_t nacks;
+    size_t ackslots;
+
+    unsigned long long entries; /* Entries delivered */
+    unsigned long long claimed; /* Entries reclaimed from other consumers */
+    unsigned long long acked; /* Entries the server acknowledged */
+} redisStreamConsumer;
+
+redisStreamConsumer *redisStreamConnect(const char *addr, const char *stream, const char *group, const char *consumer,
+                                        const redisStreamOptions *opts, redisStreamCallback *fn, void *privdata,
+                                        redisStreamAttachFn *attach, void *data);
+int redisStreamAck(redisStreamConsumer *sc, const char *id, size_t idlen);
+int redisStreamFlushAcks(redisStreamConsumer *sc);
+void redisStreamFree(redisStreamConsumer *sc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
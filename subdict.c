@@ -0,0 +1,345 @@
+/* Hash table of pub/sub subscriptions, see subdict.h.
+ *
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "subdict.h"
+
+/* Marks a slot whose entry was deleted. Lookups continue probing past it. */
+static char subdictDeletedName;
+#define SUBDICT_DELETED ((sds)&subdictDeletedName)
+#define subdictIsLive(de) ((de)->name != NULL && (de)->name != SUBDICT_DELETED)
+
+/* ----------------------------- hash function ------------------------------ */
+
+/* SipHash-2-4. The key is random, so that channel names picked by someone
+ * else cannot be crafted to collide. */
+static uint64_t subdictKey[2];
+static pthread_once_t subdictKeyOnce = PTHREAD_ONCE_INIT;
+
+static void subdictInitKey(void) {
+    int fd;
+
+    fd = open("/dev/urandom",O_RDONLY);
+    if (fd == -1 || read(fd,subdictKey,sizeof(subdictKey)) != sizeof(subdictKey)) {
+        /* Better than nothing. */
+        subdictKey[0] = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+        subdictKey[1] = (uint64_t)(uintptr_t)&subdictKey ^ (uint64_t)clock();
+    }
+    if (fd != -1)
+        close(fd);
+}
+
+#define ROTL(x,b) (uint64_t)(((x) << (b)) | ((x) >> (64-(b))))
+
+#define U8TO64_LE(p) \
+    (((uint64_t)((p)[0])) | ((uint64_t)((p)[1]) << 8) | \
+     ((uint64_t)((p)[2]) << 16) | ((uint64_t)((p)[3]) << 24) | \
+     ((uint64_t)((p)[4]) << 32) | ((uint64_t)((p)[5]) << 40) | \
+     ((uint64_t)((p)[6]) << 48) | ((uint64_t)((p)[7]) << 56))
+
+#define SIPROUND do { \
+        v0 += v1; v1 = ROTL(v1,13); v1 ^= v0; v0 = ROTL(v0,32); \
+        v2 += v3; v3 = ROTL(v3,16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3,21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1,17); v1 ^= v2; v2 = ROTL(v2,32); \
+    } while(0)
+
+static uint64_t subdictSipHash(const uint8_t *in, size_t len, uint64_t k0, uint64_t k1) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    uint64_t b = ((uint64_t)len) << 56;
+    const uint8_t *end = in+len-(len%8);
+    uint64_t m;
+
+    for (; in != end; in += 8) {
+        m = U8TO64_LE(in);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    switch (len & 7) {
+    case 7: b |= ((uint64_t)in[6]) << 48; /* fall through */
+    case 6: b |= ((uint64_t)in[5]) << 40; /* fall through */
+    case 5: b |= ((uint64_t)in[4]) << 32; /* fall through */
+    case 4: b |= ((uint64_t)in[3]) << 24; /* fall through */
+    case 3: b |= ((uint64_t)in[2]) << 16; /* fall through */
+    case 2: b |= ((uint64_t)in[1]) << 8; /* fall through */
+    case 1: b |= ((uint64_t)in[0]); break;
+    case 0: break;
+    }
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint64_t subdictHash(const char *name, size_t len) {
+    pthread_once(&subdictKeyOnce,subdictInitKey);
+    return subdictSipHash((const uint8_t*)name,len,subdictKey[0],subdictKey[1]);
+}
+
+/* ---------------------------- private helpers ----------------------------- */
+
+static unsigned long _subdictNextPower(unsigned long size) {
+    unsigned long i = SUBDICT_INITIAL_SIZE;
+
+    while (i < size)
+        i *= 2;
+    return i;
+}
+
+static subdictEntry *_subdictLookup(subdictTable *t, uint64_t hash,
+                                    const char *name, size_t len) {
+    unsigned long mask = t->size-1, i;
+    subdictEntry *de;
+
+    if (t->size == 0)
+        return NULL;
+
+    /* There is always a free slot, so probing ends. */
+    for (i = hash & mask; ; i = (i+1) & mask) {
+        de = &t->slots[i];
+        if (de->name == NULL)
+            return NULL;
+        if (de->name != SUBDICT_DELETED && de->hash == hash &&
+            sdslen(de->name) == len && memcmp(de->name,name,len) == 0)
+            return de;
+    }
+}
+
+/* Returns the slot to store a new entry in, reusing deleted slots. */
+static subdictEntry *_subdictFreeSlot(subdictTable *t, uint64_t hash) {
+    unsigned long mask = t->size-1, i;
+    subdictEntry *de;
+
+    for (i = hash & mask; ; i = (i+1) & mask) {
+        de = &t->slots[i];
+        if (de->name == NULL) {
+            t->filled++;
+            return de;
+        }
+        if (de->name == SUBDICT_DELETED)
+            return de;
+    }
+}
+
+/* Move up to n slots of ht[1] to ht[0]. */
+static void _subdictRehash(subdict *d, unsigned long n) {
+    subdictTable *from = &d->ht[1], *to = &d->ht[0];
+    subdictEntry *de, *ne;
+
+    if (from->size == 0)
+        return;
+
+    /* Entries are about to move. */
+    d->last = NULL;
+    while (n-- > 0 && d->rehashidx < from->size) {
+        de = &from->slots[d->rehashidx++];
+        if (!subdictIsLive(de))
+            continue;
+
+        ne = _subdictFreeSlot(to,de->hash);
+        *ne = *de;
+        to->used++;
+
+        /* Keep probe sequences in ht[1] intact for lookups. */
+        de->name = SUBDICT_DELETED;
+        from->used--;
+    }
+
+    if (d->rehashidx == from->size) {
+        free(from->slots);
+        memset(from,0,sizeof(*from));
+        d->rehashidx = 0;
+    }
+}
+
+static void _subdictRehashStep(subdict *d) {
+    _subdictRehash(d,d->rehashstep);
+}
+
+/* Start moving the entries to a new table with room for twice the current
+ * number of entries, which also drops deleted slots. */
+static int _subdictResize(subdict *d) {
+    subdictTable t;
+    unsigned long budget;
+
+    /* Finish moving entries of the previous resize first. */
+    _subdictRehash(d,d->ht[1].size);
+
+    t.size = _subdictNextPower((d->ht[0].used+1)*2);
+    t.used = 0;
+    t.filled = 0;
+    t.slots = calloc(t.size,sizeof(*t.slots));
+    if (t.slots == NULL)
+        return REDIS_ERR;
+
+    if (d->ht[0].size == 0) {
+        d->ht[0] = t;
+        return REDIS_OK;
+    }
+
+    d->ht[1] = d->ht[0];
+    d->ht[0] = t;
+    d->rehashidx = 0;
+
+    /* All entries must have moved before the new table needs to grow: every
+     * operation moves enough slots to be done after the number of additions
+     * the new table can take. */
+    budget = t.size/4*3-d->ht[1].used;
+    d->rehashstep = d->ht[1].size/budget+1;
+    if (d->rehashstep < SUBDICT_REHASH_STEP)
+        d->rehashstep = SUBDICT_REHASH_STEP;
+    return REDIS_OK;
+}
+
+/* ----------------------------- API implementation ------------------------- */
+
+static subdict *subdictCreate(void) {
+    return calloc(1,sizeof(subdict));
+}
+
+static void subdictRelease(subdict *d) {
+    subdictEntry *de;
+    unsigned long i;
+    int j;
+
+    for (j = 0; j < 2; j++) {
+        for (i = 0; i < d->ht[j].size; i++) {
+            de = &d->ht[j].slots[i];
+            if (subdictIsLive(de))
+                sdsfree(de->name);
+        }
+        free(d->ht[j].slots);
+    }
+    free(d);
+}
+
+static subdictEntry *subdictFind(subdict *d, const char *name, size_t len) {
+    subdictEntry *de = d->last;
+    uint64_t hash;
+
+    if (de != NULL && sdslen(de->name) == len && memcmp(de->name,name,len) == 0)
+        return de;
+
+    _subdictRehashStep(d);
+    hash = subdictHash(name,len);
+    de = _subdictLookup(&d->ht[0],hash,name,len);
+    if (de == NULL)
+        de = _subdictLookup(&d->ht[1],hash,name,len);
+    if (de != NULL)
+        d->last = de;
+    return de;
+}
+
+/* Add a subscription or replace its callback. */
+static int subdictReplace(subdict *d, const char *name, size_t len, const redisCallback *cb) {
+    subdictEntry *de;
+    uint64_t hash;
+    sds copy;
+
+    _subdictRehashStep(d);
+    hash = subdictHash(name,len);
+    de = _subdictLookup(&d->ht[0],hash,name,len);
+    if (de == NULL)
+        de = _subdictLookup(&d->ht[1],hash,name,len);
+    if (de != NULL) {
+        de->cb = *cb;
+        return REDIS_OK;
+    }
+
+    if ((d->ht[0].filled+1)*4 > d->ht[0].size*3 && _subdictResize(d) != REDIS_OK)
+        return REDIS_ERR;
+    if ((copy = sdsnewlen(name,len)) == NULL)
+        return REDIS_ERR;
+
+    de = _subdictFreeSlot(&d->ht[0],hash);
+    de->name = copy;
+    de->hash = hash;
+    de->cb = *cb;
+    d->ht[0].used++;
+    return REDIS_OK;
+}
+
+/* Delete an entry returned by subdictFind(). */
+static void subdictDelete(subdict *d, subdictEntry *de) {
+    subdictTable *t = &d->ht[0];
+
+    if (de < t->slots || de >= t->slots+t->size)
+        t = &d->ht[1];
+    sdsfree(de->name);
+    de->name = SUBDICT_DELETED;
+    t->used--;
+    if (d->last == de)
+        d->last = NULL;
+
+    _subdictRehashStep(d);
+
+    /* Shrink when mostly empty. */
+    if (d->ht[1].size == 0 && d->ht[0].size > SUBDICT_INITIAL_SIZE &&
+        d->ht[0].used*8 < d->ht[0].size)
+        _subdictResize(d);
+}
+
+/* Iterate over all entries, starting with *cursor set to 0. Returns NULL at
+ * the end. The table must not be modified while iterating. */
+static subdictEntry *subdictNext(subdict *d, unsigned long *cursor) {
+    subdictEntry *de;
+
+    while (*cursor < d->ht[0].size+d->ht[1].size) {
+        if (*cursor < d->ht[0].size)
+            de = &d->ht[0].slots[*cursor];
+        else
+            de = &d->ht[1].slots[*cursor-d->ht[0].size];
+        (*cursor)++;
+        if (subdictIsLive(de))
+            return de;
+    }
+    return NULL;
+}
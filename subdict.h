@@ -0,0 +1,88 @@
+/* Hash table of pub/sub subscriptions.
+ *
+ * Maps channel and pattern names to their callbacks. This is an open
+ * addressing table with linear probing that stores the callbacks inline,
+ * hashed with SipHash using a random key. It grows and shrinks
+ * incrementally, so that subscribing to many channels does not stall the
+ * event loop while the table is resized.
+ *
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __SUBDICT_H
+#define __SUBDICT_H
+
+#include <stdint.h>
+#include "async.h"
+#include "sds.h"
+
+typedef struct subdictEntry {
+    sds name; /* NULL for a free slot */
+    uint64_t hash;
+    redisCallback cb;
+} subdictEntry;
+
+typedef struct subdictTable {
+    subdictEntry *slots;
+    unsigned long size; /* Power of two, or 0 */
+    unsigned long used; /* Subscriptions */
+    unsigned long filled; /* Subscriptions and deleted slots */
+} subdictTable;
+
+typedef struct subdict {
+    /* While resizing, entries are moved from ht[1] to ht[0] a few slots at a
+     * time. New entries are always added to ht[0]. */
+    subdictTable ht[2];
+    unsigned long rehashidx; /* Next slot of ht[1] to move */
+    unsigned long rehashstep; /* Slots of ht[1] to move per operation */
+
+    /* Entry found by the last lookup. Publishers tend to send bursts to the
+     * same channel, so it is checked first. */
+    subdictEntry *last;
+} subdict;
+
+/* This is the initial size of every table */
+#define SUBDICT_INITIAL_SIZE 8
+
+/* Minimum number of slots moved to the new table by every operation while
+ * resizing. More are moved when needed to finish before ht[0] fills up. */
+#define SUBDICT_REHASH_STEP 64
+
+#define subdictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
+
+/* API */
+static subdict *subdictCreate(void);
+static void subdictRelease(subdict *d);
+static subdictEntry *subdictFind(subdict *d, const char *name, size_t len);
+static int subdictReplace(subdict *d, const char *name, size_t len, const redisCallback *cb);
+static void subdictDelete(subdict *d, subdictEntry *de);
+static subdictEntry *subdictNext(subdict *d, unsigned long *cursor);
+
+#endif /* __SUBDICT_H */
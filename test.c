@@ -3,14 +3,36 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <sys/time.h>
 #include <assert.h>
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
 #include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/wait.h>
 
 #include "hiredis.h"
+#include "async.h"
+#include "pool.h"
+#include "cluster.h"
+#include "script.h"
+#include "scan.h"
+#include "sentinel.h"
+#include "router.h"
+#include "cache.h"
+#include "stream.h"
+#include "sds.h"
+#include "net.h"
+
+/* The subscription table is private to async.c, which includes it. */
+#include "subdict.c"
 
 enum connection_type {
     CONN_TCP,
@@ -83,7 +105,7 @@ static int disconnect(redisContext *c, int keep_fd) {
     return -1;
 }
 
-static redisContext *connect(struct config config) {
+static redisContext *do_connect(struct config config) {
     redisContext *c = NULL;
 
     if (config.type == CONN_TCP) {
@@ -113,6 +135,285 @@ static redisContext *connect(struct config config) {
     return select_database(c);
 }
 
+/* A small poll(2) based event loop, to run async contexts in the tests. */
+#define TEST_LOOP_SIZE 64
+
+typedef struct test_loop_events {
+    redisAsyncContext *ac;
+    int reading, writing;
+    long long timer; /* When the timer fires, 0 when it is not scheduled */
+} test_loop_events;
+
+static test_loop_events *test_loop[TEST_LOOP_SIZE];
+
+static void test_loop_add_read(void *privdata) { ((test_loop_events*)privdata)->reading = 1; }
+static void test_loop_del_read(void *privdata) { ((test_loop_events*)privdata)->reading = 0; }
+static void test_loop_add_write(void *privdata) { ((test_loop_events*)privdata)->writing = 1; }
+static void test_loop_del_write(void *privdata) { ((test_loop_events*)privdata)->writing = 0; }
+
+static void test_loop_schedule_timer(void *privdata, struct timeval tv) {
+    ((test_loop_events*)privdata)->timer = usec()+tv.tv_sec*1000000LL+tv.tv_usec;
+}
+
+static void test_loop_cancel_timer(void *privdata) {
+    ((test_loop_events*)privdata)->timer = 0;
+}
+
+static void test_loop_cleanup(void *privdata) {
+    int j;
+
+    for (j = 0; j < TEST_LOOP_SIZE; j++)
+        if (test_loop[j] == privdata)
+            test_loop[j] = NULL;
+    free(privdata);
+}
+
+/* Has the signature of the attach functions of cache, stream, router, ... */
+static int test_loop_attach(redisAsyncContext *ac, void *data) {
+    test_loop_events *e;
+    int j;
+    ((void)data);
+
+    for (j = 0; j < TEST_LOOP_SIZE && test_loop[j] != NULL; j++);
+    assert(j < TEST_LOOP_SIZE && ac->ev.data == NULL);
+    e = calloc(1,sizeof(*e));
+    e->ac = ac;
+    test_loop[j] = e;
+
+    ac->ev.addRead = test_loop_add_read;
+    ac->ev.delRead = test_loop_del_read;
+    ac->ev.addWrite = test_loop_add_write;
+    ac->ev.delWrite = test_loop_del_write;
+    ac->ev.cleanup = test_loop_cleanup;
+    ac->ev.scheduleTimer = test_loop_schedule_timer;
+    ac->ev.cancelTimer = test_loop_cancel_timer;
+    ac->ev.data = e;
+    return REDIS_OK;
+}
+
+/* Run the loop until *done is set, or for at most the given time. Returns
+ * whether *done was set. */
+static int test_loop_run(volatile int *done, long long timeout) {
+    struct pollfd fds[TEST_LOOP_SIZE];
+    test_loop_events *ev[TEST_LOOP_SIZE];
+    long long end = usec()+timeout, now, next;
+    int j, n;
+
+    while ((done == NULL || !*done) && (now = usec()) < end) {
+        next = end;
+        for (j = n = 0; j < TEST_LOOP_SIZE; j++) {
+            test_loop_events *e = test_loop[j];
+            if (e == NULL)
+                continue;
+            if (e->timer && e->timer < next)
+                next = e->timer;
+            if (!e->reading && !e->writing)
+                continue;
+            ev[n] = e;
+            fds[n].fd = e->ac->c.fd;
+            fds[n].events = (e->reading ? POLLIN : 0) | (e->writing ? POLLOUT : 0);
+            fds[n].revents = 0;
+            n++;
+        }
+        poll(fds,n,next > now ? (int)((next-now+999)/1000) : 0);
+
+        /* A handler can free any context, so every one is looked up again. */
+        for (j = 0; j < n; j++) {
+            int k, live = 0;
+            for (k = 0; k < TEST_LOOP_SIZE; k++)
+                live = live || test_loop[k] == ev[j];
+            if (!live)
+                continue;
+            if (fds[j].revents & (POLLIN | POLLERR | POLLHUP) && ev[j]->reading)
+                redisAsyncHandleRead(ev[j]->ac);
+            else if (fds[j].revents & (POLLOUT | POLLERR | POLLHUP) && ev[j]->writing)
+                redisAsyncHandleWrite(ev[j]->ac);
+        }
+        now = usec();
+        for (j = 0; j < TEST_LOOP_SIZE; j++) {
+            test_loop_events *e = test_loop[j];
+            if (e != NULL && e->timer && e->timer <= now) {
+                e->timer = 0;
+                redisAsyncHandleTimeout(e->ac);
+            }
+        }
+    }
+    return done != NULL && *done;
+}
+
+/* Connects to the database that the blocking tests use. */
+static redisAsyncContext *async_connect(struct config config) {
+    redisAsyncContext *ac = redisAsyncConnect(config.tcp.host,config.tcp.port);
+    assert(ac != NULL && ac->err == 0);
+    test_loop_attach(ac,NULL);
+    redisAsyncCommand(ac,NULL,NULL,"SELECT 9");
+    return ac;
+}
+
+/* A fake server in a child process, for the tests that need replies that a
+ * real server would not give, or a server that goes away. Every command is
+ * passed to the handler as an array of strings. */
+#define FAKE_CLIENTS 16
+
+typedef struct fake_client {
+    int fd;
+    int close; /* Set by the handler to close the connection after replying */
+    int state; /* For the handler, 0 for new connections */
+    redisReader *reader;
+    sds out;
+} fake_client;
+
+typedef void (fake_handler)(fake_client *fc, redisReply *cmd, void *privdata);
+
+static void fake_reply(fake_client *fc, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap,fmt);
+    fc->out = sdscatvprintf(fc->out,fmt,ap);
+    va_end(ap);
+}
+
+/* Replies with a bulk string, or a nil bulk for NULL. */
+static void fake_bulk(fake_client *fc, const char *str) {
+    if (str == NULL)
+        fake_reply(fc,"$-1\r\n");
+    else
+        fake_reply(fc,"$%zu\r\n%s\r\n",strlen(str),str);
+}
+
+static int fake_is(redisReply *cmd, const char *name) {
+    return cmd->elements > 0 && strcasecmp(cmd->element[0]->str,name) == 0;
+}
+
+static void fake_server_run(int l, fake_handler *fn, void *privdata, pid_t parent) {
+    struct pollfd fds[FAKE_CLIENTS+1];
+    fake_client clients[FAKE_CLIENTS];
+    char buf[16384];
+    void *reply;
+    int j, n;
+
+    memset(clients,0,sizeof(clients));
+    for (j = 0; j < FAKE_CLIENTS; j++)
+        clients[j].fd = -1;
+
+    /* The server goes away with the tests, even when they crash. */
+    while (getppid() == parent) {
+        fds[0].fd = l;
+        fds[0].events = POLLIN;
+        for (j = 0; j < FAKE_CLIENTS; j++) {
+            fds[j+1].fd = clients[j].fd;
+            fds[j+1].events = POLLIN;
+            if (clients[j].fd != -1 && sdslen(clients[j].out) > 0)
+                fds[j+1].events |= POLLOUT;
+            fds[j+1].revents = 0;
+        }
+        if (poll(fds,FAKE_CLIENTS+1,100) <= 0)
+            continue;
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(l,NULL,NULL);
+            for (j = 0; j < FAKE_CLIENTS && clients[j].fd != -1; j++);
+            if (fd != -1 && j == FAKE_CLIENTS) {
+                close(fd);
+            } else if (fd != -1) {
+                clients[j].fd = fd;
+                clients[j].close = 0;
+                clients[j].state = 0;
+                clients[j].reader = redisReaderCreate();
+                clients[j].out = sdsempty();
+            }
+        }
+
+        for (j = 0; j < FAKE_CLIENTS; j++) {
+            fake_client *fc = &clients[j];
+            if (fc->fd == -1)
+                continue;
+            if (fds[j+1].revents & POLLIN) {
+                if ((n = read(fc->fd,buf,sizeof(buf))) <= 0) {
+                    fc->close = 1;
+                    sdsclear(fc->out);
+                } else {
+                    redisReaderFeed(fc->reader,buf,n);
+                    while (!fc->close && redisReaderGetReply(fc->reader,&reply) == REDIS_OK &&
+                           reply != NULL)
+                    {
+                        if (((redisReply*)reply)->type == REDIS_REPLY_ARRAY)
+                            fn(fc,reply,privdata);
+                        freeReplyObject(reply);
+                    }
+                }
+            }
+            if (sdslen(fc->out) > 0) {
+                if ((n = write(fc->fd,fc->out,sdslen(fc->out))) > 0)
+                    sdsrange(fc->out,n,-1);
+                else
+                    fc->close = 1;
+            }
+            if (fc->close && sdslen(fc->out) == 0) {
+                close(fc->fd);
+                fc->fd = -1;
+                redisReaderFree(fc->reader);
+                sdsfree(fc->out);
+            }
+        }
+    }
+    _exit(0);
+}
+
+/* Listens on the given port, or on any free port when it is 0. Returns the
+ * socket, or -1 when the port is taken. */
+static int fake_server_listen(int *port) {
+    struct sockaddr_in sa;
+    socklen_t salen = sizeof(sa);
+    int l, yes = 1;
+
+    l = socket(AF_INET,SOCK_STREAM,0);
+    assert(l != -1);
+    setsockopt(l,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes));
+    memset(&sa,0,sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(*port);
+    if (bind(l,(struct sockaddr*)&sa,sizeof(sa)) != 0 || listen(l,16) != 0) {
+        close(l);
+        return -1;
+    }
+    assert(getsockname(l,(struct sockaddr*)&sa,&salen) == 0);
+    *port = ntohs(sa.sin_port);
+    return l;
+}
+
+/* Serves the socket in a child process. The handler gets a copy of the
+ * privdata, as it was when the server started. Returns the pid. */
+static pid_t fake_server_fork(int l, fake_handler *fn, void *privdata) {
+    pid_t pid, parent = getpid();
+
+    /* Output buffered so far must not be written by the child as well. */
+    fflush(stdout);
+    pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        /* Connections of the tests are closed when the tests close them. */
+        int fd;
+        for (fd = 3; fd < 1024; fd++)
+            if (fd != l) close(fd);
+        fake_server_run(l,fn,privdata,parent);
+    }
+    close(l);
+    return pid;
+}
+
+/* Returns the pid of the server, or -1 when the port is taken. */
+static pid_t fake_server_start(int *port, fake_handler *fn, void *privdata) {
+    int l = fake_server_listen(port);
+    return l == -1 ? -1 : fake_server_fork(l,fn,privdata);
+}
+
+static void fake_server_stop(pid_t pid) {
+    kill(pid,SIGKILL);
+    waitpid(pid,NULL,0);
+}
+
 static void test_format_commands(void) {
     char *cmd;
     int len;
@@ -223,7 +524,7 @@ static void test_append_formatted_commands(struct config config) {
     char *cmd;
     int len;
 
-    c = connect(config);
+    c = do_connect(config);
 
     test("Append format command: ");
 
@@ -318,6 +619,142 @@ static void test_reply_reader(void) {
     redisReaderFree(reader);
 }
 
+static void test_key_slot(void) {
+    const char *keys[37];
+    size_t keylens[37];
+    unsigned int slots[37];
+    char buf[37][64];
+    int i, ok = 1;
+
+    test("Key slot is the CRC16 of the key: ");
+    test_cond(redisKeySlot("123456789",9) == (0x31c3 & 16383) &&
+              redisKeySlot("foo",3) == 12182);
+
+    test("Key slot only hashes a non-empty hash tag: ");
+    test_cond(redisKeySlot("{user1000}.following",20) == redisKeySlot("user1000",8) &&
+              redisKeySlot("foo{}{bar}",10) != redisKeySlot("bar",3) &&
+              redisKeySlot("foo{{bar}}zap",13) == redisKeySlot("{bar",4));
+
+    test("Key slots of a batch match those of single keys: ");
+    for (i = 0; i < 37; i++) {
+        snprintf(buf[i],sizeof(buf[i]),"%s%d:%.*s",i % 5 ? "key" : "{tag}",i,i,
+                 "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz");
+        keys[i] = buf[i];
+        keylens[i] = strlen(buf[i]);
+    }
+    redisKeySlotsBatch(keys,keylens,37,slots);
+    for (i = 0; i < 37; i++)
+        if (slots[i] != redisKeySlot(keys[i],keylens[i])) ok = 0;
+    test_cond(ok);
+}
+
+static int subdict_add(subdict *d, const char *fmt, long i) {
+    redisCallback cb;
+    char name[32];
+    int len;
+
+    memset(&cb,0,sizeof(cb));
+    cb.privdata = (void*)i;
+    len = snprintf(name,sizeof(name),fmt,i);
+    return subdictReplace(d,name,len,&cb);
+}
+
+static subdictEntry *subdict_find(subdict *d, const char *fmt, long i) {
+    char name[32];
+    int len = snprintf(name,sizeof(name),fmt,i);
+    return subdictFind(d,name,len);
+}
+
+/* Returns whether entries from..to-1 are found with their own callback. */
+static int subdict_has(subdict *d, const char *fmt, long from, long to) {
+    subdictEntry *de;
+    long i;
+
+    for (i = from; i < to; i++) {
+        de = subdict_find(d,fmt,i);
+        if (de == NULL || de->cb.privdata != (void*)i)
+            return 0;
+    }
+    return 1;
+}
+
+static unsigned long subdict_count(subdict *d) {
+    unsigned long cursor = 0, n = 0;
+
+    while (subdictNext(d,&cursor) != NULL)
+        n++;
+    return n;
+}
+
+static void test_subdict(void) {
+    subdict *d = subdictCreate();
+    redisCallback cb;
+    unsigned long size, filled;
+    int ok = 1, rehashing = 0, nested = 0;
+    long i;
+
+    test("Subscription table finds entries while rehashing: ");
+    for (i = 0; i < 100000; i++) {
+        /* A resize must never have to finish the previous one first. */
+        if ((d->ht[0].filled+1)*4 > d->ht[0].size*3 &&
+            d->ht[1].size-d->rehashidx > d->rehashstep)
+            nested = 1;
+        assert(subdict_add(d,"channel:%ld",i) == REDIS_OK);
+        if (d->ht[1].size != 0 && !rehashing && !subdict_has(d,"channel:%ld",0,i+1))
+            ok = 0;
+        rehashing = d->ht[1].size != 0;
+    }
+    test_cond(ok && subdict_has(d,"channel:%ld",0,100000) &&
+              subdictSize(d) == 100000 && subdict_count(d) == 100000);
+
+    test("Subscription table moves every entry before growing again: ");
+    test_cond(!nested);
+
+    test("Subscription table replaces the callback of an entry: ");
+    memset(&cb,0,sizeof(cb));
+    subdictReplace(d,"channel:7",9,&cb);
+    test_cond(subdictSize(d) == 100000 &&
+              subdict_find(d,"channel:%ld",7)->cb.privdata == NULL);
+    subdict_add(d,"channel:%ld",7);
+
+    test("Subscription table probes past deleted entries: ");
+    for (i = 0; i < 100000; i += 2)
+        subdictDelete(d,subdict_find(d,"channel:%ld",i));
+    for (i = 0; i < 100000 && ok; i++) {
+        if (i % 2 == 0)
+            ok = subdict_find(d,"channel:%ld",i) == NULL;
+        else
+            ok = subdict_has(d,"channel:%ld",i,i+1);
+    }
+    test_cond(ok && subdictSize(d) == 50000 && subdict_count(d) == 50000);
+
+    test("Subscription table reuses deleted slots: ");
+    while (d->ht[1].size != 0)
+        subdict_find(d,"channel:%ld",1);
+    size = d->ht[0].size;
+    filled = d->ht[0].filled;
+    for (i = 0; i < 100; i++) {
+        subdictDelete(d,subdict_find(d,"channel:%ld",2*i+1));
+        subdict_add(d,"channel:%ld",2*i+1);
+    }
+    test_cond(d->ht[0].size == size && d->ht[0].filled == filled &&
+              subdict_has(d,"channel:%ld",1,2));
+
+    test("Subscription table shrinks when mostly empty: ");
+    for (i = 21; i < 100000; i += 2)
+        subdictDelete(d,subdict_find(d,"channel:%ld",i));
+    while (d->ht[1].size != 0)
+        subdict_find(d,"channel:%ld",1);
+    test_cond(d->ht[0].size <= 64 && subdictSize(d) == 10 &&
+              subdict_count(d) == 10 && subdict_find(d,"channel:%ld",21) == NULL);
+
+    test("Subscription table keeps the remaining entries after shrinking: ");
+    for (i = 1; i < 21; i += 2)
+        ok = ok && subdict_has(d,"channel:%ld",i,i+1);
+    test_cond(ok);
+    subdictRelease(d);
+}
+
 static void test_free_null(void) {
     void *redisContext = NULL;
     void *reply = NULL;
@@ -354,13 +791,26 @@ static void test_blocking_connection_errors(void) {
     c = redisConnectUnix((char*)"/tmp/idontexist.sock");
     test_cond(c->err == REDIS_ERR_IO); /* Don't care about the message... */
     redisFree(c);
+
+    test("Returns error when a pre-resolved address doesn't accept connections: ");
+    {
+        struct sockaddr_in sa;
+        memset(&sa,0,sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(1);
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        c = redisConnectAddr((struct sockaddr*)&sa,sizeof(sa));
+    }
+    test_cond(c->err == REDIS_ERR_IO &&
+        strcmp(c->errstr,"Connection refused") == 0);
+    redisFree(c);
 }
 
 static void test_blocking_connection(struct config config) {
     redisContext *c;
     redisReply *reply;
 
-    c = connect(config);
+    c = do_connect(config);
 
     test("Is able to deliver commands: ");
     reply = redisCommand(c,"PING");
@@ -441,7 +891,7 @@ static void test_blocking_io_errors(struct config config) {
     int major, minor;
 
     /* Connect to target given by config. */
-    c = connect(config);
+    c = do_connect(config);
     {
         /* Find out Redis version to determine the path for the next test */
         const char *field = "redis_version:";
@@ -476,7 +926,7 @@ static void test_blocking_io_errors(struct config config) {
         strcmp(c->errstr,"Server closed the connection") == 0);
     redisFree(c);
 
-    c = connect(config);
+    c = do_connect(config);
     test("Returns I/O error on socket timeout: ");
     struct timeval tv = { 0, 1000 };
     assert(redisSetTimeout(c,tv) == REDIS_OK);
@@ -509,8 +959,2484 @@ static void test_invalid_timeout_errors(struct config config) {
     redisFree(c);
 }
 
+static void test_socket_options(struct config config) {
+    redisContext *c;
+    redisReply *reply;
+    redisSocketOptions opts;
+    int keepalive = 0, rcvbuf = 0;
+    socklen_t len;
+
+    memset(&opts,0,sizeof(opts));
+    opts.rcvbuf = 256*1024;
+    opts.keepalive_idle = 5;
+
+    test("Applies socket options when connecting: ");
+    c = redisConnectWithOptions(config.tcp.host, config.tcp.port, NULL, &opts);
+    assert(c->err == 0);
+    len = sizeof(keepalive);
+    getsockopt(c->fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, &len);
+    len = sizeof(rcvbuf);
+    getsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+    /* Linux doubles the requested buffer size for bookkeeping overhead. */
+    test_cond(keepalive && rcvbuf >= opts.rcvbuf);
+    redisFree(c);
+
+    memset(&opts,0,sizeof(opts));
+    opts.fastopen = 1;
+
+    test("Is able to deliver commands with TCP Fast Open: ");
+    c = redisConnectWithOptions(config.tcp.host, config.tcp.port, NULL, &opts);
+    assert(c->err == 0);
+    reply = redisCommand(c,"PING");
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_STATUS &&
+        strcasecmp(reply->str,"pong") == 0);
+    freeReplyObject(reply);
+    redisFree(c);
+}
+
+static void test_blocking_pool(struct config config) {
+    redisPoolConfig pc;
+    redisPool *p;
+    redisContext *c[3];
+    redisReply *reply;
+    struct timeval tv = { 0, 100000 };
+    int j, ok;
+
+    memset(&pc,0,sizeof(pc));
+    if (config.type == CONN_TCP) {
+        pc.ip = config.tcp.host;
+        pc.port = config.tcp.port;
+    } else {
+        pc.path = config.unix.path;
+    }
+    pc.minsize = 2;
+    pc.maxsize = 3;
+
+    test("Opens minsize connections when creating a pool: ");
+    p = redisPoolCreate(&pc);
+    test_cond(p != NULL && p->err == 0 && p->total == 2);
+
+    test("Hands out at most maxsize working connections: ");
+    ok = 1;
+    for (j = 0; j < 3; j++) {
+        c[j] = redisPoolGet(p);
+        reply = redisCommand(c[j],"PING");
+        ok = ok && reply != NULL && reply->type == REDIS_REPLY_STATUS;
+        freeReplyObject(reply);
+    }
+    test_cond(ok && p->total == 3 && redisPoolGetWithTimeout(p,tv) == NULL);
+
+    test("Closes returned connections that have an error: ");
+    c[0]->err = REDIS_ERR_IO;
+    redisPoolPut(p,c[0]);
+    test_cond(p->total == 2);
+
+    test("Replaces connections that were closed: ");
+    c[0] = redisPoolGet(p);
+    reply = redisCommand(c[0],"PING");
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_STATUS && p->total == 3);
+    freeReplyObject(reply);
+
+    test("Reuses returned connections: ");
+    redisPoolPut(p,c[1]);
+    test_cond(redisPoolGet(p) == c[1]);
+
+    test("Replaces idle connections that were closed: ");
+    shutdown(c[1]->fd,SHUT_RDWR);
+    redisPoolPut(p,c[1]);
+    c[1] = redisPoolGet(p);
+    reply = redisCommand(c[1],"PING");
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_STATUS && p->total == 3);
+    freeReplyObject(reply);
+
+    for (j = 0; j < 3; j++)
+        redisPoolPut(p,c[j]);
+    redisPoolFree(p);
+
+    test("Closes connections that were idle too long on checkout: ");
+    pc.minsize = 1;
+    pc.idletimeout = tv;
+    p = redisPoolCreate(&pc);
+    for (j = 0; j < 3; j++)
+        c[j] = redisPoolGet(p);
+    for (j = 0; j < 3; j++)
+        redisPoolPut(p,c[j]);
+    assert(p->total == 3);
+    usleep(150000);
+    c[0] = redisPoolGet(p);
+    reply = redisCommand(c[0],"PING");
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_STATUS && p->total == 1);
+    freeReplyObject(reply);
+    redisPoolPut(p,c[0]);
+    redisPoolFree(p);
+    pc.minsize = 2;
+
+    if (config.type == CONN_TCP) {
+        test("Sets an error when connections cannot be opened: ");
+        pc.port = 1;
+        p = redisPoolCreate(&pc);
+        test_cond(p != NULL && p->err == REDIS_ERR_IO && p->total == 0);
+        redisPoolFree(p);
+    }
+}
+
+static void test_blocking_scripts(struct config config) {
+    redisScripts *s;
+    redisScript *script, *get;
+    redisContext *c;
+    redisReply *reply;
+
+    s = redisScriptsCreate();
+    test("Computes the SHA1 digest of a script: ");
+    script = redisScriptsAdd(s,"return 'hello'",14);
+    test_cond(strcmp(script->sha,"1b936e3fe509bcbc9cd0664897bbe8fd0cac101b") == 0);
+
+    test("Returns a script that was added before: ");
+    test_cond(redisScriptsAdd(s,"return 'hello'",14) == script && s->count == 1);
+    get = redisScriptsAdd(s,"return redis.call('GET', KEYS[1])",33);
+
+    c = do_connect(config);
+    test("Loads the scripts on a connection: ");
+    test_cond(redisScriptsLoad(c,s) == REDIS_OK);
+
+    test("Calls a script by its digest: ");
+    freeReplyObject(redisCommand(c,"SET foo bar"));
+    reply = redisScriptCommand(c,get,"1 %s","foo");
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_STRING && strcmp(reply->str,"bar") == 0);
+    freeReplyObject(reply);
+
+    test("Loads a script again when the server lost it: ");
+    freeReplyObject(redisCommand(c,"SCRIPT FLUSH"));
+    reply = redisScriptCommand(c,script,"0");
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_STRING && strcmp(reply->str,"hello") == 0);
+    freeReplyObject(reply);
+
+    disconnect(c, 0);
+    redisScriptsFree(s);
+}
+
+static void test_blocking_scan(struct config config) {
+    redisScanOptions opts;
+    redisScanIterator *it;
+    redisContext *c;
+    redisReply *batch;
+    char seen[100];
+    int j, batches, count, ok;
+
+    c = do_connect(config);
+    for (j = 0; j < 100; j++)
+        freeReplyObject(redisCommand(c,"SET key:%d %d",j,j));
+    freeReplyObject(redisCommand(c,"SET other 1"));
+
+    test("Iterates over every key with SCAN: ");
+    memset(&opts,0,sizeof(opts));
+    opts.match = "key:*";
+    opts.count = 7;
+    memset(seen,0,sizeof(seen));
+    it = redisScanStart(c,"SCAN",NULL,0,&opts);
+    batches = count = 0;
+    ok = 1;
+    while ((batch = redisScanNext(it)) != NULL) {
+        batches++;
+        for (j = 0; j < (int)batch->elements; j++) {
+            ok = ok && strncmp(batch->element[j]->str,"key:",4) == 0;
+            if (ok && !seen[atoi(batch->element[j]->str+4)]++)
+                count++;
+        }
+        freeReplyObject(batch);
+    }
+    test_cond(ok && it->err == 0 && count == 100 && batches > 1);
+    redisScanFree(it);
+
+    test("Leaves the connection usable when free'd early: ");
+    it = redisScanStart(c,"SCAN",NULL,0,NULL);
+    freeReplyObject(redisScanNext(it));
+    redisScanFree(it);
+    batch = redisCommand(c,"GET key:1");
+    test_cond(batch != NULL && batch->type == REDIS_REPLY_STRING && strcmp(batch->str,"1") == 0);
+    freeReplyObject(batch);
+
+    test("Iterates over the fields of a hash with HSCAN: ");
+    for (j = 0; j < 20; j++)
+        freeReplyObject(redisCommand(c,"HSET hash f%d %d",j,j));
+    it = redisScanStart(c,"HSCAN","hash",4,NULL);
+    count = 0;
+    while ((batch = redisScanNext(it)) != NULL) {
+        count += batch->elements;
+        freeReplyObject(batch);
+    }
+    test_cond(it->err == 0 && count == 40);
+    redisScanFree(it);
+
+    test("Sets the error of a failed iteration: ");
+    it = redisScanStart(c,"HSCAN","other",5,NULL);
+    test_cond(redisScanNext(it) == NULL && it->err == REDIS_ERR_OTHER);
+    redisScanFree(it);
+
+    disconnect(c, 0);
+}
+
+static void async_connect_cb(const redisAsyncContext *ac, int status) {
+    int *res = ac->data;
+    res[0] = 1;
+    res[1] = status;
+    res[2] = ac->err;
+}
+
+static void test_async_connect(struct config config) {
+    struct sockaddr_in sa;
+    socklen_t salen = sizeof(sa);
+    struct timeval tv = { 0, 200000 };
+    redisAsyncContext *ac;
+    test_loop_events *e;
+    int l, fill, res[3];
+    long long t;
+
+    /* Connections to a listener with a full backlog never complete. */
+    l = socket(AF_INET,SOCK_STREAM,0);
+    memset(&sa,0,sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(l,(struct sockaddr*)&sa,sizeof(sa)) == 0 && listen(l,0) == 0);
+    assert(getsockname(l,(struct sockaddr*)&sa,&salen) == 0);
+    fill = socket(AF_INET,SOCK_STREAM,0);
+    assert(connect(fill,(struct sockaddr*)&sa,sizeof(sa)) == 0);
+
+    test("Calls the connect callback when the connect timeout expires: ");
+    memset(res,0,sizeof(res));
+    ac = redisAsyncConnect("127.0.0.1",ntohs(sa.sin_port));
+    ac->data = res;
+    test_loop_attach(ac,NULL);
+    redisAsyncSetConnectCallback(ac,async_connect_cb);
+    redisAsyncSetConnectTimeout(ac,tv);
+    t = usec();
+    test_loop_run(&res[0],2000000);
+    t = usec()-t;
+    test_cond(res[0] && res[1] == REDIS_ERR && res[2] == REDIS_ERR_TIMEOUT &&
+              t >= 150000 && t < 1000000);
+    close(fill);
+    close(l);
+
+    test("Cancels the connect timeout once connected: ");
+    memset(res,0,sizeof(res));
+    tv.tv_sec = 1;
+    ac = async_connect(config);
+    ac->data = res;
+    redisAsyncSetConnectCallback(ac,async_connect_cb);
+    redisAsyncSetConnectTimeout(ac,tv);
+    e = ac->ev.data;
+    t = e->timer;
+    test_loop_run(&res[0],1000000);
+    test_cond(t != 0 && res[1] == REDIS_OK && e->timer == 0);
+    redisAsyncFree(ac);
+}
+
+/* Counts replies, and is done once the expected number arrived. */
+typedef struct reply_counter {
+    int replies;
+    int expect;
+    volatile int done;
+} reply_counter;
+
+static void reply_counter_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    reply_counter *rc = privdata;
+    ((void)ac);
+
+    if (r != NULL)
+        rc->replies++;
+    if (rc->replies == rc->expect)
+        rc->done = 1;
+}
+
+typedef struct pubsub_state {
+    int messages;
+    int releases;
+    char last[16];
+} pubsub_state;
+
+static void pubsub_message_cb(redisAsyncContext *ac, const redisMessage *m, void *privdata) {
+    pubsub_state *st = privdata;
+    ((void)ac);
+
+    if (m == NULL) {
+        st->releases++;
+    } else {
+        st->messages++;
+        snprintf(st->last,sizeof(st->last),"%.*s:%.*s",(int)m->channellen,m->channel,
+                 (int)m->payloadlen,m->payload);
+    }
+}
+
+/* Counts the arrays built by the reader, to check that messages skip it. */
+static const redisReplyObjectFunctions *pubsub_reply_fn;
+static int pubsub_arrays;
+
+static void *pubsub_create_array(const redisReadTask *task, int elements) {
+    pubsub_arrays++;
+    return pubsub_reply_fn->createArray(task,elements);
+}
+
+/* Publish until the message reaches a subscriber, running the loop in
+ * between so that the subscription gets written. */
+static void pubsub_publish(redisContext *c, const char *channel, const char *payload) {
+    redisReply *reply;
+    long long receivers;
+    int tries = 0;
+
+    do {
+        test_loop_run(NULL,10000);
+        reply = redisCommand(c,"PUBLISH %s %s",channel,payload);
+        assert(reply != NULL && reply->type == REDIS_REPLY_INTEGER);
+        receivers = reply->integer;
+        freeReplyObject(reply);
+    } while (receivers == 0 && ++tries < 100);
+}
+
+static void test_async_pubsub(struct config config) {
+    redisContext *c = do_connect(config);
+    redisReplyObjectFunctions fn;
+    redisAsyncContext *ac;
+    pubsub_state st, other;
+    const char *channels[] = { "hiredis-ch1", "hiredis-ch2" };
+    int i;
+
+    memset(&st,0,sizeof(st));
+    memset(&other,0,sizeof(other));
+    ac = async_connect(config);
+    pubsub_reply_fn = ac->c.reader->fn;
+    fn = *pubsub_reply_fn;
+    fn.createArray = pubsub_create_array;
+    ac->c.reader->fn = &fn;
+    pubsub_arrays = 0;
+
+    test("Passes messages to the message callback without building replies: ");
+    assert(redisAsyncSubscribe(ac,pubsub_message_cb,&st,2,channels,NULL) == REDIS_OK);
+    pubsub_publish(c,"hiredis-ch1","a");
+    pubsub_publish(c,"hiredis-ch2","b");
+    pubsub_publish(c,"hiredis-ch1","c");
+    for (i = 0; i < 100 && st.messages < 3; i++)
+        test_loop_run(NULL,10000);
+    /* Only the two subscribe confirmations are built as replies. */
+    test_cond(st.messages == 3 && strcmp(st.last,"hiredis-ch1:c") == 0 &&
+              pubsub_arrays == 2);
+
+    test("Releases the privdata of a subscribe call once: ");
+    redisAsyncCommand(ac,NULL,NULL,"UNSUBSCRIBE hiredis-ch1 hiredis-ch2");
+    test_loop_run(NULL,100000);
+    test_cond(st.releases == 1 && st.messages == 3);
+
+    test("Releases the privdata once its subscriptions are replaced or free'd: ");
+    memset(&st,0,sizeof(st));
+    assert(redisAsyncSubscribe(ac,pubsub_message_cb,&st,2,channels,NULL) == REDIS_OK);
+    assert(redisAsyncSubscribe(ac,pubsub_message_cb,&other,1,channels,NULL) == REDIS_OK);
+    assert(st.releases == 0);
+    assert(redisAsyncSubscribe(ac,pubsub_message_cb,&other,1,channels+1,NULL) == REDIS_OK);
+    assert(st.releases == 1);
+    pubsub_publish(c,"hiredis-ch2","d");
+    test_loop_run(NULL,50000);
+    redisAsyncFree(ac);
+    test_cond(st.releases == 1 && st.messages == 0 && other.releases == 2 &&
+              strcmp(other.last,"hiredis-ch2:d") == 0);
+
+    disconnect(c, 0);
+}
+
+static void test_async_pipeline_window(struct config config) {
+    redisContext *c = do_connect(config);
+    struct timeval tv = { 0, 50000 };
+    redisAsyncContext *ac = async_connect(config);
+    test_loop_events *e = ac->ev.data;
+    reply_counter rc = { 0, 1, 0 };
+    unsigned long long batches;
+    char *value;
+    long long t;
+    int j;
+
+    /* Writes before the connection is established are never delayed. */
+    redisAsyncCommand(ac,reply_counter_cb,&rc,"PING");
+    test_loop_run(&rc.done,1000000);
+    assert(rc.done);
+
+    test("Rejects an invalid pipeline window: ");
+    tv.tv_usec = 1000000;
+    test_cond(redisAsyncSetPipelineWindow(ac,tv) == REDIS_ERR);
+    tv.tv_usec = 50000;
+
+    test("Delays writes by the pipeline window: ");
+    redisAsyncSetPipelineWindow(ac,tv);
+    memset(&rc,0,sizeof(rc));
+    rc.expect = 3;
+    batches = ac->pipeline.batches;
+    t = usec();
+    for (j = 0; j < 3; j++)
+        redisAsyncCommand(ac,reply_counter_cb,&rc,"PING");
+    assert(!e->writing && e->timer != 0);
+    test_loop_run(&rc.done,1000000);
+    t = usec()-t;
+    test_cond(rc.done && t >= 40000 && ac->pipeline.batches == batches+1 &&
+              ac->pipeline.last == 3);
+
+    test("Writes right away once the output buffer is large enough: ");
+    tv.tv_sec = 10;
+    redisAsyncSetPipelineWindow(ac,tv);
+    memset(&rc,0,sizeof(rc));
+    rc.expect = 2;
+    redisAsyncCommand(ac,reply_counter_cb,&rc,"PING");
+    assert(!e->writing);
+    value = malloc(64*1024);
+    memset(value,'x',64*1024);
+    redisAsyncCommand(ac,reply_counter_cb,&rc,"SET hiredis-window %b",value,(size_t)64*1024);
+    free(value);
+    test_cond(e->writing && test_loop_run(&rc.done,1000000) && ac->pipeline.last == 2);
+
+    test("Writes on the next write event without a pipeline window: ");
+    tv.tv_sec = tv.tv_usec = 0;
+    redisAsyncSetPipelineWindow(ac,tv);
+    memset(&rc,0,sizeof(rc));
+    rc.expect = 1;
+    redisAsyncCommand(ac,reply_counter_cb,&rc,"PING");
+    test_cond(e->writing && test_loop_run(&rc.done,1000000));
+    redisAsyncFree(ac);
+    disconnect(c, 0);
+}
+
+typedef struct merge_reply {
+    int type;
+    char str[16];
+    size_t elements;
+} merge_reply;
+
+static void merge_reply_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    merge_reply *m = privdata;
+    redisReply *reply = r;
+    ((void)ac);
+
+    m->type = reply ? reply->type : -1;
+    snprintf(m->str,sizeof(m->str),"%s",reply && reply->str ? reply->str : "");
+    m->elements = reply ? reply->elements : 0;
+}
+
+/* Runs the loop until the reply was stored, for at most a second. */
+static void merge_wait(merge_reply *m) {
+    int j;
+
+    for (j = 0; j < 100 && m->type == 0; j++)
+        test_loop_run(NULL,10000);
+}
+
+static void test_async_merging(struct config config) {
+    redisContext *c = do_connect(config);
+    redisAsyncContext *ac = async_connect(config);
+    reply_counter rc = { 0, 1, 0 };
+    merge_reply m[4];
+
+    freeReplyObject(redisCommand(c,"MSET hiredis-a 1 hiredis-b 2"));
+    freeReplyObject(redisCommand(c,"HSET hiredis-h f 3"));
+    redisAsyncCommand(ac,reply_counter_cb,&rc,"PING");
+    test_loop_run(&rc.done,1000000);
+    redisAsyncEnableMerging(ac);
+
+    test("Merges GET commands into a single MGET: ");
+    memset(m,0,sizeof(m));
+    redisAsyncCommand(ac,merge_reply_cb,&m[0],"GET hiredis-a");
+    redisAsyncCommand(ac,merge_reply_cb,&m[1],"GET hiredis-none");
+    redisAsyncCommand(ac,merge_reply_cb,&m[2],"GET hiredis-b");
+    merge_wait(&m[2]);
+    test_cond(ac->pipeline.last == 1 && strcmp(m[0].str,"1") == 0 &&
+              m[1].type == REDIS_REPLY_NIL && strcmp(m[2].str,"2") == 0);
+
+    test("Merges HGET commands on the same hash into a single HMGET: ");
+    memset(m,0,sizeof(m));
+    redisAsyncCommand(ac,merge_reply_cb,&m[0],"HGET hiredis-h f");
+    redisAsyncCommand(ac,merge_reply_cb,&m[1],"HGET hiredis-h g");
+    redisAsyncCommand(ac,merge_reply_cb,&m[2],"GET hiredis-a");
+    merge_wait(&m[2]);
+    test_cond(ac->pipeline.last == 2 && strcmp(m[0].str,"3") == 0 &&
+              m[1].type == REDIS_REPLY_NIL && strcmp(m[2].str,"1") == 0);
+
+    test("Keeps merged commands in order with other commands: ");
+    memset(m,0,sizeof(m));
+    redisAsyncCommand(ac,merge_reply_cb,&m[0],"GET hiredis-a");
+    redisAsyncCommand(ac,merge_reply_cb,&m[1],"SET hiredis-a 4");
+    redisAsyncCommand(ac,merge_reply_cb,&m[2],"GET hiredis-a");
+    merge_wait(&m[2]);
+    test_cond(strcmp(m[0].str,"1") == 0 && strcmp(m[1].str,"OK") == 0 &&
+              strcmp(m[2].str,"4") == 0);
+
+    test("Does not merge commands inside a transaction: ");
+    memset(m,0,sizeof(m));
+    redisAsyncCommand(ac,NULL,NULL,"MULTI");
+    redisAsyncCommand(ac,merge_reply_cb,&m[0],"GET hiredis-a");
+    redisAsyncCommand(ac,merge_reply_cb,&m[1],"GET hiredis-b");
+    redisAsyncCommand(ac,merge_reply_cb,&m[2],"EXEC");
+    merge_wait(&m[2]);
+    test_cond(ac->pipeline.last == 4 && strcmp(m[0].str,"QUEUED") == 0 &&
+              strcmp(m[1].str,"QUEUED") == 0 && m[2].type == REDIS_REPLY_ARRAY &&
+              m[2].elements == 2 && !(ac->c.flags & REDIS_IN_MULTI));
+
+    test("Does not merge commands after WATCH until UNWATCH: ");
+    memset(m,0,sizeof(m));
+    redisAsyncCommand(ac,NULL,NULL,"WATCH hiredis-a");
+    redisAsyncCommand(ac,merge_reply_cb,&m[0],"GET hiredis-a");
+    redisAsyncCommand(ac,merge_reply_cb,&m[1],"GET hiredis-b");
+    redisAsyncCommand(ac,NULL,NULL,"UNWATCH");
+    redisAsyncCommand(ac,merge_reply_cb,&m[2],"GET hiredis-a");
+    redisAsyncCommand(ac,merge_reply_cb,&m[3],"GET hiredis-b");
+    merge_wait(&m[3]);
+    test_cond(ac->pipeline.last == 5 && strcmp(m[0].str,"4") == 0 &&
+              strcmp(m[1].str,"2") == 0 && strcmp(m[3].str,"2") == 0 &&
+              !(ac->c.flags & REDIS_WATCHING));
+
+    redisAsyncFree(ac);
+    disconnect(c, 0);
+}
+
+/* Transitions reported by the watermark callback, 1 for above. */
+static int watermark_log[8];
+static int watermark_len;
+
+static void watermark_cb(const redisAsyncContext *ac, int above) {
+    ((void)ac);
+    if (watermark_len < 8)
+        watermark_log[watermark_len++] = above;
+}
+
+typedef struct timer_state {
+    int order[4];
+    int fired;
+} timer_state;
+
+static timer_state timers;
+
+static void timer_cb(redisAsyncContext *ac, void *privdata) {
+    ((void)ac);
+    timers.order[timers.fired++] = (int)(long)privdata;
+}
+
+static void test_async_timers(struct config config) {
+    redisAsyncContext *ac = async_connect(config), *plain;
+    struct timeval tv[3] = { { 0, 60000 }, { 0, 20000 }, { 0, 40000 } };
+    redisAsyncTimer *t, *cancelled;
+    struct timespec ts;
+    long long now, start;
+    int j;
+
+    memset(&timers,0,sizeof(timers));
+    test("Sets timers on the monotonic clock: ");
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    now = (long long)ts.tv_sec*1000000+ts.tv_nsec/1000;
+    t = redisAsyncAddTimer(ac,tv[0],timer_cb,(void*)3);
+    test_cond(t != NULL && t->when >= now+60000 && t->when < now+1000000);
+
+    test("Runs timers in the order of their deadlines: ");
+    start = usec();
+    redisAsyncAddTimer(ac,tv[1],timer_cb,(void*)1);
+    cancelled = redisAsyncAddTimer(ac,tv[1],timer_cb,(void*)4);
+    redisAsyncAddTimer(ac,tv[2],timer_cb,(void*)2);
+    redisAsyncCancelTimer(ac,cancelled);
+    for (j = 0; j < 100 && timers.fired < 3; j++)
+        test_loop_run(NULL,10000);
+    test_cond(timers.fired == 3 && timers.order[0] == 1 && timers.order[1] == 2 &&
+              timers.order[2] == 3 && usec()-start >= 60000);
+
+    test("Does not run a cancelled timer: ");
+    test_loop_run(NULL,50000);
+    test_cond(timers.fired == 3);
+
+    test("Refuses timers without a scheduleTimer hook: ");
+    plain = redisAsyncConnect(config.tcp.host,config.tcp.port);
+    test_cond(redisAsyncAddTimer(plain,tv[0],timer_cb,NULL) == NULL);
+    redisAsyncFree(plain);
+    redisAsyncFree(ac);
+}
+
+static void test_async_watermarks(struct config config) {
+    redisContext *c = do_connect(config);
+    redisAsyncContext *ac = async_connect(config);
+    reply_counter rc = { 0, 1, 0 };
+    redisWatermarks wm;
+    char value[256];
+    int j, ok;
+
+    redisAsyncCommand(ac,reply_counter_cb,&rc,"PING");
+    test_loop_run(&rc.done,1000000);
+
+    test("Rejects a low watermark above the high watermark: ");
+    memset(&wm,0,sizeof(wm));
+    wm.highcallbacks = 2;
+    wm.lowcallbacks = 3;
+    test_cond(redisAsyncSetWatermarks(ac,&wm,watermark_cb) == REDIS_ERR);
+
+    test("Reports crossing the high watermark of pending callbacks: ");
+    wm.highcallbacks = 3;
+    wm.lowcallbacks = 1;
+    wm.failfast = 1;
+    watermark_len = 0;
+    assert(redisAsyncSetWatermarks(ac,&wm,watermark_cb) == 0);
+    memset(&rc,0,sizeof(rc));
+    rc.expect = 3;
+    ok = 1;
+    for (j = 0; j < 3; j++) {
+        ok = ok && watermark_len == 0;
+        redisAsyncCommand(ac,reply_counter_cb,&rc,"PING");
+    }
+    test_cond(ok && watermark_len == 1 && watermark_log[0] == 1 &&
+              (ac->c.flags & REDIS_ABOVE_WATERMARK));
+
+    test("Rejects commands above a high watermark when failing fast: ");
+    test_cond(redisAsyncCommand(ac,reply_counter_cb,&rc,"PING") == REDIS_ERR &&
+              rc.replies == 0);
+
+    test("Reports dropping below the low watermark once replies arrive: ");
+    test_loop_run(&rc.done,1000000);
+    test_cond(rc.done && watermark_len == 2 && watermark_log[1] == 0 &&
+              !(ac->c.flags & REDIS_ABOVE_WATERMARK) &&
+              redisAsyncCommand(ac,NULL,NULL,"PING") == REDIS_OK);
+
+    test("Reports crossing the high watermark of unwritten bytes: ");
+    memset(&wm,0,sizeof(wm));
+    wm.highbytes = 200;
+    watermark_len = 0;
+    redisAsyncSetWatermarks(ac,&wm,watermark_cb);
+    memset(&rc,0,sizeof(rc));
+    rc.expect = 1;
+    memset(value,'x',sizeof(value));
+    redisAsyncCommand(ac,reply_counter_cb,&rc,"SET hiredis-wm %b",value,sizeof(value));
+    ok = watermark_len == 1 && watermark_log[0] == 1;
+    test_loop_run(&rc.done,1000000);
+    test_cond(ok && watermark_len == 2 && watermark_log[1] == 0);
+
+    redisAsyncFree(ac);
+    disconnect(c, 0);
+}
+
+/* Runs the test loop, draining the queue when its descriptor is readable. */
+/* Closes the connection on CRASH, confirms subscriptions and sends a message
+ * right after every confirmation. */
+static void reconnect_handler(fake_client *fc, redisReply *cmd, void *privdata) {
+    size_t j;
+    ((void)privdata);
+
+    if (fake_is(cmd,"CRASH")) {
+        fc->close = 1;
+    } else if (fake_is(cmd,"SUBSCRIBE")) {
+        for (j = 1; j < cmd->elements; j++) {
+            fake_reply(fc,"*3\r\n$9\r\nsubscribe\r\n");
+            fake_bulk(fc,cmd->element[j]->str);
+            fake_reply(fc,":%zu\r\n*3\r\n$7\r\nmessage\r\n",j);
+            fake_bulk(fc,cmd->element[j]->str);
+            fake_bulk(fc,"hello");
+        }
+    } else if (fake_is(cmd,"PING")) {
+        fake_reply(fc,"+PONG\r\n");
+    } else {
+        fake_reply(fc,"+OK\r\n");
+    }
+}
+
+typedef struct reconnect_state {
+    int status[16]; /* Passed to the reconnect callback */
+    long long at[16];
+    int len;
+    volatile int gone; /* The disconnect callback was called */
+    long long goneat;
+    int confirmations, messages;
+} reconnect_state;
+
+static void reconnect_cb(const redisAsyncContext *ac, int status) {
+    reconnect_state *st = ac->data;
+
+    if (st->len < 16) {
+        st->status[st->len] = status;
+        st->at[st->len++] = usec();
+    }
+}
+
+static void reconnect_disconnect_cb(const redisAsyncContext *ac, int status) {
+    reconnect_state *st = ac->data;
+    ((void)status);
+
+    st->gone = 1;
+    st->goneat = usec();
+}
+
+static void reconnect_subscribe_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    reconnect_state *st = privdata;
+    redisReply *reply = r;
+    ((void)ac);
+
+    if (reply == NULL || reply->type != REDIS_REPLY_ARRAY)
+        return;
+    if (strcmp(reply->element[0]->str,"subscribe") == 0)
+        st->confirmations++;
+    else if (strcmp(reply->element[0]->str,"message") == 0)
+        st->messages++;
+}
+
+/* Stores the status reply in privdata, or "(nil)" for a NULL reply. */
+static void reconnect_reply_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    redisReply *reply = r;
+    ((void)ac);
+
+    snprintf(privdata,16,"%s",reply != NULL ? reply->str : "(nil)");
+}
+
+static redisAsyncContext *reconnect_connect(int port, reconnect_state *st, int replay) {
+    redisReconnectOptions opts = { { 0, 20000 }, { 0, 80000 }, 4, 0 };
+    redisAsyncContext *ac;
+    char pong[16] = "";
+
+    opts.replay = replay;
+    memset(st,0,sizeof(*st));
+    ac = redisAsyncConnect("127.0.0.1",port);
+    assert(ac != NULL && ac->err == 0);
+    ac->data = st;
+    test_loop_attach(ac,NULL);
+    redisAsyncSetDisconnectCallback(ac,reconnect_disconnect_cb);
+    assert(redisAsyncSetReconnect(ac,&opts,reconnect_cb) == REDIS_OK);
+    redisAsyncCommand(ac,reconnect_reply_cb,pong,"PING");
+    while (pong[0] == '\0' && !st->gone)
+        test_loop_run(NULL,10000);
+    assert(strcmp(pong,"PONG") == 0);
+    return ac;
+}
+
+/* Has the server close the connection, and returns once it did, but before
+ * the context noticed. Commands that are issued next were not written to the
+ * connection that was lost. */
+static void reconnect_crash(redisAsyncContext *ac, char *reply) {
+    redisAsyncCommand(ac,reconnect_reply_cb,reply,"CRASH");
+    redisAsyncHandleWrite(ac);
+    usleep(50000);
+}
+
+static void test_async_reconnect(void) {
+    redisAsyncContext *ac;
+    reconnect_state st;
+    char crash[16], ping[16];
+    int port = 0, ok, i;
+    pid_t pid;
+
+    test("Backs off exponentially when reconnecting, up to the maximum delay: ");
+    pid = fake_server_start(&port,reconnect_handler,NULL);
+    ac = reconnect_connect(port,&st,REDIS_REPLAY_UNSENT);
+    fake_server_stop(pid);
+    test_loop_run(&st.gone,2000000);
+    /* Every failed attempt reports the error, after 20, 40, 80 and 80ms. */
+    test_cond(st.gone && st.len == 4 && st.status[0] == REDIS_ERR &&
+              st.status[3] == REDIS_ERR &&
+              st.at[1]-st.at[0] >= 20000 && st.at[2]-st.at[1] >= 40000 &&
+              st.at[3]-st.at[2] >= 80000 && st.goneat-st.at[3] >= 80000 &&
+              st.goneat-st.at[3] < 160000);
+
+    test("Replays commands that were not written after reconnecting: ");
+    pid = fake_server_start(&port,reconnect_handler,NULL);
+    ac = reconnect_connect(port,&st,REDIS_REPLAY_UNSENT);
+    crash[0] = ping[0] = '\0';
+    reconnect_crash(ac,crash);
+    redisAsyncCommand(ac,reconnect_reply_cb,ping,"PING");
+    for (i = 0; i < 100 && ping[0] == '\0'; i++)
+        test_loop_run(NULL,10000);
+    test_cond(strcmp(crash,"(nil)") == 0 && strcmp(ping,"PONG") == 0 &&
+              st.len == 2 && st.status[0] == REDIS_ERR && st.status[1] == REDIS_OK);
+    redisAsyncFree(ac);
+
+    test("Fails commands that were not written when not replaying: ");
+    ac = reconnect_connect(port,&st,REDIS_REPLAY_NONE);
+    crash[0] = ping[0] = '\0';
+    reconnect_crash(ac,crash);
+    redisAsyncCommand(ac,reconnect_reply_cb,ping,"PING");
+    test_loop_run(NULL,100000);
+    ok = strcmp(crash,"(nil)") == 0 && strcmp(ping,"(nil)") == 0 &&
+         st.len == 2 && st.status[1] == REDIS_OK;
+    ping[0] = '\0';
+    redisAsyncCommand(ac,reconnect_reply_cb,ping,"PING");
+    test_loop_run(NULL,100000);
+    test_cond(ok && strcmp(ping,"PONG") == 0);
+    redisAsyncFree(ac);
+
+    test("Subscribes once to channels that were not subscribed yet: ");
+    ac = reconnect_connect(port,&st,REDIS_REPLAY_UNSENT);
+    reconnect_crash(ac,crash);
+    redisAsyncCommand(ac,reconnect_subscribe_cb,&st,"SUBSCRIBE hiredis-ch");
+    test_loop_run(NULL,200000);
+    test_cond(st.len == 2 && st.status[1] == REDIS_OK &&
+              st.confirmations == 1 && st.messages == 1);
+
+    test("Subscribes again after reconnecting: ");
+    reconnect_crash(ac,crash);
+    test_loop_run(NULL,200000);
+    test_cond(st.len == 4 && st.status[3] == REDIS_OK &&
+              st.confirmations == 2 && st.messages == 2);
+    redisAsyncFree(ac);
+    fake_server_stop(pid);
+}
+
+/* Replies to ECHO with its argument. */
+static void fake_echo_handler(fake_client *fc, redisReply *cmd, void *privdata) {
+    ((void)privdata);
+    if (fake_is(cmd,"ECHO") && cmd->elements == 2)
+        fake_bulk(fc,cmd->element[1]->str);
+    else
+        fake_reply(fc,"+OK\r\n");
+}
+
+/* The privdata of pipelined command i points to slot i. Every callback
+ * checks that it is the next one, and that its reply is i. */
+typedef struct ring_slot {
+    struct ring_state *rs;
+    int index;
+} ring_slot;
+
+typedef struct ring_state {
+    redisAsyncContext *ac;
+    ring_slot slots[64];
+    int calls[64]; /* Callbacks of every command */
+    int sent, fired, wrong;
+    int refill; /* Command whose callback sends more */
+    size_t head, size; /* Callback list when the refill was sent */
+} ring_state;
+
+static void ring_cb(redisAsyncContext *ac, void *r, void *privdata);
+
+static void ring_send(ring_state *rs, int n) {
+    int i;
+
+    while (n-- > 0) {
+        i = rs->sent++;
+        rs->slots[i].rs = rs;
+        rs->slots[i].index = i;
+        redisAsyncCommand(rs->ac,ring_cb,&rs->slots[i],"ECHO %d",i);
+    }
+}
+
+static void ring_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    ring_slot *slot = privdata;
+    ring_state *rs = slot->rs;
+    redisReply *reply = r;
+
+    rs->calls[slot->index]++;
+    if (reply == NULL || reply->type != REDIS_REPLY_STRING || atoi(reply->str) != slot->index ||
+        slot->index != rs->fired)
+        rs->wrong++;
+    rs->fired++;
+    if (slot->index == rs->refill) {
+        rs->head = ac->replies.head;
+        rs->size = ac->replies.size;
+        ring_send(rs,30);
+    }
+}
+
+static void test_async_callbacks(void) {
+    redisAsyncContext *ac;
+    ring_state rs;
+    size_t head;
+    int port = 0, ok, j;
+    pid_t pid;
+
+    pid = fake_server_start(&port,fake_echo_handler,NULL);
+    ac = redisAsyncConnect("127.0.0.1",port);
+    assert(ac != NULL && ac->err == 0);
+    test_loop_attach(ac,NULL);
+    memset(&rs,0,sizeof(rs));
+    rs.ac = ac;
+    rs.refill = 12;
+
+    /* Moves the head of the callback list of 16 away from the start, then
+     * wraps it, and has it grow while wrapped: the callback of command 12
+     * sends 30 more while commands 13 to 21 wait in slots 13 to 15 and 0 to
+     * 5 of the list. */
+    test("Calls every callback once and in order while the callback list wraps and grows: ");
+    ring_send(&rs,10);
+    for (j = 0; j < 100 && rs.fired < 10; j++)
+        test_loop_run(NULL,10000);
+    head = ac->replies.head;
+    ring_send(&rs,12);
+    for (j = 0; j < 100 && rs.fired < 52; j++)
+        test_loop_run(NULL,10000);
+    ok = head == 10 && rs.head == 13 && rs.size == 16 && ac->replies.size == 64;
+    for (j = 0; j < 52; j++)
+        ok = ok && rs.calls[j] == 1;
+    test_cond(ok && rs.sent == 52 && rs.fired == 52 && rs.wrong == 0);
+
+    redisAsyncFree(ac);
+    fake_server_stop(pid);
+}
+
+/* Two fake cluster nodes. At first node 0 serves the slots below 8192, and
+ * node 1 the others. GET and MGET reply with the node that served them and
+ * the key, DEL and EXISTS with the number of keys.
+ * FAKE-MOVE and FAKE-ASK change the layout, FAKE-STATS returns how many
+ * times the node sent its slot map and redirected a command. */
+typedef struct fake_cluster {
+    int port[2];
+    int self;
+    unsigned char owner[REDIS_CLUSTER_SLOTS];
+    int ask; /* Slot that node 0 migrates to node 1, or -1 */
+    int slotscalls, redirects;
+} fake_cluster;
+
+/* Rejects commands with keys in more than one slot, like the cluster does,
+ * and fails commands for the key "fail". */
+static int fake_cluster_check(fake_client *fc, redisReply *cmd, int slot) {
+    size_t j, step = fake_is(cmd,"MSET") ? 2 : 1;
+
+    for (j = 1; j < cmd->elements; j += step) {
+        if (redisKeySlot(cmd->element[j]->str,cmd->element[j]->len) != (unsigned int)slot) {
+            fake_reply(fc,"-CROSSSLOT Keys in request don't hash to the same slot\r\n");
+            return REDIS_ERR;
+        }
+        if (strcmp(cmd->element[j]->str,"fail") == 0) {
+            fake_reply(fc,"-ERR failed\r\n");
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+static void fake_cluster_handler(fake_client *fc, redisReply *cmd, void *privdata) {
+    fake_cluster *fcl = privdata;
+    int start, end, n, slot, asking;
+    size_t j;
+    sds map;
+
+    if (fake_is(cmd,"CLUSTER")) {
+        map = sdsempty();
+        for (start = n = 0; start < REDIS_CLUSTER_SLOTS; start = end, n++) {
+            for (end = start; end < REDIS_CLUSTER_SLOTS && fcl->owner[end] == fcl->owner[start]; end++);
+            map = sdscatprintf(map,"*3\r\n:%d\r\n:%d\r\n*2\r\n$9\r\n127.0.0.1\r\n:%d\r\n",
+                               start,end-1,fcl->port[fcl->owner[start]]);
+        }
+        fake_reply(fc,"*%d\r\n",n);
+        fc->out = sdscatsds(fc->out,map);
+        sdsfree(map);
+        fcl->slotscalls++;
+    } else if (fake_is(cmd,"ASKING")) {
+        fc->state = 1;
+        fake_reply(fc,"+OK\r\n");
+    } else if (fake_is(cmd,"FAKE-MOVE")) {
+        fcl->owner[atoi(cmd->element[1]->str)] = atoi(cmd->element[2]->str);
+        fake_reply(fc,"+OK\r\n");
+    } else if (fake_is(cmd,"FAKE-ASK")) {
+        fcl->ask = atoi(cmd->element[1]->str);
+        fake_reply(fc,"+OK\r\n");
+    } else if (fake_is(cmd,"FAKE-STATS")) {
+        fake_reply(fc,"*2\r\n:%d\r\n:%d\r\n",fcl->slotscalls,fcl->redirects);
+    } else if (fake_is(cmd,"SCAN")) {
+        /* Two batches of a key each, "<node>:a" and "<node>:b". */
+        n = strcmp(cmd->element[1]->str,"0") == 0;
+        fake_reply(fc,"*2\r\n$1\r\n%d\r\n*1\r\n$3\r\n%d:%c\r\n",n,fcl->self,n ? 'a' : 'b');
+    } else if (cmd->elements >= 2) {
+        slot = redisKeySlot(cmd->element[1]->str,cmd->element[1]->len);
+        asking = fc->state;
+        fc->state = 0;
+        if (fcl->self == 0 && slot == fcl->ask) {
+            fake_reply(fc,"-ASK %d 127.0.0.1:%d\r\n",slot,fcl->port[1]);
+            fcl->redirects++;
+        } else if (fcl->owner[slot] != fcl->self && !(asking && slot == fcl->ask)) {
+            fake_reply(fc,"-MOVED %d 127.0.0.1:%d\r\n",slot,fcl->port[fcl->owner[slot]]);
+            fcl->redirects++;
+        } else if (fake_cluster_check(fc,cmd,slot) != REDIS_OK) {
+            return;
+        } else if (fake_is(cmd,"GET")) {
+            fake_reply(fc,"$%zu\r\n%d:%s\r\n",cmd->element[1]->len+2,fcl->self,cmd->element[1]->str);
+        } else if (fake_is(cmd,"MGET")) {
+            fake_reply(fc,"*%zu\r\n",cmd->elements-1);
+            for (j = 1; j < cmd->elements; j++)
+                fake_reply(fc,"$%zu\r\n%d:%s\r\n",cmd->element[j]->len+2,fcl->self,cmd->element[j]->str);
+        } else if (fake_is(cmd,"DEL") || fake_is(cmd,"EXISTS")) {
+            fake_reply(fc,":%zu\r\n",cmd->elements-1);
+        } else {
+            fake_reply(fc,"+OK\r\n");
+        }
+    } else {
+        fake_reply(fc,"+OK\r\n");
+    }
+}
+
+/* Reads requests, but never replies. */
+static void fake_silent_handler(fake_client *fc, redisReply *cmd, void *privdata) {
+    ((void)fc); ((void)cmd); ((void)privdata);
+}
+
+/* Sends a command to a fake server over a connection of its own. */
+static redisReply *fake_command(int port, const char *format, ...) {
+    redisContext *c = redisConnect("127.0.0.1",port);
+    redisReply *reply;
+    va_list ap;
+
+    assert(c != NULL && c->err == 0);
+    va_start(ap,format);
+    reply = redisvCommand(c,format,ap);
+    va_end(ap);
+    redisFree(c);
+    assert(reply != NULL);
+    return reply;
+}
+
+static void fake_cluster_command(fake_cluster *fcl, const char *format, int slot, int node) {
+    int j;
+    for (j = 0; j < 2; j++)
+        freeReplyObject(fake_command(fcl->port[j],format,slot,node));
+}
+
+/* Slot maps sent and commands redirected by both nodes. */
+static void fake_cluster_stats(fake_cluster *fcl, int *slotscalls, int *redirects) {
+    redisReply *r;
+    int j;
+
+    *slotscalls = *redirects = 0;
+    for (j = 0; j < 2; j++) {
+        r = fake_command(fcl->port[j],"FAKE-STATS");
+        *slotscalls += (int)r->element[0]->integer;
+        *redirects += (int)r->element[1]->integer;
+        freeReplyObject(r);
+    }
+}
+
+/* The n-th key that node 0 or node 1 serves at first. */
+static int cluster_key(char *buf, int node, int n) {
+    int i, slot;
+
+    for (i = 0; ; i++) {
+        snprintf(buf,16,"key:%d",i);
+        slot = redisKeySlot(buf,strlen(buf));
+        if ((slot >= 8192) == node && n-- == 0)
+            return slot;
+    }
+}
+
+/* Checks a string or status reply, and free's it. */
+static int reply_is(redisReply *r, const char *str) {
+    int ok = r != NULL && (r->type == REDIS_REPLY_STRING || r->type == REDIS_REPLY_STATUS) &&
+             strcmp(r->str,str) == 0;
+    if (r != NULL) freeReplyObject(r);
+    return ok;
+}
+
+static void cluster_reply_cb(redisClusterAsyncContext *acc, void *r, void *privdata) {
+    redisReply *reply = r;
+    ((void)acc);
+
+    snprintf(privdata,32,"%s",reply != NULL && reply->str != NULL ? reply->str : "(nil)");
+}
+
+/* Runs a command on the async context, and returns its reply. */
+static const char *cluster_async_command(redisClusterAsyncContext *acc, char *buf, const char *format, const char *key) {
+    int i;
+
+    buf[0] = '\0';
+    if (redisClusterAsyncCommand(acc,cluster_reply_cb,buf,format,key) != REDIS_OK)
+        return "(error)";
+    for (i = 0; i < 100 && buf[0] == '\0'; i++)
+        test_loop_run(NULL,10000);
+    return buf;
+}
+
+/* Checks an MGET reply for keys a, b, c and d, in that order. */
+static int cluster_mget_is(redisReply *r, char k[][16], const int *node) {
+    char expect[32];
+    int ok, j;
+
+    ok = r != NULL && r->type == REDIS_REPLY_ARRAY && r->elements == 4;
+    for (j = 0; ok && j < 4; j++) {
+        snprintf(expect,sizeof(expect),"%d:%s",node[j],k[j]);
+        ok = strcmp(r->element[j]->str,expect) == 0;
+    }
+    return ok;
+}
+
+/* Checks an async MGET reply, or the error of a part. */
+typedef struct cluster_split_state {
+    char (*k)[16];
+    const int *node;
+    volatile int done;
+    int ok;
+} cluster_split_state;
+
+static void cluster_split_cb(redisClusterAsyncContext *acc, void *r, void *privdata) {
+    cluster_split_state *st = privdata;
+    redisReply *reply = r;
+    ((void)acc);
+
+    st->done = 1;
+    if (reply != NULL && reply->type == REDIS_REPLY_ARRAY)
+        st->ok = cluster_mget_is(reply,st->k,st->node);
+    else
+        st->ok = reply != NULL && reply->type == REDIS_REPLY_ERROR &&
+                 strcmp(reply->str,"ERR failed") == 0;
+}
+
+static void test_cluster_split(fake_cluster *fcl) {
+    redisClusterContext *cc;
+    redisClusterAsyncContext *acc;
+    cluster_split_state st;
+    redisReply *r;
+    char addr[32], k[4][16];
+    int node[4] = { 1, 0, 1, 0 }, ok, j;
+
+    for (j = 0; j < 4; j++)
+        cluster_key(k[j],node[j],10+j);
+    snprintf(addr,sizeof(addr),"127.0.0.1:%d",fcl->port[0]);
+    cc = redisClusterConnect(addr);
+
+    test("Splits MGET over the nodes and puts the values back in order: ");
+    r = redisClusterCommand(cc,"MGET %s %s %s %s",k[0],k[1],k[2],k[3]);
+    test_cond(cluster_mget_is(r,k,node));
+    freeReplyObject(r);
+
+    test("Adds up the counts of split DEL and EXISTS commands: ");
+    r = redisClusterCommand(cc,"DEL %s %s %s",k[0],k[1],k[2]);
+    ok = r != NULL && r->type == REDIS_REPLY_INTEGER && r->integer == 3;
+    freeReplyObject(r);
+    r = redisClusterCommand(cc,"EXISTS %s %s %s %s",k[0],k[1],k[2],k[3]);
+    test_cond(ok && r != NULL && r->type == REDIS_REPLY_INTEGER && r->integer == 4);
+    freeReplyObject(r);
+
+    test("Returns the status of a split MSET: ");
+    r = redisClusterCommand(cc,"MSET %s a %s b %s c",k[0],k[1],k[2]);
+    test_cond(r != NULL && r->type == REDIS_REPLY_STATUS && strcmp(r->str,"OK") == 0);
+    freeReplyObject(r);
+
+    test("Returns the error of a part of a split command: ");
+    r = redisClusterCommand(cc,"MSET %s a fail b %s c",k[0],k[1]);
+    ok = r != NULL && r->type == REDIS_REPLY_ERROR && strcmp(r->str,"ERR failed") == 0;
+    freeReplyObject(r);
+    r = redisClusterCommand(cc,"MGET %s fail",k[1]);
+    test_cond(ok && r != NULL && r->type == REDIS_REPLY_ERROR && strcmp(r->str,"ERR failed") == 0);
+    freeReplyObject(r);
+    redisClusterFree(cc);
+
+    /* Split commands of the async API are gathered by the same code. */
+    test("Splits async commands over the nodes and gathers their replies: ");
+    acc = redisClusterAsyncConnect(addr,test_loop_attach,NULL);
+    memset(&st,0,sizeof(st));
+    st.k = k;
+    st.node = node;
+    redisClusterAsyncCommand(acc,cluster_split_cb,&st,"MGET %s %s %s %s",k[0],k[1],k[2],k[3]);
+    ok = test_loop_run(&st.done,1000000) && st.ok;
+    st.done = st.ok = 0;
+    redisClusterAsyncCommand(acc,cluster_split_cb,&st,"MSET %s a fail b",k[0]);
+    test_cond(ok && test_loop_run(&st.done,1000000) && st.ok);
+    redisClusterAsyncFree(acc);
+}
+
+typedef struct scan_state {
+    char keys[8][16];
+    int nkeys;
+    int finals; /* Calls with a NULL batch */
+    int err;
+    int stop; /* Stop the scan at the first batch */
+} scan_state;
+
+static void scan_cb(redisAsyncScan *scan, redisReply *batch, void *privdata) {
+    scan_state *st = privdata;
+    size_t j;
+
+    if (batch == NULL) {
+        st->finals++;
+        st->err = scan->err;
+        return;
+    }
+    for (j = 0; j < batch->elements && st->nkeys < 8; j++)
+        snprintf(st->keys[st->nkeys++],sizeof(st->keys[0]),"%s",batch->element[j]->str);
+    if (st->stop)
+        redisAsyncScanStop(scan);
+}
+
+/* Whether the keys are the given ones, in any order. */
+static int scan_keys_are(scan_state *st, const char **keys, int n) {
+    int i, j;
+
+    if (st->nkeys != n)
+        return 0;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < st->nkeys && strcmp(st->keys[j],keys[i]) != 0; j++);
+        if (j == st->nkeys)
+            return 0;
+    }
+    return 1;
+}
+
+static void test_cluster_scan(fake_cluster *fcl) {
+    const char *all[] = { "0:a", "0:b", "1:a", "1:b" };
+    redisClusterContext *cc;
+    redisClusterAsyncContext *acc;
+    redisAsyncContext *ac;
+    redisScanIterator *it;
+    redisReply *batch;
+    scan_state st;
+    char addr[32];
+    size_t j;
+    int ok, n;
+
+    snprintf(addr,sizeof(addr),"127.0.0.1:%d",fcl->port[0]);
+
+    test("Scans every master of a cluster: ");
+    cc = redisClusterConnect(addr);
+    it = redisClusterScanStart(cc,NULL);
+    memset(&st,0,sizeof(st));
+    for (n = 0; (batch = redisScanNext(it)) != NULL; n++) {
+        for (j = 0; j < batch->elements && st.nkeys < 8; j++)
+            snprintf(st.keys[st.nkeys++],sizeof(st.keys[0]),"%s",batch->element[j]->str);
+        freeReplyObject(batch);
+    }
+    ok = it->err == 0 && n == 4 && scan_keys_are(&st,all,4);
+    redisScanFree(it);
+    /* The connections can be used again. */
+    batch = redisClusterCommand(cc,"EXISTS %s","foo");
+    test_cond(ok && batch != NULL && batch->type == REDIS_REPLY_INTEGER && batch->integer == 1);
+    freeReplyObject(batch);
+    redisClusterFree(cc);
+
+    test("Scans every master of an async cluster context: ");
+    acc = redisClusterAsyncConnect(addr,test_loop_attach,NULL);
+    memset(&st,0,sizeof(st));
+    ok = redisClusterAsyncScan(acc,NULL,scan_cb,&st) != NULL;
+    for (n = 0; n < 100 && st.finals == 0; n++)
+        test_loop_run(NULL,10000);
+    test_cond(ok && st.finals == 1 && st.err == 0 && scan_keys_are(&st,all,4));
+    redisClusterAsyncFree(acc);
+
+    test("Scans an async context: ");
+    ac = redisAsyncConnect("127.0.0.1",fcl->port[1]);
+    test_loop_attach(ac,NULL);
+    memset(&st,0,sizeof(st));
+    ok = redisAsyncScanStart(ac,"SCAN",NULL,0,NULL,scan_cb,&st) != NULL;
+    for (n = 0; n < 100 && st.finals == 0; n++)
+        test_loop_run(NULL,10000);
+    test_cond(ok && st.finals == 1 && st.err == 0 && scan_keys_are(&st,all+2,2));
+
+    test("Does not call the callback again after an async scan is stopped: ");
+    memset(&st,0,sizeof(st));
+    st.stop = 1;
+    ok = redisAsyncScanStart(ac,"SCAN",NULL,0,NULL,scan_cb,&st) != NULL;
+    for (n = 0; n < 100 && st.nkeys == 0; n++)
+        test_loop_run(NULL,10000);
+    test_loop_run(NULL,50000);
+    test_cond(ok && st.nkeys == 1 && st.finals == 0);
+    redisAsyncFree(ac);
+}
+
+static void test_cluster(void) {
+    struct timeval tv = { 0, 200000 };
+    redisClusterContext *cc;
+    redisClusterAsyncContext *acc;
+    fake_cluster fcl;
+    char addr[32], buf[32], k[6][16], expect[32];
+    int j, l[2], slot[6], calls, redirects, calls2, redirects2, ok, port = 0;
+    pid_t pid[2], silent;
+    long long t;
+
+    memset(&fcl,0,sizeof(fcl));
+    fcl.ask = -1;
+    memset(fcl.owner+8192,1,8192);
+    for (j = 0; j < 2; j++)
+        l[j] = fake_server_listen(&fcl.port[j]);
+    for (j = 0; j < 2; j++) {
+        fcl.self = j;
+        pid[j] = fake_server_fork(l[j],fake_cluster_handler,&fcl);
+    }
+    for (j = 0; j < 6; j++)
+        slot[j] = cluster_key(k[j],j == 1,j);
+    snprintf(addr,sizeof(addr),"127.0.0.1:%d",fcl.port[0]);
+
+    test("Routes cluster commands to the node that serves their slot: ");
+    cc = redisClusterConnect(addr);
+    snprintf(expect,sizeof(expect),"1:%s",k[1]);
+    ok = cc->err == 0 && reply_is(redisClusterCommand(cc,"GET %s",k[1]),expect);
+    snprintf(expect,sizeof(expect),"0:%s",k[0]);
+    ok = ok && reply_is(redisClusterCommand(cc,"GET %s",k[0]),expect);
+    fake_cluster_stats(&fcl,&calls,&redirects);
+    test_cond(ok && calls == 1 && redirects == 0);
+
+    test("Follows MOVED and reloads the stale slot map before the next command: ");
+    fake_cluster_command(&fcl,"FAKE-MOVE %d %d",slot[2],1);
+    snprintf(expect,sizeof(expect),"1:%s",k[2]);
+    ok = reply_is(redisClusterCommand(cc,"GET %s",k[2]),expect) && cc->refresh;
+    ok = ok && reply_is(redisClusterCommand(cc,"GET %s",k[2]),expect) && !cc->refresh;
+    fake_cluster_stats(&fcl,&calls2,&redirects2);
+    test_cond(ok && calls2 == calls+1 && redirects2 == redirects+1);
+
+    test("Follows ASK without changing the slot map: ");
+    fake_cluster_command(&fcl,"FAKE-ASK %d %d",slot[3],0);
+    snprintf(expect,sizeof(expect),"1:%s",k[3]);
+    ok = reply_is(redisClusterCommand(cc,"GET %s",k[3]),expect);
+    ok = ok && reply_is(redisClusterCommand(cc,"GET %s",k[3]),expect) && !cc->refresh;
+    fake_cluster_stats(&fcl,&calls,&redirects);
+    test_cond(ok && calls == calls2 && redirects == redirects2+2 &&
+              cc->slots[slot[3]]->port == fcl.port[0]);
+    redisClusterFree(cc);
+
+    test("Routes async cluster commands to the node that serves their slot: ");
+    acc = redisClusterAsyncConnect(addr,test_loop_attach,NULL);
+    fake_cluster_stats(&fcl,&calls,&redirects);
+    snprintf(expect,sizeof(expect),"1:%s",k[1]);
+    ok = acc->err == 0 && strcmp(cluster_async_command(acc,buf,"GET %s",k[1]),expect) == 0;
+    snprintf(expect,sizeof(expect),"0:%s",k[0]);
+    ok = ok && strcmp(cluster_async_command(acc,buf,"GET %s",k[0]),expect) == 0;
+    fake_cluster_stats(&fcl,&calls2,&redirects2);
+    test_cond(ok && calls2 == calls && redirects2 == redirects);
+
+    test("Follows MOVED and reloads the stale slot map of an async context: ");
+    fake_cluster_command(&fcl,"FAKE-MOVE %d %d",slot[4],1);
+    snprintf(expect,sizeof(expect),"1:%s",k[4]);
+    ok = strcmp(cluster_async_command(acc,buf,"GET %s",k[4]),expect) == 0 && acc->cc.refresh;
+    ok = ok && strcmp(cluster_async_command(acc,buf,"GET %s",k[4]),expect) == 0;
+    for (j = 0; j < 100 && acc->refreshing; j++)
+        test_loop_run(NULL,10000);
+    ok = ok && !acc->cc.refresh && strcmp(cluster_async_command(acc,buf,"GET %s",k[4]),expect) == 0;
+    fake_cluster_stats(&fcl,&calls,&redirects);
+    test_cond(ok && calls == calls2+1 && redirects == redirects2+1);
+
+    test("Follows ASK without changing the slot map of an async context: ");
+    fake_cluster_command(&fcl,"FAKE-ASK %d %d",slot[5],0);
+    snprintf(expect,sizeof(expect),"1:%s",k[5]);
+    ok = strcmp(cluster_async_command(acc,buf,"GET %s",k[5]),expect) == 0;
+    ok = ok && strcmp(cluster_async_command(acc,buf,"GET %s",k[5]),expect) == 0;
+    fake_cluster_stats(&fcl,&calls2,&redirects2);
+    test_cond(ok && !acc->cc.refresh && calls2 == calls && redirects2 == redirects+2 &&
+              acc->cc.slots[slot[5]]->port == fcl.port[0]);
+    redisClusterAsyncFree(acc);
+
+    test_cluster_split(&fcl);
+    test_cluster_scan(&fcl);
+
+    test("Bounds the time to load the slot map of an async context: ");
+    silent = fake_server_start(&port,fake_silent_handler,NULL);
+    snprintf(addr,sizeof(addr),"127.0.0.1:%d",port);
+    t = usec();
+    acc = redisClusterAsyncConnectWithTimeout(addr,tv,test_loop_attach,NULL);
+    t = usec()-t;
+    test_cond(acc->err != 0 && t >= 150000 && t < 1000000);
+    redisClusterAsyncFree(acc);
+    fake_server_stop(silent);
+
+    for (j = 0; j < 2; j++)
+        fake_server_stop(pid[j]);
+}
+
+/* A fake sentinel that knows the address of a fake master. FAKE-MASTER
+ * changes the address without publishing a switch, FAKE-FAIL makes it fail
+ * to answer, and FAKE-STATS returns how many times it was asked. */
+typedef struct fake_sentinel {
+    int master;
+    int fail;
+    int asked;
+} fake_sentinel;
+
+static void fake_sentinel_handler(fake_client *fc, redisReply *cmd, void *privdata) {
+    fake_sentinel *fs = privdata;
+    char port[16];
+
+    if (fake_is(cmd,"SENTINEL")) {
+        fs->asked++;
+        if (fs->fail) {
+            fake_reply(fc,"-ERR failing\r\n");
+            return;
+        }
+        snprintf(port,sizeof(port),"%d",fs->master);
+        fake_reply(fc,"*2\r\n");
+        fake_bulk(fc,"127.0.0.1");
+        fake_bulk(fc,port);
+    } else if (fake_is(cmd,"SUBSCRIBE")) {
+        fake_reply(fc,"*3\r\n$9\r\nsubscribe\r\n$14\r\n+switch-master\r\n:1\r\n");
+    } else if (fake_is(cmd,"FAKE-MASTER")) {
+        fs->master = atoi(cmd->element[1]->str);
+        fake_reply(fc,"+OK\r\n");
+    } else if (fake_is(cmd,"FAKE-FAIL")) {
+        fs->fail = atoi(cmd->element[1]->str);
+        fake_reply(fc,"+OK\r\n");
+    } else if (fake_is(cmd,"FAKE-STATS")) {
+        fake_reply(fc,":%d\r\n",fs->asked);
+    } else {
+        fake_reply(fc,"+OK\r\n");
+    }
+}
+
+/* A fake master, or a replica that rejects writes. GET replies with its
+ * port. */
+typedef struct fake_master {
+    int port;
+    int replica;
+} fake_master;
+
+static void fake_master_handler(fake_client *fc, redisReply *cmd, void *privdata) {
+    fake_master *fm = privdata;
+
+    if (fake_is(cmd,"GET"))
+        fake_reply(fc,"$%d\r\n%d\r\n",snprintf(NULL,0,"%d",fm->port),fm->port);
+    else if (fake_is(cmd,"SET") && fm->replica)
+        fake_reply(fc,"-READONLY You can't write against a read only replica.\r\n");
+    else
+        fake_reply(fc,"+OK\r\n");
+}
+
+static int sentinel_asked(int port) {
+    redisReply *r = fake_command(port,"FAKE-STATS");
+    int asked = (int)r->integer;
+    freeReplyObject(r);
+    return asked;
+}
+
+static int sentinel_switched;
+
+static void sentinel_switch_cb(redisSentinelAsyncContext *sac, const char *host, int port) {
+    ((void)sac); ((void)host);
+    sentinel_switched = port;
+}
+
+static void test_sentinel(void) {
+    struct timeval tv = { 0, 200000 };
+    redisSentinelContext *sc;
+    redisSentinelAsyncContext *sac;
+    fake_sentinel fs;
+    fake_master replica, master;
+    char addr[32], a[16], b[16], set[16], get[16];
+    pid_t pids[3], silent;
+    int asked, ok, j, port = 0;
+    long long t;
+
+    memset(&replica,0,sizeof(replica));
+    memset(&master,0,sizeof(master));
+    memset(&fs,0,sizeof(fs));
+    replica.replica = 1;
+    pids[0] = fake_server_start(&replica.port,fake_master_handler,&replica);
+    pids[1] = fake_server_start(&master.port,fake_master_handler,&master);
+    fs.master = replica.port;
+    pids[2] = fake_server_start(&port,fake_sentinel_handler,&fs);
+    snprintf(addr,sizeof(addr),"127.0.0.1:%d",port);
+    snprintf(a,sizeof(a),"%d",replica.port);
+    snprintf(b,sizeof(b),"%d",master.port);
+
+    test("Sends commands to the master that the sentinels know: ");
+    sc = redisSentinelConnect(addr,"mymaster");
+    test_cond(sc->err == 0 && reply_is(redisSentinelCommand(sc,"GET foo"),a));
+
+    test("Sends a command again after a READONLY error: ");
+    freeReplyObject(fake_command(port,"FAKE-MASTER %d",master.port));
+    ok = reply_is(redisSentinelCommand(sc,"GET foo"),a);
+    test_cond(ok && reply_is(redisSentinelCommand(sc,"SET foo bar"),"OK") &&
+              reply_is(redisSentinelCommand(sc,"GET foo"),b));
+
+    test("Asks the sentinels at most once per retry interval while none answers: ");
+    freeReplyObject(fake_command(port,"FAKE-FAIL 1"));
+    asked = sentinel_asked(port);
+    redisFree(sc->sub);
+    sc->sub = NULL;
+    for (j = 0, ok = 1; j < 5; j++)
+        ok = ok && reply_is(redisSentinelCommand(sc,"GET foo"),b);
+    ok = ok && sentinel_asked(port) == asked+1;
+    /* Once the interval has passed, they are asked again. */
+    sc->retryat = 1;
+    ok = ok && reply_is(redisSentinelCommand(sc,"GET foo"),b);
+    test_cond(ok && sentinel_asked(port) == asked+2);
+    redisSentinelFree(sc);
+    freeReplyObject(fake_command(port,"FAKE-FAIL 0"));
+
+    test("Sends an async command again after a READONLY error: ");
+    freeReplyObject(fake_command(port,"FAKE-MASTER %d",replica.port));
+    sac = redisSentinelAsyncConnect(addr,"mymaster",test_loop_attach,NULL);
+    redisSentinelAsyncSetSwitchCallback(sac,sentinel_switch_cb);
+    sentinel_switched = 0;
+    get[0] = '\0';
+    redisSentinelAsyncCommand(sac,reconnect_reply_cb,get,"GET foo");
+    for (j = 0; j < 100 && get[0] == '\0'; j++)
+        test_loop_run(NULL,10000);
+    ok = sac->err == 0 && strcmp(get,a) == 0;
+    freeReplyObject(fake_command(port,"FAKE-MASTER %d",master.port));
+    set[0] = get[0] = '\0';
+    redisSentinelAsyncCommand(sac,reconnect_reply_cb,set,"SET foo bar");
+    redisSentinelAsyncCommand(sac,reconnect_reply_cb,get,"GET foo");
+    for (j = 0; j < 100 && (set[0] == '\0' || get[0] == '\0'); j++)
+        test_loop_run(NULL,10000);
+    /* The GET was sent before the SET failed, so the replica served it. */
+    ok = ok && strcmp(set,"OK") == 0 && strcmp(get,a) == 0 && sentinel_switched == master.port;
+    get[0] = '\0';
+    redisSentinelAsyncCommand(sac,reconnect_reply_cb,get,"GET foo");
+    for (j = 0; j < 100 && get[0] == '\0'; j++)
+        test_loop_run(NULL,10000);
+    test_cond(ok && strcmp(get,b) == 0);
+    redisSentinelAsyncFree(sac);
+
+    test("Bounds the time to ask the sentinels of an async context: ");
+    port = 0;
+    silent = fake_server_start(&port,fake_silent_handler,NULL);
+    snprintf(addr,sizeof(addr),"127.0.0.1:%d",port);
+    t = usec();
+    sac = redisSentinelAsyncConnectWithTimeout(addr,"mymaster",tv,test_loop_attach,NULL);
+    t = usec()-t;
+    test_cond(sac->err != 0 && t >= 150000 && t < 1000000);
+    redisSentinelAsyncFree(sac);
+    fake_server_stop(silent);
+
+    for (j = 0; j < 3; j++)
+        fake_server_stop(pids[j]);
+}
+
+/* Send a command through the router and wait for its reply. */
+static const char *router_command(redisRouter *rt, char *buf, const char *format, const char *arg) {
+    int j;
+
+    buf[0] = '\0';
+    if (redisRouterCommand(rt,reconnect_reply_cb,buf,format,arg) != REDIS_OK)
+        return "(error)";
+    for (j = 0; j < 100 && buf[0] == '\0'; j++)
+        test_loop_run(NULL,10000);
+    return buf;
+}
+
+static void test_router(void) {
+    const char * const *cmds;
+    redisRouter *rt;
+    fake_master primary, replica;
+    char addr[32], replicas[32], p[16], r[16], buf[16];
+    redisHedgeOptions hedge;
+    pid_t pids[2], slow;
+    size_t count, i;
+    int j, ok, port = 0;
+    long long t;
+
+    test("Keeps the read-only commands of the router sorted: ");
+    cmds = redisRouterReadOnlyCommands(&count);
+    for (i = 1, ok = count > 0; i < count; i++)
+        ok = ok && strcasecmp(cmds[i-1],cmds[i]) < 0;
+    test_cond(ok);
+
+    memset(&primary,0,sizeof(primary));
+    memset(&replica,0,sizeof(replica));
+    pids[0] = fake_server_start(&primary.port,fake_master_handler,&primary);
+    pids[1] = fake_server_start(&replica.port,fake_master_handler,&replica);
+    snprintf(addr,sizeof(addr),"127.0.0.1:%d",primary.port);
+    snprintf(replicas,sizeof(replicas),"127.0.0.1:%d",replica.port);
+    snprintf(p,sizeof(p),"%d",primary.port);
+    snprintf(r,sizeof(r),"%d",replica.port);
+    rt = redisRouterConnect(addr,replicas,test_loop_attach,NULL);
+    for (j = 0; j < 100 && !(rt->primary->up && rt->replicas[0]->up); j++)
+        test_loop_run(NULL,10000);
+
+    test("Sends reads to a replica: ");
+    test_cond(rt->err == 0 && strcmp(router_command(rt,buf,"GET %s","foo"),r) == 0 &&
+              strcmp(router_command(rt,buf,"SET %s bar","foo"),"OK") == 0);
+
+    test("Sends every command of a transaction to the primary: ");
+    ok = strcmp(router_command(rt,buf,"MULTI",NULL),"OK") == 0;
+    ok = ok && strcmp(router_command(rt,buf,"GET %s","foo"),p) == 0;
+    ok = ok && strcmp(router_command(rt,buf,"EXEC",NULL),"OK") == 0;
+    test_cond(ok && strcmp(router_command(rt,buf,"GET %s","foo"),r) == 0);
+
+    test("Sends reads to the primary between WATCH and UNWATCH: ");
+    ok = strcmp(router_command(rt,buf,"WATCH %s","foo"),"OK") == 0;
+    ok = ok && strcmp(router_command(rt,buf,"GET %s","foo"),p) == 0;
+    ok = ok && strcmp(router_command(rt,buf,"MULTI",NULL),"OK") == 0;
+    ok = ok && strcmp(router_command(rt,buf,"DISCARD",NULL),"OK") == 0;
+    ok = ok && strcmp(router_command(rt,buf,"GET %s","foo"),r) == 0;
+    ok = ok && strcmp(router_command(rt,buf,"WATCH %s","foo"),"OK") == 0;
+    ok = ok && strcmp(router_command(rt,buf,"UNWATCH",NULL),"OK") == 0;
+    test_cond(ok && strcmp(router_command(rt,buf,"GET %s","foo"),r) == 0);
+
+    test("Sends a read again to another replica when it takes too long: ");
+    redisRouterFree(rt);
+    slow = fake_server_start(&port,fake_silent_handler,NULL);
+    snprintf(replicas,sizeof(replicas),"127.0.0.1:%d,127.0.0.1:%d",port,replica.port);
+    rt = redisRouterConnect(addr,replicas,test_loop_attach,NULL);
+    for (j = 0; j < 100 && !(rt->replicas[0]->up && rt->replicas[1]->up); j++)
+        test_loop_run(NULL,10000);
+    memset(&hedge,0,sizeof(hedge));
+    hedge.percentile = 0.99;
+    hedge.mindelay.tv_usec = 10000;
+    hedge.maxdelay.tv_usec = 50000;
+    redisRouterSetHedging(rt,&hedge);
+    /* The replicas cost the same, so the silent first one gets the read. */
+    t = usec();
+    ok = strcmp(router_command(rt,buf,"GET %s","foo"),r) == 0;
+    t = usec()-t;
+    test_cond(ok && rt->hedges == 1 && rt->hedgewins == 1 && t >= 40000 && t < 1000000);
+
+    test("Does not send a read again when it is answered in time: ");
+    test_cond(strcmp(router_command(rt,buf,"GET %s","foo"),r) == 0 && rt->hedges == 1);
+
+    test("Rejects SELECT: ");
+    test_cond(redisRouterCommand(rt,reconnect_reply_cb,buf,"SELECT 9") == REDIS_ERR &&
+              rt->err == REDIS_ERR_OTHER && strstr(rt->errstr,"SELECT") != NULL);
+
+    redisRouterFree(rt);
+    fake_server_stop(slow);
+    for (j = 0; j < 2; j++)
+        fake_server_stop(pids[j]);
+}
+
+/* A fake server for client side caching. SET changes a key and publishes its
+ * name to the client subscribed to invalidation messages, and FAKE-HOLD
+ * holds the reply of the next GET until FAKE-RELEASE. */
+#define FAKE_TRACKING_KEYS 8
+
+typedef struct fake_tracking {
+    fake_client *sub;
+    char keys[FAKE_TRACKING_KEYS][16];
+    char values[FAKE_TRACKING_KEYS][16];
+    int hold;
+    fake_client *held;
+    char reply[64];
+} fake_tracking;
+
+static char *fake_tracking_value(fake_tracking *ft, const char *key) {
+    int j;
+
+    for (j = 0; j < FAKE_TRACKING_KEYS && ft->keys[j][0] != '\0'; j++)
+        if (strcmp(ft->keys[j],key) == 0)
+            return ft->values[j];
+    assert(j < FAKE_TRACKING_KEYS);
+    snprintf(ft->keys[j],sizeof(ft->keys[j]),"%s",key);
+    return ft->values[j];
+}
+
+static void fake_tracking_handler(fake_client *fc, redisReply *cmd, void *privdata) {
+    fake_tracking *ft = privdata;
+    char *value;
+
+    if (fake_is(cmd,"CLIENT") && strcasecmp(cmd->element[1]->str,"ID") == 0) {
+        fake_reply(fc,":%d\r\n",fc->fd);
+    } else if (fake_is(cmd,"SUBSCRIBE")) {
+        ft->sub = fc;
+        fake_reply(fc,"*3\r\n$9\r\nsubscribe\r\n$20\r\n__redis__:invalidate\r\n:1\r\n");
+    } else if (fake_is(cmd,"GET")) {
+        value = fake_tracking_value(ft,cmd->element[1]->str);
+        if (ft->hold) {
+            snprintf(ft->reply,sizeof(ft->reply),"$%zu\r\n%s\r\n",strlen(value),value);
+            ft->held = fc;
+            ft->hold = 0;
+        } else {
+            fake_bulk(fc,value);
+        }
+    } else if (fake_is(cmd,"SET")) {
+        value = fake_tracking_value(ft,cmd->element[1]->str);
+        snprintf(value,sizeof(ft->values[0]),"%s",cmd->element[2]->str);
+        if (ft->sub != NULL) {
+            fake_reply(ft->sub,"*3\r\n$7\r\nmessage\r\n$20\r\n__redis__:invalidate\r\n*1\r\n");
+            fake_bulk(ft->sub,cmd->element[1]->str);
+        }
+        fake_reply(fc,"+OK\r\n");
+    } else if (fake_is(cmd,"FAKE-HOLD")) {
+        ft->hold = 1;
+        fake_reply(fc,"+OK\r\n");
+    } else if (fake_is(cmd,"FAKE-RELEASE")) {
+        fake_reply(fc,":%d\r\n",ft->held != NULL);
+        if (ft->held != NULL)
+            fake_reply(ft->held,"%s",ft->reply);
+        ft->held = NULL;
+    } else {
+        fake_reply(fc,"+OK\r\n");
+    }
+}
+
+typedef struct cache_result {
+    char str[16];
+    int order; /* Of the reply among all replies, 0 until it arrived */
+} cache_result;
+
+static int cache_replies;
+
+static void cache_reply_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    cache_result *res = privdata;
+    redisReply *reply = r;
+    ((void)ac);
+
+    snprintf(res->str,sizeof(res->str),"%s",reply != NULL ? reply->str : "(nil)");
+    res->order = ++cache_replies;
+}
+
+static void cache_send(redisCache *cache, cache_result *res, const char *key) {
+    memset(res,0,sizeof(*res));
+    assert(redisCacheCommand(cache,cache_reply_cb,res,"GET %s",key) == REDIS_OK);
+}
+
+/* Send a GET through the cache and wait for its reply. */
+static const char *cache_get(redisCache *cache, cache_result *res, const char *key) {
+    int j;
+
+    cache_send(cache,res,key);
+    for (j = 0; j < 100 && res->order == 0; j++)
+        test_loop_run(NULL,10000);
+    return res->str;
+}
+
+/* Release the GET that the server holds, once it arrived. */
+static void cache_release(int port) {
+    redisReply *r;
+    int j, released = 0;
+
+    for (j = 0; j < 100 && !released; j++) {
+        test_loop_run(NULL,10000);
+        r = fake_command(port,"FAKE-RELEASE");
+        released = r->integer == 1;
+        freeReplyObject(r);
+    }
+}
+
+static redisCache *cache_connect(int port) {
+    redisCache *cache;
+    char addr[32];
+    int j;
+
+    snprintf(addr,sizeof(addr),"127.0.0.1:%d",port);
+    cache = redisCacheConnect(addr,1024*1024,test_loop_attach,NULL);
+    for (j = 0; j < 100 && cache->tracking != REDIS_CACHE_TRACKING_ON; j++)
+        test_loop_run(NULL,10000);
+    assert(cache->tracking == REDIS_CACHE_TRACKING_ON);
+    return cache;
+}
+
+static void test_cache(void) {
+    redisCache *cache;
+    fake_tracking ft;
+    cache_result res, res2;
+    unsigned long long misses;
+    size_t used;
+    pid_t pid;
+    int j, ok, port = 0;
+
+    memset(&ft,0,sizeof(ft));
+    pid = fake_server_start(&port,fake_tracking_handler,&ft);
+    /* Set before the cache subscribes, so nothing is invalidated yet. */
+    freeReplyObject(fake_command(port,"SET foo 1"));
+    freeReplyObject(fake_command(port,"SET k1 v1"));
+    freeReplyObject(fake_command(port,"SET k2 v2"));
+    freeReplyObject(fake_command(port,"SET k3 v3"));
+    cache = cache_connect(port);
+
+    test("Serves a read from the cache once its reply arrived: ");
+    ok = strcmp(cache_get(cache,&res,"foo"),"1") == 0 && cache->misses == 1;
+    test_cond(ok && strcmp(cache_get(cache,&res,"foo"),"1") == 0 && cache->hits == 1 &&
+              cache->misses == 1);
+
+    test("Passes a hit on from the event loop: ");
+    cache_send(cache,&res,"foo");
+    ok = res.order == 0;
+    test_loop_run(NULL,10000);
+    test_cond(ok && res.order != 0 && strcmp(res.str,"1") == 0 && cache->hits == 2);
+
+    test("Drops a cached reply when the server invalidates its key: ");
+    freeReplyObject(fake_command(port,"SET foo 2"));
+    for (j = 0; j < 100 && cache->invalidations == 0; j++)
+        test_loop_run(NULL,10000);
+    test_cond(cache->invalidations == 1 && strcmp(cache_get(cache,&res,"foo"),"2") == 0 &&
+              cache->misses == 2);
+
+    test("Does not cache a reply when its key changed before it arrived: ");
+    freeReplyObject(fake_command(port,"FAKE-HOLD"));
+    cache_send(cache,&res,"bar");
+    test_loop_run(NULL,20000);
+    freeReplyObject(fake_command(port,"SET bar 1"));
+    for (j = 0; j < 100 && cache->invalidations == 1; j++)
+        test_loop_run(NULL,10000);
+    cache_release(port);
+    for (j = 0; j < 100 && res.order == 0; j++)
+        test_loop_run(NULL,10000);
+    misses = cache->misses;
+    test_cond(res.order != 0 && strcmp(cache_get(cache,&res,"bar"),"1") == 0 &&
+              cache->misses == misses+1);
+
+    test("Does not cache a reply when the cache was flushed before it arrived: ");
+    freeReplyObject(fake_command(port,"FAKE-HOLD"));
+    cache_send(cache,&res,"baz");
+    test_loop_run(NULL,20000);
+    redisCacheFlush(cache);
+    cache_release(port);
+    for (j = 0; j < 100 && res.order == 0; j++)
+        test_loop_run(NULL,10000);
+    misses = cache->misses;
+    test_cond(res.order != 0 && cache->keys == 0 && strcmp(cache_get(cache,&res,"baz"),"") == 0 &&
+              cache->misses == misses+1);
+
+    test("Passes a hit on after the replies of earlier commands: ");
+    cache_get(cache,&res,"foo");
+    freeReplyObject(fake_command(port,"FAKE-HOLD"));
+    cache_send(cache,&res,"qux");
+    cache_send(cache,&res2,"foo");
+    ok = res2.order == 0;
+    cache_release(port);
+    for (j = 0; j < 100 && res2.order == 0; j++)
+        test_loop_run(NULL,10000);
+    test_cond(ok && res.order != 0 && res.order < res2.order && strcmp(res2.str,"2") == 0);
+
+    test("Evicts the least recently used replies: ");
+    redisCacheFlush(cache);
+    cache_get(cache,&res,"k1");
+    used = cache->used;
+    cache->maxmemory = used*2+used/2;
+    cache_get(cache,&res,"k2");
+    cache_get(cache,&res,"k1");
+    cache_get(cache,&res,"k3");
+    ok = cache->evictions == 1;
+    misses = cache->misses;
+    cache_get(cache,&res,"k1");
+    ok = ok && cache->misses == misses;
+    cache_get(cache,&res,"k2");
+    test_cond(ok && cache->misses == misses+1 && cache->used <= cache->maxmemory);
+
+    test("Passes NULL to hits that wait when the cache is free'd: ");
+    freeReplyObject(fake_command(port,"FAKE-HOLD"));
+    cache_send(cache,&res,"k9");
+    cache_send(cache,&res2,"k1");
+    redisCacheFree(cache);
+    test_cond(res.order != 0 && res.order < res2.order && strcmp(res2.str,"(nil)") == 0);
+
+    test("Takes the host of an IPv6 address out of its brackets: ");
+    cache = redisCacheConnect("[::1]:1",1024,test_loop_attach,NULL);
+    ok = cache->host != NULL && strcmp(cache->host,"::1") == 0 && cache->port == 1;
+    redisCacheFree(cache);
+    cache = redisCacheConnect("[]:1",1024,test_loop_attach,NULL);
+    test_cond(ok && cache->err == REDIS_ERR_OTHER && strcmp(cache->errstr,"Invalid server address") == 0);
+    redisCacheFree(cache);
+
+    fake_server_stop(pid);
+}
+
+/* A fake server that forgets its scripts on SCRIPT FLUSH, and fails to load
+ * them after FAKE-BROKEN. EVALSHA replies with the number of scripts loaded
+ * so far, EVAL with a status. */
+typedef struct fake_scripting {
+    int loaded;
+    int loads;
+    int broken;
+} fake_scripting;
+
+static void fake_scripting_handler(fake_client *fc, redisReply *cmd, void *privdata) {
+    fake_scripting *fs = privdata;
+
+    if (fake_is(cmd,"EVALSHA") && !fs->loaded) {
+        fake_reply(fc,"-NOSCRIPT No matching script. Please use EVAL.\r\n");
+    } else if (fake_is(cmd,"EVALSHA")) {
+        fake_reply(fc,":%d\r\n",fs->loads);
+    } else if (fake_is(cmd,"EVAL")) {
+        fake_reply(fc,"+EVAL\r\n");
+    } else if (fake_is(cmd,"SCRIPT") && strcasecmp(cmd->element[1]->str,"LOAD") == 0 && fs->broken) {
+        fake_reply(fc,"-ERR Error compiling script\r\n");
+    } else if (fake_is(cmd,"SCRIPT") && strcasecmp(cmd->element[1]->str,"LOAD") == 0) {
+        fs->loaded = 1;
+        fs->loads++;
+        fake_bulk(fc,"0123456789012345678901234567890123456789");
+    } else if (fake_is(cmd,"SCRIPT")) {
+        fs->loaded = 0;
+        fake_reply(fc,"+OK\r\n");
+    } else if (fake_is(cmd,"FAKE-BROKEN")) {
+        fs->broken = 1;
+        fake_reply(fc,"+OK\r\n");
+    } else {
+        fake_reply(fc,"+OK\r\n");
+    }
+}
+
+typedef struct script_result {
+    volatile int done;
+    int type;
+    long long integer;
+    char str[64];
+} script_result;
+
+static void script_reply_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    script_result *res = privdata;
+    redisReply *reply = r;
+    ((void)ac);
+
+    res->done = 1;
+    res->type = reply != NULL ? reply->type : 0;
+    res->integer = reply != NULL ? reply->integer : 0;
+    snprintf(res->str,sizeof(res->str),"%s",reply != NULL && reply->str != NULL ? reply->str : "");
+}
+
+/* Calls a script once the reply of the command arrives. */
+typedef struct script_chain {
+    const redisScript *script;
+    script_result *res;
+} script_chain;
+
+static void script_chain_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    script_chain *chain = privdata;
+    ((void)r);
+
+    redisAsyncScriptCommand(ac,script_reply_cb,chain->res,chain->script,"0");
+}
+
+static void test_async_scripts(void) {
+    redisAsyncContext *ac;
+    redisScripts *s;
+    redisScript *script;
+    redisWatermarks wm;
+    fake_scripting fs;
+    script_result res, res2;
+    script_chain chain;
+    reply_counter rc = { 0, 1, 0 };
+    char body[256];
+    pid_t pid;
+    int ok, port = 0;
+
+    memset(&fs,0,sizeof(fs));
+    pid = fake_server_start(&port,fake_scripting_handler,&fs);
+    memset(body,'-',sizeof(body)-1);
+    body[sizeof(body)-1] = '\0';
+    s = redisScriptsCreate();
+    script = redisScriptsAdd(s,body,strlen(body));
+    ac = redisAsyncConnect("127.0.0.1",port);
+    test_loop_attach(ac,NULL);
+
+    test("Loads an async script again when the server lost it: ");
+    memset(&res,0,sizeof(res));
+    redisAsyncScriptCommand(ac,script_reply_cb,&res,script,"0");
+    ok = test_loop_run(&res.done,1000000);
+    test_cond(ok && res.type == REDIS_REPLY_INTEGER && res.integer == 1);
+
+    /* The PING is answered after the NOSCRIPT error and before the reply of
+     * the SCRIPT LOAD. */
+    test("Calls scripts with EVAL while a lost script is loaded again: ");
+    rc.expect = 1;
+    redisAsyncCommand(ac,reply_counter_cb,&rc,"SCRIPT FLUSH");
+    test_loop_run(&rc.done,1000000);
+    memset(&res,0,sizeof(res));
+    memset(&res2,0,sizeof(res2));
+    chain.script = script;
+    chain.res = &res2;
+    redisAsyncScriptCommand(ac,script_reply_cb,&res,script,"0");
+    redisAsyncCommand(ac,script_chain_cb,&chain,"PING");
+    ok = test_loop_run(&res.done,1000000) && test_loop_run(&res2.done,1000000);
+    ok = ok && res.type == REDIS_REPLY_INTEGER && res.integer == 2 &&
+         res2.type == REDIS_REPLY_STATUS && strcmp(res2.str,"EVAL") == 0 &&
+         !(ac->c.flags & REDIS_SCRIPTS_LOADING);
+    memset(&res,0,sizeof(res));
+    redisAsyncScriptCommand(ac,script_reply_cb,&res,script,"0");
+    test_cond(ok && test_loop_run(&res.done,1000000) && res.type == REDIS_REPLY_INTEGER);
+
+    /* The SCRIPT LOAD crosses the watermark, so the call is rejected. The
+     * error of the SCRIPT LOAD arrives after the request was passed on. */
+    test("Passes the NOSCRIPT error on when the call cannot be sent again: ");
+    rc.replies = rc.done = 0;
+    rc.expect = 2;
+    redisAsyncCommand(ac,reply_counter_cb,&rc,"SCRIPT FLUSH");
+    redisAsyncCommand(ac,reply_counter_cb,&rc,"FAKE-BROKEN");
+    test_loop_run(&rc.done,1000000);
+    memset(&wm,0,sizeof(wm));
+    wm.highbytes = 200;
+    wm.failfast = 1;
+    redisAsyncSetWatermarks(ac,&wm,NULL);
+    memset(&res,0,sizeof(res));
+    redisAsyncScriptCommand(ac,script_reply_cb,&res,script,"0");
+    ok = test_loop_run(&res.done,1000000);
+    ok = ok && res.type == REDIS_REPLY_ERROR && strncmp(res.str,"NOSCRIPT",8) == 0;
+    /* The reply of the SCRIPT LOAD still arrives. */
+    test_loop_run(NULL,50000);
+    rc.replies = rc.done = 0;
+    rc.expect = 1;
+    redisAsyncCommand(ac,reply_counter_cb,&rc,"PING");
+    test_cond(ok && test_loop_run(&rc.done,1000000));
+
+    redisAsyncFree(ac);
+    fake_server_stop(pid);
+    redisScriptsFree(s);
+}
+
+/* A fake server with one pending entry per connection, reads that block
+ * until the connection is closed, and one entry to reclaim per XAUTOCLAIM.
+ * When privdata points to a non-zero int, XAUTOCLAIM replies like Redis 6.2
+ * with a deleted entry as well. */
+static void fake_stream_handler(fake_client *fc, redisReply *cmd, void *privdata) {
+    int *legacy = privdata;
+
+    if (fake_is(cmd,"XREADGROUP") && cmd->elements > 6 && strcasecmp(cmd->element[6]->str,"BLOCK") == 0) {
+        return;
+    } else if (fake_is(cmd,"XREADGROUP") && fc->state++ == 0) {
+        fake_reply(fc,"*1\r\n*2\r\n$1\r\ns\r\n*1\r\n*2\r\n$3\r\n1-0\r\n*2\r\n$1\r\nf\r\n$1\r\nv\r\n");
+    } else if (fake_is(cmd,"XREADGROUP")) {
+        fake_reply(fc,"*1\r\n*2\r\n$1\r\ns\r\n*0\r\n");
+    } else if (fake_is(cmd,"XACK")) {
+        fake_reply(fc,":%zu\r\n",cmd->elements-3);
+    } else if (fake_is(cmd,"XAUTOCLAIM") && legacy != NULL && *legacy) {
+        fake_reply(fc,"*2\r\n$3\r\n0-0\r\n*2\r\n*-1\r\n*2\r\n$3\r\n2-0\r\n*2\r\n$1\r\nf\r\n$1\r\nv\r\n");
+    } else if (fake_is(cmd,"XAUTOCLAIM")) {
+        fake_reply(fc,"*3\r\n$3\r\n0-0\r\n*1\r\n*2\r\n$3\r\n2-0\r\n*2\r\n$1\r\nf\r\n$1\r\nv\r\n*0\r\n");
+    } else {
+        fake_reply(fc,"+OK\r\n");
+    }
+}
+
+static int stream_stops;
+
+/* Acknowledges every entry it gets. */
+static void stream_cb(redisStreamConsumer *sc, const redisStreamBatch *batch, void *privdata) {
+    size_t j;
+    ((void)privdata);
+
+    if (batch == NULL) {
+        stream_stops++;
+        return;
+    }
+    for (j = 0; j < batch->count; j++)
+        redisStreamAck(sc,batch->entries[j].id,batch->entries[j].idlen);
+}
+
+static int stream_attach_without_timers(redisAsyncContext *ac, void *data) {
+    int status = test_loop_attach(ac,data);
+
+    ac->ev.scheduleTimer = NULL;
+    ac->ev.cancelTimer = NULL;
+    return status;
+}
+
+static void test_stream(void) {
+    redisStreamConsumer *sc;
+    redisStreamOptions opts;
+    char addr[32];
+    pid_t pid;
+    int j, ok, legacy = 1, port = 0;
+
+    pid = fake_server_start(&port,fake_stream_handler,NULL);
+    snprintf(addr,sizeof(addr),"127.0.0.1:%d",port);
+    memset(&opts,0,sizeof(opts));
+    opts.claim.tv_usec = 50000;
+
+    test("Acknowledges entries while a read blocks on the server: ");
+    sc = redisStreamConnect(addr,"s","g","c",&opts,stream_cb,NULL,test_loop_attach,NULL);
+    ok = sc->err == 0;
+    for (j = 0; j < 100 && (sc->acked == 0 || !sc->reading || sc->history != NULL); j++)
+        test_loop_run(NULL,10000);
+    ok = ok && sc->entries == 1 && sc->acked == 1 && sc->reading;
+    redisStreamAck(sc,"3-0",3);
+    redisStreamFlushAcks(sc);
+    for (j = 0; j < 50 && sc->acked < 2; j++)
+        test_loop_run(NULL,10000);
+    test_cond(ok && sc->acked >= 2 && sc->reading);
+
+    test("Reclaims entries at the claim interval while a read blocks: ");
+    for (j = 0; j < 100 && sc->claimed < 3; j++)
+        test_loop_run(NULL,10000);
+    test_cond(sc->claimed >= 3 && sc->reading && stream_stops == 0);
+    redisStreamFree(sc);
+
+    test("Skips deleted entries that XAUTOCLAIM of Redis 6.2 returns as nil: ");
+    fake_server_stop(pid);
+    port = 0;
+    pid = fake_server_start(&port,fake_stream_handler,&legacy);
+    snprintf(addr,sizeof(addr),"127.0.0.1:%d",port);
+    sc = redisStreamConnect(addr,"s","g","c",&opts,stream_cb,NULL,test_loop_attach,NULL);
+    for (j = 0; j < 100 && sc->claimed < 2; j++)
+        test_loop_run(NULL,10000);
+    test_cond(sc->claimed >= 2 && sc->err == 0 && stream_stops == 0);
+    redisStreamFree(sc);
+
+    test("Fails to reclaim entries when the event library has no timers: ");
+    sc = redisStreamConnect(addr,"s","g","c",&opts,stream_cb,NULL,stream_attach_without_timers,NULL);
+    test_cond(sc->err == REDIS_ERR_OTHER && strcmp(sc->errstr,"The event library does not support timers") == 0);
+    redisStreamFree(sc);
+
+    test_loop_run(NULL,20000);
+    fake_server_stop(pid);
+}
+
+static void queue_loop_run(redisAsyncQueue *q, volatile int *done, long long timeout) {
+    long long end = usec()+timeout;
+    struct pollfd pfd;
+
+    while ((done == NULL || !*done) && usec() < end) {
+        pfd.fd = redisAsyncQueueGetFd(q);
+        pfd.events = POLLIN;
+        if (poll(&pfd,1,0) == 1)
+            redisAsyncQueueHandleRead(q);
+        test_loop_run(NULL,1000);
+    }
+}
+
+#define QUEUE_THREADS 4
+#define QUEUE_COMMANDS 1000
+
+typedef struct queue_state {
+    redisAsyncQueue *q;
+    struct queue_state *replies_to; /* State counting the replies */
+    int queued; /* Written by a producer thread */
+    int replies; /* Written by the loop thread */
+    int contexts; /* Replies with a non-NULL context */
+    volatile int done;
+    redisReply *reply;
+    int err;
+    long long waited;
+} queue_state;
+
+static void queue_reply_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    queue_state *st = privdata;
+    redisReply *reply = r;
+
+    if (ac != NULL)
+        st->contexts++;
+    if (reply != NULL && reply->type == REDIS_REPLY_INTEGER)
+        st->replies++;
+    if (st->replies == QUEUE_THREADS*QUEUE_COMMANDS)
+        st->done = 1;
+}
+
+static void *queue_producer(void *arg) {
+    queue_state *st = arg;
+    int i;
+
+    for (i = 0; i < QUEUE_COMMANDS; i++)
+        if (redisAsyncQueueCommand(st->q,queue_reply_cb,st->replies_to,"INCR hiredis-queue") == REDIS_OK)
+            st->queued++;
+    return NULL;
+}
+
+static void *queue_waiter(void *arg) {
+    queue_state *st = arg;
+    long long t = usec();
+
+    errno = 0;
+    st->reply = redisAsyncQueueCommandWait(st->q,"GET hiredis-queue");
+    st->err = errno;
+    st->waited = usec()-t;
+    st->done = 1;
+    return NULL;
+}
+
+static void test_async_queue(struct config config) {
+    redisContext *c = do_connect(config);
+    struct timeval tv = { 0, 100000 };
+    queue_state st, producers[QUEUE_THREADS], waiter;
+    pthread_t threads[QUEUE_THREADS], thread;
+    redisAsyncContext *ac;
+    redisAsyncQueue *q;
+    int i, queued = 0;
+
+    freeReplyObject(redisCommand(c,"DEL hiredis-queue"));
+    memset(&st,0,sizeof(st));
+    ac = async_connect(config);
+    st.q = q = redisAsyncQueueCreate(ac);
+    assert(q != NULL);
+
+    test("Executes the commands queued by several threads: ");
+    for (i = 0; i < QUEUE_THREADS; i++) {
+        producers[i] = st;
+        producers[i].replies_to = &st;
+        assert(pthread_create(&threads[i],NULL,queue_producer,&producers[i]) == 0);
+    }
+    queue_loop_run(q,&st.done,5000000);
+    for (i = 0; i < QUEUE_THREADS; i++) {
+        pthread_join(threads[i],NULL);
+        queued += producers[i].queued;
+    }
+    test_cond(queued == QUEUE_THREADS*QUEUE_COMMANDS && st.replies == queued);
+
+    test("Passes a copy of the reply to a waiting thread: ");
+    waiter = st;
+    waiter.done = 0;
+    assert(pthread_create(&thread,NULL,queue_waiter,&waiter) == 0);
+    queue_loop_run(q,&waiter.done,2000000);
+    pthread_join(thread,NULL);
+    test_cond(waiter.reply != NULL && waiter.reply->type == REDIS_REPLY_STRING &&
+              atoi(waiter.reply->str) == QUEUE_THREADS*QUEUE_COMMANDS);
+    freeReplyObject(waiter.reply);
+
+    test("Stops waiting for a reply when the wait timeout expires: ");
+    redisAsyncQueueSetWaitTimeout(q,tv);
+    waiter.done = 0;
+    assert(pthread_create(&thread,NULL,queue_waiter,&waiter) == 0);
+    pthread_join(thread,NULL);
+    test_cond(waiter.reply == NULL && waiter.err == ETIMEDOUT &&
+              waiter.waited >= 90000 && waiter.waited < 1000000);
+    /* The reply still arrives and is discarded. */
+    queue_loop_run(q,NULL,100000);
+
+    test("Fails queued commands with a valid context when it is free'd: ");
+    memset(&st,0,sizeof(st));
+    redisAsyncQueueCommand(q,queue_reply_cb,&st,"PING");
+    redisAsyncQueueCommand(q,queue_reply_cb,&st,"PING");
+    redisAsyncFree(ac);
+    test_cond(st.contexts == 2 && st.replies == 0 &&
+              redisAsyncQueueCommand(q,queue_reply_cb,&st,"PING") == REDIS_ERR);
+    redisAsyncQueueFree(q);
+
+    disconnect(c, 0);
+}
+
+/* Starts an async connection to localhost and returns whether it had to
+ * start a resolver thread. */
+static int resolve_cache_async_lookup(struct config config) {
+    redisAsyncContext *ac;
+    int res[3] = { 0, 0, 0 }, threaded;
+
+    ac = redisAsyncConnect("localhost",config.tcp.port);
+    assert(ac != NULL && ac->err == 0);
+    threaded = ac->resolver != NULL;
+    ac->data = res;
+    test_loop_attach(ac,NULL);
+    redisAsyncSetConnectCallback(ac,async_connect_cb);
+    test_loop_run(&res[0],1000000);
+    assert(res[1] == REDIS_OK);
+    redisAsyncFree(ac);
+    return threaded;
+}
+
+static void test_resolve_cache(struct config config) {
+    redisContext *c;
+
+    /* The cached address must be the one of the test server. */
+    if (strcmp(config.tcp.host,"127.0.0.1") != 0 &&
+        strcmp(config.tcp.host,"localhost") != 0)
+        return;
+
+    test("Starts a resolver thread when the resolve cache is disabled: ");
+    redisSetResolveCacheTTL(0);
+    c = redisConnect("localhost",config.tcp.port);
+    assert(c != NULL && c->err == 0);
+    redisFree(c);
+    test_cond(resolve_cache_async_lookup(config));
+
+    test("Connects from the resolve cache without a resolver thread: ");
+    redisSetResolveCacheTTL(2);
+    c = redisConnect("localhost",config.tcp.port);
+    assert(c != NULL && c->err == 0);
+    redisFree(c);
+    test_cond(!resolve_cache_async_lookup(config));
+
+    test("Resolves again once the cache is flushed: ");
+    redisResolveCacheFlush();
+    test_cond(resolve_cache_async_lookup(config) &&
+              !resolve_cache_async_lookup(config));
+
+    test("Resolves again once the cache entry expired: ");
+    sleep(3);
+    test_cond(resolve_cache_async_lookup(config));
+
+    redisSetResolveCacheTTL(0);
+}
+
+/* Loopback address of the family, with the given port. */
+static socklen_t race_sockaddr(int family, int port, struct sockaddr_storage *ss) {
+    struct sockaddr_in *sin = (struct sockaddr_in*)ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)ss;
+
+    memset(ss,0,sizeof(*ss));
+    if (family == AF_INET6) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = in6addr_loopback;
+        sin6->sin6_port = htons(port);
+        return sizeof(*sin6);
+    }
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin->sin_port = htons(port);
+    return sizeof(*sin);
+}
+
+static int race_port(struct sockaddr_storage *ss) {
+    if (ss->ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6*)ss)->sin6_port);
+    return ntohs(((struct sockaddr_in*)ss)->sin_port);
+}
+
+/* Port of the peer of a connected socket. */
+static int race_peer_port(int fd) {
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+
+    if (getpeername(fd,(struct sockaddr*)&ss,&len) == -1)
+        return -1;
+    return race_port(&ss);
+}
+
+/* Listens on loopback, and returns the port. When hang is set, the backlog
+ * is full so that connections to the port never complete. fds holds the
+ * listener and the connection that fills the backlog, or -1. */
+static int race_listen(int family, int hang, int fds[2]) {
+    struct sockaddr_storage ss;
+    socklen_t len = race_sockaddr(family,0,&ss);
+
+    fds[0] = socket(family,SOCK_STREAM,0);
+    fds[1] = -1;
+    assert(fds[0] != -1 && bind(fds[0],(struct sockaddr*)&ss,len) == 0);
+    assert(listen(fds[0],hang ? 0 : 16) == 0);
+    assert(getsockname(fds[0],(struct sockaddr*)&ss,&len) == 0);
+    if (hang) {
+        fds[1] = socket(family,SOCK_STREAM,0);
+        assert(connect(fds[1],(struct sockaddr*)&ss,len) == 0);
+    }
+    return race_port(&ss);
+}
+
+static int race_port_of(int fds[2]) {
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+
+    assert(getsockname(fds[0],(struct sockaddr*)&ss,&len) == 0);
+    return race_port(&ss);
+}
+
+static void race_close(int fds[2]) {
+    close(fds[0]);
+    if (fds[1] != -1)
+        close(fds[1]);
+}
+
+/* Whether the platform lets TCP Fast Open be enabled on a socket. */
+static int race_fastopen(void) {
+#ifdef TCP_FASTOPEN_CONNECT
+    int fd = socket(AF_INET,SOCK_STREAM,0), yes = 1, ok;
+
+    ok = setsockopt(fd,IPPROTO_TCP,TCP_FASTOPEN_CONNECT,&yes,sizeof(yes)) != -1;
+    close(fd);
+    return ok;
+#else
+    return 0;
+#endif
+}
+
+/* Addresses that "hiredis.test" resolves to, through the resolve cache. */
+#define RACE_ADDRS 4
+
+typedef struct race_list {
+    struct addrinfo ai[RACE_ADDRS];
+    struct sockaddr_storage ss[RACE_ADDRS];
+    int count;
+} race_list;
+
+static void race_add(race_list *rl, int family, int port) {
+    struct addrinfo *ai = &rl->ai[rl->count];
+
+    assert(rl->count < RACE_ADDRS);
+    memset(ai,0,sizeof(*ai));
+    ai->ai_family = family;
+    ai->ai_socktype = SOCK_STREAM;
+    ai->ai_addrlen = race_sockaddr(family,port,&rl->ss[rl->count]);
+    ai->ai_addr = (struct sockaddr*)&rl->ss[rl->count];
+    if (rl->count > 0)
+        rl->ai[rl->count-1].ai_next = ai;
+    rl->count++;
+}
+
+static void race_cache(race_list *rl, int port) {
+    redisResolveCacheFlush();
+    assert(redisResolveCacheAdd("hiredis.test",port,rl->ai) == REDIS_OK);
+}
+
+static void test_connect_race(void) {
+    redisAsyncContext *ac;
+    redisContext *c;
+    redisSocketOptions opts;
+    struct timeval tv = { 0, 300000 };
+    struct pollfd pfd;
+    race_list rl;
+    int up[2], up6[2], hang[2], hang6[2], late[2], port, fd, threaded, res[3];
+    long long t;
+
+    redisSetResolveCacheTTL(60);
+
+    test("Connects to the next address right away when one is refused: ");
+    port = race_listen(AF_INET,0,up);
+    memset(&rl,0,sizeof(rl));
+    race_add(&rl,AF_INET,race_listen(AF_INET,0,hang));
+    race_close(hang);
+    race_add(&rl,AF_INET,port);
+    race_cache(&rl,port);
+    t = usec();
+    c = redisConnect("hiredis.test",port);
+    t = usec()-t;
+    test_cond(c->err == 0 && race_peer_port(c->fd) == port && t < 200000);
+    redisFree(c);
+
+    test("Starts the next attempt when the delay elapsed: ");
+    memset(&rl,0,sizeof(rl));
+    race_add(&rl,AF_INET,race_listen(AF_INET,1,hang));
+    race_add(&rl,AF_INET,port);
+    race_cache(&rl,port);
+    t = usec();
+    c = redisConnect("hiredis.test",port);
+    t = usec()-t;
+    test_cond(c->err == 0 && race_peer_port(c->fd) == port && t >= 200000 && t < 1000000);
+    redisFree(c);
+
+    /* In the order given, the second IPv6 address would win. */
+    test("Alternates the address families: ");
+    memset(&rl,0,sizeof(rl));
+    race_add(&rl,AF_INET6,race_listen(AF_INET6,1,hang6));
+    race_add(&rl,AF_INET6,race_listen(AF_INET6,0,up6));
+    race_add(&rl,AF_INET,port);
+    race_cache(&rl,port);
+    c = redisConnect("hiredis.test",port);
+    test_cond(c->err == 0 && race_peer_port(c->fd) == port);
+    redisFree(c);
+    race_close(up6);
+    race_close(hang6);
+
+    test("Gives up on all addresses when the connect timeout expires: ");
+    memset(&rl,0,sizeof(rl));
+    race_add(&rl,AF_INET,race_port_of(hang));
+    race_add(&rl,AF_INET,race_port_of(hang));
+    race_cache(&rl,port);
+    t = usec();
+    c = redisConnectWithTimeout("hiredis.test",port,tv);
+    t = usec()-t;
+    test_cond(c->err == REDIS_ERR_IO && t >= 250000 && t < 1000000);
+    redisFree(c);
+
+    memset(&opts,0,sizeof(opts));
+    opts.fastopen = 1;
+
+    test("Tells whether TCP Fast Open was enabled: ");
+    c = redisConnectWithOptions("127.0.0.1",port,NULL,&opts);
+    test_cond(c->err == 0 && !!(c->flags & REDIS_FASTOPEN) == race_fastopen());
+    redisFree(c);
+
+    /* With Fast Open, the hanging address would look connected. */
+    test("Races several addresses without TCP Fast Open: ");
+    memset(&rl,0,sizeof(rl));
+    race_add(&rl,AF_INET,race_port_of(hang));
+    race_add(&rl,AF_INET,port);
+    race_cache(&rl,port);
+    c = redisConnectWithOptions("hiredis.test",port,NULL,&opts);
+    test_cond(c->err == 0 && race_peer_port(c->fd) == port && !(c->flags & REDIS_FASTOPEN));
+    redisFree(c);
+
+    test("Races the cached addresses of an async connection: ");
+    memset(&rl,0,sizeof(rl));
+    race_add(&rl,AF_INET,race_port_of(hang));
+    race_add(&rl,AF_INET,port);
+    race_cache(&rl,port);
+    memset(res,0,sizeof(res));
+    t = usec();
+    ac = redisAsyncConnect("hiredis.test",port);
+    assert(ac != NULL && ac->err == 0);
+    threaded = ac->resolver != NULL;
+    fd = ac->c.fd;
+    ac->data = res;
+    test_loop_attach(ac,NULL);
+    redisAsyncSetConnectCallback(ac,async_connect_cb);
+    test_loop_run(&res[0],2000000);
+    t = usec()-t;
+    test_cond(threaded && res[1] == REDIS_OK && ac->c.fd == fd && race_peer_port(fd) == port &&
+              t >= 200000 && t < 1000000);
+    redisAsyncFree(ac);
+
+    /* The listening address is only tried after 500 ms. */
+    test("Stops the race of an async connection that is free'd: ");
+    memset(&rl,0,sizeof(rl));
+    race_add(&rl,AF_INET,race_port_of(hang));
+    race_add(&rl,AF_INET,race_port_of(hang));
+    race_add(&rl,AF_INET,race_listen(AF_INET,0,late));
+    race_cache(&rl,port);
+    ac = redisAsyncConnect("hiredis.test",port);
+    threaded = ac->resolver != NULL;
+    test_loop_attach(ac,NULL);
+    test_loop_run(NULL,100000);
+    redisAsyncFree(ac);
+    usleep(800000);
+    pfd.fd = late[0];
+    pfd.events = POLLIN;
+    test_cond(threaded && poll(&pfd,1,0) == 0);
+    race_close(late);
+
+    race_close(hang);
+    race_close(up);
+    redisSetResolveCacheTTL(0);
+}
+
 static void test_throughput(struct config config) {
-    redisContext *c = connect(config);
+    redisContext *c = do_connect(config);
     redisReply **replies;
     int i, num;
     long long t1, t2;
@@ -714,6 +3640,8 @@ int main(int argc, char **argv) {
 
     test_format_commands();
     test_reply_reader();
+    test_key_slot();
+    test_subdict();
     test_blocking_connection_errors();
     test_free_null();
 
@@ -722,6 +3650,27 @@ int main(int argc, char **argv) {
     test_blocking_connection(cfg);
     test_blocking_io_errors(cfg);
     test_invalid_timeout_errors(cfg);
+    test_socket_options(cfg);
+    test_blocking_pool(cfg);
+    test_blocking_scripts(cfg);
+    test_blocking_scan(cfg);
+    test_async_connect(cfg);
+    test_async_pubsub(cfg);
+    test_async_queue(cfg);
+    test_async_pipeline_window(cfg);
+    test_async_merging(cfg);
+    test_async_watermarks(cfg);
+    test_async_timers(cfg);
+    test_async_reconnect();
+    test_async_callbacks();
+    test_cluster();
+    test_sentinel();
+    test_router();
+    test_cache();
+    test_async_scripts();
+    test_stream();
+    test_resolve_cache(cfg);
+    test_connect_race();
     test_append_formatted_commands(cfg);
     if (throughput) test_throughput(cfg);
 
@@ -729,6 +3678,7 @@ int main(int argc, char **argv) {
     cfg.type = CONN_UNIX;
     test_blocking_connection(cfg);
     test_blocking_io_errors(cfg);
+    test_blocking_pool(cfg);
     if (throughput) test_throughput(cfg);
 
     if (test_inherit_fd) {